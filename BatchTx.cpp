@@ -0,0 +1,189 @@
+/*
+ * BatchTx.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "BatchTx.h"
+#include "FrameUtil.h"
+#include "TxQueue.h"
+#include "M2RET.h"
+
+extern TxQueue txQueues[];
+
+/*
+ * PROTO_BATCH_TX packet, following 0xF1 26:
+ *   length(2) - number of bytes of frame records
+ *   frame records, back to back:
+ *     bus byte - bus in the low nibble, TX priority in bits 4-6, BATCH_FLAG_OFFSET in bit 7
+ *     id(4, bit 31 = extended)
+ *     offset(4) - only if BATCH_FLAG_OFFSET is set. Microseconds after the packet arrived to send at
+ *     length
+ *     data bytes (length of them)
+ *   crc - SAE J1850 CRC8 over the length bytes and the records
+ *
+ * Replies 0xF1 26 status(BATCH_STATUS) frames accepted.
+ *
+ * A packet can hold far more frames than a TX queue so frames wait in a FIFO of our own and
+ * are moved to the queues as they come due and as there is room. Frames without an offset are
+ * due straight away. Being a FIFO, offsets are expected to go up through a packet and from one
+ * packet to the next.
+ */
+
+uint8_t BatchTx::packet[BATCH_MAX_PAYLOAD + 3];
+uint32_t BatchTx::packetPos = 0;
+uint32_t BatchTx::packetLen = 0;
+boolean BatchTx::discarding = false;
+BATCH_PENDING BatchTx::pending[BATCH_PENDING_SIZE];
+uint16_t BatchTx::pendingHead = 0;
+uint16_t BatchTx::pendingTail = 0;
+
+void BatchTx::setup()
+{
+    packetPos = 0;
+    pendingHead = pendingTail = 0;
+}
+
+//Called when 0xF1 26 has been seen
+void BatchTx::begin()
+{
+    packetPos = 0;
+    packetLen = 0;
+    discarding = false;
+}
+
+/*
+ * Feed the packet in. Once the length is known the rest of the packet is pulled straight from
+ * SerialUSB rather than going round loop()'s byte at a time state machine. A packet too big
+ * for the buffer is still read to the end and thrown away so it doesn't get taken for commands.
+ * Returns true when the packet is done with (handled or rejected).
+ */
+boolean BatchTx::collect(uint8_t in_byte)
+{
+    if (discarding) packetPos++;
+    else packet[packetPos++] = in_byte;
+    if (packetPos < 2) return false;
+    if (packetPos == 2) {
+        uint16_t payload = packet[0] + (packet[1] << 8);
+        packetLen = (uint32_t)payload + 3; //length bytes and crc too
+        discarding = (payload > BATCH_MAX_PAYLOAD);
+    }
+    if (discarding) {
+        while (packetPos < packetLen && SerialUSB.available() > 0) {
+            SerialUSB.read();
+            packetPos++;
+        }
+        if (packetPos < packetLen) return false;
+        discarding = false;
+        reply(BATCH_TOO_LONG, 0);
+        return true;
+    }
+    while (packetPos < packetLen && SerialUSB.available() > 0) packet[packetPos++] = SerialUSB.read();
+    if (packetPos < packetLen) return false;
+    handlePacket();
+    return true;
+}
+
+void BatchTx::handlePacket()
+{
+    CAN_FRAME frame;
+    uint8_t crc = 0xFF;
+    uint8_t bus, priority, count = 0;
+    uint16_t pos = 2;
+    uint16_t end;
+    uint32_t arrived = micros();
+    uint32_t offset;
+    boolean pendingFull = false;
+
+    if (packetLen < 3 || packetLen > sizeof(packet)) {
+        reply(BATCH_BAD_FORMAT, 0);
+        return;
+    }
+    end = packetLen - 1;
+    for (int b = 0; b < end; b++) crc = crc8Update(crc, packet[b]);
+    if ((crc ^ 0xFF) != packet[end]) {
+        reply(BATCH_BAD_CRC, 0);
+        return;
+    }
+
+    while (pos < end) {
+        if (pos + 6 > end) break;
+        bus = packet[pos] & BATCH_BUS_MASK;
+        priority = (packet[pos] & BATCH_PRIORITY_MASK) >> 4;
+        offset = 0;
+        frame.id = packet[pos + 1] + (packet[pos + 2] << 8) + (packet[pos + 3] << 16) + ((uint32_t)packet[pos + 4] << 24);
+        frame.extended = (frame.id & 0x80000000) ? true : false;
+        frame.id &= 0x7FFFFFFF;
+        frame.rtr = 0;
+        if (packet[pos] & BATCH_FLAG_OFFSET) {
+            if (pos + 10 > end) break;
+            offset = packet[pos + 5] + (packet[pos + 6] << 8) + (packet[pos + 7] << 16) + ((uint32_t)packet[pos + 8] << 24);
+            pos += 4;
+        }
+        frame.length = packet[pos + 5];
+        pos += 6;
+        if (bus > 2 || frame.length > 8 || pos + frame.length > end) break;
+        for (int b = 0; b < frame.length; b++) frame.data.bytes[b] = packet[pos + b];
+        pos += frame.length;
+
+        uint16_t nextHead = (pendingHead + 1) % BATCH_PENDING_SIZE;
+        if (nextHead == pendingTail) {
+            pendingFull = true;
+            continue;
+        }
+        pending[pendingHead].frame = frame;
+        pending[pendingHead].due = arrived + offset;
+        pending[pendingHead].bus = bus;
+        pending[pendingHead].priority = priority;
+        pendingHead = nextHead;
+        count++;
+    }
+
+    if (pos != end) reply(BATCH_BAD_FORMAT, count);
+    else reply(pendingFull ? BATCH_FULL : BATCH_OK, count);
+}
+
+void BatchTx::reply(uint8_t status, uint8_t count)
+{
+    uint8_t buff[4];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_BATCH_TX;
+    buff[2] = status;
+    buff[3] = count;
+    SerialUSB.write(buff, 4);
+}
+
+//Move frames to the TX queues as they come due, leaving some room in the queues for everyone else
+void BatchTx::loop()
+{
+    uint32_t now = micros();
+
+    while (pendingTail != pendingHead) {
+        BATCH_PENDING &entry = pending[pendingTail];
+        if ((int32_t)(now - entry.due) < 0) return;
+        if (txQueues[entry.bus].count() >= TX_QUEUE_SIZE - 4) return;
+        queueFrame(entry.bus, entry.frame, entry.priority);
+        pendingTail = (pendingTail + 1) % BATCH_PENDING_SIZE;
+    }
+}
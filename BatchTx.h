@@ -0,0 +1,78 @@
+/*
+ * BatchTx.h
+ *
+ * Binary protocol command carrying many frames in one packet so a host can keep the
+ * buses busy without paying for a command per frame.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef BATCHTX_H_
+#define BATCHTX_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//Status byte of the reply to PROTO_BATCH_TX
+enum BATCH_STATUS {
+    BATCH_OK = 0,
+    BATCH_BAD_CRC = 1,
+    BATCH_BAD_FORMAT = 2,
+    BATCH_TOO_LONG = 3,
+    BATCH_FULL = 4          //not all frames fit in the pending buffer, the rest were thrown away
+};
+
+//Frame bus byte flags
+#define BATCH_FLAG_OFFSET   0x80    //a 32 bit transmit time offset follows the ID
+#define BATCH_PRIORITY_MASK 0x70
+#define BATCH_BUS_MASK      0x0F
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t due;           //micros() value to send at
+    uint8_t bus;
+    uint8_t priority;
+} BATCH_PENDING;
+
+class BatchTx {
+public:
+    static void setup();
+    static void loop();
+    static void begin();
+    static boolean collect(uint8_t in_byte);
+
+private:
+    static uint8_t packet[BATCH_MAX_PAYLOAD + 3];
+    static uint32_t packetPos;      //32 bits, a packet being thrown away can be up to 65538 bytes
+    static uint32_t packetLen;
+    static boolean discarding;      //packet is too long, reading the rest of it to drop it
+    static BATCH_PENDING pending[BATCH_PENDING_SIZE];
+    static uint16_t pendingHead;
+    static uint16_t pendingTail;
+
+    static void handlePacket();
+    static void reply(uint8_t status, uint8_t count);
+};
+
+#endif /* BATCHTX_H_ */
@@ -0,0 +1,265 @@
+/*
+ * ClockSync.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ClockSync.h"
+#include "Logger.h"
+
+/*
+ * One exchange, all times in microseconds:
+ *   t1 host sends the request       (hostSend, host clock)
+ *   t2 device gets it               (received, device clock)
+ *   t3 device sends the reply       (replied, device clock)
+ *   t4 host gets the reply          (hostReceive, host clock, comes with the next request)
+ * delay = (t4 - t1) - (t3 - t2) and offset = ((t1 - t2) + (t4 - t3)) / 2, which is exact if the
+ * trip over was as long as the trip back. USB latency jitters by a lot more than the clocks drift
+ * so out of every CLOCK_SYNC_WINDOW exchanges only the one with the shortest delay is kept. The
+ * offset and drift come from a weighted straight line fit through the last CLOCK_SYNC_HISTORY of those.
+ *
+ * micros() wraps every 71 minutes so it's extended to 64 bits here. loop() looks at it often
+ * enough to catch every wrap.
+ */
+
+uint32_t ClockSync::lastMicros = 0;
+uint32_t ClockSync::wraps = 0;
+uint64_t ClockSync::receivedMicros = 0;
+uint8_t ClockSync::lastSeq = 0;
+uint64_t ClockSync::lastHostSend = 0;
+uint64_t ClockSync::lastReceived = 0;
+uint64_t ClockSync::lastReplied = 0;
+boolean ClockSync::haveLast = false;
+boolean ClockSync::hostTime = false;
+CLOCK_SAMPLE ClockSync::best;
+uint8_t ClockSync::windowCount = 0;
+CLOCK_SAMPLE ClockSync::history[CLOCK_SYNC_HISTORY];
+uint8_t ClockSync::historyCount = 0;
+uint8_t ClockSync::historyPos = 0;
+uint64_t ClockSync::refDevice = 0;
+int64_t ClockSync::refOffset = 0;
+int32_t ClockSync::driftPpb = 0;
+boolean ClockSync::synced = false;
+uint32_t ClockSync::exchanges = 0;
+uint32_t ClockSync::rejected = 0;
+uint32_t ClockSync::lastDelay = 0;
+
+static uint64_t getUInt64(uint8_t *data)
+{
+    uint64_t value = 0;
+    for (int b = 7; b >= 0; b--) value = (value << 8) | data[b];
+    return value;
+}
+
+static void putUInt64(uint8_t *data, uint64_t value)
+{
+    for (int b = 0; b < 8; b++) data[b] = (uint8_t)(value >> (8 * b));
+}
+
+void ClockSync::setup()
+{
+    lastMicros = micros();
+    wraps = 0;
+    hostTime = false;
+    reset();
+}
+
+void ClockSync::loop()
+{
+    deviceNow();
+}
+
+void ClockSync::reset()
+{
+    haveLast = false;
+    windowCount = 0;
+    historyCount = 0;
+    historyPos = 0;
+    refDevice = 0;
+    refOffset = 0;
+    driftPpb = 0;
+    synced = false;
+    exchanges = 0;
+    rejected = 0;
+    lastDelay = 0;
+}
+
+uint64_t ClockSync::deviceNow()
+{
+    uint32_t now = micros();
+
+    if (now < lastMicros) wraps++;
+    lastMicros = now;
+    return ((uint64_t)wraps << 32) | now;
+}
+
+//Frame timestamps are recent (or a little in the future for TX events) so they're taken as close to now
+uint64_t ClockSync::extend(uint32_t deviceMicros)
+{
+    uint64_t now = deviceNow();
+    int32_t age = (int32_t)((uint32_t)now - deviceMicros);
+    return now - age;
+}
+
+int64_t ClockSync::offsetAt(uint64_t deviceMicros)
+{
+    return refOffset + ((int64_t)(deviceMicros - refDevice) * driftPpb) / 1000000000LL;
+}
+
+//Called as soon as the PROTO_CLOCK_SYNC command byte comes in, before the rest of the request
+void ClockSync::requestReceived()
+{
+    receivedMicros = deviceNow();
+}
+
+/*
+ * Request: seq, flags (CLOCK_HOST_TIME, CLOCK_RESET), t1(8), t4 of the reply to seq - 1 (8, 0 if it never came)
+ * Reply (after 0xF1 41): seq, status (bit 0 = synced, bit 1 = host time on), t2(8), t3(8),
+ * offset (8, signed, host - device at t3), drift (4, signed, parts per billion)
+ */
+int ClockSync::exchange(uint8_t *data, uint8_t *reply, int maxLen)
+{
+    uint8_t seq = data[0];
+    uint8_t flags = data[1];
+    uint64_t hostSend = getUInt64(data + 2);
+    uint64_t hostReceive = getUInt64(data + 10);
+    uint64_t replied;
+    int64_t offset;
+
+    if (maxLen < 30) return 0;
+    if (flags & CLOCK_RESET) reset();
+    if (haveLast && hostReceive != 0 && seq == (uint8_t)(lastSeq + 1)) {
+        addSample(lastHostSend, lastReceived, lastReplied, hostReceive);
+    }
+    hostTime = (flags & CLOCK_HOST_TIME) ? true : false;
+
+    replied = deviceNow();
+    offset = synced ? offsetAt(replied) : 0;
+    reply[0] = seq;
+    reply[1] = (synced ? 1 : 0) | (hostTime ? 2 : 0);
+    putUInt64(reply + 2, receivedMicros);
+    putUInt64(reply + 10, replied);
+    putUInt64(reply + 18, (uint64_t)offset);
+    reply[26] = (uint8_t)(driftPpb & 0xFF);
+    reply[27] = (uint8_t)(driftPpb >> 8);
+    reply[28] = (uint8_t)(driftPpb >> 16);
+    reply[29] = (uint8_t)(driftPpb >> 24);
+
+    lastSeq = seq;
+    lastHostSend = hostSend;
+    lastReceived = receivedMicros;
+    lastReplied = replied;
+    haveLast = true;
+    return 30;
+}
+
+void ClockSync::addSample(uint64_t hostSend, uint64_t received, uint64_t replied, uint64_t hostReceive)
+{
+    CLOCK_SAMPLE sample;
+    int64_t delay = (int64_t)(hostReceive - hostSend) - (int64_t)(replied - received);
+
+    exchanges++;
+    if (delay < 0 || delay > CLOCK_SYNC_MAX_RTT) {
+        rejected++;
+        return;
+    }
+    sample.deviceMicros = received + (replied - received) / 2;
+    sample.offset = ((int64_t)(hostSend - received) + (int64_t)(hostReceive - replied)) / 2;
+    sample.delay = (uint32_t)delay;
+    lastDelay = sample.delay;
+
+    if (windowCount == 0 || sample.delay < best.delay) {
+        best = sample;
+        //nothing to fit yet, so go with the best exchange so far rather than wait out the first window
+        if (historyCount == 0) {
+            refDevice = best.deviceMicros;
+            refOffset = best.offset;
+            synced = true;
+        }
+    }
+    if (++windowCount < CLOCK_SYNC_WINDOW) return;
+    history[historyPos] = best;
+    historyPos = (historyPos + 1) % CLOCK_SYNC_HISTORY;
+    if (historyCount < CLOCK_SYNC_HISTORY) historyCount++;
+    windowCount = 0;
+    fit();
+}
+
+/*
+ * Least squares line through the kept exchanges, each weighted by 1 / delay^2 since an exchange
+ * can be off by up to half its delay. Everything is taken relative to the newest one so the
+ * doubles only have to hold differences, not 64 bit host times.
+ */
+void ClockSync::fit()
+{
+    CLOCK_SAMPLE &newest = history[(historyPos + CLOCK_SYNC_HISTORY - 1) % CLOCK_SYNC_HISTORY];
+    double sumW = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0, w, x, y, den, slope;
+    int n = historyCount;
+
+    refDevice = newest.deviceMicros;
+    refOffset = newest.offset;
+    synced = true;
+    if (n < 2) return;
+
+    for (int i = 0; i < n; i++) {
+        w = 1.0 / ((double)history[i].delay * history[i].delay + 1.0);
+        x = (double)(int64_t)(history[i].deviceMicros - newest.deviceMicros);
+        y = (double)(history[i].offset - newest.offset);
+        sumW += w;
+        sumX += w * x;
+        sumY += w * y;
+        sumXX += w * x * x;
+        sumXY += w * x * y;
+    }
+    den = sumW * sumXX - sumX * sumX;
+    if (den <= 0) return;
+    slope = (sumW * sumXY - sumX * sumY) / den;
+    if (slope > CLOCK_SYNC_MAX_PPM / 1e6) slope = CLOCK_SYNC_MAX_PPM / 1e6;
+    if (slope < -CLOCK_SYNC_MAX_PPM / 1e6) slope = -CLOCK_SYNC_MAX_PPM / 1e6;
+    driftPpb = (int32_t)(slope * 1e9);
+    //where the line crosses the newest exchange
+    refOffset += (int64_t)((sumY - slope * sumX) / sumW);
+}
+
+//Low 32 bits of host time if the host asked for it and there's an estimate, otherwise unchanged
+uint32_t ClockSync::toHost(uint32_t deviceMicros)
+{
+    uint64_t device;
+
+    if (!hostTime || !synced) return deviceMicros;
+    device = extend(deviceMicros);
+    return (uint32_t)(device + offsetAt(device));
+}
+
+boolean ClockSync::isSynced()
+{
+    return synced;
+}
+
+void ClockSync::printStatus()
+{
+    Logger::console("Clock sync %s: %l exchanges, %l rejected, last round trip %lus, host time %s",
+                    synced ? "locked" : "not locked", exchanges, rejected, lastDelay, hostTime ? "on" : "off");
+    Logger::console("Offset %fs, drift %fppm from %i filtered exchanges", refOffset / 1000000.0, driftPpb / 1000.0,
+                    historyCount);
+}
@@ -0,0 +1,94 @@
+/*
+ * ClockSync.h
+ *
+ * Keeps track of how the host's clock relates to micros(). The host sends PROTO_CLOCK_SYNC
+ * every so often with its own time and the device answers with when the request arrived and when
+ * the reply left. Each request also carries the time the host got the previous reply so the device
+ * ends up with all four times of every exchange, the same as NTP, and works out the offset and
+ * drift between the two clocks itself. Once it has them, timestamps sent to the host can be in
+ * host time so captures from several devices line up.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef CLOCKSYNC_H_
+#define CLOCKSYNC_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+//PROTO_CLOCK_SYNC flags
+#define CLOCK_HOST_TIME     1   //send timestamps in host time once synced
+#define CLOCK_RESET         2   //forget all exchanges so far and start over
+
+typedef struct {
+    uint64_t deviceMicros;      //device time in the middle of the exchange
+    int64_t offset;             //host time - device time
+    uint32_t delay;             //round trip minus the time the device held the request
+} CLOCK_SAMPLE;
+
+class ClockSync {
+public:
+    static void setup();
+    static void loop();
+    static void requestReceived();
+    static int exchange(uint8_t *data, uint8_t *reply, int maxLen);
+    static uint32_t toHost(uint32_t deviceMicros);
+    static boolean isSynced();
+    static void printStatus();
+
+private:
+    static uint32_t lastMicros;
+    static uint32_t wraps;
+    static uint64_t receivedMicros;
+    static uint8_t lastSeq;
+    static uint64_t lastHostSend;
+    static uint64_t lastReceived;
+    static uint64_t lastReplied;
+    static boolean haveLast;
+    static boolean hostTime;
+
+    static CLOCK_SAMPLE best;           //least delayed exchange of the current window
+    static uint8_t windowCount;
+    static CLOCK_SAMPLE history[CLOCK_SYNC_HISTORY];
+    static uint8_t historyCount;
+    static uint8_t historyPos;
+
+    static uint64_t refDevice;
+    static int64_t refOffset;
+    static int32_t driftPpb;
+    static boolean synced;
+
+    static uint32_t exchanges;
+    static uint32_t rejected;
+    static uint32_t lastDelay;
+
+    static uint64_t deviceNow();
+    static uint64_t extend(uint32_t deviceMicros);
+    static int64_t offsetAt(uint64_t deviceMicros);
+    static void addSample(uint64_t hostSend, uint64_t received, uint64_t replied, uint64_t hostReceive);
+    static void fit();
+    static void reset();
+};
+
+#endif /* CLOCKSYNC_H_ */
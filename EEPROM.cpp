@@ -6,6 +6,12 @@ EEPROMCLASS::EEPROMCLASS(TwoWire *i2cport)
 {
     port = i2cport;
     //port->begin();
+    writeTime = 0;
+    numRegions = 0;
+    poolUsed = 0;
+    currentRegion = 0;
+    busy = false;
+    rawData = NULL;
 }
 
 uint8_t EEPROMCLASS::readByte(uint32_t address)
@@ -52,6 +58,197 @@ void EEPROMCLASS::setWPPin(uint8_t pin)
     digitalWrite(pin, LOW);
 }
 
+//The chip doesn't answer while it is still writing a page
+void EEPROMCLASS::waitForChip()
+{
+    while ((int32_t)(writeTime - millis()) > 0);
+}
+
+//Region for a struct at this address, created the first time it is read or written. NULL if out of room.
+EEPROM_REGION *EEPROMCLASS::findRegion(uint32_t address, uint16_t length)
+{
+    for (int r = 0; r < numRegions; r++) {
+        if (regions[r].address == address && regions[r].length == length) return &regions[r];
+    }
+    if (numRegions >= EEPROM_MAX_REGIONS || poolUsed + length > EEPROM_SHADOW_SIZE) return NULL;
+    EEPROM_REGION &region = regions[numRegions++];
+    region.address = address;
+    region.length = length;
+    region.offset = poolUsed;
+    region.cursor = 0;
+    region.dirty = false;
+    region.shadowValid = false;
+    poolUsed += length;
+    return &region;
+}
+
+//One page write. length bytes starting at address, which must not run past the end of the page.
+void EEPROMCLASS::writePage(uint32_t address, const uint8_t *data, uint8_t length)
+{
+    uint8_t buffer[EEPROM_PAGE_SIZE + 2];
+    uint8_t i2c_id;
+
+    buffer[0] = ((address & 0xFF00) >> 8);
+    buffer[1] = ((uint8_t)(address & 0x00FF));
+    for (int i = 0; i < length; i++) buffer[i + 2] = data[i];
+    i2c_id = 0b01010000 + ((address >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
+    //Blast page in single shot
+    port->beginTransmission(i2c_id);
+    port->write(buffer, length + 2);
+    port->endTransmission(true);
+    writeTime = millis() + EEPROM_WRITE_MS;
+}
+
+int EEPROMCLASS::writeBlock(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    EEPROM_REGION *region = findRegion(address, length);
+
+    if (!region) {
+        //no room to keep a copy, do it the slow way
+        uint16_t done = 0;
+        while (done < length) {
+            uint8_t chunk = EEPROM_PAGE_SIZE - ((address + done) % EEPROM_PAGE_SIZE);
+            if (chunk > length - done) chunk = length - done;
+            waitForChip();
+            writePage(address + done, data + done, chunk);
+            done += chunk;
+        }
+        return length;
+    }
+
+    memcpy(pending + region->offset, data, length);
+    region->cursor = 0; //start over, pages already written will match the shadow and be skipped
+    region->dirty = true;
+    busy = true;
+    return length;
+}
+
+int EEPROMCLASS::readBlock(uint32_t address, uint8_t *data, uint16_t length)
+{
+    EEPROM_REGION *region = findRegion(address, length);
+
+    if (region && region->dirty) {
+        memcpy(data, pending + region->offset, length);
+        return length;
+    }
+    readRaw(address, data, length);
+    if (region) {
+        memcpy(shadow + region->offset, data, length);
+        memcpy(pending + region->offset, data, length);
+        region->shadowValid = true;
+    }
+    return length;
+}
+
+//Read straight from the chip without keeping a shadow of the bytes
+void EEPROMCLASS::readRaw(uint32_t address, uint8_t *data, uint16_t length)
+{
+    uint8_t buffer[2];
+    uint8_t i2c_id;
+    uint16_t done = 0;
+
+    /*
+     * Set the address once and then keep reading. The chip's address counter carries on from where
+     * the last read stopped, across pages, so each further chunk is one short read transaction.
+     * Chunks are only as large as the Wire buffer.
+     */
+    waitForChip();
+    while (done < length) {
+        uint32_t readAddr = address + done;
+        if (done == 0 || (readAddr & 0xFFFF) == 0) { //the top address bits are part of the chip ID
+            buffer[0] = ((readAddr & 0xFF00) >> 8);
+            buffer[1] = ((uint8_t)(readAddr & 0x00FF));
+            i2c_id = 0b01010000 + ((readAddr >> 16) & 0x03); //10100 is the chip ID then the two upper bits of the address
+            port->beginTransmission(i2c_id);
+            port->write(buffer, 2);
+            port->endTransmission(false); //do NOT generate stop
+        }
+        uint8_t chunk = EEPROM_PAGE_SIZE;
+        if (chunk > length - done) chunk = length - done;
+        if (chunk > 0x10000 - (readAddr & 0xFFFF)) chunk = 0x10000 - (readAddr & 0xFFFF);
+        port->requestFrom(i2c_id, chunk); //this will generate stop though.
+        for (int i = 0; i < chunk; i++) {
+            data[done + i] = port->available() ? port->read() : 0xFF;
+        }
+        done += chunk;
+    }
+}
+
+/*
+ * Queue a write straight from the caller's buffer, which has to stay as it is until rawBusy() is false.
+ * Nothing is compared, every page is written. Used for records that go to a new place each time, so
+ * a shadow copy wouldn't save anything. Returns false if the last one hasn't finished.
+ */
+boolean EEPROMCLASS::writeRaw(uint32_t address, const uint8_t *data, uint16_t length)
+{
+    if (rawData) return false;
+    rawAddress = address;
+    rawLength = length;
+    rawCursor = 0;
+    rawData = data;
+    busy = true;
+    return true;
+}
+
+boolean EEPROMCLASS::rawBusy()
+{
+    return rawData != NULL;
+}
+
+//Write the next page of a region that differs from the shadow. False if no region has one.
+boolean EEPROMCLASS::writeNextRegionPage()
+{
+    for (int count = 0; count < numRegions; count++) {
+        EEPROM_REGION &region = regions[currentRegion];
+        if (region.dirty) {
+            while (region.cursor < region.length) {
+                uint32_t addr = region.address + region.cursor;
+                uint8_t chunk = EEPROM_PAGE_SIZE - (addr % EEPROM_PAGE_SIZE);
+                if (chunk > region.length - region.cursor) chunk = region.length - region.cursor;
+                uint8_t *newData = pending + region.offset + region.cursor;
+                uint8_t *oldData = shadow + region.offset + region.cursor;
+                region.cursor += chunk;
+                if (region.shadowValid && !memcmp(newData, oldData, chunk)) continue;
+                writePage(addr, newData, chunk);
+                memcpy(oldData, newData, chunk);
+                return true;
+            }
+            region.dirty = false;
+            region.shadowValid = true;
+            region.cursor = 0;
+        }
+        currentRegion = (currentRegion + 1) % numRegions;
+    }
+    return false;
+}
+
+/*
+ * Write at most one page of whatever has been queued. Pages whose bytes match the shadow are skipped
+ * without touching the chip, so saving settings after changing one field costs one page write.
+ */
+void EEPROMCLASS::loop()
+{
+    if (!busy) return;
+    if ((int32_t)(writeTime - millis()) > 0) return; //chip is still busy with the last page
+
+    if (writeNextRegionPage()) return;
+    if (rawData) {
+        uint32_t addr = rawAddress + rawCursor;
+        uint8_t chunk = EEPROM_PAGE_SIZE - (addr % EEPROM_PAGE_SIZE);
+        if (chunk > rawLength - rawCursor) chunk = rawLength - rawCursor;
+        writePage(addr, rawData + rawCursor, chunk);
+        rawCursor += chunk;
+        if (rawCursor >= rawLength) rawData = NULL;
+        return;
+    }
+    busy = false;
+}
+
+boolean EEPROMCLASS::isBusy()
+{
+    return busy;
+}
+
 //Instantiate the class with the proper name to pretend this is still the class from the non-Due arduinos
 EEPROMCLASS EEPROM(&Wire);
 
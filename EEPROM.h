@@ -3,6 +3,24 @@
 
 #include "Arduino.h"
 
+#define EEPROM_PAGE_SIZE    32
+#define EEPROM_WRITE_MS     30      //time to allow the chip between page writes
+#define EEPROM_MAX_REGIONS  4       //separate structs that can be written in the background
+#define EEPROM_SHADOW_SIZE  256     //bytes of those structs kept in RAM, twice over
+
+/*
+ * A struct stored at one address. pending is what was last written to it, shadow what the chip
+ * is known to hold. Both are slices of the pools in EEPROMCLASS.
+ */
+typedef struct {
+    uint32_t address;
+    uint16_t length;
+    uint16_t offset;        //into the pools
+    uint16_t cursor;        //next byte loop() looks at
+    boolean dirty;          //pending hasn't all made it to the chip yet
+    boolean shadowValid;    //false until the region has been read or written once
+} EEPROM_REGION;
+
 class EEPROMCLASS {
 public:
     uint8_t readByte(uint32_t address);
@@ -12,86 +30,48 @@ public:
 
     EEPROMCLASS(TwoWire *i2cport);
 
-    //read and write input address in bytes. The page size is assumed to be 32 bytes. If it's larger we'll
-    //be writing the same page potentially multiple times but its not the end of the world.
-
+    /*
+     * write() doesn't touch the chip. It copies the value and loop() writes out the pages that differ
+     * from what the chip already holds, one page per call, so a settings change doesn't hold up
+     * capture for the 30ms each page takes. read() returns a queued value if it hasn't been written yet.
+     */
     template <class T> int write(int ee, const T& value)
     {
-        uint8_t buffer[35];
-        uint8_t i2c_id;
-        const byte* p = (const byte*)(const void*)&value;
-        unsigned int i;
-        int valSize = sizeof(value);
-        int page;
-        int writeAddr;
-        int writeSize;
-
-        page = (ee / 32);
-
-        while (valSize > 0) {
-            writeAddr = page * 32;
-            while (writeTime > millis());
-
-            for (i = 0; i < 35; i++) buffer[i] = 0xFF;
-            buffer[0] = ((writeAddr & 0xFF00) >> 8);
-            buffer[1] = ((uint8_t)(writeAddr & 0x00FF));
-            i2c_id = 0b01010000 + ((ee >> 8) & 0x03); //10100 is the chip ID then the two upper bits of the address
-            writeSize = valSize;
-            if (writeSize > 32) writeSize = 32;
-            for (i = 0; i < writeSize; i++) {
-                buffer[i + 2] = *p++;
-            }
-            //Blast page in single shot
-            port->beginTransmission(i2c_id);
-            port->write(buffer, writeSize + 2);
-            port->endTransmission(true);
-            valSize -= writeSize;
-            page++;
-
-            writeTime = millis() + 30; //wait for transfer over i2c plus eeprom write
-        }
-
-        return i;
+        return writeBlock(ee, (const uint8_t *)(const void *)&value, sizeof(value));
     }
 
     template <class T> int read(int ee, T& value)
     {
-        uint8_t buffer[3];
-        uint8_t i2c_id;
-        byte* p = (byte*)(void*)&value;
-        unsigned int i;
-        int valSize = sizeof(value);
-        int page;
-        int readAddr;
-        int readSize;
-
-        page = (ee / 32);
-
-        while (valSize > 0) {
-            readAddr = page * 32;
-            buffer[0] = ((readAddr & 0xFF00) >> 8);
-            buffer[1] = ((uint8_t)(readAddr & 0x00FF));
-            i2c_id = 0b01010000 + ((ee >> 8) & 0x03); //10100 is the chip ID then the two upper bits of the address
-            //send the address to get the chip ready.
-            port->beginTransmission(i2c_id);
-            port->write(buffer, 2);
-            port->endTransmission(false); //do NOT generate stop
-            //Now, tell it we'd like to read up to a whole page
-            port->requestFrom(i2c_id, sizeof(value)); //this will generate stop though.
-            readSize = valSize;
-            if (readSize > 32) readSize = 32;
-            for (i = 0; i < sizeof(value); i++) {
-                if (port->available()) *p++ = port->read();
-            }
-            valSize -= readSize;
-            page++;
-        }
-        return i;
+        return readBlock(ee, (uint8_t *)(void *)&value, sizeof(value));
     }
 
+    void readRaw(uint32_t address, uint8_t *data, uint16_t length);
+    boolean writeRaw(uint32_t address, const uint8_t *data, uint16_t length);
+    boolean rawBusy();
+    void loop();
+    boolean isBusy();
+
 private:
     uint32_t writeTime;
     TwoWire *port;
+    EEPROM_REGION regions[EEPROM_MAX_REGIONS];
+    uint8_t numRegions;
+    uint16_t poolUsed;
+    uint8_t currentRegion;
+    boolean busy;
+    uint8_t pending[EEPROM_SHADOW_SIZE];
+    uint8_t shadow[EEPROM_SHADOW_SIZE];
+    const uint8_t *rawData;     //caller's buffer for writeRaw(), NULL when there's no such write
+    uint32_t rawAddress;
+    uint16_t rawLength;
+    uint16_t rawCursor;
+
+    int writeBlock(uint32_t address, const uint8_t *data, uint16_t length);
+    int readBlock(uint32_t address, uint8_t *data, uint16_t length);
+    EEPROM_REGION *findRegion(uint32_t address, uint16_t length);
+    boolean writeNextRegionPage();
+    void writePage(uint32_t address, const uint8_t *data, uint8_t length);
+    void waitForChip();
 };
 
 extern EEPROMCLASS EEPROM;
@@ -31,12 +31,24 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
 #include "ELM327_Emulator.h"
+#include "M2RET.h"
+#include "PidCache.h"
+
+/*
+ * Requests go out on CAN0 as single frames and whatever comes back from the ECUs is printed
+ * as it arrives, the same way a real ELM327 does, until the timeout runs out with nothing more
+ * coming or the requested number of replies is in. Replies are written through a fixed buffer
+ * rather than built up in Strings.
+ */
 
 /*
  * Constructor. Assign serial interface to use for comm with bluetooth adapter we're emulating with
  */
 ELM327Emu::ELM327Emu() {
     serialInterface = &Serial;
+    ibWritePtr = 0;
+    outLen = 0;
+    resetSettings();
 }
 
 /*
@@ -44,18 +56,34 @@ ELM327Emu::ELM327Emu() {
  */
 ELM327Emu::ELM327Emu(UARTClass *which) {
     serialInterface = which;
+    ibWritePtr = 0;
+    outLen = 0;
+    resetSettings();
 }
 
 /*
  * Initialization of hardware and parameters
  */
 void ELM327Emu::setup() {
-
-    tickCounter = 0;
     ibWritePtr = 0;
+    outLen = 0;
+    resetSettings();
     serialInterface->begin(115200);
 }
 
+void ELM327Emu::resetSettings() {
+    bLineFeed = false;
+    bHeader = false;
+    bSpaces = false;
+    lineStarted = false;
+    txHeader = 0x7DF;
+    txExtended = false;
+    rxAddress = ELM_NO_ADDRESS;
+    timeout = ELM_DEFAULT_TIMEOUT;
+    waiting = false;
+    monitoring = false;
+}
+
 /*
  * Send a command to ichip. The "AT+i" part will be added.
  */
@@ -70,11 +98,27 @@ void ELM327Emu::sendCmd(String cmd) {
  * Called in the main loop (hopefully) in order to process serial input waiting for us
  * from the wifi module. It should always terminate its answers with 13 so buffer
  * until we get 13 (CR) and then process it.
- * But, for now just echo stuff to our serial port for debugging
+ * While a request is waiting for replies the input is left alone. Monitoring stops on any character.
  */
 
 void ELM327Emu::loop() {
     int incoming;
+
+    if (waiting) {
+        if ((millis() - lastActivity) > (uint32_t)timeout * 4) finishRequest();
+        return;
+    }
+    if (monitoring) {
+        if (serialInterface->available()) {
+            serialInterface->read();
+            monitoring = false;
+            outLine();
+            out("STOPPED");
+            prompt();
+        }
+        return;
+    }
+
     while (serialInterface->available()) {
         incoming = serialInterface->read();
         if (incoming != -1) { //and there is no reason it should be -1
@@ -85,6 +129,7 @@ void ELM327Emu::loop() {
                 if (Logger::isDebug())
                     Logger::debug(incomingBuffer);
                 processCmd();
+                if (waiting || monitoring) return; //rest of the input waits until this one is done
 
             } else { // add more characters
                 if (incoming != 10 && incoming != ' ') // don't add a LF character or spaces. Strip them right out
@@ -100,282 +145,337 @@ void ELM327Emu::loop() {
 *   But, for reference, this cmd processes the command in incomingBuffer
 */
 void ELM327Emu::processCmd() {
-    String retString = processELMCmd(incomingBuffer);
-
-    serialInterface->print(retString);
-    if (Logger::isDebug()) {
-        char buff[30];
-        retString.toCharArray(buff, 30);
-        Logger::debug(buff);
+    if (!strncmp(incomingBuffer, "at", 2)) {
+        processATCmd(incomingBuffer + 2);
+        if (!monitoring) prompt();
     }
-
+    else processRequest(incomingBuffer); //prompts itself once the replies are in
 }
 
-String ELM327Emu::processELMCmd(char *cmd) {
-    String retString = String();
-    String lineEnding;
-    if (bLineFeed) lineEnding = String("\r\n");
-    else lineEnding = String("\r");
+void ELM327Emu::processATCmd(char *cmd) {
+    int len = strlen(cmd);
+    uint32_t value;
 
-    if (!strncmp(cmd, "at", 2)) {
-
-        if (!strcmp(cmd, "atz")) { //reset hardware
-            retString.concat(lineEnding);
-            retString.concat("ELM327 v1.3a");
-        }
-        else if (!strncmp(cmd, "atsh",4)) { //set header address
-            //ignore this - just say OK
-            retString.concat("OK");
-        }
-        else if (!strncmp(cmd, "ate",3)) { //turn echo on/off
-            //could support echo but I don't see the need, just ignore this
-            retString.concat("OK");
-        }
-        else if (!strncmp(cmd, "ath",3)) { //turn headers on/off
-            if (cmd[3] == '1') bHeader = true;
-            else bHeader = false;
-            retString.concat("OK");
-        }
-        else if (!strncmp(cmd, "atl",3)) { //turn linefeeds on/off
-            if (cmd[3] == '1') bLineFeed = true;
-            else bLineFeed = false;
-            retString.concat("OK");
-        }
-        else if (!strcmp(cmd, "at@1")) { //send device description
-            retString.concat("ELM327 Emulator");
-        }
-        else if (!strcmp(cmd, "ati")) { //send chip ID
-            retString.concat("ELM327 v1.3a");
-        }
-        else if (!strncmp(cmd, "atat",4)) { //set adaptive timing
-            //don't intend to support adaptive timing at all
-            retString.concat("OK");
-        }
-        else if (!strncmp(cmd, "atsp",4)) { //set protocol
-            //theoretically we can ignore this
-            retString.concat("OK");
-        }
-        else if (!strcmp(cmd, "atdp")) { //show description of protocol
-            retString.concat("can11/500");
-        }
-        else if (!strcmp(cmd, "atdpn")) { //show protocol number (same as passed to sp)
-            retString.concat("6");
-        }
-        else if (!strcmp(cmd, "atd")) { //set to defaults
-            retString.concat("OK");
-        }
-        else if (!strncmp(cmd, "atm", 3)) { //turn memory on/off
-            retString.concat("OK");
-        }
-        else if (!strcmp(cmd, "atrv")) { //show 12v rail voltage
-            //TODO: the system should actually have this value so it wouldn't hurt to
-            //look it up and report the real value.
-            retString.concat("14.2V");
+    if (!strcmp(cmd, "z")) { //reset hardware
+        resetSettings();
+        outLine();
+        out("ELM327 v1.3a");
+    }
+    else if (!strcmp(cmd, "d")) { //set to defaults
+        resetSettings();
+        out("OK");
+    }
+    else if (!strncmp(cmd, "sh", 2)) { //set header address
+        value = strtoul(cmd + 2, NULL, 16);
+        if (len - 2 == 3) {
+            txHeader = value & 0x7FF;
+            txExtended = false;
+            out("OK");
         }
-        else { //by default respond to anything not specifically handled by just saying OK and pretending.
-            retString.concat("OK");
+        else if (len - 2 == 6 || len - 2 == 8) {
+            //six digits leave the priority bits at 0x18 like ATCP does by default
+            txHeader = (len - 2 == 6) ? (0x18000000 | value) : (value & 0x1FFFFFFF);
+            txExtended = true;
+            out("OK");
         }
+        else out("?");
     }
-    else { //if no AT then assume it is a PID request. This takes the form of four bytes which form the alpha hex digit encoding for two bytes
-        //there should be four or six characters here forming the ascii representation of the PID request. Easiest for now is to turn the ascii into
-        //a 16 bit number and mask off to get the bytes
-        if (strlen(cmd) == 4) {
-            uint32_t valu = strtol((char *) cmd, NULL, 16); //the pid format is always in hex
-            uint8_t pidnum = (uint8_t)(valu & 0xFF);
-            uint8_t mode = (uint8_t)((valu >> 8) & 0xFF);
-            Logger::debug("Mode: %i, PID: %i", mode, pidnum);
-            char out[7];
-            char buff[10];
-            if (processRequest(mode, pidnum, NULL, out)) {
-                if (bHeader) {
-                    retString.concat("7E8");
-                    out[0] += 2; //not sending only data bits but mode and pid too
-                    for (int i = 0; i <= out[0]; i++) {
-                        sprintf(buff, "%02X", out[i]);
-                        retString.concat(buff);
-                    }
-                }
-                else {
-                    mode += 0x40;
-                    sprintf(buff, "%02X", mode);
-                    retString.concat(buff);
-                    sprintf(buff, "%02X", pidnum);
-                    retString.concat(buff);
-                    for (int i = 1; i <= out[0]; i++) {
-                        sprintf(buff, "%02X", out[i+2]);
-                        retString.concat(buff);
-                    }
-                }
-            }
+    else if (!strncmp(cmd, "cra", 3)) { //set receive address, none = automatic
+        if (len == 3) rxAddress = ELM_NO_ADDRESS;
+        else rxAddress = strtoul(cmd + 3, NULL, 16) & 0x1FFFFFFF;
+        out("OK");
+    }
+    else if (!strncmp(cmd, "st", 2)) { //set timeout
+        value = strtoul(cmd + 2, NULL, 16);
+        timeout = (value == 0) ? ELM_DEFAULT_TIMEOUT : value;
+        out("OK");
+    }
+    else if (!strcmp(cmd, "ma")) { //monitor all
+        monitoring = true;
+        flushOut();
+        return;
+    }
+    else if (!strncmp(cmd, "e", 1)) { //turn echo on/off
+        //could support echo but I don't see the need, just ignore this
+        out("OK");
+    }
+    else if (!strncmp(cmd, "h", 1)) { //turn headers on/off
+        bHeader = (cmd[1] == '1');
+        out("OK");
+    }
+    else if (!strncmp(cmd, "l", 1)) { //turn linefeeds on/off
+        bLineFeed = (cmd[1] == '1');
+        out("OK");
+    }
+    else if (!strncmp(cmd, "s", 1) && (cmd[1] == '0' || cmd[1] == '1')) { //spaces on/off
+        bSpaces = (cmd[1] == '1');
+        out("OK");
+    }
+    else if (!strcmp(cmd, "@1")) { //send device description
+        out("ELM327 Emulator");
+    }
+    else if (!strcmp(cmd, "i")) { //send chip ID
+        out("ELM327 v1.3a");
+    }
+    else if (!strcmp(cmd, "dp")) { //show description of protocol
+        out(txExtended ? "can29/500" : "can11/500");
+    }
+    else if (!strcmp(cmd, "dpn")) { //show protocol number (same as passed to sp)
+        out(txExtended ? "7" : "6");
+    }
+    else if (!strcmp(cmd, "rv")) { //show 12v rail voltage
+        //TODO: the system should actually have this value so it wouldn't hurt to
+        //look it up and report the real value.
+        out("14.2V");
+    }
+    else { //by default respond to anything not specifically handled (AT, SP, M, ...) by just saying OK and pretending.
+        out("OK");
+    }
+}
+
+/*
+ * A request is hex digits for up to 7 bytes: mode, pid and whatever else the mode takes.
+ * An odd digit on the end is the number of replies to wait for.
+ */
+void ELM327Emu::processRequest(char *cmd) {
+    CAN_FRAME frame;
+    int len = strlen(cmd);
+    int numBytes = len / 2;
+
+    for (int i = 0; i < len; i++) {
+        if (!isxdigit(cmd[i])) numBytes = 0;
+    }
+    if (numBytes == 0 || numBytes > 7) {
+        out("?");
+        prompt();
+        return;
+    }
+
+    frame.id = txHeader;
+    frame.extended = txExtended;
+    frame.rtr = 0;
+    frame.length = 8;
+    frame.data.bytes[0] = numBytes;
+    for (int b = 0; b < 7; b++) {
+        if (b < numBytes) {
+            char digits[3] = {cmd[b * 2], cmd[b * 2 + 1], 0};
+            frame.data.bytes[b + 1] = strtoul(digits, NULL, 16);
         }
+        else frame.data.bytes[b + 1] = 0;
     }
+    requestMode = frame.data.bytes[1];
+    repliesWanted = (len & 1) ? strtoul(cmd + len - 1, NULL, 16) : 0;
+    repliesGot = 0;
+    gotReply = false;
+    for (int e = 0; e < ELM_MAX_ECUS; e++) multiLeft[e] = 0;
+    ecuCount = 0;
+    if (numBytes == 2 && answerFromCache(frame.data.bytes[2])) return;
+    queueFrame(0, frame, 1);
+    lastActivity = millis();
+    waiting = true;
+    flushOut();
+}
+
+/*
+ * Answer a mode/pid request from replies recently seen on the bus if there are fresh enough ones
+ * from every ECU the request could be going to. Functional requests are answered with whatever
+ * ECUs are in the cache unless the request says more replies are expected than that.
+ */
+bool ELM327Emu::answerFromCache(uint8_t pid) {
+    CAN_FRAME cached[8];
+    uint32_t onlyId = PIDCACHE_ANY_ID;
+    int count;
 
-    retString.concat(lineEnding);
-    retString.concat(">"); //prompt to show we're ready to receive again
+    if (rxAddress != ELM_NO_ADDRESS) onlyId = rxAddress;
+    else if (!txExtended && txHeader >= 0x7E0 && txHeader <= 0x7E7) onlyId = txHeader + 8;
+    else if (txExtended && (txHeader & 0x1FFF00FF) == 0x18DA00F1) onlyId = 0x18DAF100 | ((txHeader >> 8) & 0xFF);
+    else if (txHeader != (txExtended ? 0x18DB33F1 : 0x7DF)) return false; //not an OBD request address
 
-    return retString;
+    count = PidCache::lookup(requestMode, pid, onlyId, cached, 8);
+    if (count == 0 || count < repliesWanted) return false;
+    if (repliesWanted > 0) count = repliesWanted;
+    for (int c = 0; c < count; c++) printFrame(cached[c], 1, cached[c].data.bytes[0] & 0xF);
+    prompt();
+    return true;
+}
+
+//Default receive addresses are the OBD-II response IDs for the kind of header in use
+bool ELM327Emu::isReplyAddress(CAN_FRAME &frame) {
+    if (rxAddress != ELM_NO_ADDRESS) return frame.id == rxAddress;
+    if (frame.extended != txExtended) return false;
+    if (txExtended) return (frame.id & 0x1FFFFF00) == 0x18DAF100;
+    return frame.id >= 0x7E8 && frame.id <= 0x7EF;
 }
 
 /*
-Public method to process OBD2 requests.
-    inData is whatever payload the request might need to have sent - it's OK to be NULL if this is a run of the mill PID request with no payload
-    outData should be a preallocated buffer of at least 6 bytes. The format is as follows:
-    outData[0] is the length of the data actually returned
-    outData[1] is the returned mode (input mode + 0x40)
-    there after, the rest of the bytes are the data requested. This should be 1-5 bytes
-*/
-bool ELM327Emu::processRequest(uint8_t mode, uint8_t pid, char *inData, char *outData) {
-    bool ret = false;
-    switch (mode) {
-    case 1: //show current data
-        ret = processShowData(pid, inData, outData);
-        outData[1] = mode + 0x40;
-        outData[2] = pid;
-        break;
-    case 2: //show freeze frame data - not sure we'll be supporting this
-        break;
-    case 3: //show stored diagnostic codes - Returns DTC codes
-        break;
-    case 4: //clear diagnostic trouble codes - If we get this frame we just clear all codes no questions asked.
-        break;
-    case 6: //test results over CANBus (this replaces mode 5 from non-canbus) - I know nothing of this
-        break;
-    case 7: //show pending diag codes (current or last driving cycle) - Might just overlap with mode 3
-        break;
-    case 8: //control operation of on-board systems - this sounds really proprietary and dangerous. Maybe ignore this?
-        break;
-    case 9: //request vehicle info - We can identify ourselves here but little else
-        break;
-    case 0x20: //0x20 through something like 0x2F are custom PIDs. You make up what you want here.
-        break;
+ * Which multiLeft slot a reply belongs to. 11 bit replies are 0x7E8-0x7EF. 29 bit ones (18DAF1xx)
+ * can come from any source address so each new one gets the next free slot for this request.
+ * Returns ELM_MAX_ECUS if more ECUs answer than there are slots.
+ */
+uint8_t ELM327Emu::ecuIndex(CAN_FRAME &frame) {
+    uint8_t src = frame.id & 0xFF;
+
+    if (!frame.extended) return (frame.id >= 0x7E8 && frame.id <= 0x7EF) ? frame.id - 0x7E8 : 0;
+    for (int e = 0; e < ecuCount; e++) {
+        if (ecuAddrs[e] == src) return e;
     }
-    return ret;
+    if (ecuCount >= ELM_MAX_ECUS) return ELM_MAX_ECUS;
+    ecuAddrs[ecuCount] = src;
+    return ecuCount++;
 }
 
-//Process SAE standard PID requests. Function returns whether it handled the request or not.
-bool ELM327Emu::processShowData(uint8_t pid, char *inData, char *outData) {
-    int temp;
+//Tell an ECU sending a multi frame reply to send the rest, all of it and as fast as it likes
+void ELM327Emu::sendFlowControl(CAN_FRAME &frame) {
+    CAN_FRAME fc;
 
+    fc.extended = frame.extended;
+    if (frame.extended) fc.id = 0x18DA00F1 | ((frame.id & 0xFF) << 8);
+    else if (frame.id >= 0x7E8 && frame.id <= 0x7EF) fc.id = frame.id - 8;
+    else fc.id = txHeader;
+    fc.rtr = 0;
+    fc.length = 8;
+    fc.data.bytes[0] = 0x30;
+    for (int b = 1; b < 8; b++) fc.data.bytes[b] = 0;
+    queueFrame(0, fc, 1);
+}
 
-    switch (pid) {
-    case 0: //pids 1-0x20 that we support - bitfield
-        //returns 4 bytes so immediately indicate that.
-        outData[0] = 4;
-        outData[3] = 0b11011000; //pids 1 - 8 - starting with pid 1 in the MSB and going from there
-        outData[4] = 0b00010000; //pids 9 - 0x10
-        outData[5] = 0b10000000; //pids 0x11 - 0x18
-        outData[6] = 0b00010011; //pids 0x19 - 0x20
-        return true;
-        break;
-    case 1: //Returns 32 bits but we really can only support the first byte which has bit 7 = Malfunction? Bits 0-6 = # of DTCs
-        outData[0] = 4;
-        outData[3] = 0; //Fault codes would go here if any were returned by the car
-        outData[4] = 0; 
-        outData[5] = 0; 
-        outData[6] = 0;
-        return true;
-        break;
-    case 2: //Freeze DTC
-        return false; //don't support freeze framing yet. Might be useful in the future.
-        break;
-    case 4: //Calculated engine load (A * 100 / 255) - Percentage
-        outData[0] = 1;
-        outData[3] = 0xE4; //return a load of 89.4%
-        return true;
-        break;
-    case 5: //Engine Coolant Temp (A - 40) = Degrees Centigrade
-        outData[0] = 1; //returning only one byte
-        outData[3] = 120; //Return 80C as the coolant temperature.
-        return true;
-        break;
-    case 0xC: //Engine RPM (A * 256 + B) / 4
-        temp = 4200; //1050 RPM
-        outData[0] = 2;
-        outData[3] = (uint8_t)(temp / 256);
-        outData[4] = (uint8_t)(temp);
-        return true;
-        break;
-    case 0x11: //Throttle position (A * 100 / 255) - Percentage
-        outData[0] = 1;
-        outData[3] = 127; //50% throttle
-        return true;
-        break;
-    case 0x1C: //Standard supported (We return 1 = OBDII)
-        outData[0] = 1;
-        outData[3] = 1;
-        return true;
-        break;
-    case 0x1F: //runtime since engine start (A*256 + B)
-        temp = millis() / 1000; //return the actual board uptime
-        outData[0] = 2;
-        outData[3] = (uint8_t)(temp / 256);
-        outData[4] = (uint8_t)(temp);
-        return true;
-        break;
-    case 0x20: //pids supported (next 32 pids - formatted just like PID 0)
-        outData[0] = 4;
-        outData[3] = 0b10000000; //pids 0x21 - 0x28 - starting with pid 0x21 in the MSB and going from there
-        outData[4] = 0b00000010; //pids 0x29 - 0x30
-        outData[5] = 0b00000000; //pids 0x31 - 0x38
-        outData[6] = 0b00000001; //pids 0x39 - 0x40
-        return true;
-        break;
-    case 0x21: //Distance traveled with fault light lit (A*256 + B) - In km
-        outData[0] = 2;
-        outData[3] = 0; //there are no faults so no distance here either
-        outData[4] = 0;
-        return true;
-        break;
-    case 0x2F: //Fuel level (A * 100 / 255) - Percentage
-        outData[0] = 1;
-        outData[3] = 64; //a quarter tank of fuel
-        return true;
-        break;
-    case 0x40: //PIDs supported, next 32
-        outData[0] = 4;
-        outData[3] = 0b00000000; //pids 0x41 - 0x48 - starting with pid 0x41 in the MSB and going from there
-        outData[4] = 0b00000000; //pids 0x49 - 0x50
-        outData[5] = 0b10000000; //pids 0x51 - 0x58
-        outData[6] = 0b00000001; //pids 0x59 - 0x60
-        return true;
-        break;
-    case 0x51: //What type of fuel do we use?
-        outData[0] = 1;
-        outData[3] = 8; //code came from an electric car ECU so say we're using electricity for fuel
-        return true;
-        break;
-    case 0x60: //PIDs supported, next 32
-        outData[0] = 4;
-        outData[3] = 0b11100000; //pids 0x61 - 0x68 - starting with pid 0x61 in the MSB and going from there
-        outData[4] = 0b00000000; //pids 0x69 - 0x70
-        outData[5] = 0b00000000; //pids 0x71 - 0x78
-        outData[6] = 0b00000000; //pids 0x79 - 0x80
-        return true;
-        break;
-    case 0x61: //Driver requested torque (A-125) - Percentage
-        outData[0] = 1;
-        outData[3] = 175; //50% torque requested
-        return true;
-        break;
-    case 0x62: //Actual Torque delivered (A-125) - Percentage
-        outData[0] = 1;
-        outData[3] = 168; //getting less torque than requested.
-        return true;
+/*
+ * Every frame received on CAN0 comes through here. Replies to the request in progress are
+ * printed as they come in. With headers off multi frame replies are printed the way an ELM327
+ * does: the total length on a line of its own and then each frame's data behind its sequence number.
+ */
+void ELM327Emu::handleCANFrame(CAN_FRAME &frame) {
+    uint8_t *data = frame.data.bytes;
+    uint8_t ecu;
+
+    if (monitoring) {
+        if (rxAddress == ELM_NO_ADDRESS || frame.id == rxAddress) printFrame(frame, 0, frame.length);
+        flushOut();
+        return;
+    }
+    if (!waiting || frame.length == 0 || !isReplyAddress(frame)) return;
+    ecu = ecuIndex(frame);
+
+    switch (data[0] >> 4) {
+    case 0: //single frame
+        if ((data[0] & 0xF) == 0 || (data[0] & 0xF) > 7) return;
+        if (data[1] == 0x7F) {
+            if (data[2] != requestMode) return; //negative reply to some other request
+        }
+        else if (data[1] != (requestMode | 0x40)) return; //not a reply to this request
+        lastActivity = millis();
+        printFrame(frame, 1, data[0] & 0xF);
+        if (data[1] == 0x7F && frame.length > 3 && data[3] == 0x78) { //response pending, more to come
+            flushOut();
+            return;
+        }
+        repliesGot++;
         break;
-    case 0x63: //Reference torque for engine - presumably max torque - A*256 + B -> In Nm
-        temp = 600; //Powerful!
-        outData[0] = 2;
-        outData[3] = (uint8_t)(temp / 256);
-        outData[4] = (uint8_t)(temp & 0xFF);
-        return true;
+    case 1: //first frame
+        if (data[2] != (requestMode | 0x40) || ecu >= ELM_MAX_ECUS) return;
+        lastActivity = millis();
+        sendFlowControl(frame);
+        multiLeft[ecu] = (((data[0] & 0xF) << 8) | data[1]);
+        if (!bHeader) {
+            outHex(multiLeft[ecu], 3);
+            outLine();
+        }
+        multiLeft[ecu] = (multiLeft[ecu] > 6) ? multiLeft[ecu] - 6 : 0;
+        printFrame(frame, 2, 6);
+        flushOut();
+        return;
+    case 2: //consecutive frame
+        if (ecu >= ELM_MAX_ECUS || multiLeft[ecu] == 0) return;
+        lastActivity = millis();
+        printFrame(frame, 1, 7);
+        multiLeft[ecu] = (multiLeft[ecu] > 7) ? multiLeft[ecu] - 7 : 0;
+        if (multiLeft[ecu] > 0) {
+            flushOut();
+            return;
+        }
+        repliesGot++;
         break;
+    default:
+        return;
+    }
+    if (repliesWanted > 0 && repliesGot >= repliesWanted) finishRequest();
+    else flushOut();
+}
+
+/*
+ * One reply line. With headers on that's the ID and the whole frame, otherwise just the data
+ * (count bytes from start) with the sequence number in front for multi frame replies.
+ */
+void ELM327Emu::printFrame(CAN_FRAME &frame, int start, int count) {
+    uint8_t pci = frame.data.bytes[0] >> 4;
+
+    if (bHeader || monitoring) {
+        outHex(frame.id, frame.extended ? 8 : 3);
+        for (int b = 0; b < frame.length; b++) outByte(frame.data.bytes[b]);
     }
-    return false;
+    else {
+        if (pci == 1) out("0:");
+        if (pci == 2) {
+            outHex(frame.data.bytes[0] & 0xF, 1);
+            outChar(':');
+        }
+        if (start + count > frame.length) count = frame.length - start;
+        for (int b = 0; b < count; b++) outByte(frame.data.bytes[start + b]);
+    }
+    outLine();
+    if (waiting) gotReply = true;
+}
+
+void ELM327Emu::finishRequest() {
+    waiting = false;
+    if (!gotReply) out("NO DATA");
+    prompt();
 }
 
-//Add any custom PIDs you want in here. Format code as above ^^^ 0 = Returned data length, 3-? = Data returned.
-bool ELM327Emu::processShowCustomData(uint16_t pid, char *inData, char *outData) {
-    switch (pid) {
+void ELM327Emu::out(const char *str) {
+    while (*str) outChar(*str++);
+}
+
+void ELM327Emu::outChar(char c) {
+    if (outLen >= ELM_OUT_BUFF_SIZE) flushOut();
+    outBuffer[outLen++] = c;
+    lineStarted = true;
+}
+
+void ELM327Emu::outHex(uint32_t value, int digits) {
+    const char hexDigits[] = "0123456789ABCDEF";
+
+    for (int d = digits - 1; d >= 0; d--) outChar(hexDigits[(value >> (d * 4)) & 0xF]);
+}
+
+void ELM327Emu::outByte(uint8_t value) {
+    if (bSpaces && lineStarted) outChar(' ');
+    outHex(value, 2);
+}
+
+void ELM327Emu::outLine() {
+    outChar('\r');
+    if (bLineFeed) outChar('\n');
+    lineStarted = false;
+}
+
+//End of a reply
+void ELM327Emu::prompt() {
+    outLine();
+    outChar('>');
+    flushOut();
+    lineStarted = false;
+}
+
+void ELM327Emu::flushOut() {
+    if (outLen == 0) return;
+    serialInterface->write((uint8_t *)outBuffer, outLen);
+    if (Logger::isDebug()) {
+        char buff[30];
+        int len = (outLen < 29) ? outLen : 29;
+        memcpy(buff, outBuffer, len);
+        buff[len] = 0;
+        Logger::debug(buff);
     }
-    return false;
+    outLen = 0;
 }
@@ -33,10 +33,15 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 /*
 List of AT commands to support:
 AT E0 (turn echo off)
-AT H (0/1) - Turn headers on or off - headers are used to determine how many ECU√≠s present (hint: only send one response to 0100 and emulate a single ECU system to save time coding)
+AT H (0/1) - Turn headers on or off - with headers on each reply line starts with the ID of the ECU that sent it
 AT L0 (Turn linefeeds off - just use CR)
+AT S (0/1) - Spaces between bytes off or on
 AT Z (reset)
-AT SH - Set header address - seems to set the ECU address to send to (though you may be able to ignore this if you wish)
+AT D (set all of the below back to defaults)
+AT SH - Set header address - the ID requests are sent to. 3 hex digits for 11 bit, 6 or 8 for 29 bit
+AT CRA - Set receive address - only listen to this ID for replies. No address goes back to automatic
+AT ST - Set timeout in 4ms units to wait for (more) replies
+AT MA - Monitor all - print every frame on CAN0 until a character comes in
 AT @1 - Display device description - ELM327 returns: Designed by Andy Honecker 2011
 AT I - Cause chip to output its ID: ELM327 says: ELM327 v1.3a
 AT AT (0/1/2) - Set adaptive timing (though you can ignore this)
@@ -44,6 +49,9 @@ AT SP (set protocol) - you can ignore this
 AT DP (get protocol by name) - (always return can11/500)
 AT DPN (get protocol by number) - (always return 6)
 AT RV (adapter voltage) - Send something like 14.4V
+
+Anything else is taken as a request in hex (mode, pid, ...) and sent out on CAN0. An extra hex digit
+on the end is how many replies to wait for, otherwise replies are collected until the timeout.
 */
 
 
@@ -53,6 +61,10 @@ AT RV (adapter voltage) - Send something like 14.4V
 #include <Arduino.h>
 #include "config.h"
 #include "Logger.h"
+#include "due_can.h"
+
+#define ELM_NO_ADDRESS      0xFFFFFFFF  //receive address when ATCRA hasn't been given one
+#define ELM_MAX_ECUS        8           //ECUs whose multi frame replies can be followed at once
 
 class ELM327Emu {
 public:
@@ -60,29 +72,56 @@ public:
     ELM327Emu();
     ELM327Emu(UARTClass *which);
     void setup(); //initialization on start up
-    void handleTick(); //periodic processes
     void loop();
     void sendCmd(String cmd);
+    void handleCANFrame(CAN_FRAME &frame);
 
 private:
     UARTClass *serialInterface; //Allows for retargetting which serial port we use
     char incomingBuffer[128]; //storage for one incoming line
-    char buffer[30]; // a buffer for various string conversions
+    char outBuffer[ELM_OUT_BUFF_SIZE]; //reply being built, written out when full or done
+    int outLen;
+    bool lineStarted;
     bool bLineFeed; //should we use line feeds?
     bool bHeader; //should we produce a header?
-    int tickCounter;
+    bool bSpaces; //spaces between bytes?
     int ibWritePtr;
-    int currReply;
 
+    //request in progress
+    uint32_t txHeader;
+    bool txExtended;
+    uint32_t rxAddress; //ELM_NO_ADDRESS = 0x7E8-0x7EF or 0x18DAF1xx depending on the header
+    uint8_t timeout; //in 4ms units like the real thing
+    bool waiting;
+    bool monitoring;
+    uint8_t requestMode;
+    uint8_t repliesWanted; //0 = until the timeout
+    uint8_t repliesGot;
+    bool gotReply; //anything printed for this request yet
+    uint32_t lastActivity;
+    uint16_t multiLeft[ELM_MAX_ECUS]; //bytes still to come of a multi frame reply, per ECU
+    uint8_t ecuAddrs[ELM_MAX_ECUS]; //source address of each 29 bit replier seen for this request
+    uint8_t ecuCount;
+
+    void resetSettings();
     void processCmd();
-    String processELMCmd(char *cmd);
-    bool processRequest(uint8_t mode, uint8_t pid, char *inData, char *outData);
-    bool processShowData(uint8_t pid, char *inData, char *outData);
-    bool processShowCustomData(uint16_t pid, char *inData, char *outData);    
+    void processATCmd(char *cmd);
+    void processRequest(char *cmd);
+    bool answerFromCache(uint8_t pid);
+    bool isReplyAddress(CAN_FRAME &frame);
+    uint8_t ecuIndex(CAN_FRAME &frame);
+    void sendFlowControl(CAN_FRAME &frame);
+    void finishRequest();
+    void printFrame(CAN_FRAME &frame, int start, int count);
+    void out(const char *str);
+    void outChar(char c);
+    void outHex(uint32_t value, int digits);
+    void outByte(uint8_t value);
+    void outLine();
+    void prompt();
+    void flushOut();
 };
 
 
   
 #endif
-
-
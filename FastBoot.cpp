@@ -0,0 +1,204 @@
+/*
+ * FastBoot.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "FastBoot.h"
+#include "Logger.h"
+#include "Gateway.h"
+#include "SysHealth.h"
+#include "M2RET.h"
+#include <MCP2515_sw_can.h>
+#include <Arduino_Due_SD_HSMCI.h>
+
+/*
+ * setup() only does what has to happen before CAN can start (settings from EEPROM), starts CAN0
+ * and CAN1 and calls start(). From then on every frame is taken from the CAN interrupt through
+ * due_can's general callback, the same way the gateway does it, and put in ring[] with a micros()
+ * timestamp. loop() then runs one init step per pass. Initializing the sdcard blocks for a while
+ * but the interrupt keeps capturing in the meantime.
+ *
+ * If logging starts automatically the frames stay in ring[] until the card is ready, otherwise
+ * they would be read before there's a file to write them to. Without that there's nothing to wait
+ * for and read() hands them out right away. Either way the callbacks are taken off once the steps
+ * are done and the rest of the frames come from the driver as usual. The gateway needs the same
+ * callbacks, so if it gets turned on before then capture() does its forwarding and release()
+ * hands the callbacks over to it.
+ */
+
+extern SWcan SWCAN;
+extern FileStore FS;
+extern void CANHandler();
+
+BOOT_FRAME FastBoot::ring[BOOT_CAPTURE_FRAMES];
+volatile uint16_t FastBoot::head = 0;
+volatile uint16_t FastBoot::tail = 0;
+volatile uint32_t FastBoot::held = 0;
+volatile uint32_t FastBoot::dropped = 0;
+volatile uint32_t FastBoot::firstFrameMicros = 0;
+uint32_t FastBoot::canUpMicros = 0;
+uint32_t FastBoot::swcanUpMicros = 0;
+uint32_t FastBoot::sdReadyMicros = 0;
+uint32_t FastBoot::releaseMicros = 0;
+uint32_t FastBoot::stepMillis = 0;
+uint8_t FastBoot::step = BOOT_DONE;
+boolean FastBoot::holding = false;
+
+//Called from setup() right after CAN0 and CAN1 have been started
+void FastBoot::start()
+{
+    head = tail = 0;
+    held = dropped = 0;
+    firstFrameMicros = 0;
+    canUpMicros = micros();
+    holding = SysSettings.useSD && settings.autoStartLogging;
+    step = BOOT_SWCAN_START;
+    if (settings.CAN0_Enabled) Can0.setGeneralCallback(rxCAN0);
+    if (settings.CAN1_Enabled) Can1.setGeneralCallback(rxCAN1);
+}
+
+void FastBoot::rxCAN0(CAN_FRAME *frame)
+{
+    capture(0, frame);
+}
+
+void FastBoot::rxCAN1(CAN_FRAME *frame)
+{
+    capture(1, frame);
+}
+
+//Runs in the CAN interrupts
+void FastBoot::capture(uint8_t bus, CAN_FRAME *frame)
+{
+    uint32_t now = micros();
+
+    if (firstFrameMicros == 0) firstFrameMicros = now;
+    if (Gateway::getDirections() & ((bus == 0) ? GW_CAN0_TO_CAN1 : GW_CAN1_TO_CAN0)) Gateway::forward(bus, frame);
+    //both CAN interrupts put frames in here so keep the other one out
+    __disable_irq();
+    uint16_t nextHead = (head + 1) % BOOT_CAPTURE_FRAMES;
+    if (nextHead == tail) dropped++;
+    else {
+        ring[head].frame = *frame;
+        ring[head].timestamp = now;
+        ring[head].bus = bus;
+        head = nextHead;
+        held++;
+    }
+    __enable_irq();
+}
+
+/*
+ * Next held frame for a bus. Frames are handed out in the order they came in over both buses, so
+ * if the oldest one is for the other bus nothing is returned until that bus has taken it.
+ */
+boolean FastBoot::read(uint8_t bus, CAN_FRAME &frame, uint32_t &timestamp)
+{
+    if (holding || tail == head) return false;
+    if (ring[tail].bus != bus) return false;
+    frame = ring[tail].frame;
+    timestamp = ring[tail].timestamp;
+    tail = (tail + 1) % BOOT_CAPTURE_FRAMES;
+    return true;
+}
+
+//True while frames are held here. The driver isn't read until then so it can't get ahead of them.
+boolean FastBoot::busy()
+{
+    return holding || tail != head;
+}
+
+boolean FastBoot::isDone()
+{
+    return step == BOOT_DONE;
+}
+
+/*
+ * Let the held frames go and hand reception back to the driver, or to the gateway if it was turned
+ * on. step is already BOOT_DONE so setDirections() takes the callbacks this time.
+ */
+void FastBoot::release()
+{
+    Gateway::setDirections(Gateway::getDirections());
+    holding = false;
+    releaseMicros = micros();
+    if (dropped) SysHealth::rxOverrun(0);
+}
+
+//One init step per call so loop() keeps getting around to the buses in between
+void FastBoot::loop()
+{
+    switch (step) {
+    case BOOT_SWCAN_START:
+        if (!settings.SWCAN_Enabled) {
+            step = BOOT_SD;
+            break;
+        }
+        SWCAN.setupSW(settings.SWCANSpeed);
+        stepMillis = millis();
+        step = BOOT_SWCAN_WAIT;
+        break;
+    case BOOT_SWCAN_WAIT:
+        if ((millis() - stepMillis) < 20) break;
+        SWCAN.mode(3); // Go to normal mode. 0 - Sleep, 1 - High Speed, 2 - High Voltage Wake-Up, 3 - Normal
+        SWCAN.setListenOnlyMode(settings.SWCANListenOnly ? true : false);
+        attachInterrupt(SWC_INT, CANHandler, FALLING); //enable interrupt for SWCAN
+        SWCAN.InitFilters(true);
+        swcanUpMicros = micros();
+        Logger::console("Enabled SWCAN with speed %l", settings.SWCANSpeed);
+        step = BOOT_SD;
+        break;
+    case BOOT_SD:
+        if (SysSettings.useSD) {
+            if (SD.Init()) {
+                FS.Init();
+                SysSettings.SDCardInserted = true;
+                sdReadyMicros = micros();
+                if (settings.autoStartLogging) {
+                    SysSettings.logToFile = true;
+                    Logger::info("Automatically logging to file.");
+                }
+            } else {
+                Logger::error("SDCard not inserted. Cannot log to file!");
+                SysSettings.SDCardInserted = false;
+            }
+        }
+        step = BOOT_RELEASE;
+        break;
+    case BOOT_RELEASE:
+        step = BOOT_DONE;
+        release();
+        printStatus();
+        break;
+    }
+}
+
+//All times are from reset, which is when micros() starts counting
+void FastBoot::printStatus()
+{
+    Logger::console("Boot: CAN up at %lus, first frame at %lus, SWCAN up at %lus, sdcard ready at %lus, released at %lus",
+                    canUpMicros, firstFrameMicros, swcanUpMicros, sdReadyMicros, releaseMicros);
+    Logger::console("Boot: %l frames captured before release, %l dropped (BOOT_CAPTURE_FRAMES is %i)", held, dropped,
+                    BOOT_CAPTURE_FRAMES);
+}
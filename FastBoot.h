@@ -0,0 +1,82 @@
+/*
+ * FastBoot.h
+ *
+ * Gets CAN0 and CAN1 listening as early as possible after reset and holds what they receive in
+ * RAM while the slow parts of start up (SWCAN, the sdcard) are brought up from loop(). Once the
+ * card is ready the held frames go through the normal receive path so the log starts with them.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef FASTBOOT_H_
+#define FASTBOOT_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+enum BOOT_STEP {
+    BOOT_SWCAN_START,
+    BOOT_SWCAN_WAIT,        //transceiver needs 20ms after setup before it can be put in normal mode
+    BOOT_SD,
+    BOOT_RELEASE,
+    BOOT_DONE
+};
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t timestamp;
+    uint8_t bus;
+} BOOT_FRAME;
+
+class FastBoot {
+public:
+    static void start();
+    static void loop();
+    static boolean read(uint8_t bus, CAN_FRAME &frame, uint32_t &timestamp);
+    static boolean busy();
+    static boolean isDone();
+    static void printStatus();
+
+private:
+    static BOOT_FRAME ring[BOOT_CAPTURE_FRAMES];
+    static volatile uint16_t head;
+    static volatile uint16_t tail;
+    static volatile uint32_t held;
+    static volatile uint32_t dropped;
+    static volatile uint32_t firstFrameMicros;
+    static uint32_t canUpMicros;
+    static uint32_t swcanUpMicros;
+    static uint32_t sdReadyMicros;
+    static uint32_t releaseMicros;
+    static uint32_t stepMillis;
+    static uint8_t step;
+    static boolean holding;
+
+    static void rxCAN0(CAN_FRAME *frame);
+    static void rxCAN1(CAN_FRAME *frame);
+    static void capture(uint8_t bus, CAN_FRAME *frame);
+    static void release();
+};
+
+#endif /* FASTBOOT_H_ */
@@ -0,0 +1,234 @@
+/*
+ * FrameGenerator.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "FrameGenerator.h"
+#include "Logger.h"
+#include "TxQueue.h"
+#include "M2RET.h"
+#include "sys_io.h"
+
+extern TxQueue txQueues[];
+
+GEN_CONFIG FrameGenerator::config;
+boolean FrameGenerator::running = false;
+uint32_t FrameGenerator::intervalMicros = 0;
+uint32_t FrameGenerator::nextDue = 0;
+uint32_t FrameGenerator::startMillis = 0;
+uint32_t FrameGenerator::framesSent = 0;
+uint32_t FrameGenerator::currentId = 0;
+uint8_t FrameGenerator::counters[8];
+CAN_FRAME FrameGenerator::lastFrame;
+
+void FrameGenerator::setup()
+{
+    running = false;
+    config.bus = 0;
+    config.idStart = 0x100;
+    config.idEnd = 0x100;
+    config.extended = false;
+    config.length = 8;
+    for (int b = 0; b < 8; b++) {
+        config.payload[b] = 0;
+        config.bytes[b].mode = GEN_BYTE_FIXED;
+        config.bytes[b].min = 0;
+        config.bytes[b].max = 255;
+    }
+    config.rate = 100;
+    config.loadPercent = 0;
+    config.durationMs = 0;
+    config.stopId = GEN_NO_TRIGGER;
+    config.stopInput = GEN_NO_INPUT;
+}
+
+GEN_CONFIG &FrameGenerator::getConfig()
+{
+    return config;
+}
+
+boolean FrameGenerator::isRunning()
+{
+    return running;
+}
+
+/*
+ * Time between frames. In load mode this uses the same bits per frame estimate as the busload
+ * calculation so GENLOAD=50 should show up as about 50% on the busload LEDs.
+ */
+uint32_t FrameGenerator::calcInterval()
+{
+    uint32_t speed;
+    uint32_t bits = 41 + (config.length * 9);
+
+    if (config.loadPercent == 0) {
+        if (config.rate == 0) return 0;
+        return 1000000ul / config.rate;
+    }
+    if (config.extended || config.idEnd > 0x7FF) bits += 18;
+    if (config.bus == 0) speed = settings.CAN0Speed;
+    else if (config.bus == 1) speed = settings.CAN1Speed;
+    else speed = settings.SWCANSpeed;
+    if (speed == 0) return 0;
+    return (uint32_t)(((uint64_t)bits * 100000000ull) / ((uint64_t)speed * config.loadPercent));
+}
+
+boolean FrameGenerator::start()
+{
+    if (config.bus > 2 || config.length > 8 || config.idEnd < config.idStart) {
+        Logger::console("Generator config is not valid");
+        return false;
+    }
+    intervalMicros = calcInterval();
+    if (intervalMicros == 0) {
+        Logger::console("Generator rate is not valid");
+        return false;
+    }
+    for (int b = 0; b < 8; b++) counters[b] = config.bytes[b].min;
+    currentId = config.idStart;
+    framesSent = 0;
+    startMillis = millis();
+    nextDue = micros();
+    running = true;
+    Logger::console("Generator started, one frame every %lus", intervalMicros);
+    return true;
+}
+
+/*
+ * Frames still waiting in the TX queue are thrown away so nothing more goes out after a stop.
+ * The one already in the mailbox (if any) still finishes and gets counted.
+ */
+void FrameGenerator::stop(const char *reason)
+{
+    uint16_t flushed;
+
+    if (!running) return;
+    running = false;
+    flushed = txQueues[config.bus].flush(TX_FROM_GENERATOR);
+    Logger::console("Generator stopped (%s) after %l frames, %i queued frames dropped", reason, framesSent, flushed);
+    if (framesSent > 0) {
+        SerialUSB.print("Last frame: ");
+        SerialUSB.print(lastFrame.id, HEX);
+        for (int c = 0; c < lastFrame.length; c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(lastFrame.data.bytes[c], HEX);
+        }
+        SerialUSB.println();
+    }
+}
+
+void FrameGenerator::printStatus()
+{
+    Logger::console("Generator %s, %l frames sent", running ? "running" : "stopped", framesSent);
+    Logger::console("Bus %i, ID %x - %x, length %i, %l fps / %i%% load, duration %lms", config.bus, config.idStart,
+                    config.idEnd, config.length, config.rate, config.loadPercent, config.durationMs);
+}
+
+//Stop as soon as the trigger frame shows up on any bus. Called for every received frame.
+void FrameGenerator::checkTrigger(CAN_FRAME &frame)
+{
+    if (!running || config.stopId == GEN_NO_TRIGGER) return;
+    if (frame.id == config.stopId) stop("trigger frame");
+}
+
+//Called from txFrameDone for each of our frames. Only what actually went out counts.
+void FrameGenerator::frameDone(CAN_FRAME &frame, uint8_t event)
+{
+    if (event != TX_EVENT_COMPLETE) return;
+    lastFrame = frame;
+    framesSent++;
+}
+
+void FrameGenerator::buildFrame(CAN_FRAME &frame)
+{
+    frame.id = currentId;
+    frame.extended = (config.extended || currentId > 0x7FF);
+    frame.rtr = 0;
+    frame.length = config.length;
+    for (int b = 0; b < config.length; b++) {
+        switch (config.bytes[b].mode) {
+        case GEN_BYTE_INCREMENT:
+            frame.data.bytes[b] = counters[b];
+            break;
+        case GEN_BYTE_RANDOM:
+            frame.data.bytes[b] = random(config.bytes[b].min, config.bytes[b].max + 1);
+            break;
+        default:
+            frame.data.bytes[b] = config.payload[b];
+            break;
+        }
+    }
+}
+
+/*
+ * Step to the next frame. The ID moves every frame. Each time the ID range wraps the incrementing
+ * bytes step like an odometer (lowest byte index first) so every combination gets sent on every ID.
+ */
+void FrameGenerator::advance()
+{
+    if (currentId < config.idEnd) {
+        currentId++;
+        return;
+    }
+    currentId = config.idStart;
+    for (int b = 0; b < config.length; b++) {
+        if (config.bytes[b].mode != GEN_BYTE_INCREMENT) continue;
+        if (counters[b] < config.bytes[b].max) {
+            counters[b]++;
+            return;
+        }
+        counters[b] = config.bytes[b].min; //carry into the next incrementing byte
+    }
+}
+
+void FrameGenerator::loop()
+{
+    CAN_FRAME frame;
+    uint32_t now;
+
+    if (!running) return;
+    if (config.durationMs > 0 && (millis() - startMillis) >= config.durationMs) {
+        stop("duration reached");
+        return;
+    }
+    if (config.stopInput != GEN_NO_INPUT && getDigital(config.stopInput)) {
+        stop("digital input");
+        return;
+    }
+
+    now = micros();
+    for (int count = 0; count < GEN_MAX_PER_LOOP; count++) {
+        if ((int32_t)(now - nextDue) < 0) return;
+        if (txQueues[config.bus].count() >= TX_QUEUE_SIZE / 2) {
+            nextDue = now; //bus can't keep up. Go at whatever rate it can take rather than bursting later
+            return;
+        }
+        buildFrame(frame);
+        queueFrame(config.bus, frame, TX_FROM_GENERATOR);
+        advance();
+        nextDue += intervalMicros;
+    }
+    //still behind after a full batch, don't try to make it all up
+    if ((int32_t)(now - nextDue) > 0) nextDue = now;
+}
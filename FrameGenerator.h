@@ -0,0 +1,95 @@
+/*
+ * FrameGenerator.h
+ *
+ * On device frame generator for sweeping IDs and payload bytes (or fuzzing them) at a set
+ * rate without needing the host to send every frame.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef FRAMEGENERATOR_H_
+#define FRAMEGENERATOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+enum GEN_BYTE_MODE {
+    GEN_BYTE_FIXED = 0,     //always the template value
+    GEN_BYTE_INCREMENT = 1, //counts from min to max then wraps, one step each time the ID range wraps
+    GEN_BYTE_RANDOM = 2     //random value from min to max every frame
+};
+
+#define GEN_NO_TRIGGER  0xFFFFFFFF  //stopId value meaning "no stop frame"
+#define GEN_NO_INPUT    0xFF        //stopInput value meaning "no stop input"
+
+typedef struct {
+    uint8_t mode;
+    uint8_t min;
+    uint8_t max;
+} GEN_BYTE;
+
+typedef struct {
+    uint8_t bus;
+    uint32_t idStart;
+    uint32_t idEnd;
+    boolean extended;
+    uint8_t length;
+    uint8_t payload[8];
+    GEN_BYTE bytes[8];
+    uint32_t rate;          //frames per second, used if loadPercent is 0
+    uint8_t loadPercent;    //percent of bus capacity to use, 0 to go by rate instead
+    uint32_t durationMs;    //0 = run until stopped
+    uint32_t stopId;        //stop when this ID is received on any bus
+    uint8_t stopInput;      //stop when this digital input goes active
+} GEN_CONFIG;
+
+class FrameGenerator {
+public:
+    static void setup();
+    static void loop();
+    static boolean start();
+    static void stop(const char *reason);
+    static boolean isRunning();
+    static void checkTrigger(CAN_FRAME &frame);
+    static void frameDone(CAN_FRAME &frame, uint8_t event);
+    static GEN_CONFIG &getConfig();
+    static void printStatus();
+
+private:
+    static GEN_CONFIG config;
+    static boolean running;
+    static uint32_t intervalMicros;
+    static uint32_t nextDue;
+    static uint32_t startMillis;
+    static uint32_t framesSent;     //frames that made it onto the bus
+    static uint32_t currentId;
+    static uint8_t counters[8];
+    static CAN_FRAME lastFrame;
+
+    static void buildFrame(CAN_FRAME &frame);
+    static void advance();
+    static uint32_t calcInterval();
+};
+
+#endif /* FRAMEGENERATOR_H_ */
@@ -0,0 +1,82 @@
+/*
+ * FrameUtil.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "FrameUtil.h"
+
+/*
+ * A field is the bits of one data byte selected by mask (0x0F, 0xF0, 0x3C, ...). Values are
+ * shifted down so the field reads as a plain number.
+ */
+uint8_t frameGetField(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask)
+{
+    if (byteIdx > 7 || mask == 0) return 0;
+    return (frame.data.bytes[byteIdx] & mask) >> __builtin_ctz(mask);
+}
+
+//Values too big for the field wrap around within it
+void frameSetField(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask, uint8_t value)
+{
+    if (byteIdx > 7 || mask == 0) return;
+    uint8_t shift = __builtin_ctz(mask);
+    frame.data.bytes[byteIdx] = (frame.data.bytes[byteIdx] & ~mask) | ((value << shift) & mask);
+}
+
+void frameBumpCounter(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask)
+{
+    frameSetField(frame, byteIdx, mask, frameGetField(frame, byteIdx, mask) + 1);
+}
+
+void frameFillChecksum(CAN_FRAME &frame, uint8_t byteIdx, uint8_t type)
+{
+    uint8_t *bytes = frame.data.bytes;
+    uint8_t chk = (type == CHK_CRC8) ? 0xFF : 0;
+
+    if (byteIdx >= frame.length || type == CHK_NONE) return;
+    for (int b = 0; b < frame.length; b++) {
+        if (b == byteIdx) continue;
+        switch (type) {
+        case CHK_SUM:
+            chk += bytes[b];
+            break;
+        case CHK_XOR:
+            chk ^= bytes[b];
+            break;
+        case CHK_CRC8:
+            chk = crc8Update(chk, bytes[b]);
+            break;
+        }
+    }
+    if (type == CHK_CRC8) chk ^= 0xFF;
+    bytes[byteIdx] = chk;
+}
+
+//One byte of the SAE J1850 CRC8. Start with 0xFF and xor the result with 0xFF when done.
+uint8_t crc8Update(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (int bit = 0; bit < 8; bit++) crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x1D) : (uint8_t)(crc << 1);
+    return crc;
+}
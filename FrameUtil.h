@@ -0,0 +1,52 @@
+/*
+ * FrameUtil.h
+ *
+ * Helpers for filling in rolling counters and checksum bytes in frame payloads. Used by
+ * the periodic scheduler and the gateway rewrite rules.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef FRAMEUTIL_H_
+#define FRAMEUTIL_H_
+
+#include <Arduino.h>
+#include "due_can.h"
+
+//Checksum byte types. All of them cover every data byte except the checksum byte itself.
+enum FRAME_CHECKSUM {
+    CHK_NONE = 0,
+    CHK_SUM = 1,       //8 bit sum of the data bytes
+    CHK_XOR = 2,       //XOR of the data bytes
+    CHK_CRC8 = 3       //SAE J1850 CRC8 (poly 0x1D, init and final xor 0xFF)
+};
+
+#define FRAME_NO_BYTE   0xFF    //byte index meaning "not used"
+
+uint8_t frameGetField(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask);
+void frameSetField(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask, uint8_t value);
+void frameBumpCounter(CAN_FRAME &frame, uint8_t byteIdx, uint8_t mask);
+void frameFillChecksum(CAN_FRAME &frame, uint8_t byteIdx, uint8_t type);
+uint8_t crc8Update(uint8_t crc, uint8_t data);
+
+#endif /* FRAMEUTIL_H_ */
@@ -0,0 +1,174 @@
+/*
+ * Gateway.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Gateway.h"
+#include "Logger.h"
+#include "SysHealth.h"
+#include "RewriteRules.h"
+#include "FastBoot.h"
+
+/*
+ * Once due_can has a general callback set it hands every received frame to the callback from
+ * its interrupt instead of putting it into its own RX buffer. So while the gateway is on, the
+ * callback forwards the frame to the other controller right there (it only has to be copied
+ * into a mailbox or due_can's TX buffer) and also puts it into a capture buffer of our own
+ * which loop() reads from in place of the driver's. The forwarded copy goes through the rewrite
+ * rules first, the captured one is the frame as it was received.
+ *
+ * Until FastBoot has released the boot capture the callbacks are its own. Directions set in the
+ * meantime are only stored, FastBoot forwards through forward() and hands the callbacks over
+ * to us when it's done.
+ */
+
+uint8_t Gateway::directions = 0;
+GW_DIRECTION Gateway::dir[2];
+CAN_FRAME Gateway::capture[2][GW_CAPTURE_SIZE];
+volatile uint16_t Gateway::captureHead[2];
+volatile uint16_t Gateway::captureTail[2];
+uint32_t Gateway::reportedDrops[2];
+uint32_t Gateway::reportedTxFails[2];
+
+void Gateway::setup()
+{
+    directions = 0;
+    for (int b = 0; b < 2; b++) {
+        dir[b].filterId = 0;
+        dir[b].filterMask = 0;
+        captureHead[b] = captureTail[b] = 0;
+    }
+    resetStats();
+}
+
+void Gateway::resetStats()
+{
+    for (int b = 0; b < 2; b++) {
+        dir[b].forwarded = 0;
+        dir[b].filtered = 0;
+        dir[b].dropped = 0;
+        dir[b].txFailed = 0;
+        dir[b].captureDropped = 0;
+        reportedDrops[b] = 0;
+        reportedTxFails[b] = 0;
+    }
+}
+
+void Gateway::setDirections(uint8_t dirs)
+{
+    directions = dirs & (GW_CAN0_TO_CAN1 | GW_CAN1_TO_CAN0);
+    if (!FastBoot::isDone()) return;
+    if (directions & GW_CAN0_TO_CAN1) Can0.setGeneralCallback(rxCAN0);
+    else Can0.removeGeneralCallback();
+    if (directions & GW_CAN1_TO_CAN0) Can1.setGeneralCallback(rxCAN1);
+    else Can1.removeGeneralCallback();
+}
+
+uint8_t Gateway::getDirections()
+{
+    return directions;
+}
+
+void Gateway::setFilter(uint8_t fromBus, uint32_t id, uint32_t mask)
+{
+    if (fromBus > 1) return;
+    dir[fromBus].filterId = id;
+    dir[fromBus].filterMask = mask;
+}
+
+void Gateway::rxCAN0(CAN_FRAME *frame)
+{
+    handleRx(0, frame);
+}
+
+void Gateway::rxCAN1(CAN_FRAME *frame)
+{
+    handleRx(1, frame);
+}
+
+//Send a received frame on to the other bus. Runs in the CAN interrupt of the bus the frame came in on.
+void Gateway::forward(uint8_t bus, CAN_FRAME *frame)
+{
+    GW_DIRECTION &d = dir[bus];
+
+    if ((frame->id & d.filterMask) == (d.filterId & d.filterMask)) {
+        CANRaw &out = (bus == 0) ? Can1 : Can0;
+        CAN_FRAME outFrame = *frame;
+        if (!RewriteRules::apply(bus, outFrame)) d.dropped++;
+        else if (out.sendFrame(outFrame)) d.forwarded++;
+        else d.txFailed++;
+    } else d.filtered++;
+}
+
+//Runs in the CAN interrupt of the bus the frame came in on
+void Gateway::handleRx(uint8_t bus, CAN_FRAME *frame)
+{
+    GW_DIRECTION &d = dir[bus];
+
+    forward(bus, frame);
+    uint16_t nextHead = (captureHead[bus] + 1) % GW_CAPTURE_SIZE;
+    if (nextHead == captureTail[bus]) {
+        d.captureDropped++;
+        return;
+    }
+    capture[bus][captureHead[bus]] = *frame;
+    captureHead[bus] = nextHead;
+}
+
+/*
+ * Take the next captured frame for a bus. Returns false if there isn't one, in which case
+ * the caller reads the driver as usual.
+ */
+boolean Gateway::read(uint8_t bus, CAN_FRAME &frame)
+{
+    if (bus > 1 || captureTail[bus] == captureHead[bus]) return false;
+    frame = capture[bus][captureTail[bus]];
+    captureTail[bus] = (captureTail[bus] + 1) % GW_CAPTURE_SIZE;
+    return true;
+}
+
+void Gateway::loop()
+{
+    for (int b = 0; b < 2; b++) {
+        if (dir[b].captureDropped != reportedDrops[b]) {
+            reportedDrops[b] = dir[b].captureDropped;
+            SysHealth::rxOverrun(b);
+        }
+        while (reportedTxFails[b] != dir[b].txFailed) {
+            reportedTxFails[b]++;
+            SysHealth::txFailed(b ^ 1);
+        }
+    }
+}
+
+void Gateway::printStatus()
+{
+    Logger::console("Gateway CAN0->CAN1 %s, CAN1->CAN0 %s", (directions & GW_CAN0_TO_CAN1) ? "on" : "off",
+                    (directions & GW_CAN1_TO_CAN0) ? "on" : "off");
+    for (int b = 0; b < 2; b++) {
+        Logger::console("From CAN%i: filter %x/%x, forwarded %l, filtered %l, rule dropped %l, TX failed %l, capture dropped %l",
+                        b, dir[b].filterId, dir[b].filterMask, dir[b].forwarded, dir[b].filtered, dir[b].dropped,
+                        dir[b].txFailed, dir[b].captureDropped);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Gateway.h
+ *
+ * Bridges CAN0 and CAN1. Frames are forwarded to the other bus from the receive interrupt
+ * so the M2 can sit inline between an ECU and the rest of the vehicle while still
+ * capturing everything to USB and the sdcard.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef GATEWAY_H_
+#define GATEWAY_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//Forwarding directions, can be or'ed together
+#define GW_CAN0_TO_CAN1     1
+#define GW_CAN1_TO_CAN0     2
+
+typedef struct {
+    uint32_t filterId;      //frames are forwarded if (id & filterMask) == (filterId & filterMask)
+    uint32_t filterMask;
+    volatile uint32_t forwarded;
+    volatile uint32_t filtered;
+    volatile uint32_t dropped;      //dropped by a rewrite rule
+    volatile uint32_t txFailed;     //other bus's driver had no room
+    volatile uint32_t captureDropped;   //forwarded fine but loop() was too far behind to see it
+} GW_DIRECTION;
+
+class Gateway {
+public:
+    static void setup();
+    static void loop();
+    static void setDirections(uint8_t dirs);
+    static uint8_t getDirections();
+    static void setFilter(uint8_t fromBus, uint32_t id, uint32_t mask);
+    static boolean read(uint8_t bus, CAN_FRAME &frame);
+    static void forward(uint8_t bus, CAN_FRAME *frame);
+    static void resetStats();
+    static void printStatus();
+
+private:
+    static uint8_t directions;
+    static GW_DIRECTION dir[2];     //indexed by the bus the frame came in on
+    static CAN_FRAME capture[2][GW_CAPTURE_SIZE];
+    static volatile uint16_t captureHead[2];
+    static volatile uint16_t captureTail[2];
+    static uint32_t reportedDrops[2];
+    static uint32_t reportedTxFails[2];
+
+    static void rxCAN0(CAN_FRAME *frame);
+    static void rxCAN1(CAN_FRAME *frame);
+    static void handleRx(uint8_t bus, CAN_FRAME *frame);
+};
+
+#endif /* GATEWAY_H_ */
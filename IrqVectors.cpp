@@ -0,0 +1,53 @@
+/*
+ * IrqVectors.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "IrqVectors.h"
+
+//16 system vectors plus the SAM3X peripheral interrupts, rounded up. VTOR needs the table aligned
+//to its size rounded up to a power of two.
+#define IRQ_VECTOR_COUNT    64
+static uint32_t ramVectors[IRQ_VECTOR_COUNT] __attribute__((aligned(256)));
+
+boolean IrqVectors::moved = false;
+
+void IrqVectors::moveTable()
+{
+    uint32_t *current = (uint32_t *)SCB->VTOR;
+
+    for (int v = 0; v < IRQ_VECTOR_COUNT; v++) ramVectors[v] = (v < 16 + PERIPH_COUNT_IRQn) ? current[v] : 0;
+    SCB->VTOR = (uint32_t)ramVectors;
+    __DSB();
+    moved = true;
+}
+
+void IrqVectors::setHandler(IRQn_Type irq, void (*handler)())
+{
+    __disable_irq();
+    if (!moved) moveTable();
+    ramVectors[16 + irq] = (uint32_t)handler;
+    __DSB();
+    __enable_irq();
+}
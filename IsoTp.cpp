@@ -0,0 +1,396 @@
+/*
+ * IsoTp.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "IsoTp.h"
+#include "TxQueue.h"
+#include "SessionPool.h"
+#include "M2RET.h"
+
+extern TxQueue txQueues[];
+
+/*
+ * Each channel is a TX ID / RX ID pair on one bus, the same as a tester talking to one ECU.
+ * Received frames are handed in from loop() as they are read and the consecutive frames we
+ * send go out through the TX queues at high priority, paced by the other side's STmin.
+ *
+ * Host side (binary protocol):
+ *   PROTO_ISOTP_OPEN: chan, bus, txId(4, bit 31 = extended), rxId(4, bit 31 = extended), block size,
+ *                     STmin, flags (ISOTP_FLAG_PADDING), pad byte
+ *   PROTO_ISOTP_CLOSE: chan
+ *   PROTO_ISOTP_SEND: chan, length(2), payload. Replies 0xF1 29 chan result when the last frame is
+ *                     queued or sending fails
+ *   Received payloads are sent up as 0xF1 30 chan result length(2) payload
+ *
+ * A channel only holds a TX or RX buffer (from SessionPool) while a message is going through it.
+ */
+
+ISOTP_CHANNEL IsoTp::channels[ISOTP_MAX_CHANNELS];
+uint8_t IsoTp::collectHeader[3];
+uint16_t IsoTp::collectPos = 0;
+uint16_t IsoTp::collectLen = 0;
+uint8_t *IsoTp::collectDest = NULL;
+
+void IsoTp::setup()
+{
+    for (int c = 0; c < ISOTP_MAX_CHANNELS; c++) {
+        channels[c].open = false;
+        channels[c].txState = ISOTP_IDLE;
+        channels[c].rxState = ISOTP_IDLE;
+        channels[c].txBuf = NULL;
+        channels[c].rxBuf = NULL;
+    }
+}
+
+boolean IsoTp::openChannel(uint8_t chan, uint8_t bus, uint32_t txId, boolean txExtended, uint32_t rxId,
+                           boolean rxExtended, uint8_t blockSize, uint8_t stMin, uint8_t flags, uint8_t padByte)
+{
+    if (chan >= ISOTP_MAX_CHANNELS || bus > 2) return false;
+    ISOTP_CHANNEL &ch = channels[chan];
+    ch.bus = bus;
+    ch.txId = txId;
+    ch.txExtended = txExtended;
+    ch.rxId = rxId;
+    ch.rxExtended = rxExtended;
+    ch.blockSize = blockSize;
+    ch.stMin = stMin;
+    ch.flags = flags;
+    ch.padByte = padByte;
+    endTx(ch);
+    endRx(ch);
+    ch.open = true;
+    return true;
+}
+
+void IsoTp::closeChannel(uint8_t chan)
+{
+    if (chan >= ISOTP_MAX_CHANNELS) return;
+    endTx(channels[chan]);
+    endRx(channels[chan]);
+    channels[chan].open = false;
+}
+
+//Give the channel a TX buffer for a payload of length bytes. NULL if it is busy, closed or the pool is full.
+uint8_t *IsoTp::txBuffer(uint8_t chan, uint16_t length)
+{
+    if (chan >= ISOTP_MAX_CHANNELS || !channels[chan].open || channels[chan].txState != ISOTP_IDLE) return NULL;
+    ISOTP_CHANNEL &ch = channels[chan];
+    SessionPool::release(ch.txBuf); //left over from a send that never started
+    ch.txBuf = SessionPool::alloc(length);
+    return ch.txBuf;
+}
+
+//Finish with the message going out, or coming in, and hand its buffer back
+void IsoTp::endTx(ISOTP_CHANNEL &ch)
+{
+    ch.txState = ISOTP_IDLE;
+    SessionPool::release(ch.txBuf);
+    ch.txBuf = NULL;
+}
+
+void IsoTp::endRx(ISOTP_CHANNEL &ch)
+{
+    ch.rxState = ISOTP_IDLE;
+    SessionPool::release(ch.rxBuf);
+    ch.rxBuf = NULL;
+}
+
+//0-127 are milliseconds, F1-F9 are 100-900us. Anything else is reserved and means the maximum.
+uint32_t IsoTp::stMinToMicros(uint8_t stMin)
+{
+    if (stMin <= 0x7F) return stMin * 1000ul;
+    if (stMin >= 0xF1 && stMin <= 0xF9) return (stMin - 0xF0) * 100ul;
+    return 127000ul;
+}
+
+void IsoTp::sendSegment(ISOTP_CHANNEL &ch, uint8_t *data, uint8_t length)
+{
+    CAN_FRAME frame;
+
+    frame.id = ch.txId;
+    frame.extended = ch.txExtended;
+    frame.rtr = 0;
+    frame.length = (ch.flags & ISOTP_FLAG_PADDING) ? 8 : length;
+    for (int b = 0; b < 8; b++) frame.data.bytes[b] = (b < length) ? data[b] : ch.padByte;
+    queueFrame(ch.bus, frame, 1);
+}
+
+void IsoTp::sendFlowControl(ISOTP_CHANNEL &ch, uint8_t status)
+{
+    uint8_t fc[3];
+
+    fc[0] = 0x30 | status;
+    fc[1] = ch.blockSize;
+    fc[2] = ch.stMin;
+    sendSegment(ch, fc, 3);
+}
+
+/*
+ * Start sending the payload that is in the channel's TX buffer. Single frames go straight out,
+ * anything longer sends the first frame and waits for flow control.
+ */
+uint8_t IsoTp::send(uint8_t chan, uint16_t length)
+{
+    uint8_t seg[8];
+
+    if (chan >= ISOTP_MAX_CHANNELS || !channels[chan].open) return ISOTP_BAD_CHANNEL;
+    ISOTP_CHANNEL &ch = channels[chan];
+    if (ch.txState != ISOTP_IDLE) return ISOTP_BUSY;
+    if (ch.txBuf == NULL) return ISOTP_NO_BUFFER;
+    if (length == 0 || length > ISOTP_MAX_PAYLOAD) {
+        endTx(ch);
+        return ISOTP_BAD_LENGTH;
+    }
+
+    if (length <= 7) {
+        seg[0] = length;
+        memcpy(seg + 1, ch.txBuf, length);
+        sendSegment(ch, seg, length + 1);
+        endTx(ch);
+        return ISOTP_OK;
+    }
+    seg[0] = 0x10 | (length >> 8);
+    seg[1] = length & 0xFF;
+    memcpy(seg + 2, ch.txBuf, 6);
+    sendSegment(ch, seg, 8);
+    ch.txLen = length;
+    ch.txPos = 6;
+    ch.txSeq = 1;
+    ch.txLast = micros();
+    ch.txState = ISOTP_TX_WAIT_FC;
+    return ISOTP_OK;
+}
+
+void IsoTp::sendNextCF(ISOTP_CHANNEL &ch)
+{
+    uint8_t seg[8];
+    uint16_t count = ch.txLen - ch.txPos;
+
+    if (count > 7) count = 7;
+    seg[0] = 0x20 | ch.txSeq;
+    memcpy(seg + 1, ch.txBuf + ch.txPos, count);
+    sendSegment(ch, seg, count + 1);
+    ch.txPos += count;
+    ch.txSeq = (ch.txSeq + 1) & 0xF;
+    ch.txLast = micros();
+}
+
+//Called from loop() for every frame received on CAN0, CAN1 and SWCAN
+void IsoTp::handleFrame(uint8_t bus, CAN_FRAME &frame)
+{
+    uint8_t *data = frame.data.bytes;
+    uint16_t length, count;
+
+    if (frame.length == 0) return;
+    for (int c = 0; c < ISOTP_MAX_CHANNELS; c++) {
+        ISOTP_CHANNEL &ch = channels[c];
+        if (!ch.open || ch.bus != bus || ch.rxId != frame.id || ch.rxExtended != frame.extended) continue;
+
+        switch (data[0] >> 4) {
+        case 0: //single frame
+            length = data[0] & 0xF;
+            if (length == 0 || length > frame.length - 1) break;
+            if (ch.rxState == ISOTP_RX_WAIT_CF) reportRx(c, ISOTP_BAD_SEQUENCE, NULL, 0); //a new message cuts off the old one
+            endRx(ch);
+            reportRx(c, ISOTP_OK, data + 1, length);
+            break;
+        case 1: //first frame
+            if (frame.length < 8) break;
+            length = ((data[0] & 0xF) << 8) | data[1];
+            if (length < 8) break;
+            if (ch.rxState == ISOTP_RX_WAIT_CF) reportRx(c, ISOTP_BAD_SEQUENCE, NULL, 0);
+            endRx(ch);
+            if (length > ISOTP_MAX_PAYLOAD) {
+                sendFlowControl(ch, 2); //overflow
+                reportRx(c, ISOTP_OVERFLOW, NULL, 0);
+                break;
+            }
+            ch.rxBuf = SessionPool::alloc(length);
+            if (ch.rxBuf == NULL) {
+                sendFlowControl(ch, 2); //nowhere to put it, tell the sender it's too big for us right now
+                reportRx(c, ISOTP_NO_BUFFER, NULL, 0);
+                break;
+            }
+            memcpy(ch.rxBuf, data + 2, 6);
+            ch.rxLen = length;
+            ch.rxPos = 6;
+            ch.rxSeq = 1;
+            ch.rxBlockCount = 0;
+            ch.rxLast = millis();
+            ch.rxState = ISOTP_RX_WAIT_CF;
+            sendFlowControl(ch, 0); //clear to send
+            break;
+        case 2: //consecutive frame
+            if (ch.rxState != ISOTP_RX_WAIT_CF) break;
+            if ((data[0] & 0xF) != ch.rxSeq) {
+                endRx(ch);
+                reportRx(c, ISOTP_BAD_SEQUENCE, NULL, 0);
+                break;
+            }
+            count = ch.rxLen - ch.rxPos;
+            if (count > 7) count = 7;
+            if (count > frame.length - 1) count = frame.length - 1;
+            memcpy(ch.rxBuf + ch.rxPos, data + 1, count);
+            ch.rxPos += count;
+            ch.rxSeq = (ch.rxSeq + 1) & 0xF;
+            ch.rxLast = millis();
+            if (ch.rxPos >= ch.rxLen) {
+                reportRx(c, ISOTP_OK, ch.rxBuf, ch.rxLen);
+                endRx(ch);
+            } else if (ch.blockSize > 0 && ++ch.rxBlockCount >= ch.blockSize) {
+                ch.rxBlockCount = 0;
+                sendFlowControl(ch, 0);
+            }
+            break;
+        case 3: //flow control
+            if (ch.txState != ISOTP_TX_WAIT_FC) break;
+            switch (data[0] & 0xF) {
+            case 0: //clear to send
+                if (frame.length < 3) break;
+                ch.txBlockLeft = data[1];
+                ch.txSeparation = stMinToMicros(data[2]);
+                ch.txLast = micros() - ch.txSeparation; //first one can go right away
+                ch.txState = ISOTP_TX_SEND_CF;
+                break;
+            case 1: //wait, restarts the timeout
+                ch.txLast = micros();
+                break;
+            default: //overflow or reserved
+                endTx(ch);
+                reportTx(c, ISOTP_OVERFLOW);
+                break;
+            }
+            break;
+        }
+    }
+}
+
+//Pace out consecutive frames and time out stalled transfers
+void IsoTp::loop()
+{
+    uint32_t now;
+
+    for (int c = 0; c < ISOTP_MAX_CHANNELS; c++) {
+        ISOTP_CHANNEL &ch = channels[c];
+        if (!ch.open) continue;
+
+        if (ch.rxState == ISOTP_RX_WAIT_CF && (millis() - ch.rxLast) > ISOTP_TIMEOUT_MS) {
+            endRx(ch);
+            reportRx(c, ISOTP_TIMEOUT, NULL, 0);
+        }
+
+        if (ch.txState == ISOTP_TX_WAIT_FC && (micros() - ch.txLast) > ISOTP_TIMEOUT_MS * 1000ul) {
+            endTx(ch);
+            reportTx(c, ISOTP_TIMEOUT);
+        }
+
+        //with no separation time send as many as the queue will take
+        while (ch.txState == ISOTP_TX_SEND_CF) {
+            now = micros();
+            if ((now - ch.txLast) < ch.txSeparation) break;
+            if (txQueues[ch.bus].count() >= TX_QUEUE_SIZE / 2) break;
+            sendNextCF(ch);
+            if (ch.txPos >= ch.txLen) {
+                endTx(ch);
+                reportTx(c, ISOTP_OK);
+            } else if (ch.txBlockLeft > 0 && --ch.txBlockLeft == 0) {
+                ch.txState = ISOTP_TX_WAIT_FC;
+            }
+        }
+    }
+}
+
+void IsoTp::reportTx(uint8_t chan, uint8_t result)
+{
+    uint8_t buff[4];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_ISOTP_SEND;
+    buff[2] = chan;
+    buff[3] = result;
+    SerialUSB.write(buff, 4);
+}
+
+void IsoTp::reportRx(uint8_t chan, uint8_t result, uint8_t *data, uint16_t length)
+{
+    uint8_t buff[6];
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_ISOTP_RECEIVE;
+    buff[2] = chan;
+    buff[3] = result;
+    buff[4] = length & 0xFF;
+    buff[5] = length >> 8;
+    SerialUSB.write(buff, 6);
+    if (length > 0) SerialUSB.write(data, length);
+}
+
+//Called when 0xF1 PROTO_ISOTP_SEND has been seen
+void IsoTp::beginCollect()
+{
+    collectPos = 0;
+    collectLen = 0;
+    collectDest = NULL;
+}
+
+/*
+ * Take in a PROTO_ISOTP_SEND packet. The payload is copied straight into a TX buffer taken from
+ * the session pool, pulling it from SerialUSB as a block once the header is in. If the channel
+ * can't take it the payload is read and thrown away so it doesn't get taken for commands.
+ * Returns true once the whole packet has been read.
+ */
+boolean IsoTp::collect(uint8_t in_byte)
+{
+    uint8_t result;
+    uint8_t chan;
+
+    //collectPos counts the 3 header bytes too
+    if (collectPos < 3) {
+        collectHeader[collectPos++] = in_byte;
+        if (collectPos < 3) return false;
+        collectLen = collectHeader[1] + (collectHeader[2] << 8);
+        collectDest = (collectLen > 0 && collectLen <= ISOTP_MAX_PAYLOAD) ? txBuffer(collectHeader[0], collectLen) : NULL;
+    } else {
+        if (collectDest) collectDest[collectPos - 3] = in_byte;
+        collectPos++;
+    }
+
+    while (collectPos < collectLen + 3 && SerialUSB.available() > 0) {
+        in_byte = SerialUSB.read();
+        if (collectDest) collectDest[collectPos - 3] = in_byte;
+        collectPos++;
+    }
+    if (collectPos < collectLen + 3) return false;
+
+    chan = collectHeader[0];
+    if (collectDest) result = send(chan, collectLen);
+    else if (chan >= ISOTP_MAX_CHANNELS || !channels[chan].open) result = ISOTP_BAD_CHANNEL;
+    else if (collectLen == 0 || collectLen > ISOTP_MAX_PAYLOAD) result = ISOTP_BAD_LENGTH;
+    else if (channels[chan].txState != ISOTP_IDLE) result = ISOTP_BUSY;
+    else result = ISOTP_NO_BUFFER;
+    //multi frame sends report when they finish, everything else reports now
+    if (result != ISOTP_OK || collectLen <= 7) reportTx(chan, result);
+    return true;
+}
@@ -0,0 +1,120 @@
+/*
+ * IsoTp.h
+ *
+ * ISO 15765-2 (ISO-TP) transport on the device. The host sends and receives whole payloads
+ * of up to 4095 bytes and the segmentation, flow control and separation timing is done here
+ * where the bus timing can actually be met.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef ISOTP_H_
+#define ISOTP_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+enum ISOTP_STATE {
+    ISOTP_IDLE = 0,
+    ISOTP_TX_WAIT_FC = 1,   //sent a first frame or a full block, waiting for flow control
+    ISOTP_TX_SEND_CF = 2,   //sending consecutive frames
+    ISOTP_RX_WAIT_CF = 3    //got a first frame, collecting consecutive frames
+};
+
+//Result codes reported to the host
+enum ISOTP_RESULT {
+    ISOTP_OK = 0,
+    ISOTP_TIMEOUT = 1,          //no flow control / consecutive frame in time
+    ISOTP_OVERFLOW = 2,         //other side said our payload is too big, or theirs is too big for us
+    ISOTP_BUSY = 3,             //channel is already sending
+    ISOTP_BAD_CHANNEL = 4,      //channel not open or out of range
+    ISOTP_BAD_SEQUENCE = 5,     //consecutive frame out of order
+    ISOTP_BAD_LENGTH = 6,
+    ISOTP_NO_BUFFER = 7         //session pool had no room for the payload
+};
+
+//ISOTP_CHANNEL flags
+#define ISOTP_FLAG_PADDING  1   //pad every frame to 8 bytes with padByte
+
+typedef struct {
+    boolean open;
+    uint8_t bus;
+    uint32_t txId;
+    uint32_t rxId;
+    boolean txExtended;
+    boolean rxExtended;
+    uint8_t blockSize;      //what we ask of the other side in our flow control frames
+    uint8_t stMin;
+    uint8_t flags;
+    uint8_t padByte;
+
+    uint8_t txState;
+    uint8_t *txBuf;         //from SessionPool while a payload is held, otherwise NULL
+    uint16_t txLen;
+    uint16_t txPos;
+    uint8_t txSeq;
+    uint8_t txBlockLeft;    //consecutive frames left in this block, 0 = no limit
+    uint32_t txSeparation;  //microseconds the other side wants between consecutive frames
+    uint32_t txLast;        //micros() of the last frame sent or flow control wait started
+
+    uint8_t rxState;
+    uint8_t *rxBuf;         //from SessionPool while a message is coming in, otherwise NULL
+    uint16_t rxLen;
+    uint16_t rxPos;
+    uint8_t rxSeq;
+    uint8_t rxBlockCount;
+    uint32_t rxLast;
+} ISOTP_CHANNEL;
+
+class IsoTp {
+public:
+    static void setup();
+    static void loop();
+    static void handleFrame(uint8_t bus, CAN_FRAME &frame);
+    static boolean openChannel(uint8_t chan, uint8_t bus, uint32_t txId, boolean txExtended, uint32_t rxId,
+                               boolean rxExtended, uint8_t blockSize, uint8_t stMin, uint8_t flags, uint8_t padByte);
+    static void closeChannel(uint8_t chan);
+    static uint8_t send(uint8_t chan, uint16_t length);
+    static uint8_t *txBuffer(uint8_t chan, uint16_t length);
+    static void beginCollect();
+    static boolean collect(uint8_t in_byte);
+
+private:
+    static ISOTP_CHANNEL channels[ISOTP_MAX_CHANNELS];
+    static uint8_t collectHeader[3];
+    static uint16_t collectPos;
+    static uint16_t collectLen;
+    static uint8_t *collectDest;
+
+    static void endTx(ISOTP_CHANNEL &ch);
+    static void endRx(ISOTP_CHANNEL &ch);
+    static void sendSegment(ISOTP_CHANNEL &ch, uint8_t *data, uint8_t length);
+    static void sendFlowControl(ISOTP_CHANNEL &ch, uint8_t status);
+    static void sendNextCF(ISOTP_CHANNEL &ch);
+    static uint32_t stMinToMicros(uint8_t stMin);
+    static void reportTx(uint8_t chan, uint8_t result);
+    static void reportRx(uint8_t chan, uint8_t result, uint8_t *data, uint16_t length);
+};
+
+#endif /* ISOTP_H_ */
@@ -0,0 +1,219 @@
+/*
+ * IsoTpSniffer.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "IsoTpSniffer.h"
+#include "Logger.h"
+#include "SessionPool.h"
+#include "M2RET.h"
+
+/*
+ * Every ID that is watched is one direction of a conversation so each sender is reassembled on
+ * its own, nothing needs to know which request goes with which response. A flow is taken up at
+ * a first frame and let go when the message is complete, out of sequence or times out. Its buffer
+ * comes from SessionPool for that long. Single frames don't need a flow at all.
+ */
+
+uint8_t IsoTpSniffer::mode = ISOSNIFF_OFF;
+uint32_t IsoTpSniffer::filterId = 0;
+uint32_t IsoTpSniffer::filterMask = 0;
+boolean IsoTpSniffer::raw = true;
+ISOSNIFF_FLOW IsoTpSniffer::flows[ISOSNIFF_MAX_FLOWS];
+uint32_t IsoTpSniffer::pdus = 0;
+uint32_t IsoTpSniffer::aborted = 0;
+
+void IsoTpSniffer::setup()
+{
+    mode = ISOSNIFF_OFF;
+    raw = true;
+    for (int f = 0; f < ISOSNIFF_MAX_FLOWS; f++) {
+        flows[f].active = false;
+        flows[f].data = NULL;
+    }
+}
+
+void IsoTpSniffer::setMode(uint8_t newMode)
+{
+    if (newMode > ISOSNIFF_AUTO) return;
+    mode = newMode;
+    for (int f = 0; f < ISOSNIFF_MAX_FLOWS; f++) endFlow(flows[f]);
+    pdus = aborted = 0;
+}
+
+uint8_t IsoTpSniffer::getMode()
+{
+    return mode;
+}
+
+void IsoTpSniffer::setFilter(uint32_t id, uint32_t mask)
+{
+    filterId = id;
+    filterMask = mask;
+}
+
+//Whether the raw frames of reassembled messages still go out as well
+void IsoTpSniffer::setKeepRaw(boolean keep)
+{
+    raw = keep;
+}
+
+boolean IsoTpSniffer::keepRaw()
+{
+    return raw;
+}
+
+boolean IsoTpSniffer::matches(CAN_FRAME &frame)
+{
+    if (mode == ISOSNIFF_FILTER) return (frame.id & filterMask) == (filterId & filterMask);
+    if (frame.extended) return (frame.id & 0x1FFE0000) == 0x18DA0000;
+    return frame.id >= 0x700;
+}
+
+ISOSNIFF_FLOW *IsoTpSniffer::findFlow(uint8_t bus, CAN_FRAME &frame, boolean create)
+{
+    ISOSNIFF_FLOW *freeFlow = NULL;
+
+    for (int f = 0; f < ISOSNIFF_MAX_FLOWS; f++) {
+        ISOSNIFF_FLOW &flow = flows[f];
+        if (!flow.active) {
+            if (!freeFlow) freeFlow = &flow;
+            continue;
+        }
+        if (flow.bus == bus && flow.id == frame.id && flow.extended == frame.extended) return &flow;
+    }
+    if (!create) return NULL;
+    return freeFlow;
+}
+
+void IsoTpSniffer::endFlow(ISOSNIFF_FLOW &flow)
+{
+    flow.active = false;
+    SessionPool::release(flow.data);
+    flow.data = NULL;
+}
+
+/*
+ * Look at a captured frame. Returns true if it was ISO-TP on a watched ID, in which case
+ * the caller can leave the raw frame out (see keepRaw()).
+ */
+boolean IsoTpSniffer::handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp)
+{
+    uint8_t *data = frame.data.bytes;
+    uint16_t length, count;
+    ISOSNIFF_FLOW *flow;
+
+    if (mode == ISOSNIFF_OFF || frame.length == 0 || !matches(frame)) return false;
+
+    switch (data[0] >> 4) {
+    case 0: //single frame
+        length = data[0] & 0xF;
+        if (length == 0 || length > frame.length - 1) return false;
+        emit(bus, frame, data + 1, length, timestamp);
+        return true;
+    case 1: //first frame
+        if (frame.length < 8) return false;
+        length = ((data[0] & 0xF) << 8) | data[1];
+        if (length < 8) return false;
+        flow = findFlow(bus, frame, true);
+        if (!flow) {
+            aborted++; //more conversations going on at once than we have flows for
+            return false;
+        }
+        if (flow->active) aborted++; //a new message cuts off the one in progress
+        endFlow(*flow);
+        flow->data = SessionPool::alloc((length < ISOSNIFF_MAX_PAYLOAD) ? length : ISOSNIFF_MAX_PAYLOAD);
+        if (!flow->data) {
+            aborted++; //no room in the pool right now
+            return false;
+        }
+        flow->active = true;
+        flow->bus = bus;
+        flow->id = frame.id;
+        flow->extended = frame.extended;
+        flow->length = length;
+        flow->seq = 1;
+        flow->startStamp = timestamp;
+        flow->lastMillis = millis();
+        memcpy(flow->data, data + 2, 6);
+        flow->pos = 6;
+        return true;
+    case 2: //consecutive frame
+        flow = findFlow(bus, frame, false);
+        if (!flow) return false;
+        if ((data[0] & 0xF) != flow->seq) {
+            endFlow(*flow);
+            aborted++;
+            return true;
+        }
+        count = flow->length - flow->pos;
+        if (count > 7) count = 7;
+        if (count > frame.length - 1) count = frame.length - 1;
+        //anything past the buffer is counted but not kept, the record is cut short
+        for (int b = 0; b < count; b++) {
+            if (flow->pos + b < ISOSNIFF_MAX_PAYLOAD) flow->data[flow->pos + b] = data[1 + b];
+        }
+        flow->pos += count;
+        flow->seq = (flow->seq + 1) & 0xF;
+        flow->lastMillis = millis();
+        if (flow->pos >= flow->length) {
+            emit(bus, frame, flow->data, (flow->length < ISOSNIFF_MAX_PAYLOAD) ? flow->length : ISOSNIFF_MAX_PAYLOAD,
+                 flow->startStamp);
+            endFlow(*flow);
+        }
+        return true;
+    case 3: //flow control, nothing to reassemble
+        return frame.length >= 3;
+    }
+    return false;
+}
+
+void IsoTpSniffer::emit(uint8_t bus, CAN_FRAME &frame, uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    pdus++;
+    sendPduToUSB(PDU_ISOTP, bus, frame.id, frame.extended, data, length, timestamp);
+    if (SysSettings.logToFile) sendPduToFile(PDU_ISOTP, bus, frame.id, frame.extended, data, length, timestamp);
+}
+
+//Let go of flows whose sender went quiet partway through a message
+void IsoTpSniffer::loop()
+{
+    if (mode == ISOSNIFF_OFF) return;
+    for (int f = 0; f < ISOSNIFF_MAX_FLOWS; f++) {
+        if (flows[f].active && (millis() - flows[f].lastMillis) > ISOTP_TIMEOUT_MS) {
+            endFlow(flows[f]);
+            aborted++;
+        }
+    }
+}
+
+void IsoTpSniffer::printStatus()
+{
+    const char *modes[] = {"off", "filter", "auto"};
+
+    Logger::console("ISO-TP sniffer %s, filter %x/%x, raw frames %s", modes[mode], filterId, filterMask,
+                    raw ? "kept" : "left out");
+    Logger::console("%l messages reassembled, %l cut off", pdus, aborted);
+    SessionPool::printStatus();
+}
@@ -0,0 +1,84 @@
+/*
+ * IsoTpSniffer.h
+ *
+ * Passive ISO-TP reassembly of captured traffic. Multi frame diagnostic messages between
+ * a tester and an ECU are put back together on the device and sent to USB and the sdcard
+ * as one record per message.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef ISOTPSNIFFER_H_
+#define ISOTPSNIFFER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+enum ISOSNIFF_MODE {
+    ISOSNIFF_OFF = 0,
+    ISOSNIFF_FILTER = 1,    //IDs matching the filter
+    ISOSNIFF_AUTO = 2       //the usual diagnostic IDs: 0x700-0x7FF and 29 bit 0x18DA/0x18DB
+};
+
+typedef struct {
+    boolean active;
+    uint8_t bus;
+    uint32_t id;
+    boolean extended;
+    uint16_t length;        //length from the first frame
+    uint16_t pos;           //bytes received so far
+    uint8_t seq;
+    uint32_t startStamp;    //timestamp of the first frame
+    uint32_t lastMillis;
+    uint8_t *data;          //from SessionPool, min(length, ISOSNIFF_MAX_PAYLOAD) bytes
+} ISOSNIFF_FLOW;
+
+class IsoTpSniffer {
+public:
+    static void setup();
+    static void loop();
+    static boolean handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp);
+    static void setMode(uint8_t newMode);
+    static uint8_t getMode();
+    static void setFilter(uint32_t id, uint32_t mask);
+    static void setKeepRaw(boolean keep);
+    static boolean keepRaw();
+    static void printStatus();
+
+private:
+    static uint8_t mode;
+    static uint32_t filterId;
+    static uint32_t filterMask;
+    static boolean raw;
+    static ISOSNIFF_FLOW flows[ISOSNIFF_MAX_FLOWS];
+    static uint32_t pdus;
+    static uint32_t aborted;
+
+    static boolean matches(CAN_FRAME &frame);
+    static ISOSNIFF_FLOW *findFlow(uint8_t bus, CAN_FRAME &frame, boolean create);
+    static void endFlow(ISOSNIFF_FLOW &flow);
+    static void emit(uint8_t bus, CAN_FRAME &frame, uint8_t *data, uint16_t length, uint32_t timestamp);
+};
+
+#endif /* ISOTPSNIFFER_H_ */
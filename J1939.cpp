@@ -0,0 +1,372 @@
+/*
+ * J1939.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "J1939.h"
+#include "Logger.h"
+#include "SessionPool.h"
+#include "M2RET.h"
+
+/*
+ * Transport sessions are keyed on bus, sender and destination, which is how J1939 itself keeps
+ * them apart: a node may run one BAM and one RTS/CTS session per destination at a time. The data
+ * packets only carry a sequence number, the PGN and length come from the TP.CM that opened the
+ * session, which also takes a buffer of that length from SessionPool. A complete message goes out
+ * as one record with the 29 bit ID it would have had as a single frame so the host decodes it the
+ * same way.
+ */
+
+boolean J1939::enabled = false;
+boolean J1939::raw = true;
+J1939_SESSION J1939::sessions[J1939_MAX_SESSIONS];
+J1939_PGN_STAT J1939::pgns[J1939_MAX_PGNS];
+uint8_t J1939::pgnCount = 0;
+uint32_t J1939::untracked = 0;
+J1939_CLAIM J1939::claims[J1939_MAX_CLAIMS];
+uint32_t J1939::claimConflicts = 0;
+uint32_t J1939::messages = 0;
+uint32_t J1939::aborted = 0;
+
+void J1939::setup()
+{
+    enabled = false;
+    raw = true;
+    for (int s = 0; s < J1939_MAX_SESSIONS; s++) {
+        sessions[s].active = false;
+        sessions[s].data = NULL;
+    }
+    resetStats();
+}
+
+void J1939::resetStats()
+{
+    pgnCount = 0;
+    untracked = 0;
+    claimConflicts = 0;
+    messages = 0;
+    aborted = 0;
+    for (int c = 0; c < J1939_MAX_CLAIMS; c++) claims[c].bus = 0xFF;
+}
+
+void J1939::setEnabled(boolean on)
+{
+    enabled = on;
+    for (int s = 0; s < J1939_MAX_SESSIONS; s++) endSession(sessions[s]);
+}
+
+boolean J1939::isEnabled()
+{
+    return enabled;
+}
+
+//Whether the TP.CM / TP.DT frames of reassembled sessions still go out as well
+void J1939::setKeepRaw(boolean keep)
+{
+    raw = keep;
+}
+
+boolean J1939::keepRaw()
+{
+    return raw;
+}
+
+void J1939::decodeId(uint32_t id, J1939_ID &out)
+{
+    uint8_t pf = (id >> 16) & 0xFF;
+
+    out.priority = (id >> 26) & 7;
+    out.src = id & 0xFF;
+    out.pgn = (id >> 8) & 0x3FFFF;
+    if (pf < 240) { //PDU1, PS is the destination address
+        out.dst = (id >> 8) & 0xFF;
+        out.pgn &= 0x3FF00;
+    } else out.dst = J1939_GLOBAL;
+}
+
+uint32_t J1939::encodeId(uint8_t priority, uint32_t pgn, uint8_t dst, uint8_t src)
+{
+    uint32_t id = ((uint32_t)(priority & 7) << 26) | ((pgn & 0x3FFFF) << 8) | src;
+    if (((pgn >> 8) & 0xFF) < 240) id = (id & ~0xFF00ul) | ((uint32_t)dst << 8);
+    return id;
+}
+
+void J1939::countPgn(uint32_t pgn, uint8_t src)
+{
+    for (int p = 0; p < pgnCount; p++) {
+        if (pgns[p].pgn == pgn) {
+            pgns[p].count++;
+            pgns[p].lastSrc = src;
+            return;
+        }
+    }
+    if (pgnCount >= J1939_MAX_PGNS) {
+        untracked++;
+        return;
+    }
+    pgns[pgnCount].pgn = pgn;
+    pgns[pgnCount].count = 1;
+    pgns[pgnCount].lastSrc = src;
+    pgnCount++;
+}
+
+/*
+ * Address claims. When two NAMEs go for the same address the lower NAME wins, so that is the one
+ * kept. A node that moves to a new address takes its entry with it.
+ */
+void J1939::handleClaim(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame)
+{
+    J1939_CLAIM *freeClaim = NULL;
+    J1939_CLAIM *sameAddr = NULL;
+    J1939_CLAIM *sameName = NULL;
+    uint64_t name = 0;
+
+    if (frame.length < 8) return;
+    for (int b = 7; b >= 0; b--) name = (name << 8) | frame.data.bytes[b];
+    if (jid.src == J1939_NULL_ADDR) { //cannot claim
+        claimConflicts++;
+        return;
+    }
+
+    for (int c = 0; c < J1939_MAX_CLAIMS; c++) {
+        J1939_CLAIM &claim = claims[c];
+        if (claim.bus == 0xFF) {
+            if (!freeClaim) freeClaim = &claim;
+            continue;
+        }
+        if (claim.bus != bus) continue;
+        if (claim.addr == jid.src) sameAddr = &claim;
+        else if (claim.name == name) sameName = &claim;
+    }
+
+    if (sameAddr) {
+        if (sameAddr->name != name) {
+            claimConflicts++;
+            if (name > sameAddr->name) return;
+            sameAddr->name = name;
+        }
+        sameAddr->lastMillis = millis();
+        if (sameName) sameName->bus = 0xFF; //it left its old address for this one
+        return;
+    }
+    if (!sameName) sameName = freeClaim;
+    if (!sameName) return; //table full
+    sameName->bus = bus;
+    sameName->addr = jid.src;
+    sameName->name = name;
+    sameName->lastMillis = millis();
+}
+
+J1939_SESSION *J1939::findSession(uint8_t bus, uint8_t src, uint8_t dst, boolean create)
+{
+    J1939_SESSION *freeSession = NULL;
+
+    for (int s = 0; s < J1939_MAX_SESSIONS; s++) {
+        J1939_SESSION &session = sessions[s];
+        if (!session.active) {
+            if (!freeSession) freeSession = &session;
+            continue;
+        }
+        if (session.bus == bus && session.src == src && session.dst == dst) return &session;
+    }
+    if (!create) return NULL;
+    return freeSession;
+}
+
+void J1939::endSession(J1939_SESSION &session)
+{
+    session.active = false;
+    SessionPool::release(session.data);
+    session.data = NULL;
+}
+
+void J1939::handleConnection(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame, uint32_t timestamp)
+{
+    J1939_SESSION *session;
+    uint8_t *data = frame.data.bytes;
+
+    if (frame.length < 8) return;
+    switch (data[0]) {
+    case J1939_TP_BAM:
+    case J1939_TP_RTS:
+        if (data[0] == J1939_TP_BAM) jid.dst = J1939_GLOBAL;
+        session = findSession(bus, jid.src, jid.dst, true);
+        if (!session) {
+            aborted++; //more sessions going at once than we have room for
+            return;
+        }
+        if (session->active) aborted++; //a new announcement cuts off the one in progress
+        endSession(*session);
+        session->length = data[1] | (data[2] << 8);
+        session->packets = data[3];
+        if (session->length < 9) return;
+        //a length we can't hold or a packet count that doesn't fit it would have the data packets run off the buffer
+        if (session->length > J1939_MAX_PAYLOAD || session->packets != (session->length + 6) / 7) {
+            aborted++;
+            return;
+        }
+        session->data = SessionPool::alloc(session->length);
+        if (!session->data) {
+            aborted++; //no room in the pool right now
+            return;
+        }
+        session->active = true;
+        session->bus = bus;
+        session->src = jid.src;
+        session->dst = jid.dst;
+        session->priority = jid.priority;
+        session->pgn = data[5] | (data[6] << 8) | ((uint32_t)data[7] << 16);
+        session->nextSeq = 1;
+        session->startStamp = timestamp;
+        session->lastMillis = millis();
+        break;
+    case J1939_TP_CTS:
+        //sent by the receiver, so the session is the one going the other way
+        session = findSession(bus, jid.dst, jid.src, false);
+        if (session && data[1] > 0 && data[2] > 0 && data[2] <= session->packets) {
+            session->nextSeq = data[2]; //the sender may be asked to go back and resend
+            session->lastMillis = millis();
+        }
+        break;
+    case J1939_TP_ABORT:
+        session = findSession(bus, jid.src, jid.dst, false);
+        if (!session) session = findSession(bus, jid.dst, jid.src, false);
+        if (session) {
+            endSession(*session);
+            aborted++;
+        }
+        break;
+    }
+}
+
+void J1939::handleData(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame)
+{
+    J1939_SESSION *session = findSession(bus, jid.src, jid.dst, false);
+    uint16_t pos;
+
+    if (!session || frame.length < 2) return;
+    if (frame.data.bytes[0] == 0 || frame.data.bytes[0] > session->packets || frame.data.bytes[0] != session->nextSeq) {
+        endSession(*session);
+        aborted++;
+        return;
+    }
+    pos = (uint16_t)(session->nextSeq - 1) * 7;
+    for (int b = 1; b < frame.length && b < 8 && pos < session->length; b++) session->data[pos++] = frame.data.bytes[b];
+    session->lastMillis = millis();
+    if (pos >= session->length || session->nextSeq >= session->packets) {
+        if (pos >= session->length) emit(*session);
+        else aborted++;
+        endSession(*session);
+        return;
+    }
+    session->nextSeq++;
+}
+
+/*
+ * Look at a captured frame. Only 29 bit frames are J1939. Returns true if it was part of a
+ * transport session, in which case the caller can leave the raw frame out (see keepRaw()).
+ */
+boolean J1939::handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp)
+{
+    J1939_ID jid;
+
+    if (!enabled || !frame.extended) return false;
+    decodeId(frame.id, jid);
+    countPgn(jid.pgn, jid.src);
+
+    switch (jid.pgn) {
+    case J1939_PGN_ADDR_CLAIM:
+        handleClaim(bus, jid, frame);
+        return false;
+    case J1939_PGN_TP_CM:
+        handleConnection(bus, jid, frame, timestamp);
+        return true;
+    case J1939_PGN_TP_DT:
+        handleData(bus, jid, frame);
+        return true;
+    }
+    return false;
+}
+
+void J1939::emit(J1939_SESSION &session)
+{
+    uint16_t length = session.length;
+    uint32_t id = encodeId(session.priority, session.pgn, session.dst, session.src);
+
+    messages++;
+    countPgn(session.pgn, session.src);
+    sendPduToUSB(PDU_J1939, session.bus, id, true, session.data, length, session.startStamp);
+    if (SysSettings.logToFile) sendPduToFile(PDU_J1939, session.bus, id, true, session.data, length, session.startStamp);
+}
+
+//Let go of sessions whose sender went quiet partway through (J1939-21 T1)
+void J1939::loop()
+{
+    if (!enabled) return;
+    for (int s = 0; s < J1939_MAX_SESSIONS; s++) {
+        if (sessions[s].active && (millis() - sessions[s].lastMillis) > J1939_TIMEOUT_MS) {
+            endSession(sessions[s]);
+            aborted++;
+        }
+    }
+}
+
+//count, then PGN(3) count(4) for each PGN seen. Returns bytes used.
+int J1939::encodeStats(uint8_t *buff, int maxLen)
+{
+    int pos = 1;
+    uint8_t count = 0;
+
+    for (int p = 0; p < pgnCount && pos + 7 <= maxLen; p++) {
+        buff[pos++] = (uint8_t)(pgns[p].pgn & 0xFF);
+        buff[pos++] = (uint8_t)(pgns[p].pgn >> 8);
+        buff[pos++] = (uint8_t)(pgns[p].pgn >> 16);
+        buff[pos++] = (uint8_t)(pgns[p].count & 0xFF);
+        buff[pos++] = (uint8_t)(pgns[p].count >> 8);
+        buff[pos++] = (uint8_t)(pgns[p].count >> 16);
+        buff[pos++] = (uint8_t)(pgns[p].count >> 24);
+        count++;
+    }
+    buff[0] = count;
+    return pos;
+}
+
+void J1939::printStatus()
+{
+    char name[17];
+
+    Logger::console("J1939 %s, raw transport frames %s", enabled ? "on" : "off", raw ? "kept" : "left out");
+    Logger::console("%l messages reassembled, %l cut off, %l address conflicts, %l frames of untracked PGNs",
+                    messages, aborted, claimConflicts, untracked);
+    SessionPool::printStatus();
+    for (int p = 0; p < pgnCount; p++) {
+        Logger::console("PGN %x: %l frames, last from %x", pgns[p].pgn, pgns[p].count, pgns[p].lastSrc);
+    }
+    for (int c = 0; c < J1939_MAX_CLAIMS; c++) {
+        if (claims[c].bus == 0xFF) continue;
+        sprintf(name, "%08lX%08lX", (unsigned long)(claims[c].name >> 32), (unsigned long)(claims[c].name & 0xFFFFFFFF));
+        Logger::console("Bus %i address %x: NAME %s, claimed %lms ago", claims[c].bus, claims[c].addr, name,
+                        millis() - claims[c].lastMillis);
+    }
+}
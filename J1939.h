@@ -0,0 +1,123 @@
+/*
+ * J1939.h
+ *
+ * Optional J1939 layer on the capture path. Reassembles BAM and RTS/CTS transport sessions into
+ * whole PGNs, keeps per PGN counts and tracks which NAME has claimed which address.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef J1939_H_
+#define J1939_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+#define J1939_PGN_REQUEST   0xEA00
+#define J1939_PGN_TP_DT     0xEB00
+#define J1939_PGN_TP_CM     0xEC00
+#define J1939_PGN_ADDR_CLAIM 0xEE00
+
+//TP.CM control bytes
+#define J1939_TP_RTS    16
+#define J1939_TP_CTS    17
+#define J1939_TP_EOM    19
+#define J1939_TP_BAM    32
+#define J1939_TP_ABORT  255
+
+#define J1939_GLOBAL    0xFF
+#define J1939_NULL_ADDR 0xFE    //source used by a node that could not claim an address
+
+typedef struct {
+    uint32_t pgn;           //PDU1 PGNs have the destination byte zeroed
+    uint8_t priority;
+    uint8_t src;
+    uint8_t dst;            //J1939_GLOBAL for PDU2 and broadcasts
+} J1939_ID;
+
+typedef struct {
+    boolean active;
+    uint8_t bus;
+    uint8_t src;
+    uint8_t dst;            //J1939_GLOBAL for BAM
+    uint8_t priority;
+    uint32_t pgn;           //PGN being carried, from the TP.CM
+    uint16_t length;
+    uint8_t packets;
+    uint8_t nextSeq;
+    uint32_t startStamp;
+    uint32_t lastMillis;
+    uint8_t *data;          //from SessionPool, length bytes
+} J1939_SESSION;
+
+typedef struct {
+    uint32_t pgn;
+    uint32_t count;
+    uint8_t lastSrc;
+} J1939_PGN_STAT;
+
+typedef struct {
+    uint64_t name;
+    uint32_t lastMillis;
+    uint8_t bus;
+    uint8_t addr;
+} J1939_CLAIM;
+
+class J1939 {
+public:
+    static void setup();
+    static void loop();
+    static void setEnabled(boolean on);
+    static boolean isEnabled();
+    static void setKeepRaw(boolean keep);
+    static boolean keepRaw();
+    static boolean handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp);
+    static void decodeId(uint32_t id, J1939_ID &out);
+    static uint32_t encodeId(uint8_t priority, uint32_t pgn, uint8_t dst, uint8_t src);
+    static int encodeStats(uint8_t *buff, int maxLen);
+    static void resetStats();
+    static void printStatus();
+
+private:
+    static boolean enabled;
+    static boolean raw;
+    static J1939_SESSION sessions[J1939_MAX_SESSIONS];
+    static J1939_PGN_STAT pgns[J1939_MAX_PGNS];
+    static uint8_t pgnCount;
+    static uint32_t untracked;      //frames whose PGN didn't fit in the stats table
+    static J1939_CLAIM claims[J1939_MAX_CLAIMS];
+    static uint32_t claimConflicts;
+    static uint32_t messages;
+    static uint32_t aborted;
+
+    static void countPgn(uint32_t pgn, uint8_t src);
+    static void handleClaim(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame);
+    static void handleConnection(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame, uint32_t timestamp);
+    static void handleData(uint8_t bus, J1939_ID &jid, CAN_FRAME &frame);
+    static J1939_SESSION *findSession(uint8_t bus, uint8_t src, uint8_t dst, boolean create);
+    static void endSession(J1939_SESSION &session);
+    static void emit(J1939_SESSION &session);
+};
+
+#endif /* J1939_H_ */
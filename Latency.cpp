@@ -0,0 +1,150 @@
+/*
+ * Latency.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Latency.h"
+#include "Logger.h"
+
+LATENCY_STATS Latency::stats[LAT_NUM_SINKS];
+uint32_t Latency::pending[LAT_NUM_SINKS][LAT_MAX_PENDING];
+uint16_t Latency::pendingCount[LAT_NUM_SINKS];
+
+void Latency::setup()
+{
+    reset();
+    for (int s = 0; s < LAT_NUM_SINKS; s++) pendingCount[s] = 0;
+}
+
+void Latency::reset()
+{
+    for (int s = 0; s < LAT_NUM_SINKS; s++) {
+        stats[s].count = 0;
+        stats[s].minMicros = 0xFFFFFFFF;
+        stats[s].maxMicros = 0;
+        stats[s].totalMicros = 0;
+        stats[s].unsampled = 0;
+        for (int b = 0; b < LAT_HIST_BUCKETS; b++) stats[s].histogram[b] = 0;
+    }
+}
+
+/*
+ * Add one measurement for a sink. Used directly by sinks that write frames out
+ * immediately (text and LAWICEL modes on USB).
+ */
+void Latency::record(uint8_t sink, uint32_t latency)
+{
+    if (sink >= LAT_NUM_SINKS) return;
+    LATENCY_STATS &st = stats[sink];
+    st.count++;
+    st.totalMicros += latency;
+    if (latency < st.minMicros) st.minMicros = latency;
+    if (latency > st.maxMicros) st.maxMicros = latency;
+
+    int bucket = 31 - __builtin_clz(latency | 1);
+    if (bucket >= LAT_HIST_BUCKETS) bucket = LAT_HIST_BUCKETS - 1;
+    st.histogram[bucket]++;
+}
+
+/*
+ * A frame received at rxMicros was put into a sink's buffer. Its latency gets
+ * recorded when that buffer is flushed.
+ */
+void Latency::queued(uint8_t sink, uint32_t rxMicros)
+{
+    if (sink >= LAT_NUM_SINKS) return;
+    if (pendingCount[sink] >= LAT_MAX_PENDING) {
+        stats[sink].unsampled++;
+        return;
+    }
+    pending[sink][pendingCount[sink]++] = rxMicros;
+}
+
+//The sink's buffer has just been handed to the hardware. Everything queued up is now out.
+void Latency::flushed(uint8_t sink)
+{
+    if (sink >= LAT_NUM_SINKS) return;
+    uint32_t now = micros();
+    for (int i = 0; i < pendingCount[sink]; i++) record(sink, now - pending[sink][i]);
+    pendingCount[sink] = 0;
+}
+
+//The sink threw its buffer away (write failure) so the frames in it never made it out.
+void Latency::discard(uint8_t sink)
+{
+    if (sink >= LAT_NUM_SINKS) return;
+    pendingCount[sink] = 0;
+}
+
+void Latency::printReport()
+{
+    const char *names[LAT_NUM_SINKS] = {"USB", "SD"};
+
+    for (int s = 0; s < LAT_NUM_SINKS; s++) {
+        LATENCY_STATS &st = stats[s];
+        if (st.count == 0) {
+            Logger::console("%s: no samples", names[s]);
+            continue;
+        }
+        Logger::console("%s: count %l min %lus avg %lus max %lus unsampled %l", names[s], st.count, st.minMicros,
+                        (uint32_t)(st.totalMicros / st.count), st.maxMicros, st.unsampled);
+        SerialUSB.print("    hist:");
+        for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(st.histogram[b]);
+        }
+        SerialUSB.println();
+    }
+}
+
+/*
+ * Binary form for PROTO_GET_LATENCY. Number of sinks and number of buckets, then per
+ * sink (USB first, then SD): count, min, max, average, unsampled and then the bucket counts.
+ * All values are 32 bit little endian and in microseconds.
+ */
+int Latency::encodeReport(uint8_t *buff, int maxLen)
+{
+    int idx = 0;
+    uint32_t vals[5 + LAT_HIST_BUCKETS];
+
+    if (maxLen < 2 + LAT_NUM_SINKS * 4 * (5 + LAT_HIST_BUCKETS)) return 0;
+    buff[idx++] = LAT_NUM_SINKS;
+    buff[idx++] = LAT_HIST_BUCKETS;
+    for (int s = 0; s < LAT_NUM_SINKS; s++) {
+        LATENCY_STATS &st = stats[s];
+        vals[0] = st.count;
+        vals[1] = st.count ? st.minMicros : 0;
+        vals[2] = st.maxMicros;
+        vals[3] = st.count ? (uint32_t)(st.totalMicros / st.count) : 0;
+        vals[4] = st.unsampled;
+        for (int b = 0; b < LAT_HIST_BUCKETS; b++) vals[5 + b] = st.histogram[b];
+        for (int v = 0; v < 5 + LAT_HIST_BUCKETS; v++) {
+            buff[idx++] = (uint8_t)(vals[v] & 0xFF);
+            buff[idx++] = (uint8_t)(vals[v] >> 8);
+            buff[idx++] = (uint8_t)(vals[v] >> 16);
+            buff[idx++] = (uint8_t)(vals[v] >> 24);
+        }
+    }
+    return idx;
+}
@@ -0,0 +1,73 @@
+/*
+ * Latency.h
+ *
+ * Measures how long frames wait between being received and being pushed out to
+ * the host (USB) or the sdcard and keeps a log scale histogram for each.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+enum LATENCY_SINK {
+    LAT_USB = 0,
+    LAT_SD = 1,
+    LAT_NUM_SINKS
+};
+
+//Bucket n holds latencies of 2^n to 2^(n+1) - 1 microseconds (bucket 0 also holds 0us).
+//The last bucket holds everything from ~8 seconds up.
+#define LAT_HIST_BUCKETS    24
+
+typedef struct {
+    uint32_t count;
+    uint32_t minMicros;
+    uint32_t maxMicros;
+    uint64_t totalMicros;
+    uint32_t unsampled;     //frames that were sent without a measurement because the pending list was full
+    uint32_t histogram[LAT_HIST_BUCKETS];
+} LATENCY_STATS;
+
+class Latency {
+public:
+    static void setup();
+    static void record(uint8_t sink, uint32_t latency);
+    static void queued(uint8_t sink, uint32_t rxMicros);
+    static void flushed(uint8_t sink);
+    static void discard(uint8_t sink);
+    static void reset();
+    static void printReport();
+    static int encodeReport(uint8_t *buff, int maxLen);
+
+private:
+    static LATENCY_STATS stats[LAT_NUM_SINKS];
+    //receive timestamps of the frames that are sitting in a sink's buffer waiting to be flushed
+    static uint32_t pending[LAT_NUM_SINKS][LAT_MAX_PENDING];
+    static uint16_t pendingCount[LAT_NUM_SINKS];
+};
+
+#endif /* LATENCY_H_ */
@@ -0,0 +1,271 @@
+/*
+ * LinBus.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "LinBus.h"
+#include "Logger.h"
+#include "IrqVectors.h"
+
+/*
+ * The Arduino core already owns USART0_Handler and USART1_Handler (for Serial1 / Serial2) and
+ * its handlers only know about received bytes, not breaks. So the vector table is copied to RAM
+ * once and the two USART entries pointed at our own handlers. Serial1 / Serial2 begin() is still
+ * used to set up the pins, clock and baud rate.
+ *
+ * A LIN frame starts with a break, which the USART flags with RXBRK (at its start and again at its
+ * end). Then come the 0x55 sync byte, the protected ID, up to 8 data bytes and a checksum. A sniffer
+ * can't know how long the response is, so the response ends at the next break or after byteTimeout
+ * of silence, and its last byte is the checksum. A response is good if either the enhanced (LIN 2.x)
+ * or the classic (LIN 1.x, always used by the 0x3C / 0x3D diagnostic frames) checksum fits.
+ */
+
+LIN_PORT LinBus::ports[2];
+LIN_RECEIVED LinBus::received[LIN_RX_RING];
+volatile uint16_t LinBus::rxHead = 0;
+volatile uint16_t LinBus::rxTail = 0;
+volatile uint32_t LinBus::ringDropped = 0;
+
+static void lin1Handler()
+{
+    LinBus::handleIrq(0);
+}
+
+static void lin2Handler()
+{
+    LinBus::handleIrq(1);
+}
+
+void LinBus::setup()
+{
+    ports[0].usart = USART0;
+    ports[0].irq = USART0_IRQn;
+    ports[1].usart = USART1;
+    ports[1].irq = USART1_IRQn;
+    for (int p = 0; p < 2; p++) {
+        ports[p].enabled = false;
+        ports[p].state = LIN_IDLE;
+        ports[p].inBreak = false;
+    }
+    rxHead = rxTail = 0;
+}
+
+//port 0 = LIN1, 1 = LIN2
+void LinBus::begin(uint8_t port, uint32_t speed)
+{
+    if (port > 1 || speed < 1000 || speed > 20000) return;
+    LIN_PORT &p = ports[port];
+
+    NVIC_DisableIRQ(p.irq);
+    IrqVectors::setHandler(p.irq, (port == 0) ? lin1Handler : lin2Handler);
+    if (port == 0) Serial1.begin(speed);
+    else Serial2.begin(speed);
+    p.usart->US_IDR = 0xFFFFFFFF;
+    p.usart->US_CR = US_CR_RSTSTA;
+    p.speed = speed;
+    p.byteTimeout = 3 * 10 * 1000000ul / speed; //three byte times
+    p.state = LIN_IDLE;
+    p.inBreak = false;
+    p.frames = p.noResponse = p.syncErrors = p.parityErrors = p.checksumErrors = p.overruns = 0;
+    p.enabled = true;
+    p.usart->US_IER = US_IER_RXRDY | US_IER_RXBRK | US_IER_OVRE | US_IER_FRAME;
+    NVIC_ClearPendingIRQ(p.irq);
+    NVIC_EnableIRQ(p.irq);
+}
+
+void LinBus::end(uint8_t port)
+{
+    if (port > 1) return;
+    NVIC_DisableIRQ(ports[port].irq);
+    ports[port].usart->US_IDR = 0xFFFFFFFF;
+    ports[port].enabled = false;
+}
+
+boolean LinBus::isEnabled(uint8_t port)
+{
+    return (port <= 1) && ports[port].enabled;
+}
+
+//P0 = ID0 ^ ID1 ^ ID2 ^ ID4, P1 = !(ID1 ^ ID3 ^ ID4 ^ ID5)
+boolean LinBus::parityOk(uint8_t pid)
+{
+    uint8_t p0 = ((pid >> 0) ^ (pid >> 1) ^ (pid >> 2) ^ (pid >> 4)) & 1;
+    uint8_t p1 = ~((pid >> 1) ^ (pid >> 3) ^ (pid >> 4) ^ (pid >> 5)) & 1;
+    return (pid >> 6) == (p0 | (p1 << 1));
+}
+
+//Inverted sum with carry. The enhanced checksum includes the protected ID.
+uint8_t LinBus::checksum(uint8_t pid, uint8_t *data, uint8_t length, boolean enhanced)
+{
+    uint16_t sum = enhanced ? pid : 0;
+    for (int b = 0; b < length; b++) {
+        sum += data[b];
+        if (sum > 0xFF) sum -= 0xFF;
+    }
+    return (uint8_t)~sum;
+}
+
+//Close off the response being received. Runs in the USART interrupt or with it held off.
+void LinBus::finishFrame(uint8_t port)
+{
+    LIN_PORT &p = ports[port];
+    uint8_t length, id;
+    boolean good;
+
+    if (p.state != LIN_DATA) {
+        p.state = LIN_IDLE;
+        return;
+    }
+    p.state = LIN_IDLE;
+    if (p.count < 2) { //nobody answered the header (or just one stray byte)
+        p.noResponse++;
+        return;
+    }
+    length = p.count - 1;
+    id = p.pid & 0x3F;
+    good = (p.bytes[length] == checksum(p.pid, p.bytes, length, false));
+    if (!good && id < 0x3C) good = (p.bytes[length] == checksum(p.pid, p.bytes, length, true));
+    if (!good) {
+        p.checksumErrors++;
+        return;
+    }
+
+    p.frames++;
+    //received[] is shared by both ports so the other USART's interrupt has to be kept out
+    __disable_irq();
+    uint16_t nextHead = (rxHead + 1) % LIN_RX_RING;
+    if (nextHead == rxTail) {
+        ringDropped++;
+        __enable_irq();
+        return;
+    }
+    LIN_RECEIVED &rec = received[rxHead];
+    rec.frame.id = id;
+    rec.frame.extended = false;
+    rec.frame.rtr = 0;
+    rec.frame.length = length;
+    for (int b = 0; b < length; b++) rec.frame.data.bytes[b] = p.bytes[b];
+    rec.timestamp = p.breakMicros;
+    rec.bus = LIN_FIRST_BUS + port;
+    rxHead = nextHead;
+    __enable_irq();
+}
+
+void LinBus::receiveByte(uint8_t port, uint8_t b)
+{
+    LIN_PORT &p = ports[port];
+
+    switch (p.state) {
+    case LIN_SYNC:
+        if (b == 0x00) break; //the break itself can come through as a zero byte
+        if (b == 0x55) p.state = LIN_PID;
+        else {
+            p.syncErrors++;
+            p.state = LIN_IDLE;
+        }
+        break;
+    case LIN_PID:
+        if (!parityOk(b)) {
+            p.parityErrors++;
+            p.state = LIN_IDLE;
+            break;
+        }
+        p.pid = b;
+        p.count = 0;
+        p.lastByteMicros = micros();
+        p.state = LIN_DATA;
+        break;
+    case LIN_DATA:
+        p.bytes[p.count++] = b;
+        p.lastByteMicros = micros();
+        if (p.count == 9) finishFrame(port); //8 data bytes and the checksum, can't be any longer
+        break;
+    }
+}
+
+void LinBus::handleIrq(uint8_t port)
+{
+    LIN_PORT &p = ports[port];
+    uint32_t status = p.usart->US_CSR;
+
+    if (status & US_CSR_RXBRK) {
+        p.usart->US_CR = US_CR_RSTSTA;
+        if (!p.inBreak) {
+            finishFrame(port); //a break always ends whatever came before it
+            p.breakMicros = micros();
+            p.state = LIN_SYNC;
+        }
+        p.inBreak = !p.inBreak;
+    }
+    if (status & US_CSR_OVRE) {
+        p.usart->US_CR = US_CR_RSTSTA;
+        p.overruns++;
+        p.state = LIN_IDLE;
+    }
+    if (status & US_CSR_RXRDY) {
+        uint8_t b = p.usart->US_RHR;
+        if (status & US_CSR_FRAME) {
+            p.usart->US_CR = US_CR_RSTSTA;
+            if (p.state != LIN_SYNC) p.state = LIN_IDLE; //a bad byte ruins the frame, except the break's own zero
+        } else receiveByte(port, b);
+    }
+}
+
+//Responses only end by timing out if no break follows them, say the last frame before the bus goes quiet
+void LinBus::loop()
+{
+    for (int port = 0; port < 2; port++) {
+        LIN_PORT &p = ports[port];
+        if (!p.enabled || p.state != LIN_DATA) continue;
+        NVIC_DisableIRQ(p.irq);
+        if (p.state == LIN_DATA && (micros() - p.lastByteMicros) > p.byteTimeout) finishFrame(port);
+        NVIC_EnableIRQ(p.irq);
+    }
+}
+
+//Take the next received LIN frame, like Gateway::read
+boolean LinBus::read(uint8_t &bus, CAN_FRAME &frame, uint32_t &timestamp)
+{
+    if (rxTail == rxHead) return false;
+    LIN_RECEIVED &rec = received[rxTail];
+    frame = rec.frame;
+    timestamp = rec.timestamp;
+    bus = rec.bus;
+    rxTail = (rxTail + 1) % LIN_RX_RING;
+    return true;
+}
+
+void LinBus::printStatus()
+{
+    for (int port = 0; port < 2; port++) {
+        LIN_PORT &p = ports[port];
+        if (!p.enabled) {
+            Logger::console("LIN%i off", port + 1);
+            continue;
+        }
+        Logger::console("LIN%i at %l baud: %l frames, %l headers without response, errors: %l sync, %l parity, %l checksum, %l overrun",
+                        port + 1, p.speed, p.frames, p.noResponse, p.syncErrors, p.parityErrors, p.checksumErrors, p.overruns);
+    }
+    if (ringDropped) Logger::console("%l LIN frames dropped waiting for loop()", ringDropped);
+}
@@ -0,0 +1,98 @@
+/*
+ * LinBus.h
+ *
+ * Interrupt driven LIN sniffing on the two LIN ports (USART0 / Serial1 and USART1 / Serial2).
+ * Frames are found by their break and sync, checked for ID parity and checksum, timestamped
+ * at the break and handed to loop() as buses 3 and 4 like any CAN frame.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef LINBUS_H_
+#define LINBUS_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+#define LIN_FIRST_BUS   3   //bus number LIN1 shows up as, LIN2 is the next one
+
+enum LIN_RX_STATE {
+    LIN_IDLE,
+    LIN_SYNC,           //break seen, waiting for 0x55
+    LIN_PID,
+    LIN_DATA            //data bytes and checksum
+};
+
+typedef struct {
+    Usart *usart;
+    IRQn_Type irq;
+    boolean enabled;
+    uint32_t speed;
+    uint32_t byteTimeout;           //us of silence that ends a response
+    volatile uint8_t state;         //LIN_RX_STATE
+    volatile boolean inBreak;
+    volatile uint8_t pid;
+    volatile uint8_t count;         //data + checksum bytes so far
+    uint8_t bytes[9];
+    volatile uint32_t breakMicros;
+    volatile uint32_t lastByteMicros;
+    volatile uint32_t frames;
+    volatile uint32_t noResponse;   //header with nobody answering
+    volatile uint32_t syncErrors;
+    volatile uint32_t parityErrors;
+    volatile uint32_t checksumErrors;
+    volatile uint32_t overruns;
+} LIN_PORT;
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t timestamp;
+    uint8_t bus;
+} LIN_RECEIVED;
+
+class LinBus {
+public:
+    static void setup();
+    static void begin(uint8_t port, uint32_t speed);
+    static void end(uint8_t port);
+    static boolean isEnabled(uint8_t port);
+    static boolean read(uint8_t &bus, CAN_FRAME &frame, uint32_t &timestamp);
+    static void loop();
+    static void printStatus();
+    static void handleIrq(uint8_t port);
+
+private:
+    static LIN_PORT ports[2];
+    static LIN_RECEIVED received[LIN_RX_RING];
+    static volatile uint16_t rxHead;
+    static volatile uint16_t rxTail;
+    static volatile uint32_t ringDropped;
+
+    static void receiveByte(uint8_t port, uint8_t b);
+    static void finishFrame(uint8_t port);
+    static boolean parityOk(uint8_t pid);
+    static uint8_t checksum(uint8_t pid, uint8_t *data, uint8_t length, boolean enhanced);
+};
+
+#endif /* LINBUS_H_ */
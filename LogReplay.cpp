@@ -0,0 +1,354 @@
+/*
+ * LogReplay.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "LogReplay.h"
+#include "Logger.h"
+#include "TxQueue.h"
+#include "M2RET.h"
+
+extern TxQueue txQueues[];
+
+FileStore LogReplay::file;
+uint8_t LogReplay::buffer[REPLAY_BUFF_SIZE];
+uint16_t LogReplay::readPos = 0;
+uint16_t LogReplay::buffCount = 0;
+uint16_t LogReplay::skipCount = 0;
+boolean LogReplay::endOfFile = false;
+boolean LogReplay::running = false;
+uint16_t LogReplay::speed = 100;
+boolean LogReplay::looping = false;
+uint32_t LogReplay::filterId = 0;
+uint32_t LogReplay::filterMask = 0;
+uint8_t LogReplay::busMap[3];
+uint8_t LogReplay::format = 0;
+uint8_t LogReplay::activeFormat = GVRET;
+boolean LogReplay::haveFirst = false;
+uint32_t LogReplay::lastStamp = 0;
+uint64_t LogReplay::fileElapsed = 0;
+uint64_t LogReplay::replayClock = 0;
+uint32_t LogReplay::lastClockMicros = 0;
+boolean LogReplay::havePending = false;
+CAN_FRAME LogReplay::pendingFrame;
+uint8_t LogReplay::pendingBus = 0;
+uint64_t LogReplay::pendingDue = 0;
+uint32_t LogReplay::framesSent = 0;
+uint32_t LogReplay::loops = 0;
+
+void LogReplay::setup()
+{
+    running = false;
+    speed = 100;
+    looping = false;
+    filterId = 0;
+    filterMask = 0;
+    format = 0;
+    for (int b = 0; b < 3; b++) busMap[b] = b;
+}
+
+boolean LogReplay::isRunning()
+{
+    return running;
+}
+
+boolean LogReplay::start(const char *filename)
+{
+    if (running) stop();
+    if (!SysSettings.SDCardInserted) {
+        Logger::error("No sdcard, cannot replay");
+        return false;
+    }
+    if (!file.Open("0:", filename, false)) {
+        Logger::error("Could not open %s for replay", filename);
+        return false;
+    }
+    if (format == BINARYFILE || format == GVRET) activeFormat = format;
+    else activeFormat = (settings.fileOutputType == BINARYFILE) ? BINARYFILE : GVRET;
+
+    readPos = 0;
+    buffCount = 0;
+    skipCount = 0;
+    endOfFile = false;
+    framesSent = 0;
+    loops = 0;
+    restartTiming();
+    running = true;
+    fillBuffer();
+    Logger::console("Replaying %s", filename);
+    return true;
+}
+
+void LogReplay::stop()
+{
+    if (!running) return;
+    file.Close();
+    running = false;
+    havePending = false;
+    printStatus();
+}
+
+void LogReplay::setSpeed(uint16_t percent)
+{
+    speed = percent;
+}
+
+void LogReplay::setLooping(boolean loop)
+{
+    looping = loop;
+}
+
+void LogReplay::setFilter(uint32_t id, uint32_t mask)
+{
+    filterId = id;
+    filterMask = mask;
+}
+
+void LogReplay::setBusMap(uint8_t bus, uint8_t target)
+{
+    if (bus > 2) return;
+    busMap[bus] = (target > 2) ? REPLAY_BUS_DROP : target;
+}
+
+void LogReplay::setFormat(uint8_t fmt)
+{
+    format = fmt;
+}
+
+void LogReplay::printStatus()
+{
+    Logger::console("Replay %s: %l frames sent, %l loops, speed %i%%, loop %i", running ? "running" : "stopped",
+                    framesSent, loops, speed, looping);
+    Logger::console("Filter id %x mask %x, bus map %i,%i,%i (255 = dropped)", filterId, filterMask, busMap[0], busMap[1], busMap[2]);
+}
+
+void LogReplay::restartTiming()
+{
+    haveFirst = false;
+    fileElapsed = 0;
+    replayClock = 0;
+    lastClockMicros = micros();
+    havePending = false;
+}
+
+boolean LogReplay::rewind()
+{
+    if (!file.Seek(0)) return false;
+    readPos = 0;
+    buffCount = 0;
+    skipCount = 0;
+    endOfFile = false;
+    restartTiming();
+    return true;
+}
+
+/*
+ * Top up the read ahead buffer. At most one chunk per call so a single loop() never spends
+ * long waiting on the card.
+ */
+void LogReplay::fillBuffer()
+{
+    int got;
+
+    if (endOfFile || (REPLAY_BUFF_SIZE - buffCount) < REPLAY_READ_CHUNK) return;
+    uint16_t writePos = (readPos + buffCount) % REPLAY_BUFF_SIZE;
+    uint16_t len = REPLAY_BUFF_SIZE - writePos; //don't read past the end of the ring
+    if (len > REPLAY_READ_CHUNK) len = REPLAY_READ_CHUNK;
+    got = file.Read((char *)&buffer[writePos], len);
+    if (got <= 0) {
+        endOfFile = true;
+        return;
+    }
+    buffCount += got;
+    if (got < len) endOfFile = true;
+}
+
+uint8_t LogReplay::peekByte(uint16_t offset)
+{
+    return buffer[(readPos + offset) % REPLAY_BUFF_SIZE];
+}
+
+void LogReplay::consume(uint16_t count)
+{
+    if (count > buffCount) count = buffCount;
+    readPos = (readPos + count) % REPLAY_BUFF_SIZE;
+    buffCount -= count;
+}
+
+/*
+ * Pull the next frame out of the read ahead buffer. Timestamps come back in microseconds.
+ * Returns 1 for a frame, 0 if more of the file needs to be read first and -1 at the end of the file.
+ */
+int LogReplay::parseNext(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp)
+{
+    if (activeFormat == BINARYFILE) return parseBinary(frame, bus, stamp);
+    return parseGVRET(frame, bus, stamp);
+}
+
+//Same record layout sendFrameToFile writes: timestamp(4) id(4, bit 31 = extended) length + (bus << 4) data
+int LogReplay::parseBinary(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp)
+{
+    uint32_t id;
+    uint8_t len;
+
+    while (true) {
+        //ISO-TP records can be bigger than the whole buffer so they are skipped as they come in
+        if (skipCount > 0) {
+            uint16_t count = (skipCount < buffCount) ? skipCount : buffCount;
+            consume(count);
+            skipCount -= count;
+            if (skipCount > 0) return endOfFile ? -1 : 0;
+        }
+        if (buffCount < 9) return endOfFile ? -1 : 0;
+        len = peekByte(8) & 0xF;
+        if (len == 0xF) { //reassembled message, OBD value or decoded signals (see sendPduToFile)
+            if (buffCount < 12) return endOfFile ? -1 : 0;
+            skipCount = 12 + peekByte(10) + (peekByte(11) << 8);
+            continue;
+        }
+        if (len > 8) len = 8;
+        if (buffCount < 9 + len) return endOfFile ? -1 : 0;
+        break;
+    }
+
+    stamp = peekByte(0) + (peekByte(1) << 8) + (peekByte(2) << 16) + ((uint32_t)peekByte(3) << 24);
+    id = peekByte(4) + (peekByte(5) << 8) + (peekByte(6) << 16) + ((uint32_t)peekByte(7) << 24);
+    frame.extended = (id & 0x80000000) ? true : false;
+    frame.id = id & 0x7FFFFFFF;
+    frame.rtr = 0;
+    frame.length = len;
+    bus = peekByte(8) >> 4;
+    for (int c = 0; c < len; c++) frame.data.bytes[c] = peekByte(9 + c);
+    consume(9 + len);
+    return 1;
+}
+
+/*
+ * One frame per line: time,id(hex),extended,bus,length,data bytes(hex)...
+ * The time is in milliseconds since that's what sendFrameToFile writes. Lines that don't start with
+ * a number (header, Mark:, Status:) are skipped.
+ */
+int LogReplay::parseGVRET(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp)
+{
+    char line[REPLAY_MAX_LINE];
+    char *ptr;
+    int lineLen;
+
+    while (true) {
+        lineLen = -1;
+        for (int i = 0; i < buffCount; i++) {
+            if (peekByte(i) == '\n') {
+                lineLen = i;
+                break;
+            }
+        }
+        if (lineLen < 0) {
+            if (!endOfFile && buffCount < REPLAY_BUFF_SIZE) return 0;
+            if (buffCount == 0) return -1;
+            lineLen = buffCount; //last line has no line ending (or is far too long)
+        }
+        int copyLen = (lineLen < REPLAY_MAX_LINE - 1) ? lineLen : REPLAY_MAX_LINE - 1;
+        for (int i = 0; i < copyLen; i++) line[i] = peekByte(i);
+        line[copyLen] = 0;
+        consume(lineLen + 1);
+
+        if (line[0] < '0' || line[0] > '9') continue;
+        stamp = strtoul(line, &ptr, 10) * 1000;
+        if (*ptr++ != ',') continue;
+        frame.id = strtoul(ptr, &ptr, 16);
+        if (*ptr++ != ',') continue;
+        frame.extended = strtoul(ptr, &ptr, 10) ? true : false;
+        if (*ptr++ != ',') continue;
+        bus = strtoul(ptr, &ptr, 10);
+        if (*ptr++ != ',') continue;
+        frame.length = strtoul(ptr, &ptr, 10);
+        if (frame.length > 8) frame.length = 8;
+        for (int c = 0; c < frame.length; c++) {
+            if (*ptr++ != ',') {
+                frame.length = c;
+                break;
+            }
+            frame.data.bytes[c] = strtoul(ptr, &ptr, 16);
+        }
+        frame.rtr = 0;
+        return 1;
+    }
+}
+
+/*
+ * Send whatever is due. The replay clock runs off micros() and frame i is due
+ * (file time of i - file time of the first frame) * 100 / speed after the start.
+ * If the TX queue for a bus starts backing up the replay waits for it rather than
+ * have frames dropped.
+ */
+void LogReplay::loop()
+{
+    CAN_FRAME frame;
+    uint8_t bus;
+    uint32_t stamp, delta, now;
+    int result;
+
+    if (!running) return;
+    fillBuffer();
+
+    now = micros();
+    replayClock += (uint32_t)(now - lastClockMicros);
+    lastClockMicros = now;
+
+    for (int count = 0; count < REPLAY_MAX_PER_LOOP; count++) {
+        if (!havePending) {
+            result = parseNext(frame, bus, stamp);
+            if (result == 0) return; //read ahead hasn't caught up
+            if (result < 0) {
+                if (looping && rewind()) {
+                    loops++;
+                    return;
+                }
+                Logger::console("Replay finished");
+                stop();
+                return;
+            }
+            if (!haveFirst) {
+                haveFirst = true;
+                lastStamp = stamp;
+            }
+            delta = stamp - lastStamp;
+            if (delta > 0x80000000) delta = 0; //time went backwards, don't wait an hour for it
+            fileElapsed += delta;
+            lastStamp = stamp;
+
+            if (bus > 2 || busMap[bus] == REPLAY_BUS_DROP) continue;
+            if ((frame.id & filterMask) != (filterId & filterMask)) continue;
+            pendingFrame = frame;
+            pendingBus = busMap[bus];
+            pendingDue = speed ? (fileElapsed * 100) / speed : 0;
+            havePending = true;
+        }
+        if (pendingDue > replayClock) return;
+        if (txQueues[pendingBus].count() >= TX_QUEUE_SIZE / 2) return;
+        queueFrame(pendingBus, pendingFrame, TX_IN_ORDER); //keep the file's order, not ID order
+        framesSent++;
+        havePending = false;
+    }
+}
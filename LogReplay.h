@@ -0,0 +1,97 @@
+/*
+ * LogReplay.h
+ *
+ * Plays a log file from the sdcard back onto the CAN buses with the original timing.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef LOGREPLAY_H_
+#define LOGREPLAY_H_
+
+#include <Arduino.h>
+#include <Arduino_Due_SD_HSMCI.h>
+#include "config.h"
+#include "due_can.h"
+
+#define REPLAY_BUS_DROP     0xFF    //bus map value for "don't replay frames from this bus"
+
+class LogReplay {
+public:
+    static void setup();
+    static void loop();
+    static boolean start(const char *filename);
+    static void stop();
+    static boolean isRunning();
+    static void setSpeed(uint16_t percent);
+    static void setLooping(boolean loop);
+    static void setFilter(uint32_t id, uint32_t mask);
+    static void setBusMap(uint8_t bus, uint8_t target);
+    static void setFormat(uint8_t format);
+    static void printStatus();
+
+private:
+    static FileStore file;
+    static uint8_t buffer[REPLAY_BUFF_SIZE];    //read ahead ring buffer
+    static uint16_t readPos;
+    static uint16_t buffCount;
+    static uint16_t skipCount;      //bytes of a record being skipped that aren't in the buffer yet
+    static boolean endOfFile;
+    static boolean running;
+
+    //options
+    static uint16_t speed;          //percent of real time, 0 = as fast as the bus will take it
+    static boolean looping;
+    static uint32_t filterId;
+    static uint32_t filterMask;
+    static uint8_t busMap[3];
+    static uint8_t format;          //BINARYFILE, GVRET or 0 to go by FILETYPE
+    static uint8_t activeFormat;    //what the file being played is being read as
+
+    //timing
+    static boolean haveFirst;
+    static uint32_t lastStamp;      //file timestamp of the previous frame, in microseconds
+    static uint64_t fileElapsed;    //microseconds from the first frame of the file to the pending one
+    static uint64_t replayClock;    //microseconds since the replay (or this loop of it) started
+    static uint32_t lastClockMicros;
+
+    //next frame to go out
+    static boolean havePending;
+    static CAN_FRAME pendingFrame;
+    static uint8_t pendingBus;
+    static uint64_t pendingDue;
+
+    static uint32_t framesSent;
+    static uint32_t loops;
+
+    static void fillBuffer();
+    static void consume(uint16_t count);
+    static uint8_t peekByte(uint16_t offset);
+    static int parseNext(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp);
+    static int parseBinary(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp);
+    static int parseGVRET(CAN_FRAME &frame, uint8_t &bus, uint32_t &stamp);
+    static boolean rewind();
+    static void restartTiming();
+};
+
+#endif /* LOGREPLAY_H_ */
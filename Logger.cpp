@@ -29,6 +29,10 @@
 #include "sys_io.h"
 #include <due_wire.h>
 #include "EEPROM.h"
+#include "SettingsStore.h"
+#include "Profiler.h"
+#include "SysHealth.h"
+#include "Latency.h"
 #include <Arduino_Due_SD_HSMCI.h>
 
 Logger::LogLevel Logger::logLevel = Logger::Info;
@@ -128,20 +132,25 @@ void Logger::buffPutString(const char *c)
 
 void Logger::flushFileBuff()
 {
+    PROFILE_BEGIN(flushStart);
     Logger::debug("Write to SD Card %i bytes", fileBuffWritePtr);
     lastWriteTime = millis();
 
     if (!FS.Write((const char *)filebuffer, fileBuffWritePtr)) {
         Logger::error("Write to SDCard failed!");
+        SysHealth::sdWriteFailed();
+        Latency::discard(LAT_SD);
         SysSettings.useSD = false;
         fileBuffWritePtr = 0;
         return;
     }
     FS.Flush(); //force write of the data to card
+    Latency::flushed(LAT_SD);
 
     SysSettings.logToggle = !SysSettings.logToggle;
     setLED(SysSettings.LED_LOGGING, SysSettings.logToggle);
     fileBuffWritePtr = 0;
+    PROFILE_END(PROF_SD_FLUSH, flushStart);
 }
 
 boolean Logger::setupFile()
@@ -161,7 +170,7 @@ boolean Logger::setupFile()
             filename.concat(settings.fileNum++);
             filename.concat(".");
             filename.concat(settings.fileNameExt);
-            EEPROM.write(EEPROM_ADDR, settings); //save settings to save updated filenum
+            SettingsStore::save(); //save settings to save updated filenum
             if (FS.CreateNew("0:", filename.c_str())) {
                 fileInitialized = true;
             }
@@ -299,7 +308,7 @@ void Logger::fileRaw(uint8_t* buff, int sz)
         return;
     }
 
-    for (int i; i < sz; i++) {
+    for (int i = 0; i < sz; i++) {
         buffPutChar(*buff++);
     }
 }
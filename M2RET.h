@@ -30,6 +30,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <Arduino.h>
 #include "due_can.h"
 #include "sys_io.h"
+#include "SignalDecoder.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,7 +55,11 @@ enum STATE {
     SET_SINGLEWIRE_MODE,
     SET_SYSTYPE,
     ECHO_CAN_FRAME,
-    SETUP_EXT_BUSES
+    SETUP_EXT_BUSES,
+    SET_TX_EVENTS,
+    COLLECT_PAYLOAD,
+    COLLECT_BATCH,
+    COLLECT_ISOTP
 };
 
 enum GVRET_PROTOCOL
@@ -73,7 +78,43 @@ enum GVRET_PROTOCOL
     PROTO_ECHO_CAN_FRAME = 11,
     PROTO_GET_NUMBUSES = 12,
     PROTO_GET_EXT_BUSES = 13,
-    PROTO_SET_EXT_BUSES = 14
+    PROTO_SET_EXT_BUSES = 14,
+    PROTO_GET_PROFILE = 15,
+    PROTO_GET_STATUS = 16,
+    PROTO_GET_LATENCY = 17,
+    PROTO_TX_EVENT = 18,
+    PROTO_PERIODIC_SET = 19,
+    PROTO_PERIODIC_DATA = 20,
+    PROTO_PERIODIC_CLEAR = 21,
+    PROTO_PERIODIC_CONTROL = 22,
+    PROTO_REWRITE_SET = 23,
+    PROTO_REWRITE_CLEAR = 24,
+    PROTO_REWRITE_STATS = 25,
+    PROTO_BATCH_TX = 26,
+    PROTO_ISOTP_OPEN = 27,
+    PROTO_ISOTP_CLOSE = 28,
+    PROTO_ISOTP_SEND = 29,
+    PROTO_ISOTP_RECEIVE = 30,
+    PROTO_ISOTP_PDU = 31,
+    PROTO_OBD_VALUE = 32,
+    PROTO_OBD_POLL_SET = 33,
+    PROTO_OBD_POLL_CONTROL = 34,
+    PROTO_J1939_PGN = 35,
+    PROTO_J1939_STATS = 36,
+    PROTO_SIGNAL_VALUES = 37,
+    PROTO_SIGNAL_SET = 38,
+    PROTO_SIGNAL_CLEAR = 39,
+    PROTO_SIGNAL_CONTROL = 40,
+    PROTO_CLOCK_SYNC = 41
+};
+
+//What the data of a variable length record (sendPduToUSB / sendPduToFile) is
+enum PDU_TYPE
+{
+    PDU_ISOTP = 0,
+    PDU_OBD = 1,
+    PDU_J1939 = 2,
+    PDU_SIGNAL = 3
 };
 
 void loadSettings();
@@ -82,6 +123,16 @@ void setSWCANEnabled();
 void setSWCANWakeup();
 void processDigToggleFrame(CAN_FRAME &frame);
 void sendDigToggleMsg();
+void sendFrame(CAN_COMMON *bus, CAN_FRAME &frame);
+void queueFrame(int whichBus, CAN_FRAME &frame, uint8_t priority);
+void txFrameDone(uint8_t whichBus, CAN_FRAME &frame, uint8_t event, uint32_t timestamp, uint8_t flags = 0);
+uint32_t canTimestampToMicros(CANRaw &port, uint16_t stamp, uint32_t speed);
+void sendPduToUSB(uint8_t type, uint8_t whichBus, uint32_t id, boolean extended, uint8_t *data, uint16_t length, uint32_t timestamp);
+void sendPduToFile(uint8_t type, uint8_t whichBus, uint32_t id, boolean extended, uint8_t *data, uint16_t length, uint32_t timestamp);
+void sendObdValueToUSB(uint8_t whichBus, uint32_t id, uint8_t mode, uint8_t pid, int32_t value, uint8_t *data, uint8_t length, uint32_t timestamp);
+void sendObdValueToFile(uint8_t whichBus, uint32_t id, uint8_t mode, uint8_t pid, int32_t value, uint8_t *data, uint8_t length, uint32_t timestamp);
+void sendSignalsToUSB(uint8_t whichBus, uint32_t id, boolean extended, SIGNAL_VALUE *values, uint8_t count, uint32_t timestamp);
+void sendSignalsToFile(uint8_t whichBus, uint32_t id, boolean extended, SIGNAL_VALUE *values, uint8_t count, uint32_t timestamp);
 
 #endif /* GVRET_H_ */
 
@@ -39,6 +39,29 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "EEPROM.h"
 #include "SerialConsole.h"
+#include "Profiler.h"
+#include "SysHealth.h"
+#include "Latency.h"
+#include "TxQueue.h"
+#include "PeriodicTx.h"
+#include "LogReplay.h"
+#include "FrameGenerator.h"
+#include "Gateway.h"
+#include "RewriteRules.h"
+#include "BatchTx.h"
+#include "SessionPool.h"
+#include "IsoTp.h"
+#include "IsoTpSniffer.h"
+#include "PidCache.h"
+#include "ObdPoller.h"
+#include "J1939.h"
+#include "SignalDecoder.h"
+#include "LinBus.h"
+#include "SwcanRx.h"
+#include "SettingsStore.h"
+#include "FastBoot.h"
+#include "ClockSync.h"
+#include "IrqVectors.h"
 
 /*
 Notes on project:
@@ -58,7 +81,7 @@ typedef struct {
 byte serialBuffer[SER_BUFF_SIZE];
 int serialBufferLength = 0; //not creating a ring buffer. The buffer should be large enough to never overflow
 uint32_t lastFlushMicros = 0;
-BUSLOAD busLoad[2];
+BUSLOAD busLoad[3]; //CAN0, CAN1, SWCAN
 uint32_t busLoadTimer;
 
 EEPROMSettings settings;
@@ -75,13 +98,15 @@ lin_stack LIN2(2, 0); // Sniffer
 
 ELM327Emu elmEmulator;
 
+TxQueue txQueues[3]; //CAN0, CAN1, SWCAN
+
 SerialConsole console;
 
 bool digTogglePinState;
 uint8_t digTogglePinCounter;
 
 void CANHandler() {
-    SWCAN.intHandler();
+    SwcanRx::handleIrq();
 }
 
 //initializes all the system EEPROM values. Chances are this should be broken out a bit but
@@ -90,37 +115,46 @@ void loadSettings()
 {
     Logger::console("Loading settings....");
 
-    EEPROM.read(EEPROM_ADDR, settings);
-
-    if (settings.version != EEPROM_VER) { //if settings are not the current version then erase them and set defaults
+    //Defaults first. The stored record overrides them, fields added since it was saved keep them.
+    //They're built off to the side because load() first writes out any save still pending from
+    //the live settings, which SET_SYSTYPE relies on to read back what it just changed.
+    EEPROMSettings fresh;
+    fresh.version = EEPROM_VER;
+    fresh.appendFile = false;
+    fresh.CAN0Speed = 500000;
+    fresh.CAN0_Enabled = true;
+    fresh.CAN1Speed = 500000;
+    fresh.CAN1_Enabled = false;
+    fresh.CAN0ListenOnly = false;
+    fresh.CAN1ListenOnly = false;
+    fresh.SWCAN_Enabled = false;
+    fresh.SWCANListenOnly = false; //TODO: Not currently respected or implemented.
+    fresh.SWCANSpeed = 33333;
+    fresh.LIN1_Enabled = false;
+    fresh.LIN2_Enabled = false;
+    fresh.LIN1Speed = 19200;
+    fresh.LIN2Speed = 19200;
+    sprintf((char *)fresh.fileNameBase, "CANBUS");
+    sprintf((char *)fresh.fileNameExt, "TXT");
+    fresh.fileNum = 1;
+    fresh.fileOutputType = CRTD;
+    fresh.useBinarySerialComm = false;
+    fresh.autoStartLogging = false;
+    fresh.logLevel = 1; //info
+    fresh.sysType = 0; //CANDUE as default
+    fresh.valid = 0; //not used right now
+
+    int stored = SettingsStore::load(fresh);
+    settings = fresh;
+    if (stored == 0) {
         Logger::console("Resetting to factory defaults");
-        settings.version = EEPROM_VER;
-        settings.appendFile = false;
-        settings.CAN0Speed = 500000;
-        settings.CAN0_Enabled = true;
-        settings.CAN1Speed = 500000;
-        settings.CAN1_Enabled = false;
-        settings.CAN0ListenOnly = false;
-        settings.CAN1ListenOnly = false;
-        settings.SWCAN_Enabled = false;
-        settings.SWCANListenOnly = false; //TODO: Not currently respected or implemented.
-        settings.SWCANSpeed = 33333;
-        settings.LIN1_Enabled = false;
-        settings.LIN2_Enabled = false;
-        settings.LIN1Speed = 19200;
-        settings.LIN2Speed = 19200;
-        sprintf((char *)settings.fileNameBase, "CANBUS");
-        sprintf((char *)settings.fileNameExt, "TXT");
-        settings.fileNum = 1;
-        settings.fileOutputType = CRTD;
-        settings.useBinarySerialComm = false;
-        settings.autoStartLogging = false;
-        settings.logLevel = 1; //info
-        settings.sysType = 0; //CANDUE as default
-        settings.valid = 0; //not used right now
-        EEPROM.write(EEPROM_ADDR, settings);
+        SettingsStore::save();
     } else {
-        Logger::console("Using stored values from EEPROM");
+        if (settings.version != EEPROM_VER) {
+            Logger::console("Stored settings are from version %X, using defaults for anything newer", settings.version);
+            settings.version = EEPROM_VER;
+            SettingsStore::save();
+        } else Logger::console("Using stored values from EEPROM");
         if (settings.CAN0ListenOnly > 1) settings.CAN0ListenOnly = 0;
         if (settings.CAN1ListenOnly > 1) settings.CAN1ListenOnly = 0;
     }
@@ -159,6 +193,7 @@ void loadSettings()
         SysSettings.lawicellExtendedMode = false;
         SysSettings.lawicelTimestamping = false;
         SysSettings.numBuses = 3; //Currently we support CAN0, CAN1, SWCAN
+        SysSettings.txEvents = false;
         for (int rx = 0; rx < NUM_BUSES; rx++) SysSettings.lawicelBusReception[rx] = true; //default to showing messages on RX 
         //set pin mode for all LEDS
         pinMode(RGB_GREEN, OUTPUT);
@@ -198,6 +233,10 @@ void loadSettings()
     busLoad[1].busloadPercentage = 0;
     busLoad[1].bitsPerQuarter = settings.CAN1Speed / 4;
 
+    busLoad[2].bitsSoFar = 0;
+    busLoad[2].busloadPercentage = 0;
+    busLoad[2].bitsPerQuarter = settings.SWCAN_Enabled ? settings.SWCANSpeed / 4 : 0;
+
     busLoadTimer = millis();
 }
 
@@ -216,6 +255,23 @@ void setSWCANWakeup()
     SWCAN.mode(2);
 }
 
+//The CAN interrupts come here before due_can's own handler. See SysHealth::canIrq and TxQueue::mailboxIrq
+void can0Irq()
+{
+    SysHealth::canIrq(0, CAN0);
+    txQueues[0].mailboxIrq();
+    PeriodicTx::mailboxIrq(0);
+    Can0.interruptHandler();
+}
+
+void can1Irq()
+{
+    SysHealth::canIrq(1, CAN1);
+    txQueues[1].mailboxIrq();
+    PeriodicTx::mailboxIrq(1);
+    Can1.interruptHandler();
+}
+
 void setup()
 {
     //TODO: I don't remember why these two lines are here... anyone know?
@@ -229,54 +285,39 @@ void setup()
     Wire.begin();
     SPI.begin();
 
+    Profiler::setup();
+    SysHealth::setup();
+    Latency::setup();
+    ClockSync::setup();
+    PeriodicTx::setup();
+    LogReplay::setup();
+    FrameGenerator::setup();
+    Gateway::setup();
+    RewriteRules::setup();
+    BatchTx::setup();
+    SessionPool::setup();
+    IsoTp::setup();
+    IsoTpSniffer::setup();
+    PidCache::setup();
+    ObdPoller::setup();
+    J1939::setup();
+    SignalDecoder::setup();
+    LinBus::setup();
+    SwcanRx::setup();
+
     loadSettings();
 
+    txQueues[0].setup(&Can0, &Can0, CAN0, 0);
+    txQueues[1].setup(&Can1, &Can1, CAN1, 1);
+    txQueues[2].setup(&SWCAN, NULL, NULL, 2);
+    IrqVectors::setHandler(CAN0_IRQn, can0Irq);
+    IrqVectors::setHandler(CAN1_IRQn, can1Irq);
+
     //settings.logLevel = 0; //Also just for testing. Dont use this in production either.
     //Logger::setLoglevel(Logger::Debug);
 
-    if (SysSettings.useSD) {
-        if (SD.Init()) {
-            FS.Init();
-            SysSettings.SDCardInserted = true;
-            if (settings.autoStartLogging) {
-                SysSettings.logToFile = true;
-                Logger::info("Automatically logging to file.");
-                //Logger::file("Starting File Logging.");
-            }
-        } else {
-            Logger::error("SDCard not inserted. Cannot log to file!");
-            SysSettings.SDCardInserted = false;
-        }
-    }
-
-    SerialUSB.print("Build number: ");
-    SerialUSB.println(CFG_BUILD_NUM);
-
-    sys_early_setup();
-    setup_sys_io();
-
-    if (digToggleSettings.enabled) {
-        SerialUSB.println("Digital Toggle System Enabled");
-        if (digToggleSettings.mode & 1) { //input CAN and output pin state mode
-            SerialUSB.println("In Output Mode");
-            pinMode(digToggleSettings.pin, OUTPUT);
-            if (digToggleSettings.mode & 0x80) {
-                digitalWrite(digToggleSettings.pin, LOW);
-                digTogglePinState = false;
-            } else {
-                digitalWrite(digToggleSettings.pin, HIGH);
-                digTogglePinState = true;
-            }
-        } else { //read pin and output CAN mode
-            SerialUSB.println("In Input Mode");
-            pinMode(digToggleSettings.pin, INPUT);
-            digTogglePinCounter = 0;
-            if (digToggleSettings.mode & 0x80) digTogglePinState = false;
-            else digTogglePinState = true;
-        }
-    }
-
-
+    //CAN goes first so frames sent right after power up are caught. SWCAN, the sdcard and the
+    //messages about it all are left for FastBoot to finish from loop().
     if (settings.CAN0_Enabled) {
         if (settings.CAN0ListenOnly) {
             Can0.setListenOnlyMode(true);
@@ -285,8 +326,6 @@ void setup()
         }
         Can0.enable();
         Can0.begin(settings.CAN0Speed, 255);
-        SerialUSB.print("Enabled CAN0 with speed ");
-        SerialUSB.println(settings.CAN0Speed);
     } else Can0.disable();
 
     if (settings.CAN1_Enabled) {
@@ -297,33 +336,8 @@ void setup()
         }
         Can1.enable();
         Can1.begin(settings.CAN1Speed, 255);
-        SerialUSB.print("Enabled CAN1 with speed ");
-        SerialUSB.println(settings.CAN1Speed);        
     } else Can1.disable();
 
-    if (settings.SWCAN_Enabled) {
-        SWCAN.setupSW(settings.SWCANSpeed);       
-        delay(20);
-        SWCAN.mode(3); // Go to normal mode. 0 - Sleep, 1 - High Speed, 2 - High Voltage Wake-Up, 3 - Normal
-        if (settings.SWCANListenOnly)
-        {
-            SWCAN.setListenOnlyMode(true);
-        }
-        else
-        {
-            SWCAN.setListenOnlyMode(false);
-        }
-        attachInterrupt(SWC_INT, CANHandler, FALLING); //enable interrupt for SWCAN
-        SerialUSB.print("Enabled SWCAN with speed ");
-        SerialUSB.println(settings.SWCANSpeed);
-        SWCAN.InitFilters(true);
-    }
-
-/*
-    if (settings.LIN_Enabled) {
-        LIN1.setSerial();
-        LIN2.setSerial();
-    } */
 /*
     for (int i = 0; i < 7; i++) {
         if (settings.CAN0Filters[i].enabled) {
@@ -337,6 +351,53 @@ void setup()
     }*/
 
     setPromiscuousMode();
+    FastBoot::start();
+
+    SerialUSB.print("Build number: ");
+    SerialUSB.println(CFG_BUILD_NUM);
+    if (settings.CAN0_Enabled) {
+        SerialUSB.print("Enabled CAN0 with speed ");
+        SerialUSB.println(settings.CAN0Speed);
+    }
+    if (settings.CAN1_Enabled) {
+        SerialUSB.print("Enabled CAN1 with speed ");
+        SerialUSB.println(settings.CAN1Speed);
+    }
+
+    sys_early_setup();
+    setup_sys_io();
+
+    if (digToggleSettings.enabled) {
+        SerialUSB.println("Digital Toggle System Enabled");
+        if (digToggleSettings.mode & 1) { //input CAN and output pin state mode
+            SerialUSB.println("In Output Mode");
+            pinMode(digToggleSettings.pin, OUTPUT);
+            if (digToggleSettings.mode & 0x80) {
+                digitalWrite(digToggleSettings.pin, LOW);
+                digTogglePinState = false;
+            } else {
+                digitalWrite(digToggleSettings.pin, HIGH);
+                digTogglePinState = true;
+            }
+        } else { //read pin and output CAN mode
+            SerialUSB.println("In Input Mode");
+            pinMode(digToggleSettings.pin, INPUT);
+            digTogglePinCounter = 0;
+            if (digToggleSettings.mode & 0x80) digTogglePinState = false;
+            else digTogglePinState = true;
+        }
+    }
+
+    if (settings.LIN1_Enabled) {
+        LinBus::begin(0, settings.LIN1Speed);
+        SerialUSB.print("Enabled LIN1 with speed ");
+        SerialUSB.println(settings.LIN1Speed);
+    }
+    if (settings.LIN2_Enabled) {
+        LinBus::begin(1, settings.LIN2Speed);
+        SerialUSB.print("Enabled LIN2 with speed ");
+        SerialUSB.println(settings.LIN2Speed);
+    }
 
     SysSettings.lawicelMode = false;
     SysSettings.lawicelAutoPoll = false;
@@ -350,7 +411,8 @@ void setup()
 
 void setPromiscuousMode()
 {
-    //By default there are 7 mailboxes for each device that are RX boxes
+    //By default there are 7 mailboxes for each device that are RX boxes. The last two of
+    //them are taken over by the periodic scheduler and the TX queue so that leaves 5.
     //This sets each mailbox to have an open filter that will accept extended
     //or standard frames
     int filter;
@@ -360,7 +422,7 @@ void setPromiscuousMode()
         Can1.setRXFilter(filter, 0, 0, true);
     }
     //standard
-    for (filter = 3; filter < 7; filter++) {
+    for (filter = 3; filter < PERIODIC_TX_MAILBOX; filter++) {
         Can0.setRXFilter(filter, 0, 0, false);
         Can1.setRXFilter(filter, 0, 0, false);
     }
@@ -380,7 +442,7 @@ uint8_t checksumCalc(uint8_t *buffer, int length)
 void addBits(int offset, CAN_FRAME &frame)
 {
     if (offset < 0) return;
-    if (offset > 1) return;
+    if (offset > 2) return;
     busLoad[offset].bitsSoFar += 41 + (frame.length * 9);
     if (frame.extended) busLoad[offset].bitsSoFar += 18;
 }
@@ -390,10 +452,62 @@ void sendFrame(CAN_COMMON *bus, CAN_FRAME &frame)
     int whichBus = 0;
     if (bus == &Can1) whichBus = 1;
     if (bus == &SWCAN) whichBus = 2;
-    bus->sendFrame(frame);
-    sendFrameToFile(frame, whichBus); //copy sent frames to file as well.
-    addBits(whichBus, frame);
-    toggleTXLED();
+    queueFrame(whichBus, frame, 0);
+}
+
+/*
+ * Put a frame into a bus's TX queue. Priority 1 (most urgent) to 15, 0 if the caller doesn't care.
+ * Add TX_IN_ORDER to have it go out in queue order rather than by ID.
+ * The frame is logged, counted and blinked for once it has actually gone out, see txFrameDone.
+ */
+void queueFrame(int whichBus, CAN_FRAME &frame, uint8_t priority)
+{
+    if (whichBus < 0 || whichBus > 2) return;
+    txQueues[whichBus].enqueue(frame, priority);
+}
+
+/*
+ * Called by the TX queues when a frame has gone out, failed or was dropped. flags are the TX_IN_ORDER /
+ * TX_FROM_GENERATOR bits it was queued with. In binary mode the host can ask to be told about each of these (PROTO_TX_EVENT):
+ * 0xF1 18 event bus timestamp(4) id(4, bit 31 set if extended)
+ */
+void txFrameDone(uint8_t whichBus, CAN_FRAME &frame, uint8_t event, uint32_t timestamp, uint8_t flags)
+{
+    uint32_t id;
+    uint32_t hostStamp;
+
+    if (flags & TX_FROM_GENERATOR) FrameGenerator::frameDone(frame, event);
+
+    if (event == TX_EVENT_COMPLETE) {
+        sendFrameToFile(frame, whichBus, timestamp); //copy sent frames to file as well.
+        addBits(whichBus, frame);
+        toggleTXLED();
+    } else SysHealth::txFailed(whichBus);
+
+    if (!SysSettings.txEvents || !settings.useBinarySerialComm || SysSettings.lawicelMode) return;
+
+    if (serialBufferLength > SER_BUFF_SIZE - 12) {
+        SysHealth::usbOverflow();
+        SerialUSB.write(serialBuffer, serialBufferLength);
+        serialBufferLength = 0;
+        lastFlushMicros = micros();
+        Latency::flushed(LAT_USB);
+    }
+    id = frame.id;
+    if (frame.extended) id |= 1 << 31;
+    hostStamp = ClockSync::toHost(timestamp);
+    serialBuffer[serialBufferLength++] = 0xF1;
+    serialBuffer[serialBufferLength++] = PROTO_TX_EVENT;
+    serialBuffer[serialBufferLength++] = event;
+    serialBuffer[serialBufferLength++] = whichBus;
+    serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp & 0xFF);
+    serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 8);
+    serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 16);
+    serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 24);
+    serialBuffer[serialBufferLength++] = (uint8_t)(id & 0xFF);
+    serialBuffer[serialBufferLength++] = (uint8_t)(id >> 8);
+    serialBuffer[serialBufferLength++] = (uint8_t)(id >> 16);
+    serialBuffer[serialBufferLength++] = (uint8_t)(id >> 24);
 }
 
 void toggleRXLED()
@@ -449,15 +563,35 @@ void updateBusloadLED(uint8_t perc)
     else digitalWrite(DS2, HIGH);
 }
 
-void sendFrameToUSB(CAN_FRAME &frame, int whichBus)
+/*
+ * Turn a CAN controller timestamp into micros() time. The controller stamps each received frame
+ * (and each finished transmission) with its 16 bit timer which counts bit times, so the age of the
+ * event is the difference between that and the timer now. The timer wraps every 65536 bit times
+ * (65ms at 1Mbit) so anything that looks older than CAN_MAX_FRAME_AGE is assumed to be bogus
+ * and the event is stamped as happening just now.
+ */
+uint32_t canTimestampToMicros(CANRaw &port, uint16_t stamp, uint32_t speed)
+{
+    uint32_t now = micros();
+    uint32_t ageBits = (port.get_internal_timer_value() - stamp) & 0xFFFF;
+    uint32_t ageMicros;
+
+    if (speed < 1000) return now;
+    ageMicros = (ageBits * 1000) / (speed / 1000);
+    if (ageMicros > CAN_MAX_FRAME_AGE) return now;
+    return now - ageMicros;
+}
+
+void sendFrameToUSB(CAN_FRAME &frame, int whichBus, uint32_t timestamp)
 {
     uint8_t buff[22];
     uint8_t temp;
-    uint32_t now = micros();
+    uint32_t hostStamp;
+    uint32_t id;
 
     if (SysSettings.lawicelMode) {
         if (SysSettings.lawicellExtendedMode) {
-            SerialUSB.print(micros());
+            SerialUSB.print(timestamp);
             SerialUSB.print(" - ");
             SerialUSB.print(frame.id, HEX);            
             if (frame.extended) SerialUSB.print(" X ");
@@ -484,25 +618,37 @@ void sendFrameToUSB(CAN_FRAME &frame, int whichBus)
                 SerialUSB.print((char *)buff);
             }
             if (SysSettings.lawicelTimestamping) {
-                uint16_t timestamp = (uint16_t)millis();
-                sprintf((char *)buff, "%04x", timestamp);
+                uint16_t msStamp = (uint16_t)(timestamp / 1000);
+                sprintf((char *)buff, "%04x", msStamp);
                 SerialUSB.print((char *)buff);
             }
         }
         SerialUSB.write(13);
+        Latency::record(LAT_USB, micros() - timestamp);
     } else {
         if (settings.useBinarySerialComm) {
-            if (frame.extended) frame.id |= 1 << 31;
+            //Normally the buffer gets flushed long before this. If it hasn't been then push it out now
+            //rather than run off the end of it.
+            if (serialBufferLength > SER_BUFF_SIZE - 24) {
+                SysHealth::usbOverflow();
+                SerialUSB.write(serialBuffer, serialBufferLength);
+                serialBufferLength = 0;
+                lastFlushMicros = micros();
+                Latency::flushed(LAT_USB);
+            }
+            id = frame.id; //the caller's frame is used again after this so don't flag it
+            if (frame.extended) id |= 1 << 31;
+            hostStamp = ClockSync::toHost(timestamp);
             serialBuffer[serialBufferLength++] = 0xF1;
             serialBuffer[serialBufferLength++] = 0; //0 = canbus frame sending
-            serialBuffer[serialBufferLength++] = (uint8_t)(now & 0xFF);
-            serialBuffer[serialBufferLength++] = (uint8_t)(now >> 8);
-            serialBuffer[serialBufferLength++] = (uint8_t)(now >> 16);
-            serialBuffer[serialBufferLength++] = (uint8_t)(now >> 24);
-            serialBuffer[serialBufferLength++] = (uint8_t)(frame.id & 0xFF);
-            serialBuffer[serialBufferLength++] = (uint8_t)(frame.id >> 8);
-            serialBuffer[serialBufferLength++] = (uint8_t)(frame.id >> 16);
-            serialBuffer[serialBufferLength++] = (uint8_t)(frame.id >> 24);
+            serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp & 0xFF);
+            serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 8);
+            serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 16);
+            serialBuffer[serialBufferLength++] = (uint8_t)(hostStamp >> 24);
+            serialBuffer[serialBufferLength++] = (uint8_t)(id & 0xFF);
+            serialBuffer[serialBufferLength++] = (uint8_t)(id >> 8);
+            serialBuffer[serialBufferLength++] = (uint8_t)(id >> 16);
+            serialBuffer[serialBufferLength++] = (uint8_t)(id >> 24);
             serialBuffer[serialBufferLength++] = frame.length + (uint8_t)(whichBus << 4);
             for (int c = 0; c < frame.length; c++) {
                 serialBuffer[serialBufferLength++] = frame.data.bytes[c];
@@ -511,8 +657,9 @@ void sendFrameToUSB(CAN_FRAME &frame, int whichBus)
             temp = 0;
             serialBuffer[serialBufferLength++] = temp;
             //SerialUSB.write(buff, 12 + frame.length);
+            Latency::queued(LAT_USB, timestamp);
         } else {
-            SerialUSB.print(micros());
+            SerialUSB.print(timestamp);
             SerialUSB.print(" - ");
             SerialUSB.print(frame.id, HEX);
             if (frame.extended) SerialUSB.print(" X ");
@@ -525,26 +672,31 @@ void sendFrameToUSB(CAN_FRAME &frame, int whichBus)
                 SerialUSB.print(frame.data.bytes[c], HEX);
             }
             SerialUSB.println();
+            Latency::record(LAT_USB, micros() - timestamp);
         }
     }
 }
 
-void sendFrameToFile(CAN_FRAME &frame, int whichBus)
+/*
+ * Returns true if the frame went into the file buffer so the caller can count it for the SD
+ * latency stats. Sent frames are copied to the file too but aren't measured.
+ */
+boolean sendFrameToFile(CAN_FRAME &frame, int whichBus, uint32_t timestamp)
 {
     uint8_t buff[40];
     uint8_t temp;
-    uint32_t timestamp;
+    uint32_t id;
     if (settings.fileOutputType == BINARYFILE) {
-        if (frame.extended) frame.id |= 1 << 31;
-        timestamp = micros();
+        id = frame.id;
+        if (frame.extended) id |= 1 << 31;
         buff[0] = (uint8_t)(timestamp & 0xFF);
         buff[1] = (uint8_t)(timestamp >> 8);
         buff[2] = (uint8_t)(timestamp >> 16);
         buff[3] = (uint8_t)(timestamp >> 24);
-        buff[4] = (uint8_t)(frame.id & 0xFF);
-        buff[5] = (uint8_t)(frame.id >> 8);
-        buff[6] = (uint8_t)(frame.id >> 16);
-        buff[7] = (uint8_t)(frame.id >> 24);
+        buff[4] = (uint8_t)(id & 0xFF);
+        buff[5] = (uint8_t)(id >> 8);
+        buff[6] = (uint8_t)(id >> 16);
+        buff[7] = (uint8_t)(id >> 24);
         buff[8] = frame.length + (uint8_t)(whichBus << 4);
         for (int c = 0; c < frame.length; c++) {
             buff[9 + c] = frame.data.bytes[c];
@@ -574,9 +726,317 @@ void sendFrameToFile(CAN_FRAME &frame, int whichBus)
         buff[0] = '\r';
         buff[1] = '\n';
         Logger::fileRaw(buff, 2);
+    } else return false;
+    return SysSettings.SDCardInserted;
+}
+
+//Label PDU records get in text output and GVRET/CRTD files, indexed by PDU_TYPE
+static const char *pduNames[] = {"ISOTP", "OBD", "J1939", "SIG"};
+
+/*
+ * A reassembled ISO-TP message from the sniffer or J1939 transport message. Binary mode sends
+ * 0xF1 31 (ISO-TP) or 0xF1 35 (J1939) timestamp(4) id(4, bit 31 set if extended) bus length(2) data
+ * J1939 messages carry the ID they would have had as a single frame.
+ * Text mode prints it like a frame with ISOTP / J1939 in place of the frame length.
+ * There is no LAWICEL form so nothing is sent in that mode.
+ */
+void sendPduToUSB(uint8_t type, uint8_t whichBus, uint32_t id, boolean extended, uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    uint8_t header[13];
+    uint32_t hostStamp;
+
+    if (SysSettings.lawicelMode) return;
+    if (settings.useBinarySerialComm) {
+        if (extended) id |= 1 << 31;
+        hostStamp = ClockSync::toHost(timestamp);
+        header[0] = 0xF1;
+        header[1] = (type == PDU_J1939) ? PROTO_J1939_PGN : PROTO_ISOTP_PDU;
+        header[2] = (uint8_t)(hostStamp & 0xFF);
+        header[3] = (uint8_t)(hostStamp >> 8);
+        header[4] = (uint8_t)(hostStamp >> 16);
+        header[5] = (uint8_t)(hostStamp >> 24);
+        header[6] = (uint8_t)(id & 0xFF);
+        header[7] = (uint8_t)(id >> 8);
+        header[8] = (uint8_t)(id >> 16);
+        header[9] = (uint8_t)(id >> 24);
+        header[10] = whichBus;
+        header[11] = (uint8_t)(length & 0xFF);
+        header[12] = (uint8_t)(length >> 8);
+        //keep ordering with the frames already waiting in the buffer
+        if (serialBufferLength + sizeof(header) + length > SER_BUFF_SIZE) {
+            SerialUSB.write(serialBuffer, serialBufferLength);
+            serialBufferLength = 0;
+            lastFlushMicros = micros();
+            Latency::flushed(LAT_USB);
+        }
+        if (sizeof(header) + length > SER_BUFF_SIZE) {
+            SerialUSB.write(header, sizeof(header));
+            SerialUSB.write(data, length);
+            return;
+        }
+        memcpy(serialBuffer + serialBufferLength, header, sizeof(header));
+        memcpy(serialBuffer + serialBufferLength + sizeof(header), data, length);
+        serialBufferLength += sizeof(header) + length;
+    } else {
+        SerialUSB.print(timestamp);
+        SerialUSB.print(" - ");
+        SerialUSB.print(id, HEX);
+        if (extended) SerialUSB.print(" X ");
+        else SerialUSB.print(" S ");
+        SerialUSB.print(whichBus);
+        SerialUSB.print(" ");
+        SerialUSB.print(pduNames[type]);
+        SerialUSB.print(" ");
+        SerialUSB.print(length);
+        for (int c = 0; c < length; c++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(data[c], HEX);
+        }
+        SerialUSB.println();
+    }
+}
+
+/*
+ * Reassembled message to the log file. In binary files the record looks like a frame
+ * with a length nibble of 0xF, followed by the bus, a 16 bit length and the data. The upper nibble
+ * of that byte is the PDU_TYPE. GVRET files get an ISOTP / J1939 line and CRTD files an event line,
+ * both of which readers skip if they don't know them.
+ */
+void sendPduToFile(uint8_t type, uint8_t whichBus, uint32_t id, boolean extended, uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    uint8_t buff[40];
+
+    if (settings.fileOutputType == BINARYFILE) {
+        if (extended) id |= 1 << 31;
+        buff[0] = (uint8_t)(timestamp & 0xFF);
+        buff[1] = (uint8_t)(timestamp >> 8);
+        buff[2] = (uint8_t)(timestamp >> 16);
+        buff[3] = (uint8_t)(timestamp >> 24);
+        buff[4] = (uint8_t)(id & 0xFF);
+        buff[5] = (uint8_t)(id >> 8);
+        buff[6] = (uint8_t)(id >> 16);
+        buff[7] = (uint8_t)(id >> 24);
+        buff[8] = 0x0F | (type << 4);
+        buff[9] = whichBus;
+        buff[10] = (uint8_t)(length & 0xFF);
+        buff[11] = (uint8_t)(length >> 8);
+        Logger::fileRaw(buff, 12);
+        Logger::fileRaw(data, length);
+    } else if (settings.fileOutputType == GVRET || settings.fileOutputType == CRTD) {
+        if (settings.fileOutputType == GVRET) sprintf((char *)buff, "%s,%i,%x,%i,%i,%i", pduNames[type], timestamp / 1000, id, extended, whichBus, length);
+        else sprintf((char *)buff, "%f CEV %s %x %i %i", timestamp / 1000000.0f, pduNames[type], id, whichBus, length);
+        Logger::fileRaw(buff, strlen((char *)buff));
+        for (int c = 0; c < length; c++) {
+            sprintf((char *) buff, (settings.fileOutputType == GVRET) ? ",%x" : " %x", data[c]);
+            Logger::fileRaw(buff, strlen((char *)buff));
+        }
+        buff[0] = '\r';
+        buff[1] = '\n';
+        Logger::fileRaw(buff, 2);
+    }
+}
+
+/*
+ * A decoded OBD-II value from the PID poller. value is the PID's unit times 100 (0 if the PID
+ * isn't one ObdPids knows) and data is the reply's data bytes after the mode and PID. Binary mode sends
+ * 0xF1 32 timestamp(4) id(4, bit 31 set if extended) bus mode PID value(4) length data
+ */
+void sendObdValueToUSB(uint8_t whichBus, uint32_t id, uint8_t mode, uint8_t pid, int32_t value, uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+    uint8_t buff[22];
+    uint32_t hostStamp;
+
+    if (SysSettings.lawicelMode) return;
+    if (length > 5) length = 5;
+    if (settings.useBinarySerialComm) {
+        if (id > 0x7FF) id |= 1 << 31;
+        hostStamp = ClockSync::toHost(timestamp);
+        buff[0] = 0xF1;
+        buff[1] = PROTO_OBD_VALUE;
+        buff[2] = (uint8_t)(hostStamp & 0xFF);
+        buff[3] = (uint8_t)(hostStamp >> 8);
+        buff[4] = (uint8_t)(hostStamp >> 16);
+        buff[5] = (uint8_t)(hostStamp >> 24);
+        buff[6] = (uint8_t)(id & 0xFF);
+        buff[7] = (uint8_t)(id >> 8);
+        buff[8] = (uint8_t)(id >> 16);
+        buff[9] = (uint8_t)(id >> 24);
+        buff[10] = whichBus;
+        buff[11] = mode;
+        buff[12] = pid;
+        buff[13] = (uint8_t)(value & 0xFF);
+        buff[14] = (uint8_t)(value >> 8);
+        buff[15] = (uint8_t)(value >> 16);
+        buff[16] = (uint8_t)(value >> 24);
+        buff[17] = length;
+        memcpy(buff + 18, data, length);
+        if (serialBufferLength + 18 + length > SER_BUFF_SIZE) {
+            SerialUSB.write(serialBuffer, serialBufferLength);
+            serialBufferLength = 0;
+            lastFlushMicros = micros();
+            Latency::flushed(LAT_USB);
+        }
+        memcpy(serialBuffer + serialBufferLength, buff, 18 + length);
+        serialBufferLength += 18 + length;
+    } else {
+        SerialUSB.print(timestamp);
+        SerialUSB.print(" - ");
+        SerialUSB.print(id, HEX);
+        SerialUSB.print(" OBD ");
+        SerialUSB.print(mode, HEX);
+        SerialUSB.print(" ");
+        SerialUSB.print(pid, HEX);
+        SerialUSB.print(" = ");
+        SerialUSB.println(value / 100.0, 2);
+    }
+}
+
+//OBD value to the log file. Same layout as sendObdValueToUSB after the timestamp and id, see sendPduToFile.
+void sendObdValueToFile(uint8_t whichBus, uint32_t id, uint8_t mode, uint8_t pid, int32_t value, uint8_t *data, uint8_t length, uint32_t timestamp)
+{
+    uint8_t buff[48];
+
+    if (length > 5) length = 5;
+    if (settings.fileOutputType == BINARYFILE) {
+        if (id > 0x7FF) id |= 1 << 31;
+        buff[0] = (uint8_t)(timestamp & 0xFF);
+        buff[1] = (uint8_t)(timestamp >> 8);
+        buff[2] = (uint8_t)(timestamp >> 16);
+        buff[3] = (uint8_t)(timestamp >> 24);
+        buff[4] = (uint8_t)(id & 0xFF);
+        buff[5] = (uint8_t)(id >> 8);
+        buff[6] = (uint8_t)(id >> 16);
+        buff[7] = (uint8_t)(id >> 24);
+        buff[8] = 0x0F | (PDU_OBD << 4);
+        buff[9] = whichBus;
+        buff[10] = 7 + length;
+        buff[11] = 0;
+        buff[12] = mode;
+        buff[13] = pid;
+        buff[14] = (uint8_t)(value & 0xFF);
+        buff[15] = (uint8_t)(value >> 8);
+        buff[16] = (uint8_t)(value >> 16);
+        buff[17] = (uint8_t)(value >> 24);
+        buff[18] = length;
+        memcpy(buff + 19, data, length);
+        Logger::fileRaw(buff, 19 + length);
+    } else if (settings.fileOutputType == GVRET || settings.fileOutputType == CRTD) {
+        if (settings.fileOutputType == GVRET) sprintf((char *)buff, "OBD,%i,%x,%i,%x,%x,%i\r\n", timestamp / 1000, id, whichBus, mode, pid, value);
+        else sprintf((char *)buff, "%f CEV OBD %x %i %x %x %i\r\n", timestamp / 1000000.0f, id, whichBus, mode, pid, value);
+        Logger::fileRaw(buff, strlen((char *)buff));
+    }
+}
+
+/*
+ * Decoded signal values from one frame. Binary mode sends
+ * 0xF1 37 timestamp(4) id(4, bit 31 set if extended) bus count then index, raw value(4) for each signal
+ * The host has the table so it does the scaling. Text mode prints the scaled values.
+ */
+void sendSignalsToUSB(uint8_t whichBus, uint32_t id, boolean extended, SIGNAL_VALUE *values, uint8_t count, uint32_t timestamp)
+{
+    uint8_t buff[12 + SIGNAL_MAX_PER_FRAME * 5];
+    int len = 12;
+    uint32_t hostStamp;
+
+    if (SysSettings.lawicelMode) return;
+    if (settings.useBinarySerialComm) {
+        if (extended) id |= 1 << 31;
+        hostStamp = ClockSync::toHost(timestamp);
+        buff[0] = 0xF1;
+        buff[1] = PROTO_SIGNAL_VALUES;
+        buff[2] = (uint8_t)(hostStamp & 0xFF);
+        buff[3] = (uint8_t)(hostStamp >> 8);
+        buff[4] = (uint8_t)(hostStamp >> 16);
+        buff[5] = (uint8_t)(hostStamp >> 24);
+        buff[6] = (uint8_t)(id & 0xFF);
+        buff[7] = (uint8_t)(id >> 8);
+        buff[8] = (uint8_t)(id >> 16);
+        buff[9] = (uint8_t)(id >> 24);
+        buff[10] = whichBus;
+        buff[11] = count;
+        for (int v = 0; v < count; v++) {
+            buff[len++] = values[v].idx;
+            buff[len++] = (uint8_t)(values[v].raw & 0xFF);
+            buff[len++] = (uint8_t)(values[v].raw >> 8);
+            buff[len++] = (uint8_t)(values[v].raw >> 16);
+            buff[len++] = (uint8_t)(values[v].raw >> 24);
+        }
+        if (serialBufferLength + len > SER_BUFF_SIZE) {
+            SerialUSB.write(serialBuffer, serialBufferLength);
+            serialBufferLength = 0;
+            lastFlushMicros = micros();
+            Latency::flushed(LAT_USB);
+        }
+        memcpy(serialBuffer + serialBufferLength, buff, len);
+        serialBufferLength += len;
+    } else {
+        SerialUSB.print(timestamp);
+        SerialUSB.print(" - ");
+        SerialUSB.print(id, HEX);
+        SerialUSB.print(" SIG ");
+        SerialUSB.print(whichBus);
+        for (int v = 0; v < count; v++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(values[v].idx);
+            SerialUSB.print("=");
+            SerialUSB.print(values[v].value, 3);
+        }
+        SerialUSB.println();
+    }
+}
+
+//Decoded signal values to the log file. Binary files get the same index / raw value pairs as USB in a PDU_SIGNAL record.
+void sendSignalsToFile(uint8_t whichBus, uint32_t id, boolean extended, SIGNAL_VALUE *values, uint8_t count, uint32_t timestamp)
+{
+    uint8_t buff[SIGNAL_MAX_PER_FRAME * 5];
+    int len = 0;
+
+    if (settings.fileOutputType == BINARYFILE) {
+        for (int v = 0; v < count; v++) {
+            buff[len++] = values[v].idx;
+            buff[len++] = (uint8_t)(values[v].raw & 0xFF);
+            buff[len++] = (uint8_t)(values[v].raw >> 8);
+            buff[len++] = (uint8_t)(values[v].raw >> 16);
+            buff[len++] = (uint8_t)(values[v].raw >> 24);
+        }
+        sendPduToFile(PDU_SIGNAL, whichBus, id, extended, buff, len, timestamp);
+    } else if (settings.fileOutputType == GVRET || settings.fileOutputType == CRTD) {
+        if (settings.fileOutputType == GVRET) sprintf((char *)buff, "SIG,%i,%x,%i,%i", timestamp / 1000, id, extended, whichBus);
+        else sprintf((char *)buff, "%f CEV SIG %x %i", timestamp / 1000000.0f, id, whichBus);
+        Logger::fileRaw(buff, strlen((char *)buff));
+        for (int v = 0; v < count; v++) {
+            sprintf((char *) buff, (settings.fileOutputType == GVRET) ? ",%i,%f" : " %i %f", values[v].idx, values[v].value);
+            Logger::fileRaw(buff, strlen((char *)buff));
+        }
+        buff[0] = '\r';
+        buff[1] = '\n';
+        Logger::fileRaw(buff, 2);
     }
 }
 
+/*
+ * LIN part of PROTO_SET_EXT_BUSES. Same encoding as the CAN buses: bit 31 says bit 30 holds the
+ * enable flag, the low 20 bits are the speed and 0 turns the bus off.
+ */
+void setupLinFromHost(uint8_t port, uint32_t value)
+{
+    boolean enabled = true;
+    uint32_t speed;
+
+    if (value == 0) enabled = false;
+    else if (value & 0x80000000) enabled = (value & 0x40000000) ? true : false;
+    speed = value & 0xFFFFF;
+    if (speed > 20000) speed = 20000;
+    if (speed >= 1000) {
+        if (port == 0) settings.LIN1Speed = speed;
+        else settings.LIN2Speed = speed;
+    }
+    if (port == 0) settings.LIN1_Enabled = enabled;
+    else settings.LIN2_Enabled = enabled;
+    if (enabled) LinBus::begin(port, (port == 0) ? settings.LIN1Speed : settings.LIN2Speed);
+    else LinBus::end(port);
+}
+
 void processDigToggleFrame(CAN_FRAME &frame)
 {
     bool gotFrame = false;
@@ -619,6 +1079,266 @@ void sendDigToggleMsg()
     }
 }
 
+/*
+ * Reply to PROTO_GET_PROFILE with the loop profiler statistics. See Profiler::encodeReport
+ * for the layout. There is no checksum, same as the other immediate replies.
+ */
+void sendProfileReport()
+{
+    uint8_t buff[2 + 2 + PROF_NUM_STAGES * (16 + PROF_HIST_BUCKETS * 2)];
+    int len;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_PROFILE;
+    len = Profiler::encodeReport(buff + 2, sizeof(buff) - 2);
+    SerialUSB.write(buff, len + 2);
+}
+
+/*
+ * Reply to PROTO_GET_STATUS with controller status, error counters and buffer overruns.
+ * See SysHealth::encodeStatus for the layout.
+ */
+void sendStatusReport()
+{
+    uint8_t buff[2 + 1 + (NUM_BUSES * 20) + 8];
+    int len;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_STATUS;
+    len = SysHealth::encodeStatus(buff + 2, sizeof(buff) - 2);
+    SerialUSB.write(buff, len + 2);
+}
+
+/*
+ * Reply to PROTO_GET_LATENCY with the receive to USB/SD latency histograms.
+ * See Latency::encodeReport for the layout.
+ */
+void sendLatencyReport()
+{
+    uint8_t buff[2 + 2 + LAT_NUM_SINKS * 4 * (5 + LAT_HIST_BUCKETS)];
+    int len;
+
+    buff[0] = 0xF1;
+    buff[1] = PROTO_GET_LATENCY;
+    len = Latency::encodeReport(buff + 2, sizeof(buff) - 2);
+    SerialUSB.write(buff, len + 2);
+}
+
+/*
+ * Build a little endian 32 bit value out of a received payload
+ */
+uint32_t payloadToUInt32(uint8_t *data)
+{
+    return data[0] + (data[1] << 8) + (data[2] << 16) + ((uint32_t)data[3] << 24);
+}
+
+//Little endian IEEE 754 single
+float payloadToFloat(uint8_t *data)
+{
+    uint32_t bits = payloadToUInt32(data);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/*
+ * Number of payload bytes that follow a command which is collected whole before being handled.
+ * Zero for commands that are handled byte by byte in loop().
+ */
+int payloadLengthFor(uint8_t cmd)
+{
+    switch (cmd) {
+    case PROTO_PERIODIC_SET:
+        return 27;
+    case PROTO_PERIODIC_DATA:
+        return 10;
+    case PROTO_PERIODIC_CLEAR:
+        return 1;
+    case PROTO_PERIODIC_CONTROL:
+        return 1;
+    case PROTO_REWRITE_SET:
+        return 14;
+    case PROTO_REWRITE_CLEAR:
+        return 1;
+    case PROTO_REWRITE_STATS:
+        return 1;
+    case PROTO_ISOTP_OPEN:
+        return 14;
+    case PROTO_ISOTP_CLOSE:
+        return 1;
+    case PROTO_OBD_POLL_SET:
+        return 7;
+    case PROTO_OBD_POLL_CONTROL:
+        return 2;
+    case PROTO_J1939_STATS:
+        return 1;
+    case PROTO_SIGNAL_SET:
+        return 17;
+    case PROTO_SIGNAL_CLEAR:
+        return 1;
+    case PROTO_SIGNAL_CONTROL:
+        return 2;
+    case PROTO_CLOCK_SYNC:
+        return 18;
+    }
+    return 0;
+}
+
+/*
+ * Handle a command whose payload has been collected by the COLLECT_PAYLOAD state.
+ *
+ * PROTO_PERIODIC_SET: index, bus, id(4, bit 31 = extended), period us(4), offset us(4), length, data(8),
+ *                     counter byte, counter mask, checksum byte, checksum type (0xFF = no counter/checksum byte)
+ * PROTO_PERIODIC_DATA: index, length, data(8) - replace payload only
+ * PROTO_PERIODIC_CLEAR: index, or 0xFF for the whole table
+ * PROTO_PERIODIC_CONTROL: 0 = stop, 1 = start, anything else just asks.
+ *                         Replies 0xF1 22 running count
+ * PROTO_REWRITE_SET: index, directions, id(4, bit 31 = extended), action, byte, mask, value,
+ *                    counter byte, counter mask, checksum byte, checksum type (0xFF = no counter/checksum byte)
+ * PROTO_REWRITE_CLEAR: index, or 0xFF for all rules
+ * PROTO_REWRITE_STATS: nonzero clears the hit counters after replying.
+ *                      Replies 0xF1 25 count then index, hits(4) for each rule
+ * PROTO_ISOTP_OPEN: channel, bus, tx id(4, bit 31 = extended), rx id(4, bit 31 = extended), block size,
+ *                   STmin, flags, pad byte
+ * PROTO_ISOTP_CLOSE: channel
+ * PROTO_OBD_POLL_SET: index, mode, PID, period ms(4). A period of 0 clears the entry, or the whole table for index 0xFF.
+ *                     The PID is ignored for modes 03, 07 and 0A, mode 04 is refused
+ * PROTO_OBD_POLL_CONTROL: 0 = stop, 1 = start, anything else just asks, then the load budget % (0 = leave it).
+ *                         Replies 0xF1 34 running count budget
+ * PROTO_J1939_STATS: nonzero clears the J1939 statistics after replying.
+ *                    Replies 0xF1 36 count then PGN(3), frames(4) for each PGN seen
+ * PROTO_SIGNAL_SET: index, bus (0xFF = any), id(4, bit 31 = extended), start bit, length, flags (SIG_BIG_ENDIAN,
+ *                   SIG_SIGNED), scale(float), offset(float)
+ * PROTO_SIGNAL_CLEAR: index, or 0xFF for the whole table
+ * PROTO_SIGNAL_CONTROL: output (SIGNAL_OUTPUT, anything above just asks), keep raw frames.
+ *                       Replies 0xF1 40 output count keepraw
+ * PROTO_CLOCK_SYNC: seq, flags (CLOCK_HOST_TIME, CLOCK_RESET), host send time us(8), host receive time of the
+ *                   previous reply us(8, 0 = lost). Replies 0xF1 41 seq status, see ClockSync::exchange
+ */
+void handleProtoPayload(uint8_t cmd, uint8_t *data, int len)
+{
+    CAN_FRAME frame;
+    uint8_t reply[3 + J1939_MAX_PGNS * 7]; //big enough for the longest reply, J1939 or rewrite stats
+    uint32_t id, temp;
+    int replyLen;
+
+    switch (cmd) {
+    case PROTO_PERIODIC_SET:
+        frame.id = payloadToUInt32(data + 2);
+        frame.extended = (frame.id & 0x80000000) ? true : false;
+        frame.id &= 0x7FFFFFFF;
+        frame.length = data[14];
+        if (frame.length > 8) frame.length = 8;
+        for (int b = 0; b < 8; b++) frame.data.bytes[b] = data[15 + b];
+        if (!PeriodicTx::setEntry(data[0], data[1], frame, payloadToUInt32(data + 6), payloadToUInt32(data + 10),
+                                  data[23], data[24], data[25], data[26])) {
+            Logger::debug("Rejected periodic entry %i", data[0]);
+        }
+        break;
+    case PROTO_PERIODIC_DATA:
+        PeriodicTx::setData(data[0], data[1], data + 2);
+        break;
+    case PROTO_PERIODIC_CLEAR:
+        if (data[0] == 0xFF) PeriodicTx::clearAll();
+        else PeriodicTx::clearEntry(data[0]);
+        break;
+    case PROTO_PERIODIC_CONTROL:
+        if (data[0] == 0) PeriodicTx::stop();
+        if (data[0] == 1) PeriodicTx::start();
+        reply[0] = 0xF1;
+        reply[1] = PROTO_PERIODIC_CONTROL;
+        reply[2] = PeriodicTx::isRunning() ? 1 : 0;
+        reply[3] = PeriodicTx::activeCount();
+        SerialUSB.write(reply, 4);
+        break;
+    case PROTO_REWRITE_SET:
+        id = payloadToUInt32(data + 2);
+        if (!RewriteRules::setRule(data[0], data[1], id & 0x7FFFFFFF, (id & 0x80000000) ? true : false, data[6], data[7],
+                                   data[8], data[9], data[10], data[11], data[12], data[13])) {
+            Logger::debug("Rejected rewrite rule %i", data[0]);
+        }
+        break;
+    case PROTO_REWRITE_CLEAR:
+        if (data[0] == 0xFF) RewriteRules::clearAll();
+        else RewriteRules::clearRule(data[0]);
+        break;
+    case PROTO_REWRITE_STATS:
+        reply[0] = 0xF1;
+        reply[1] = PROTO_REWRITE_STATS;
+        replyLen = RewriteRules::encodeHits(reply + 2, sizeof(reply) - 2);
+        SerialUSB.write(reply, replyLen + 2);
+        if (data[0]) RewriteRules::resetHits();
+        break;
+    case PROTO_ISOTP_OPEN:
+        id = payloadToUInt32(data + 2);
+        temp = payloadToUInt32(data + 6);
+        if (!IsoTp::openChannel(data[0], data[1], id & 0x7FFFFFFF, (id & 0x80000000) ? true : false, temp & 0x7FFFFFFF,
+                                (temp & 0x80000000) ? true : false, data[10], data[11], data[12], data[13])) {
+            Logger::debug("Rejected ISO-TP channel %i", data[0]);
+        }
+        break;
+    case PROTO_ISOTP_CLOSE:
+        IsoTp::closeChannel(data[0]);
+        break;
+    case PROTO_OBD_POLL_SET:
+        temp = payloadToUInt32(data + 3);
+        if (temp == 0) {
+            if (data[0] == 0xFF) ObdPoller::clearAll();
+            else ObdPoller::clearEntry(data[0]);
+        } else if (!ObdPoller::setEntry(data[0], data[1], data[2], temp)) {
+            Logger::debug("Rejected OBD poll entry %i", data[0]);
+        }
+        break;
+    case PROTO_OBD_POLL_CONTROL:
+        if (data[1] > 0) ObdPoller::setBudget(data[1]);
+        if (data[0] == 0) ObdPoller::stop();
+        if (data[0] == 1) ObdPoller::start();
+        reply[0] = 0xF1;
+        reply[1] = PROTO_OBD_POLL_CONTROL;
+        reply[2] = ObdPoller::isRunning() ? 1 : 0;
+        reply[3] = ObdPoller::activeCount();
+        reply[4] = ObdPoller::getBudget();
+        SerialUSB.write(reply, 5);
+        break;
+    case PROTO_J1939_STATS:
+        reply[0] = 0xF1;
+        reply[1] = PROTO_J1939_STATS;
+        replyLen = J1939::encodeStats(reply + 2, sizeof(reply) - 2);
+        SerialUSB.write(reply, replyLen + 2);
+        if (data[0]) J1939::resetStats();
+        break;
+    case PROTO_SIGNAL_SET:
+        id = payloadToUInt32(data + 2);
+        if (!SignalDecoder::setSignal(data[0], data[1], id & 0x7FFFFFFF, (id & 0x80000000) ? true : false, data[6], data[7],
+                                      data[8], payloadToFloat(data + 9), payloadToFloat(data + 13))) {
+            Logger::debug("Rejected signal %i", data[0]);
+        }
+        break;
+    case PROTO_SIGNAL_CLEAR:
+        if (data[0] == 0xFF) SignalDecoder::clearAll();
+        else SignalDecoder::clearSignal(data[0]);
+        break;
+    case PROTO_SIGNAL_CONTROL:
+        if (data[0] <= SIG_OUT_CHANGES) {
+            SignalDecoder::setOutput(data[0]);
+            SignalDecoder::setKeepRaw(data[1] ? true : false);
+        }
+        reply[0] = 0xF1;
+        reply[1] = PROTO_SIGNAL_CONTROL;
+        reply[2] = SignalDecoder::getOutput();
+        reply[3] = SignalDecoder::signalCount();
+        reply[4] = SignalDecoder::keepRaw() ? 1 : 0;
+        SerialUSB.write(reply, 5);
+        break;
+    case PROTO_CLOCK_SYNC:
+        reply[0] = 0xF1;
+        reply[1] = PROTO_CLOCK_SYNC;
+        replyLen = ClockSync::exchange(data, reply + 2, sizeof(reply) - 2);
+        SerialUSB.write(reply, replyLen + 2);
+        break;
+    }
+}
+
 /*
 Loop executes as often as possible all the while interrupts fire in the background.
 The serial comm protocol is as follows:
@@ -637,6 +1357,10 @@ void loop()
     CAN_FRAME incoming;
     static CAN_FRAME build_out_frame;
     static int out_bus;
+    static uint8_t out_priority;
+    static uint8_t payload[PROTO_MAX_PAYLOAD];
+    static uint8_t payloadCmd;
+    static int payloadLen;
     int in_byte;
     static byte buff[20];
     static int step = 0;
@@ -649,20 +1373,28 @@ void loop()
     bool isConnected = false;
     int serialCnt;
     uint32_t now = micros();
+    uint32_t rxTime;
+    boolean keepRaw;
+    boolean haveFrame;
+    uint8_t linBus;
+    PROFILE_BEGIN(loopStart);
+    PROFILE_BEGIN(stageStart);
 
     if (millis() > (busLoadTimer + 250)) {
         busLoadTimer = millis();
-        busLoad[0].busloadPercentage = ((busLoad[0].busloadPercentage * 3) + (((busLoad[0].bitsSoFar * 1000) / busLoad[0].bitsPerQuarter) / 10)) / 4;
-        busLoad[1].busloadPercentage = ((busLoad[1].busloadPercentage * 3) + (((busLoad[1].bitsSoFar * 1000) / busLoad[1].bitsPerQuarter) / 10)) / 4;
-        //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
-        if (busLoad[0].busloadPercentage == 0 && busLoad[0].bitsSoFar > 0) busLoad[0].busloadPercentage = 1;
-        if (busLoad[1].busloadPercentage == 0 && busLoad[1].bitsSoFar > 0) busLoad[1].busloadPercentage = 1;
+        for (int b = 0; b < 3; b++) {
+            if (busLoad[b].bitsPerQuarter == 0) busLoad[b].busloadPercentage = 0;
+            else busLoad[b].busloadPercentage = ((busLoad[b].busloadPercentage * 3) + (((busLoad[b].bitsSoFar * 1000) / busLoad[b].bitsPerQuarter) / 10)) / 4;
+            //Force busload percentage to be at least 1% if any traffic exists at all. This forces the LED to light up for any traffic.
+            if (busLoad[b].busloadPercentage == 0 && busLoad[b].bitsSoFar > 0) busLoad[b].busloadPercentage = 1;
+            busLoad[b].bitsSoFar = 0;
+        }
         busLoad[0].bitsPerQuarter = settings.CAN0Speed / 4;
         busLoad[1].bitsPerQuarter = settings.CAN1Speed / 4;
-        busLoad[0].bitsSoFar = 0;
-        busLoad[1].bitsSoFar = 0;
-        if (busLoad[0].busloadPercentage > busLoad[1].busloadPercentage) updateBusloadLED(busLoad[0].busloadPercentage);
-        else updateBusloadLED(busLoad[1].busloadPercentage);
+        busLoad[2].bitsPerQuarter = settings.SWCAN_Enabled ? settings.SWCANSpeed / 4 : 0;
+        int busiest = 0;
+        for (int b = 1; b < 3; b++) if (busLoad[b].busloadPercentage > busLoad[busiest].busloadPercentage) busiest = b;
+        updateBusloadLED(busLoad[busiest].busloadPercentage);
     }
 
     /*if (SerialUSB)*/ isConnected = true;
@@ -684,30 +1416,92 @@ void loop()
 
     //if (!SysSettings.lawicelMode || SysSettings.lawicelAutoPoll || SysSettings.lawicelPollCounter > 0)
     //{
-    if (Can0.available() > 0) {
-        Can0.read(incoming);
+    PROFILE_RESTART(stageStart);
+    //while the gateway is forwarding a bus it takes the frames out of the driver and buffers them itself.
+    //Frames caught while booting come out of FastBoot first.
+    haveFrame = FastBoot::read(0, incoming, rxTime);
+    if (!haveFrame && !FastBoot::busy() && (Gateway::read(0, incoming) || (Can0.available() > 0 && Can0.read(incoming)))) {
+        rxTime = canTimestampToMicros(Can0, incoming.time, settings.CAN0Speed);
+        haveFrame = true;
+    }
+    if (haveFrame) {
         addBits(0, incoming);
         toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 0);
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 0);
+        keepRaw = !IsoTpSniffer::handleFrame(0, incoming, rxTime) || IsoTpSniffer::keepRaw();
+        if (J1939::handleFrame(0, incoming, rxTime) && !J1939::keepRaw()) keepRaw = false;
+        if (SignalDecoder::handleFrame(0, incoming, rxTime) && !SignalDecoder::keepRaw()) keepRaw = false;
+        if (keepRaw) {
+            if (isConnected) sendFrameToUSB(incoming, 0, rxTime);
+            if (SysSettings.logToFile && sendFrameToFile(incoming, 0, rxTime)) Latency::queued(LAT_SD, rxTime);
+        }
+        FrameGenerator::checkTrigger(incoming);
+        IsoTp::handleFrame(0, incoming);
+        PidCache::observe(incoming);
+        ObdPoller::handleFrame(incoming, rxTime);
+        elmEmulator.handleCANFrame(incoming);
         if (digToggleSettings.enabled && (digToggleSettings.mode & 1) && (digToggleSettings.mode & 2)) processDigToggleFrame(incoming);
     }
 
-    if (Can1.available() > 0) {
-        Can1.read(incoming);
+    haveFrame = FastBoot::read(1, incoming, rxTime);
+    if (!haveFrame && !FastBoot::busy() && (Gateway::read(1, incoming) || (Can1.available() > 0 && Can1.read(incoming)))) {
+        rxTime = canTimestampToMicros(Can1, incoming.time, settings.CAN1Speed);
+        haveFrame = true;
+    }
+    if (haveFrame) {
         addBits(1, incoming);
         toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 1);
+        keepRaw = !IsoTpSniffer::handleFrame(1, incoming, rxTime) || IsoTpSniffer::keepRaw();
+        if (J1939::handleFrame(1, incoming, rxTime) && !J1939::keepRaw()) keepRaw = false;
+        if (SignalDecoder::handleFrame(1, incoming, rxTime) && !SignalDecoder::keepRaw()) keepRaw = false;
+        if (keepRaw) {
+            if (isConnected) sendFrameToUSB(incoming, 1, rxTime);
+            if (SysSettings.logToFile && sendFrameToFile(incoming, 1, rxTime)) Latency::queued(LAT_SD, rxTime);
+        }
         if (digToggleSettings.enabled && (digToggleSettings.mode & 1) && (digToggleSettings.mode & 4)) processDigToggleFrame(incoming);
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 1);
+        FrameGenerator::checkTrigger(incoming);
+        IsoTp::handleFrame(1, incoming);
     }
     
-    if (SWCAN.GetRXFrame(incoming)) {
+    if (SwcanRx::read(incoming, rxTime)) {
+        addBits(2, incoming);
         toggleRXLED();
-        if (isConnected) sendFrameToUSB(incoming, 2);
+        keepRaw = !IsoTpSniffer::handleFrame(2, incoming, rxTime) || IsoTpSniffer::keepRaw();
+        if (J1939::handleFrame(2, incoming, rxTime) && !J1939::keepRaw()) keepRaw = false;
+        if (SignalDecoder::handleFrame(2, incoming, rxTime) && !SignalDecoder::keepRaw()) keepRaw = false;
+        if (keepRaw) {
+            if (isConnected) sendFrameToUSB(incoming, 2, rxTime);
+            if (SysSettings.logToFile && sendFrameToFile(incoming, 2, rxTime)) Latency::queued(LAT_SD, rxTime);
+        }
         //TODO: Maybe support digital toggle system on swcan too.
-        if (SysSettings.logToFile) sendFrameToFile(incoming, 2);      
+        FrameGenerator::checkTrigger(incoming);
+        IsoTp::handleFrame(2, incoming);
+    }
+
+    if (LinBus::read(linBus, incoming, rxTime)) {
+        toggleRXLED();
+        keepRaw = !SignalDecoder::handleFrame(linBus, incoming, rxTime) || SignalDecoder::keepRaw();
+        if (keepRaw) {
+            if (isConnected) sendFrameToUSB(incoming, linBus, rxTime);
+            if (SysSettings.logToFile && sendFrameToFile(incoming, linBus, rxTime)) Latency::queued(LAT_SD, rxTime);
+        }
     }
+    PROFILE_END(PROF_CAN_RX, stageStart);
+
+    PeriodicTx::loop();
+    LogReplay::loop();
+    FrameGenerator::loop();
+    BatchTx::loop();
+    IsoTp::loop();
+    IsoTpSniffer::loop();
+    ObdPoller::loop();
+    J1939::loop();
+    LinBus::loop();
+    SwcanRx::loop();
+    FastBoot::loop();
+    ClockSync::loop();
+    SettingsStore::loop();
+    EEPROM.loop();
+    for (int q = 0; q < 3; q++) txQueues[q].service();
 
     
     if (SysSettings.lawicelPollCounter > 0) SysSettings.lawicelPollCounter--;
@@ -737,12 +1531,16 @@ void loop()
 
     if (micros() - lastFlushMicros > SER_BUFF_FLUSH_INTERVAL) {
         if (serialBufferLength > 0) {
+            PROFILE_RESTART(stageStart);
             SerialUSB.write(serialBuffer, serialBufferLength);
             serialBufferLength = 0;
             lastFlushMicros = micros();
+            Latency::flushed(LAT_USB);
+            PROFILE_END(PROF_USB_FLUSH, stageStart);
         }
     }
 
+    PROFILE_RESTART(stageStart);
     serialCnt = 0;
     while (isConnected && (SerialUSB.available() > 0) && serialCnt < 128) {
         serialCnt++;
@@ -765,7 +1563,7 @@ void loop()
                 buff[0] = 0xF1;
                 step = 0;
                 break;
-            case PROTO_TIME_SYNC:
+            case PROTO_TIME_SYNC: //one shot, kept for older hosts. PROTO_CLOCK_SYNC tracks offset and drift
                 state = TIME_SYNC;
                 step = 0;
                 buff[0] = 0xF1;
@@ -873,7 +1671,7 @@ void loop()
             case PROTO_GET_NUMBUSES:
                 buff[0] = 0xF1;
                 buff[1] = 12;
-                buff[2] = 3; //number of buses actually supported by this hardware (TODO: will be 5 eventually)
+                buff[2] = 5; //number of buses actually supported by this hardware
                 SerialUSB.write(buff, 3);            
                 state = IDLE;
                 break;
@@ -903,6 +1701,56 @@ void loop()
                 step = 0;
                 buff[0] = 0xF1;      
                 break;
+            case PROTO_GET_PROFILE:
+                sendProfileReport();
+                state = IDLE;
+                break;
+            case PROTO_GET_STATUS:
+                sendStatusReport();
+                state = IDLE;
+                break;
+            case PROTO_GET_LATENCY:
+                sendLatencyReport();
+                state = IDLE;
+                break;
+            case PROTO_TX_EVENT:
+                state = SET_TX_EVENTS;
+                break;
+            case PROTO_PERIODIC_SET:
+            case PROTO_PERIODIC_DATA:
+            case PROTO_PERIODIC_CLEAR:
+            case PROTO_PERIODIC_CONTROL:
+            case PROTO_REWRITE_SET:
+            case PROTO_REWRITE_CLEAR:
+            case PROTO_REWRITE_STATS:
+            case PROTO_ISOTP_OPEN:
+            case PROTO_ISOTP_CLOSE:
+            case PROTO_OBD_POLL_SET:
+            case PROTO_OBD_POLL_CONTROL:
+            case PROTO_J1939_STATS:
+            case PROTO_SIGNAL_SET:
+            case PROTO_SIGNAL_CLEAR:
+            case PROTO_SIGNAL_CONTROL:
+                payloadCmd = in_byte;
+                payloadLen = payloadLengthFor(in_byte);
+                step = 0;
+                state = COLLECT_PAYLOAD;
+                break;
+            case PROTO_CLOCK_SYNC:
+                ClockSync::requestReceived(); //as close to arrival as we can get, the rest of the request comes after
+                payloadCmd = in_byte;
+                payloadLen = payloadLengthFor(in_byte);
+                step = 0;
+                state = COLLECT_PAYLOAD;
+                break;
+            case PROTO_BATCH_TX:
+                BatchTx::begin();
+                state = COLLECT_BATCH;
+                break;
+            case PROTO_ISOTP_SEND:
+                IsoTp::beginCollect();
+                state = COLLECT_ISOTP;
+                break;
             }
             break;
         case BUILD_CAN_FRAME:
@@ -926,6 +1774,7 @@ void loop()
                 break;
             case 4:
                 out_bus = in_byte & 3;
+                out_priority = (in_byte >> 4) & 0xF; //upper nibble is an optional TX priority, 0 = none
                 break;
             case 5:
                 build_out_frame.length = in_byte & 0xF;
@@ -954,9 +1803,7 @@ void loop()
                     }
                     */
                     build_out_frame.rtr = 0;
-                    if (out_bus == 0) sendFrame(&Can0, build_out_frame);
-                    if (out_bus == 1) sendFrame(&Can1, build_out_frame);
-                    if (out_bus == 2) sendFrame(&SWCAN, build_out_frame);
+                    queueFrame(out_bus, build_out_frame, out_priority);
                     /*
                     if (settings.singleWireMode == 1)
                     		   {
@@ -1073,7 +1920,7 @@ void loop()
                 }
                 state = IDLE;
                 //now, write out the new canbus settings to EEPROM
-                EEPROM.write(EEPROM_ADDR, settings);
+                SettingsStore::save();
                 setPromiscuousMode();
                 break;
             }
@@ -1083,12 +1930,12 @@ void loop()
             if (in_byte == 0x10) {
             } else {
             }
-            EEPROM.write(EEPROM_ADDR, settings);
+            SettingsStore::save();
             state = IDLE;
             break;
         case SET_SYSTYPE:
             settings.sysType = in_byte;
-            EEPROM.write(EEPROM_ADDR, settings);
+            SettingsStore::save();
             loadSettings();
             state = IDLE;
             break;
@@ -1128,7 +1975,7 @@ void loop()
                     //if (temp8 == in_byte)
                     //{
                     toggleRXLED();
-                    if (isConnected) sendFrameToUSB(build_out_frame, 0);
+                    if (isConnected) sendFrameToUSB(build_out_frame, 0, micros());
                     //}
                 }
                 break;
@@ -1191,29 +2038,7 @@ void loop()
                 break;
             case 7:
                 build_int |= in_byte << 24;
-                /* FIX THIS UP TO INITIALIZE LIN1
-                if (build_int > 0) {
-                    if (build_int & 0x80000000) { //signals that enabled and listen only status are also being passed
-                        if (build_int & 0x40000000) {
-                            settings.CAN1_Enabled = true;
-                            Can1.enable();
-                        } else {
-                            settings.CAN1_Enabled = false;
-                            Can1.disable();
-                        }
-                    } else {
-                        Can1.enable(); //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.CAN1_Enabled = true;
-                    }
-                    build_int = build_int & 0xFFFFF;
-                    if (build_int > 1000000) build_int = 1000000;
-                    Can1.begin(build_int, 255);
-                    //Can1.set_baudrate(build_int);
-                    settings.CAN1Speed = build_int;
-                } else { //disable second canbus
-                    Can1.disable();
-                    settings.CAN1_Enabled = false;
-                }*/
+                setupLinFromHost(0, build_int);
                 break;
             case 8:
                 build_int = in_byte;
@@ -1226,40 +2051,44 @@ void loop()
                 break;
             case 11:
                 build_int |= in_byte << 24;
-                /* FIX THIS UP TO INITIALIZE LIN2
-                if (build_int > 0) {
-                    if (build_int & 0x80000000) { //signals that enabled and listen only status are also being passed
-                        if (build_int & 0x40000000) {
-                            settings.CAN1_Enabled = true;
-                            Can1.enable();
-                        } else {
-                            settings.CAN1_Enabled = false;
-                            Can1.disable();
-                        }
-                    } else {
-                        Can1.enable(); //if not using extended status mode then just default to enabling - this was old behavior
-                        settings.CAN1_Enabled = true;
-                    }
-                    build_int = build_int & 0xFFFFF;
-                    if (build_int > 1000000) build_int = 1000000;
-                    Can1.begin(build_int, 255);
-                    //Can1.set_baudrate(build_int);
-                    settings.CAN1Speed = build_int;
-                } else { //disable second canbus
-                    Can1.disable();
-                    settings.CAN1_Enabled = false;
-                } */
+                setupLinFromHost(1, build_int);
                 state = IDLE;
                 //now, write out the new canbus settings to EEPROM
-                EEPROM.write(EEPROM_ADDR, settings);
+                SettingsStore::save();
                 //setPromiscuousMode();
                 break;
             }        
             step++;
             break; 
+        case SET_TX_EVENTS: //one byte, non-zero turns TX complete/failed events on
+            SysSettings.txEvents = (in_byte != 0);
+            state = IDLE;
+            break;
+        case COLLECT_PAYLOAD:
+            payload[step++] = in_byte;
+            if (step >= payloadLen) {
+                state = IDLE;
+                handleProtoPayload(payloadCmd, payload, payloadLen);
+            }
+            break;
+        case COLLECT_BATCH:
+            if (BatchTx::collect(in_byte)) state = IDLE;
+            break;
+        case COLLECT_ISOTP:
+            if (IsoTp::collect(in_byte)) state = IDLE;
+            break;
         }
     }
+    if (serialCnt > 0) PROFILE_END(PROF_SERIAL_IN, stageStart);
+
     Logger::loop();
+    SysHealth::loop();
+    Gateway::loop();
+
+    PROFILE_RESTART(stageStart);
     elmEmulator.loop();
+    PROFILE_END(PROF_ELM, stageStart);
+
+    PROFILE_END(PROF_LOOP, loopStart);
 }
 
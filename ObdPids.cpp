@@ -0,0 +1,78 @@
+/*
+ * ObdPids.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ObdPids.h"
+
+//SAE J1979 formulas, sorted by PID
+static const OBD_PID_DEF obdPids[] = {
+    {0x04, 1, 10000, 255, 0, "Engine load %"},          //A * 100 / 255
+    {0x05, 1, 100, 1, -4000, "Coolant temp C"},         //A - 40
+    {0x06, 1, 10000, 128, -10000, "Short fuel trim 1 %"},   //A * 100 / 128 - 100
+    {0x07, 1, 10000, 128, -10000, "Long fuel trim 1 %"},
+    {0x08, 1, 10000, 128, -10000, "Short fuel trim 2 %"},
+    {0x09, 1, 10000, 128, -10000, "Long fuel trim 2 %"},
+    {0x0A, 1, 300, 1, 0, "Fuel pressure kPa"},          //A * 3
+    {0x0B, 1, 100, 1, 0, "Intake MAP kPa"},             //A
+    {0x0C, 2, 100, 4, 0, "RPM"},                        //(A * 256 + B) / 4
+    {0x0D, 1, 100, 1, 0, "Speed km/h"},                 //A
+    {0x0E, 1, 100, 2, -6400, "Timing advance deg"},     //A / 2 - 64
+    {0x0F, 1, 100, 1, -4000, "Intake temp C"},          //A - 40
+    {0x10, 2, 1, 1, 0, "MAF g/s"},                      //(A * 256 + B) / 100
+    {0x11, 1, 10000, 255, 0, "Throttle %"},             //A * 100 / 255
+    {0x1F, 2, 100, 1, 0, "Run time s"},                 //A * 256 + B
+    {0x21, 2, 100, 1, 0, "Distance with MIL km"},       //A * 256 + B
+    {0x2F, 1, 10000, 255, 0, "Fuel level %"},           //A * 100 / 255
+    {0x33, 1, 100, 1, 0, "Baro pressure kPa"},          //A
+    {0x42, 2, 1, 10, 0, "Module voltage V"},            //(A * 256 + B) / 1000
+    {0x46, 1, 100, 1, -4000, "Ambient temp C"},         //A - 40
+    {0x51, 1, 100, 1, 0, "Fuel type"},                  //A
+    {0x5C, 1, 100, 1, -4000, "Oil temp C"},             //A - 40
+    {0x5E, 2, 5, 1, 0, "Fuel rate L/h"},                //(A * 256 + B) / 20
+    {0x61, 1, 100, 1, -12500, "Demand torque %"},       //A - 125
+    {0x62, 1, 100, 1, -12500, "Actual torque %"},       //A - 125
+    {0x63, 2, 100, 1, 0, "Reference torque Nm"},        //A * 256 + B
+};
+
+const OBD_PID_DEF *obdFindPid(uint8_t pid)
+{
+    for (unsigned int p = 0; p < sizeof(obdPids) / sizeof(obdPids[0]); p++) {
+        if (obdPids[p].pid == pid) return &obdPids[p];
+        if (obdPids[p].pid > pid) break;
+    }
+    return NULL;
+}
+
+//Decode the data bytes of a mode 1 reply (after the mode and PID bytes). False if the PID isn't known or is short.
+boolean obdDecode(uint8_t pid, uint8_t *data, uint8_t length, int32_t &value)
+{
+    const OBD_PID_DEF *def = obdFindPid(pid);
+    int64_t raw = 0;
+
+    if (!def || length < def->length) return false;
+    for (int b = 0; b < def->length; b++) raw = (raw << 8) | data[b];
+    value = (int32_t)((raw * def->mult) / def->div) + def->offset;
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * ObdPids.h
+ *
+ * How to turn the data bytes of standard OBD-II mode 1 PIDs into values.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef OBDPIDS_H_
+#define OBDPIDS_H_
+
+#include <Arduino.h>
+
+/*
+ * value = (raw * mult / div) + offset where raw is the PID's data bytes taken big endian (A*256 + B ...).
+ * Values come out in the PID's usual unit times 100 so one scaled integer covers all of them.
+ */
+typedef struct {
+    uint8_t pid;
+    uint8_t length;     //data bytes (A, B, ...)
+    int32_t mult;
+    int32_t div;
+    int32_t offset;
+    const char *name;
+} OBD_PID_DEF;
+
+const OBD_PID_DEF *obdFindPid(uint8_t pid);
+boolean obdDecode(uint8_t pid, uint8_t *data, uint8_t length, int32_t &value);
+
+#endif /* OBDPIDS_H_ */
@@ -0,0 +1,304 @@
+/*
+ * ObdPoller.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "ObdPoller.h"
+#include "ObdPids.h"
+#include "Logger.h"
+#include "TxQueue.h"
+#include "M2RET.h"
+
+/*
+ * One request is out at a time, the way a scan tool does it, so slow ECUs aren't flooded.
+ * The next one goes to whichever entry is the most overdue once the last one was answered
+ * (or timed out) and the budget gap has passed. The gap is worked out from the bits of a
+ * request plus its reply so the poller on its own never takes more than budgetPercent of CAN0.
+ *
+ * Request and reply layouts depend on the mode:
+ *   01, 05, 06, 08, 09: mode PID           reply 0x40|mode PID data
+ *   02:                 mode PID frame     reply 0x42 PID frame data (always freeze frame 0)
+ *   03, 07, 0A:         mode               reply 0x40|mode data
+ * Mode 04 clears the trouble codes so it is never polled. Only single frame replies are handled.
+ */
+
+extern TxQueue txQueues[];
+
+OBD_POLL_ENTRY ObdPoller::entries[OBDPOLL_MAX_ENTRIES];
+boolean ObdPoller::running = false;
+uint32_t ObdPoller::header = 0x7DF;
+uint8_t ObdPoller::budgetPercent = OBDPOLL_DEFAULT_BUDGET;
+uint32_t ObdPoller::gapMicros = 0;
+uint32_t ObdPoller::nextSendMicros = 0;
+int16_t ObdPoller::lastIdx = -1;
+boolean ObdPoller::waiting = false;
+uint32_t ObdPoller::requestMillis = 0;
+uint32_t ObdPoller::timeouts = 0;
+uint32_t ObdPoller::deferred = 0;
+
+void ObdPoller::setup()
+{
+    running = false;
+    header = 0x7DF;
+    budgetPercent = OBDPOLL_DEFAULT_BUDGET;
+    lastIdx = -1;
+    waiting = false;
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) entries[e].active = false;
+}
+
+uint32_t ObdPoller::calcGap()
+{
+    uint32_t bits = 2 * (41 + 8 * 9); //request and reply are both full 8 byte frames
+    if (header > 0x7FF) bits += 2 * 18;
+    if (settings.CAN0Speed == 0 || budgetPercent == 0) return 0;
+    return (uint32_t)(((uint64_t)bits * 100000000ull) / ((uint64_t)settings.CAN0Speed * budgetPercent));
+}
+
+boolean ObdPoller::start()
+{
+    gapMicros = calcGap();
+    if (gapMicros == 0) {
+        Logger::console("OBD poller needs CAN0 running and a load budget");
+        return false;
+    }
+    uint32_t now = millis();
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) {
+        entries[e].nextDue = now;
+        entries[e].requests = 0;
+        entries[e].replies = 0;
+    }
+    timeouts = deferred = 0;
+    lastIdx = -1;
+    waiting = false;
+    nextSendMicros = micros();
+    running = true;
+    return true;
+}
+
+void ObdPoller::stop()
+{
+    running = false;
+    waiting = false;
+}
+
+boolean ObdPoller::isRunning()
+{
+    return running;
+}
+
+boolean ObdPoller::setEntry(uint8_t idx, uint8_t mode, uint8_t pid, uint32_t periodMs)
+{
+    if (idx >= OBDPOLL_MAX_ENTRIES || periodMs == 0) return false;
+    if (mode == 0 || mode > 0x0A || mode == 4) return false;
+    OBD_POLL_ENTRY &entry = entries[idx];
+    if (lastIdx == idx) lastIdx = -1; //a reply still on its way belongs to the old entry
+    entry.mode = mode;
+    entry.pid = hasPid(mode) ? pid : 0;
+    entry.periodMs = periodMs;
+    entry.nextDue = millis();
+    entry.requests = 0;
+    entry.replies = 0;
+    entry.active = true;
+    return true;
+}
+
+void ObdPoller::clearEntry(uint8_t idx)
+{
+    if (idx >= OBDPOLL_MAX_ENTRIES) return;
+    entries[idx].active = false;
+    if (lastIdx == idx) lastIdx = -1;
+}
+
+void ObdPoller::clearAll()
+{
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) entries[e].active = false;
+    lastIdx = -1;
+}
+
+uint8_t ObdPoller::activeCount()
+{
+    uint8_t count = 0;
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) if (entries[e].active) count++;
+    return count;
+}
+
+void ObdPoller::setBudget(uint8_t percent)
+{
+    if (percent > 100) percent = 100;
+    budgetPercent = percent;
+    gapMicros = calcGap();
+    if (gapMicros == 0) stop();
+}
+
+uint8_t ObdPoller::getBudget()
+{
+    return budgetPercent;
+}
+
+//Functional broadcast (0x7DF / 0x18DB33F1) or one ECU's physical address
+void ObdPoller::setHeader(uint32_t id)
+{
+    header = id;
+    gapMicros = calcGap();
+}
+
+//Modes 03, 04, 07 and 0A (trouble codes) take no PID
+boolean ObdPoller::hasPid(uint8_t mode)
+{
+    return mode != 3 && mode != 4 && mode != 7 && mode != 0x0A;
+}
+
+//Most overdue active entry, -1 if nothing is due yet
+int16_t ObdPoller::pickNext(uint32_t now)
+{
+    int16_t best = -1;
+    int32_t bestLate = -1;
+
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) {
+        if (!entries[e].active) continue;
+        int32_t late = (int32_t)(now - entries[e].nextDue);
+        if (late > bestLate) {
+            bestLate = late;
+            best = e;
+        }
+    }
+    return best;
+}
+
+void ObdPoller::sendRequest(int16_t idx)
+{
+    OBD_POLL_ENTRY &entry = entries[idx];
+    CAN_FRAME frame;
+    uint32_t now = millis();
+
+    frame.id = header;
+    frame.extended = (header > 0x7FF);
+    frame.rtr = 0;
+    frame.length = 8;
+    for (int b = 0; b < 8; b++) frame.data.bytes[b] = 0;
+    frame.data.bytes[1] = entry.mode;
+    if (!hasPid(entry.mode)) frame.data.bytes[0] = 1;
+    else {
+        frame.data.bytes[0] = (entry.mode == 2) ? 3 : 2; //mode 2 also names the freeze frame, 0 is already there
+        frame.data.bytes[2] = entry.pid;
+    }
+    queueFrame(0, frame, 1);
+
+    entry.requests++;
+    entry.nextDue += entry.periodMs;
+    //fell a whole period behind (busy bus or too many PIDs for the budget), don't try to catch up
+    if ((int32_t)(now - entry.nextDue) > 0) entry.nextDue = now + entry.periodMs;
+    lastIdx = idx;
+    waiting = true;
+    requestMillis = now;
+    nextSendMicros = micros() + gapMicros;
+}
+
+void ObdPoller::loop()
+{
+    int16_t idx;
+
+    if (!running) return;
+    if (waiting) {
+        if ((millis() - requestMillis) < OBDPOLL_TIMEOUT_MS) return;
+        waiting = false;
+        timeouts++;
+    }
+    idx = pickNext(millis());
+    if (idx < 0) return;
+    if ((int32_t)(micros() - nextSendMicros) < 0) return;
+    if (txQueues[0].count() >= TX_QUEUE_SIZE / 2) {
+        deferred++;
+        nextSendMicros = micros() + gapMicros;
+        return;
+    }
+    sendRequest(idx);
+}
+
+/*
+ * Which entry a positive reply (data starting at the 0x40|mode byte, len bytes) answers. Replies say
+ * which mode and PID they are for so this works for late ones too. -1 if none.
+ */
+int16_t ObdPoller::findEntry(uint8_t *data, uint8_t len)
+{
+    uint8_t mode = data[0] & ~0x40;
+
+    if ((data[0] & 0x40) == 0) return -1;
+    if (hasPid(mode) && len < ((mode == 2) ? 3 : 2)) return -1;
+    if (lastIdx >= 0 && entries[lastIdx].active && entries[lastIdx].mode == mode &&
+        (!hasPid(mode) || data[1] == entries[lastIdx].pid)) return lastIdx;
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) {
+        if (!entries[e].active || entries[e].mode != mode) continue;
+        if (!hasPid(mode) || data[1] == entries[e].pid) return e;
+    }
+    return -1;
+}
+
+/*
+ * Called for every frame received on CAN0. Single frame positive replies are decoded and passed
+ * on. Replies from every ECU that answers a broadcast request count, including ones that come in
+ * after the first has already let the next request go.
+ */
+void ObdPoller::handleFrame(CAN_FRAME &frame, uint32_t timestamp)
+{
+    int32_t value = 0;
+    uint8_t len, skip;
+    int16_t idx;
+
+    if (!running) return;
+    if (frame.extended) {
+        if ((frame.id & 0x1FFFFF00) != 0x18DAF100) return;
+    } else if (frame.id < 0x7E8 || frame.id > 0x7EF) return;
+    if (frame.length < 2) return;
+    len = frame.data.bytes[0];
+    if ((len & 0xF0) != 0 || len < 1 || len > frame.length - 1) return;
+
+    idx = findEntry(frame.data.bytes + 1, len);
+    if (idx < 0) return;
+    OBD_POLL_ENTRY &entry = entries[idx];
+    if (frame.data.bytes[1] == 0x42 && frame.data.bytes[3] != 0) return; //some other freeze frame
+    //mode byte, then PID and for mode 2 the frame number
+    skip = hasPid(entry.mode) ? ((entry.mode == 2) ? 3 : 2) : 1;
+
+    entry.replies++;
+    if (idx == lastIdx) waiting = false;
+    //mode 1 and 2 share the PID meanings. Others are passed on raw with a value of 0
+    if (entry.mode == 1 || entry.mode == 2) obdDecode(entry.pid, frame.data.bytes + 1 + skip, len - skip, value);
+    sendObdValueToUSB(0, frame.id, entry.mode, entry.pid, value, frame.data.bytes + 1 + skip, len - skip, timestamp);
+    if (SysSettings.logToFile) sendObdValueToFile(0, frame.id, entry.mode, entry.pid, value, frame.data.bytes + 1 + skip, len - skip, timestamp);
+}
+
+void ObdPoller::printStatus()
+{
+    const OBD_PID_DEF *def;
+
+    Logger::console("OBD poller %s, header %x, budget %i%% (one request per %lus), %l timeouts, %l deferred",
+                    running ? "running" : "stopped", header, budgetPercent, calcGap(), timeouts, deferred);
+    for (int e = 0; e < OBDPOLL_MAX_ENTRIES; e++) {
+        if (!entries[e].active) continue;
+        def = (entries[e].mode == 1 || entries[e].mode == 2) ? obdFindPid(entries[e].pid) : NULL;
+        Logger::console("%i: mode %x PID %x every %lms, %l requests, %l replies (%s)", e, entries[e].mode, entries[e].pid,
+                        entries[e].periodMs, entries[e].requests, entries[e].replies, def ? def->name : "raw");
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * ObdPoller.h
+ *
+ * Polls OBD-II PIDs on CAN0 from a table the host uploads, each at its own rate, and sends
+ * the decoded values to USB and the sdcard. The request rate is kept under a bus load budget.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef OBDPOLLER_H_
+#define OBDPOLLER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+typedef struct {
+    uint32_t periodMs;
+    uint32_t nextDue;       //millis() when the next request should go out
+    uint32_t requests;
+    uint32_t replies;
+    uint8_t mode;
+    uint8_t pid;
+    boolean active;
+} OBD_POLL_ENTRY;
+
+class ObdPoller {
+public:
+    static void setup();
+    static void loop();
+    static boolean start();
+    static void stop();
+    static boolean isRunning();
+    static boolean setEntry(uint8_t idx, uint8_t mode, uint8_t pid, uint32_t periodMs);
+    static void clearEntry(uint8_t idx);
+    static void clearAll();
+    static uint8_t activeCount();
+    static void setBudget(uint8_t percent);
+    static uint8_t getBudget();
+    static void setHeader(uint32_t id);
+    static void handleFrame(CAN_FRAME &frame, uint32_t timestamp);
+    static void printStatus();
+
+private:
+    static OBD_POLL_ENTRY entries[OBDPOLL_MAX_ENTRIES];
+    static boolean running;
+    static uint32_t header;
+    static uint8_t budgetPercent;
+    static uint32_t gapMicros;      //least time between requests that stays inside the budget
+    static uint32_t nextSendMicros;
+    static int16_t lastIdx;         //entry most recently requested, -1 if none
+    static boolean waiting;         //no reply to the last request yet
+    static uint32_t requestMillis;
+    static uint32_t timeouts;
+    static uint32_t deferred;       //times a due request had to wait because the TX queue was backed up
+
+    static uint32_t calcGap();
+    static int16_t pickNext(uint32_t now);
+    static void sendRequest(int16_t idx);
+    static boolean hasPid(uint8_t mode);
+    static int16_t findEntry(uint8_t *data, uint8_t len);
+};
+
+#endif /* OBDPOLLER_H_ */
@@ -0,0 +1,383 @@
+/*
+ * PeriodicTx.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "PeriodicTx.h"
+#include "TxQueue.h"
+#include "M2RET.h"
+
+/*
+ * The schedule is a hashed timer wheel. TC3 (timer 1 channel 0) interrupts every PERIODIC_TICK_US and
+ * each tick looks at one slot of the wheel. Every entry sits in the slot of the tick it is next due on,
+ * with a count of how many more full turns of the wheel to wait if its period is longer than the wheel.
+ * So each tick only touches the entries that are due (or nearly due) no matter how big the table is.
+ *
+ * CAN0 and CAN1 frames are sent from PERIODIC_TX_MAILBOX, which is kept away from the driver the same way
+ * as the TX queue's mailbox. Due frames wait in a short list per bus and the CAN interrupt loads the next
+ * one as each finishes, so a frame is only reported complete once the controller says it is on the bus.
+ */
+
+PERIODIC_ENTRY PeriodicTx::entries[PERIODIC_MAX_ENTRIES];
+int16_t PeriodicTx::wheel[PERIODIC_WHEEL_SLOTS];
+volatile uint32_t PeriodicTx::currentTick = 0;
+boolean PeriodicTx::running = false;
+PERIODIC_SENT PeriodicTx::sent[PERIODIC_SENT_RING];
+volatile uint16_t PeriodicTx::sentHead = 0;
+volatile uint16_t PeriodicTx::sentTail = 0;
+PERIODIC_MAILBOX PeriodicTx::mailboxes[2];
+
+void TC3_Handler()
+{
+    TC_GetStatus(TC1, 0); //reading the status clears the interrupt
+    PeriodicTx::tick();
+}
+
+void PeriodicTx::setup()
+{
+    running = false;
+    for (int s = 0; s < PERIODIC_WHEEL_SLOTS; s++) wheel[s] = -1;
+    for (int e = 0; e < PERIODIC_MAX_ENTRIES; e++) {
+        entries[e].active = false;
+        entries[e].slot = -1;
+        entries[e].next = -1;
+    }
+    sentHead = sentTail = 0;
+    for (int b = 0; b < 2; b++) {
+        mailboxes[b].head = mailboxes[b].tail = 0;
+        mailboxes[b].busy = false;
+        mailboxes[b].aborting = false;
+    }
+
+    pmc_set_writeprotect(false);
+    pmc_enable_periph_clk(ID_TC3);
+    //MCK/2 = 42MHz, count up to RC and reset
+    TC_Configure(TC1, 0, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1);
+    TC_SetRC(TC1, 0, (SystemCoreClock / 2 / 1000000) * PERIODIC_TICK_US);
+    TC1->TC_CHANNEL[0].TC_IER = TC_IER_CPCS;
+    TC1->TC_CHANNEL[0].TC_IDR = ~TC_IER_CPCS;
+    //below the CAN interrupts so reception is never held up by the scheduler
+    NVIC_SetPriority(TC3_IRQn, PERIODIC_IRQ_PRIORITY);
+}
+
+uint32_t PeriodicTx::microsToTicks(uint32_t us)
+{
+    uint32_t ticks = (us + (PERIODIC_TICK_US / 2)) / PERIODIC_TICK_US;
+    if (ticks == 0) ticks = 1;
+    return ticks;
+}
+
+//Keep the timer interrupt out while the wheel is being changed from loop()
+void PeriodicTx::lockTimer()
+{
+    NVIC_DisableIRQ(TC3_IRQn);
+}
+
+void PeriodicTx::unlockTimer()
+{
+    if (running) NVIC_EnableIRQ(TC3_IRQn);
+}
+
+void PeriodicTx::start()
+{
+    lockTimer();
+    for (int s = 0; s < PERIODIC_WHEEL_SLOTS; s++) wheel[s] = -1;
+    currentTick = 0;
+    for (int e = 0; e < PERIODIC_MAX_ENTRIES; e++) {
+        entries[e].slot = -1;
+        if (entries[e].active) schedule(e, entries[e].offsetTicks);
+    }
+    running = true;
+    TC_Start(TC1, 0);
+    NVIC_ClearPendingIRQ(TC3_IRQn);
+    unlockTimer();
+}
+
+void PeriodicTx::stop()
+{
+    lockTimer();
+    running = false;
+    TC_Stop(TC1, 0);
+}
+
+boolean PeriodicTx::isRunning()
+{
+    return running;
+}
+
+uint8_t PeriodicTx::activeCount()
+{
+    uint8_t count = 0;
+    for (int e = 0; e < PERIODIC_MAX_ENTRIES; e++) if (entries[e].active) count++;
+    return count;
+}
+
+//Put an entry into the slot delayTicks from now. Must be called with the timer locked (or from the timer).
+void PeriodicTx::schedule(int16_t idx, uint32_t delayTicks)
+{
+    PERIODIC_ENTRY &entry = entries[idx];
+    if (delayTicks == 0) delayTicks = 1;
+    int16_t slot = (currentTick + delayTicks) & (PERIODIC_WHEEL_SLOTS - 1);
+    entry.rounds = (delayTicks - 1) / PERIODIC_WHEEL_SLOTS;
+    entry.slot = slot;
+    entry.next = wheel[slot];
+    wheel[slot] = idx;
+}
+
+void PeriodicTx::unschedule(int16_t idx)
+{
+    PERIODIC_ENTRY &entry = entries[idx];
+    if (entry.slot < 0) return;
+    int16_t *link = &wheel[entry.slot];
+    while (*link >= 0) {
+        if (*link == idx) {
+            *link = entry.next;
+            break;
+        }
+        link = &entries[*link].next;
+    }
+    entry.slot = -1;
+    entry.next = -1;
+}
+
+/*
+ * Add or replace a table entry. If the scheduler is running the entry starts offsetMicros from now,
+ * otherwise offsetMicros after the next start().
+ */
+boolean PeriodicTx::setEntry(uint8_t idx, uint8_t bus, CAN_FRAME &frame, uint32_t periodMicros, uint32_t offsetMicros,
+                             uint8_t counterByte, uint8_t counterMask, uint8_t checksumByte, uint8_t checksumType)
+{
+    if (idx >= PERIODIC_MAX_ENTRIES || bus > 2 || periodMicros == 0) return false;
+    if (frame.length > 8) return false;
+    if (counterByte != FRAME_NO_BYTE && (counterByte >= frame.length || counterMask == 0)) return false;
+    if (checksumByte != FRAME_NO_BYTE && (checksumByte >= frame.length || checksumType > CHK_CRC8)) return false;
+
+    lockTimer();
+    unschedule(idx);
+    PERIODIC_ENTRY &entry = entries[idx];
+    entry.frame = frame;
+    entry.frame.rtr = 0;
+    entry.bus = bus;
+    entry.periodTicks = microsToTicks(periodMicros);
+    entry.offsetTicks = microsToTicks(offsetMicros);
+    entry.counterByte = counterByte;
+    entry.counterMask = counterMask;
+    entry.checksumByte = checksumByte;
+    entry.checksumType = checksumType;
+    entry.active = true;
+    if (running) schedule(idx, entry.offsetTicks);
+    unlockTimer();
+    return true;
+}
+
+//Change the payload of an entry without touching its timing. Lets the host move signal values around on the fly.
+boolean PeriodicTx::setData(uint8_t idx, uint8_t length, uint8_t *data)
+{
+    if (idx >= PERIODIC_MAX_ENTRIES || length > 8) return false;
+    if (!entries[idx].active) return false;
+    //the counter and checksum have to stay inside the (possibly shorter) frame
+    if (entries[idx].counterByte != FRAME_NO_BYTE && entries[idx].counterByte >= length) return false;
+    if (entries[idx].checksumByte != FRAME_NO_BYTE && entries[idx].checksumByte >= length) return false;
+
+    lockTimer();
+    entries[idx].frame.length = length;
+    for (int b = 0; b < length; b++) entries[idx].frame.data.bytes[b] = data[b];
+    unlockTimer();
+    return true;
+}
+
+void PeriodicTx::clearEntry(uint8_t idx)
+{
+    if (idx >= PERIODIC_MAX_ENTRIES) return;
+    lockTimer();
+    unschedule(idx);
+    entries[idx].active = false;
+    unlockTimer();
+}
+
+void PeriodicTx::clearAll()
+{
+    lockTimer();
+    for (int s = 0; s < PERIODIC_WHEEL_SLOTS; s++) wheel[s] = -1;
+    for (int e = 0; e < PERIODIC_MAX_ENTRIES; e++) {
+        entries[e].active = false;
+        entries[e].slot = -1;
+        entries[e].next = -1;
+    }
+    unlockTimer();
+}
+
+//Bump the rolling counter and redo the checksum, in that order since the checksum covers the counter.
+void PeriodicTx::updateFrame(PERIODIC_ENTRY &entry)
+{
+    if (entry.counterByte != FRAME_NO_BYTE) frameBumpCounter(entry.frame, entry.counterByte, entry.counterMask);
+    if (entry.checksumByte != FRAME_NO_BYTE) frameFillChecksum(entry.frame, entry.checksumByte, entry.checksumType);
+}
+
+//Hand a frame to loop(). Called with interrupts off or from the CAN interrupt, which nothing here can preempt.
+void PeriodicTx::pushSent(CAN_FRAME &frame, uint32_t timestamp, uint8_t bus, uint8_t event)
+{
+    uint16_t nextHead = (sentHead + 1) % PERIODIC_SENT_RING;
+    if (nextHead == sentTail) return; //loop() is behind. The frame is still handled, it just won't be logged
+    PERIODIC_SENT &rec = sent[sentHead];
+    rec.frame = frame;
+    rec.timestamp = timestamp;
+    rec.bus = bus;
+    rec.event = event;
+    sentHead = nextHead;
+}
+
+//Put the next waiting frame into the mailbox, or hide the mailbox from the driver again if there isn't one
+void PeriodicTx::loadNext(uint8_t bus)
+{
+    PERIODIC_MAILBOX &mb = mailboxes[bus];
+    Can *regs = (bus == 0) ? CAN0 : CAN1;
+
+    if (mb.tail == mb.head) {
+        mb.busy = false;
+        TxQueue::releaseMailbox(regs, PERIODIC_TX_MAILBOX);
+        return;
+    }
+    mb.busy = true;
+    mb.aborting = false;
+    mb.loadedMicros = micros();
+    TxQueue::loadMailbox(regs, PERIODIC_TX_MAILBOX, mb.frames[mb.tail]);
+}
+
+void PeriodicTx::finishFrame(uint8_t bus, uint8_t event, uint32_t timestamp)
+{
+    PERIODIC_MAILBOX &mb = mailboxes[bus];
+
+    pushSent(mb.frames[mb.tail], timestamp, bus, event);
+    mb.tail = (mb.tail + 1) % PERIODIC_TX_PENDING;
+    loadNext(bus);
+}
+
+/*
+ * Runs in the CAN interrupt, before the driver's handler. The completion time is the controller's
+ * own stamp from the end of the frame.
+ */
+void PeriodicTx::mailboxIrq(uint8_t bus)
+{
+    PERIODIC_MAILBOX &mb = mailboxes[bus];
+    Can *regs = (bus == 0) ? CAN0 : CAN1;
+    uint32_t status;
+
+    if (!mb.busy) return;
+    if ((regs->CAN_MB[PERIODIC_TX_MAILBOX].CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_TX) return;
+    status = regs->CAN_MB[PERIODIC_TX_MAILBOX].CAN_MSR;
+    if (!(status & CAN_MSR_MRDY)) return;
+    if (status & CAN_MSR_MABT) finishFrame(bus, TX_EVENT_FAILED, micros());
+    else finishFrame(bus, TX_EVENT_COMPLETE, canTimestampToMicros((bus == 0) ? Can0 : Can1, status & 0xFFFF,
+                                                                  (bus == 0) ? settings.CAN0Speed : settings.CAN1Speed));
+}
+
+/*
+ * Called from loop() with interrupts off. Aborts a frame that can't get out (no ACK, bus off, etc) after
+ * CAN_TX_TIMEOUT, fails the one in the mailbox if begin() restarted the controller under it and takes the
+ * mailbox back from reception when idle.
+ */
+void PeriodicTx::checkMailbox(uint8_t bus)
+{
+    PERIODIC_MAILBOX &mb = mailboxes[bus];
+    Can *regs = (bus == 0) ? CAN0 : CAN1;
+    uint32_t mode = regs->CAN_MB[PERIODIC_TX_MAILBOX].CAN_MMR & CAN_MMR_MOT_Msk;
+
+    if (!mb.busy) {
+        if (mode != CAN_MMR_MOT_MB_DISABLED) TxQueue::releaseMailbox(regs, PERIODIC_TX_MAILBOX);
+    } else if (mode != CAN_MMR_MOT_MB_TX) {
+        finishFrame(bus, TX_EVENT_FAILED, micros());
+    } else {
+        mailboxIrq(bus); //in case the mailbox interrupt was turned off
+        if (mb.busy && !mb.aborting && (micros() - mb.loadedMicros) > CAN_TX_TIMEOUT) {
+            mb.aborting = true;
+            if (bus == 0) Can0.mailbox_send_abort_cmd(PERIODIC_TX_MAILBOX);
+            else Can1.mailbox_send_abort_cmd(PERIODIC_TX_MAILBOX);
+        }
+    }
+}
+
+/*
+ * Send one entry. Runs in the timer interrupt. CAN0 and CAN1 frames join their bus's list for the
+ * scheduler's mailbox and are reported to loop() when the CAN interrupt sees them finish. SWCAN is on
+ * SPI which loop() may be using at the time so those are handed to loop() to send.
+ */
+void PeriodicTx::fire(PERIODIC_ENTRY &entry)
+{
+    updateFrame(entry);
+    //the CAN interrupts take finished frames off these lists so keep them out while adding one
+    __disable_irq();
+    if (entry.bus > 1) pushSent(entry.frame, micros(), entry.bus, PERIODIC_EVENT_SEND);
+    else {
+        PERIODIC_MAILBOX &mb = mailboxes[entry.bus];
+        uint8_t nextHead = (mb.head + 1) % PERIODIC_TX_PENDING;
+        if (nextHead == mb.tail) pushSent(entry.frame, micros(), entry.bus, TX_EVENT_DROPPED); //bus can't keep up
+        else {
+            mb.frames[mb.head] = entry.frame;
+            mb.head = nextHead;
+            if (!mb.busy) loadNext(entry.bus);
+        }
+    }
+    __enable_irq();
+}
+
+void PeriodicTx::tick()
+{
+    int16_t slot, idx, nextIdx;
+
+    currentTick++;
+    slot = currentTick & (PERIODIC_WHEEL_SLOTS - 1);
+    //take the whole list off the slot first since entries get put back into the wheel as we go
+    idx = wheel[slot];
+    wheel[slot] = -1;
+    while (idx >= 0) {
+        PERIODIC_ENTRY &entry = entries[idx];
+        nextIdx = entry.next;
+        if (entry.rounds > 0) {
+            entry.rounds--;
+            entry.next = wheel[slot];
+            wheel[slot] = idx;
+        } else {
+            fire(entry);
+            schedule(idx, entry.periodTicks);
+        }
+        idx = nextIdx;
+    }
+}
+
+//Keep an eye on the mailboxes and pass what went out on to the rest of the system.
+void PeriodicTx::loop()
+{
+    for (int bus = 0; bus < 2; bus++) {
+        __disable_irq();
+        checkMailbox(bus);
+        __enable_irq();
+    }
+    while (sentTail != sentHead) {
+        PERIODIC_SENT &rec = sent[sentTail];
+        if (rec.event == PERIODIC_EVENT_SEND) queueFrame(rec.bus, rec.frame, 1);
+        else txFrameDone(rec.bus, rec.frame, rec.event, rec.timestamp);
+        sentTail = (sentTail + 1) % PERIODIC_SENT_RING;
+    }
+}
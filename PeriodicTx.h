@@ -0,0 +1,113 @@
+/*
+ * PeriodicTx.h
+ *
+ * On device scheduler for periodic frames. The host uploads a table of frames with a period
+ * and offset and they are sent from a timer interrupt so their timing doesn't depend on
+ * the USB link or on how busy loop() is.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PERIODICTX_H_
+#define PERIODICTX_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+#include "FrameUtil.h"
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t periodTicks;
+    uint32_t offsetTicks;
+    uint16_t rounds;        //full turns of the wheel left before this entry is due
+    int16_t next;           //next entry in the same wheel slot, -1 for end of list
+    int16_t slot;           //wheel slot this entry is in, -1 if not scheduled
+    uint8_t bus;
+    uint8_t counterByte;    //data byte holding a rolling counter or FRAME_NO_BYTE
+    uint8_t counterMask;    //bits of that byte the counter occupies (0x0F, 0xF0, 0xFF, ...)
+    uint8_t checksumByte;   //data byte to fill with a checksum or FRAME_NO_BYTE
+    uint8_t checksumType;   //FRAME_CHECKSUM
+    boolean active;
+} PERIODIC_ENTRY;
+
+//A frame that went out (or couldn't go out) and that loop() still has to deal with
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t timestamp;
+    uint8_t bus;
+    uint8_t event;          //TX_EVENT, or PERIODIC_EVENT_SEND if loop() still has to send it
+} PERIODIC_SENT;
+
+//Frames waiting for the scheduler's own mailbox on CAN0 or CAN1. frames[tail] is the one in the mailbox while busy.
+typedef struct {
+    CAN_FRAME frames[PERIODIC_TX_PENDING];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile boolean busy;
+    boolean aborting;
+    uint32_t loadedMicros;
+} PERIODIC_MAILBOX;
+
+#define PERIODIC_EVENT_SEND 0xFF
+
+class PeriodicTx {
+public:
+    static void setup();
+    static void loop();
+    static void start();
+    static void stop();
+    static boolean isRunning();
+    static boolean setEntry(uint8_t idx, uint8_t bus, CAN_FRAME &frame, uint32_t periodMicros, uint32_t offsetMicros,
+                            uint8_t counterByte, uint8_t counterMask, uint8_t checksumByte, uint8_t checksumType);
+    static boolean setData(uint8_t idx, uint8_t length, uint8_t *data);
+    static void clearEntry(uint8_t idx);
+    static void clearAll();
+    static uint8_t activeCount();
+    static void tick();
+    static void mailboxIrq(uint8_t bus);
+
+private:
+    static PERIODIC_ENTRY entries[PERIODIC_MAX_ENTRIES];
+    static int16_t wheel[PERIODIC_WHEEL_SLOTS];
+    static volatile uint32_t currentTick;
+    static boolean running;
+    static PERIODIC_SENT sent[PERIODIC_SENT_RING];
+    static volatile uint16_t sentHead;
+    static volatile uint16_t sentTail;
+    static PERIODIC_MAILBOX mailboxes[2];
+
+    static void schedule(int16_t idx, uint32_t delayTicks);
+    static void unschedule(int16_t idx);
+    static void fire(PERIODIC_ENTRY &entry);
+    static void updateFrame(PERIODIC_ENTRY &entry);
+    static void pushSent(CAN_FRAME &frame, uint32_t timestamp, uint8_t bus, uint8_t event);
+    static void loadNext(uint8_t bus);
+    static void finishFrame(uint8_t bus, uint8_t event, uint32_t timestamp);
+    static void checkMailbox(uint8_t bus);
+    static uint32_t microsToTicks(uint32_t us);
+    static void lockTimer();
+    static void unlockTimer();
+};
+
+#endif /* PERIODICTX_H_ */
@@ -0,0 +1,127 @@
+/*
+ * PidCache.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "PidCache.h"
+#include "Logger.h"
+
+/*
+ * Entries are keyed by the replying ECU's ID, the mode and the PID, all of which are in the
+ * frame itself. Only single frame mode 1 (current data) replies are kept since those are the
+ * ones apps poll over and over. When full the oldest entry makes room.
+ */
+
+PIDCACHE_ENTRY PidCache::entries[PIDCACHE_SIZE];
+uint32_t PidCache::maxAge = 0;
+uint32_t PidCache::hits = 0;
+uint32_t PidCache::misses = 0;
+
+void PidCache::setup()
+{
+    maxAge = PIDCACHE_DEFAULT_AGE;
+    clear();
+}
+
+void PidCache::clear()
+{
+    for (int e = 0; e < PIDCACHE_SIZE; e++) entries[e].used = false;
+    hits = misses = 0;
+}
+
+void PidCache::setMaxAge(uint32_t ms)
+{
+    maxAge = ms;
+    if (maxAge == 0) clear();
+}
+
+uint32_t PidCache::getMaxAge()
+{
+    return maxAge;
+}
+
+//Called for every frame received on CAN0
+void PidCache::observe(CAN_FRAME &frame)
+{
+    uint8_t *data = frame.data.bytes;
+    uint32_t now = millis();
+    int slot = -1, freeSlot = -1, oldestSlot = 0;
+    uint32_t oldestAge = 0;
+
+    if (maxAge == 0 || frame.length < 3) return;
+    if (frame.extended) {
+        if ((frame.id & 0x1FFFFF00) != 0x18DAF100) return;
+    }
+    else if (frame.id < 0x7E8 || frame.id > 0x7EF) return;
+    if ((data[0] & 0xF0) != 0 || (data[0] & 0xF) < 3 || (data[0] & 0xF) > 7 || data[1] != 0x41) return;
+
+    for (int e = 0; e < PIDCACHE_SIZE; e++) {
+        PIDCACHE_ENTRY &entry = entries[e];
+        if (!entry.used) {
+            if (freeSlot < 0) freeSlot = e;
+            continue;
+        }
+        if (entry.frame.id == frame.id && entry.frame.extended == frame.extended && entry.frame.data.bytes[2] == data[2]) {
+            slot = e;
+            break;
+        }
+        if ((now - entry.stamp) >= oldestAge) {
+            oldestAge = now - entry.stamp;
+            oldestSlot = e;
+        }
+    }
+    if (slot < 0) slot = (freeSlot >= 0) ? freeSlot : oldestSlot;
+    entries[slot].frame = frame;
+    entries[slot].stamp = now;
+    entries[slot].used = true;
+}
+
+/*
+ * Copy fresh replies for mode/pid into out, at most max of them. onlyId limits it to one ECU.
+ * Returns how many were found.
+ */
+int PidCache::lookup(uint8_t mode, uint8_t pid, uint32_t onlyId, CAN_FRAME *out, int max)
+{
+    int found = 0;
+
+    if (maxAge == 0 || mode != 1) return 0;
+    for (int e = 0; e < PIDCACHE_SIZE && found < max; e++) {
+        PIDCACHE_ENTRY &entry = entries[e];
+        if (!entry.used || entry.frame.data.bytes[2] != pid) continue;
+        if (onlyId != PIDCACHE_ANY_ID && entry.frame.id != onlyId) continue;
+        if ((millis() - entry.stamp) > maxAge) continue;
+        out[found++] = entry.frame;
+    }
+    if (found) hits++;
+    else misses++;
+    return found;
+}
+
+void PidCache::printStatus()
+{
+    int used = 0;
+
+    for (int e = 0; e < PIDCACHE_SIZE; e++) if (entries[e].used) used++;
+    Logger::console("PID cache %lms, %i of %i entries used, %l hits, %l misses", maxAge, used, PIDCACHE_SIZE, hits, misses);
+}
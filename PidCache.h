@@ -0,0 +1,62 @@
+/*
+ * PidCache.h
+ *
+ * Recent OBD-II mode 1 replies seen on CAN0, whoever asked for them. Lets the ELM327 emulator
+ * answer repeat requests without another round trip on the vehicle bus.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PIDCACHE_H_
+#define PIDCACHE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+#define PIDCACHE_ANY_ID     0xFFFFFFFF
+
+typedef struct {
+    CAN_FRAME frame;        //the reply as it was received
+    uint32_t stamp;         //millis() when it was received
+    boolean used;
+} PIDCACHE_ENTRY;
+
+class PidCache {
+public:
+    static void setup();
+    static void observe(CAN_FRAME &frame);
+    static int lookup(uint8_t mode, uint8_t pid, uint32_t onlyId, CAN_FRAME *out, int max);
+    static void setMaxAge(uint32_t ms);
+    static uint32_t getMaxAge();
+    static void clear();
+    static void printStatus();
+
+private:
+    static PIDCACHE_ENTRY entries[PIDCACHE_SIZE];
+    static uint32_t maxAge;     //milliseconds a reply stays good for, 0 = cache off
+    static uint32_t hits;
+    static uint32_t misses;
+};
+
+#endif /* PIDCACHE_H_ */
@@ -0,0 +1,160 @@
+/*
+ * Profiler.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "Profiler.h"
+#include "Logger.h"
+
+boolean Profiler::enabled = false;
+PROFILE_STATS Profiler::stats[PROF_NUM_STAGES];
+
+/*
+ * Turn on the DWT cycle counter. It is part of the Cortex-M3 trace unit which is
+ * powered down out of reset so trace has to be enabled first.
+ */
+void Profiler::setup()
+{
+#if defined(__arm__)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    reset();
+}
+
+void Profiler::setEnabled(boolean en)
+{
+    if (en && !enabled) reset(); //start every profiling run with a clean slate
+    enabled = en;
+}
+
+void Profiler::reset()
+{
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        stats[s].count = 0;
+        stats[s].minCycles = 0xFFFFFFFF;
+        stats[s].maxCycles = 0;
+        stats[s].totalCycles = 0;
+        for (int b = 0; b < PROF_HIST_BUCKETS; b++) stats[s].histogram[b] = 0;
+    }
+}
+
+void Profiler::record(uint8_t stage, uint32_t elapsed)
+{
+    if (stage >= PROF_NUM_STAGES) return;
+    PROFILE_STATS &st = stats[stage];
+    st.count++;
+    st.totalCycles += elapsed;
+    if (elapsed < st.minCycles) st.minCycles = elapsed;
+    if (elapsed > st.maxCycles) st.maxCycles = elapsed;
+
+    //bucket is the position of the highest set bit, offset so bucket 0 starts at 2^PROF_HIST_SHIFT cycles
+    int bucket = (31 - __builtin_clz(elapsed | 1)) - PROF_HIST_SHIFT;
+    if (bucket < 0) bucket = 0;
+    if (bucket >= PROF_HIST_BUCKETS) bucket = PROF_HIST_BUCKETS - 1;
+    st.histogram[bucket]++;
+}
+
+const char *Profiler::stageName(uint8_t stage)
+{
+    switch (stage) {
+    case PROF_LOOP:
+        return "LOOP";
+    case PROF_CAN_RX:
+        return "CAN RX";
+    case PROF_USB_FLUSH:
+        return "USB FLUSH";
+    case PROF_SERIAL_IN:
+        return "SERIAL IN";
+    case PROF_SD_FLUSH:
+        return "SD FLUSH";
+    case PROF_ELM:
+        return "ELM327";
+    }
+    return "UNKNOWN";
+}
+
+/*
+ * Dump the stats to the console. All times are shown in microseconds. The histogram shows
+ * the counts per bucket with bucket n starting at 2^(n+6) cycles.
+ */
+void Profiler::printReport()
+{
+    if (!enabled) Logger::console("Profiler is not running. Use PROFILE=1 to start it.");
+
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        PROFILE_STATS &st = stats[s];
+        if (st.count == 0) {
+            Logger::console("%s: no samples", stageName(s));
+            continue;
+        }
+        Logger::console("%s: count %l min %lus avg %lus max %lus", stageName(s), st.count,
+                        st.minCycles / PROF_CYCLES_PER_US, (uint32_t)((st.totalCycles / st.count) / PROF_CYCLES_PER_US),
+                        st.maxCycles / PROF_CYCLES_PER_US);
+        SerialUSB.print("    hist:");
+        for (int b = 0; b < PROF_HIST_BUCKETS; b++) {
+            SerialUSB.print(" ");
+            SerialUSB.print(st.histogram[b]);
+        }
+        SerialUSB.println();
+    }
+}
+
+/*
+ * Binary form of the report for the GVRET protocol. Per stage it is
+ * count, min, max, average (all 32 bit little endian, cycles) then one 16 bit
+ * (saturated) count per histogram bucket. Returns the number of bytes used.
+ */
+int Profiler::encodeReport(uint8_t *buff, int maxLen)
+{
+    int idx = 0;
+    uint32_t vals[4];
+
+    if (maxLen < 2) return 0;
+    buff[idx++] = PROF_NUM_STAGES;
+    buff[idx++] = PROF_HIST_BUCKETS;
+
+    for (int s = 0; s < PROF_NUM_STAGES; s++) {
+        PROFILE_STATS &st = stats[s];
+        if (idx + 16 + (PROF_HIST_BUCKETS * 2) > maxLen) break;
+        vals[0] = st.count;
+        vals[1] = st.count ? st.minCycles : 0;
+        vals[2] = st.maxCycles;
+        vals[3] = st.count ? (uint32_t)(st.totalCycles / st.count) : 0;
+        for (int v = 0; v < 4; v++) {
+            buff[idx++] = (uint8_t)(vals[v] & 0xFF);
+            buff[idx++] = (uint8_t)(vals[v] >> 8);
+            buff[idx++] = (uint8_t)(vals[v] >> 16);
+            buff[idx++] = (uint8_t)(vals[v] >> 24);
+        }
+        for (int b = 0; b < PROF_HIST_BUCKETS; b++) {
+            uint32_t h = st.histogram[b];
+            if (h > 0xFFFF) h = 0xFFFF;
+            buff[idx++] = (uint8_t)(h & 0xFF);
+            buff[idx++] = (uint8_t)(h >> 8);
+        }
+    }
+    return idx;
+}
@@ -0,0 +1,102 @@
+/*
+ * Profiler.h
+ *
+ * Cycle accurate timing of the individual stages of the main loop
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+//The stages of loop() that get timed. Stages may nest - an SD flush can happen inside
+//of CAN RX handling if the file buffer fills up while frames are being logged.
+enum PROFILE_STAGE {
+    PROF_LOOP = 0,      //the whole of loop()
+    PROF_CAN_RX = 1,    //pulling frames from all buses and sending them to USB/file
+    PROF_USB_FLUSH = 2, //writing the binary serial buffer out to the USB port
+    PROF_SERIAL_IN = 3, //parsing host commands (binary protocol, console and LAWICEL)
+    PROF_SD_FLUSH = 4,  //writing the file buffer to the sdcard
+    PROF_ELM = 5,       //ELM327 emulator processing
+    PROF_NUM_STAGES
+};
+
+//Histogram bucket n counts samples of 2^(n+6) to 2^(n+7) - 1 cycles. Bucket 0 also takes everything
+//faster than that and the last bucket takes everything slower. At 84MHz that's ~1.5us to ~1.5ms.
+#define PROF_HIST_BUCKETS   12
+#define PROF_HIST_SHIFT     6
+
+typedef struct {
+    uint32_t count;
+    uint32_t minCycles;
+    uint32_t maxCycles;
+    uint64_t totalCycles;
+    uint32_t histogram[PROF_HIST_BUCKETS];
+} PROFILE_STATS;
+
+class Profiler {
+public:
+    static void setup();
+    static void setEnabled(boolean);
+    static boolean isEnabled()
+    {
+        return enabled;
+    }
+    //Free running cycle counter. DWT CYCCNT on the real hardware, a clock derived from micros() otherwise
+    static inline uint32_t cycles()
+    {
+#if defined(__arm__)
+        return DWT->CYCCNT;
+#else
+        return micros() * PROF_CYCLES_PER_US;
+#endif
+    }
+    static void record(uint8_t stage, uint32_t elapsed);
+    static void reset();
+    static void printReport();
+    static int encodeReport(uint8_t *buff, int maxLen);
+    static const char *stageName(uint8_t stage);
+
+private:
+    static boolean enabled;
+    static PROFILE_STATS stats[PROF_NUM_STAGES];
+};
+
+//Timing macros used in loop(). With CFG_PROFILER undefined these compile to nothing at all.
+//With it defined but the profiler turned off the cost is a single test of a flag.
+//A start of 0 means the profiler was off at the start of the stage so it isn't recorded. The low bit of
+//a real start is forced on to keep it from looking like that.
+#ifdef CFG_PROFILER
+#define PROFILE_BEGIN(var)          uint32_t var = Profiler::isEnabled() ? (Profiler::cycles() | 1) : 0
+#define PROFILE_RESTART(var)        do { var = Profiler::isEnabled() ? (Profiler::cycles() | 1) : 0; } while (0)
+#define PROFILE_END(stage, var)     do { if (var && Profiler::isEnabled()) Profiler::record(stage, Profiler::cycles() - var); } while (0)
+#else
+#define PROFILE_BEGIN(var)
+#define PROFILE_RESTART(var)        do {} while (0)
+#define PROFILE_END(stage, var)     do {} while (0)
+#endif
+
+#endif /* PROFILER_H_ */
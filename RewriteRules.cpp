@@ -0,0 +1,197 @@
+/*
+ * RewriteRules.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "RewriteRules.h"
+#include "Gateway.h"
+#include "Logger.h"
+
+/*
+ * apply() runs in the CAN interrupt for every forwarded frame so finding the rules for an ID
+ * has to be cheap. Standard IDs index straight into stdIndex which gives the first rule for
+ * that ID, further rules for the same ID are chained through next and are applied in order.
+ * The index is rebuilt with interrupts off whenever the rules change so the buses never
+ * have to be stopped.
+ */
+
+REWRITE_RULE RewriteRules::rules[REWRITE_MAX_RULES];
+int8_t RewriteRules::stdIndex[0x800];
+int8_t RewriteRules::extHead = -1;
+uint8_t RewriteRules::ruleCount = 0;
+
+void RewriteRules::setup()
+{
+    for (int r = 0; r < REWRITE_MAX_RULES; r++) rules[r].active = false;
+    rebuildIndex();
+}
+
+void RewriteRules::rebuildIndex()
+{
+    __disable_irq();
+    memset(stdIndex, -1, sizeof(stdIndex));
+    extHead = -1;
+    ruleCount = 0;
+    //go backwards so each chain ends up in rule number order
+    for (int r = REWRITE_MAX_RULES - 1; r >= 0; r--) {
+        if (!rules[r].active) continue;
+        ruleCount++;
+        if (rules[r].extended) {
+            rules[r].next = extHead;
+            extHead = r;
+        } else {
+            rules[r].next = stdIndex[rules[r].id];
+            stdIndex[rules[r].id] = r;
+        }
+    }
+    __enable_irq();
+}
+
+boolean RewriteRules::setRule(uint8_t idx, uint8_t directions, uint32_t id, boolean extended, uint8_t action, uint8_t byteIdx,
+                              uint8_t mask, uint8_t value, uint8_t counterByte, uint8_t counterMask, uint8_t checksumByte,
+                              uint8_t checksumType)
+{
+    if (idx >= REWRITE_MAX_RULES || action > RW_DROP) return false;
+    if (!extended && id > 0x7FF) return false;
+    if ((action == RW_REPLACE || action == RW_ADD) && (byteIdx > 7 || mask == 0)) return false;
+    if (counterByte != FRAME_NO_BYTE && (counterByte > 7 || counterMask == 0)) return false;
+    if (checksumByte != FRAME_NO_BYTE && (checksumByte > 7 || checksumType > CHK_CRC8)) return false;
+
+    REWRITE_RULE &rule = rules[idx];
+    rule.active = false;
+    rebuildIndex(); //take it out of the lookup before changing it
+    rule.id = id;
+    rule.extended = extended;
+    rule.directions = directions & (GW_CAN0_TO_CAN1 | GW_CAN1_TO_CAN0);
+    rule.action = action;
+    rule.byteIdx = byteIdx;
+    rule.mask = mask;
+    rule.value = value;
+    rule.counterByte = counterByte;
+    rule.counterMask = counterMask;
+    rule.counter = 0;
+    rule.checksumByte = checksumByte;
+    rule.checksumType = checksumType;
+    rule.hits = 0;
+    rule.active = true;
+    rebuildIndex();
+    return true;
+}
+
+void RewriteRules::clearRule(uint8_t idx)
+{
+    if (idx >= REWRITE_MAX_RULES) return;
+    rules[idx].active = false;
+    rebuildIndex();
+}
+
+void RewriteRules::clearAll()
+{
+    for (int r = 0; r < REWRITE_MAX_RULES; r++) rules[r].active = false;
+    rebuildIndex();
+}
+
+void RewriteRules::resetHits()
+{
+    for (int r = 0; r < REWRITE_MAX_RULES; r++) rules[r].hits = 0;
+}
+
+/*
+ * Run a frame coming from fromBus through its rules. Modifies the frame in place.
+ * Returns false if the frame should be dropped. Called from the CAN interrupt.
+ */
+boolean RewriteRules::apply(uint8_t fromBus, CAN_FRAME &frame)
+{
+    int8_t idx;
+    uint8_t dirBit = (fromBus == 0) ? GW_CAN0_TO_CAN1 : GW_CAN1_TO_CAN0;
+
+    if (ruleCount == 0) return true;
+    if (frame.extended) idx = extHead;
+    else if (frame.id < 0x800) idx = stdIndex[frame.id];
+    else return true;
+
+    while (idx >= 0) {
+        REWRITE_RULE &rule = rules[idx];
+        idx = rule.next;
+        if (!(rule.directions & dirBit)) continue;
+        if (rule.extended && rule.id != frame.id) continue;
+        rule.hits++;
+
+        switch (rule.action) {
+        case RW_DROP:
+            return false;
+        case RW_REPLACE:
+            if (rule.byteIdx < frame.length) frameSetField(frame, rule.byteIdx, rule.mask, rule.value);
+            break;
+        case RW_ADD:
+            if (rule.byteIdx < frame.length) frameSetField(frame, rule.byteIdx, rule.mask, frameGetField(frame, rule.byteIdx, rule.mask) + rule.value);
+            break;
+        }
+        if (rule.counterByte != FRAME_NO_BYTE && rule.counterByte < frame.length) {
+            frameSetField(frame, rule.counterByte, rule.counterMask, rule.counter++);
+        }
+        if (rule.checksumByte != FRAME_NO_BYTE) frameFillChecksum(frame, rule.checksumByte, rule.checksumType);
+    }
+    return true;
+}
+
+/*
+ * Hit counters for PROTO_REWRITE_STATS: number of active rules then for each one
+ * its index and hit count (32 bit little endian).
+ */
+int RewriteRules::encodeHits(uint8_t *buff, int maxLen)
+{
+    int idx = 1;
+
+    buff[0] = 0;
+    for (int r = 0; r < REWRITE_MAX_RULES; r++) {
+        if (!rules[r].active) continue;
+        if (idx + 5 > maxLen) break;
+        uint32_t hits = rules[r].hits;
+        buff[idx++] = r;
+        buff[idx++] = (uint8_t)(hits & 0xFF);
+        buff[idx++] = (uint8_t)(hits >> 8);
+        buff[idx++] = (uint8_t)(hits >> 16);
+        buff[idx++] = (uint8_t)(hits >> 24);
+        buff[0]++;
+    }
+    return idx;
+}
+
+void RewriteRules::printRules()
+{
+    const char *actions[] = {"pass", "replace", "add", "drop"};
+
+    if (ruleCount == 0) {
+        Logger::console("No rewrite rules");
+        return;
+    }
+    for (int r = 0; r < REWRITE_MAX_RULES; r++) {
+        REWRITE_RULE &rule = rules[r];
+        if (!rule.active) continue;
+        Logger::console("Rule %i: id %x dirs %i %s byte %i mask %x value %x ctr %i/%x chk %i/%i hits %l", r, rule.id,
+                        rule.directions, actions[rule.action], rule.byteIdx, rule.mask, rule.value, rule.counterByte,
+                        rule.counterMask, rule.checksumByte, rule.checksumType, rule.hits);
+    }
+}
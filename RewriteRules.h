@@ -0,0 +1,84 @@
+/*
+ * RewriteRules.h
+ *
+ * Rules that change (or drop) frames as the gateway forwards them between CAN0 and CAN1.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef REWRITERULES_H_
+#define REWRITERULES_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+#include "FrameUtil.h"
+
+enum REWRITE_ACTION {
+    RW_PASS = 0,        //leave the data alone (still counts hits and can redo the counter/checksum)
+    RW_REPLACE = 1,     //set the masked bits of the byte to value
+    RW_ADD = 2,         //add value to the masked bits of the byte, wrapping within them
+    RW_DROP = 3         //don't forward the frame at all
+};
+
+typedef struct {
+    uint32_t id;
+    boolean extended;
+    boolean active;
+    uint8_t directions;     //GW_CAN0_TO_CAN1 and/or GW_CAN1_TO_CAN0
+    uint8_t action;         //REWRITE_ACTION
+    uint8_t byteIdx;
+    uint8_t mask;
+    uint8_t value;
+    uint8_t counterByte;    //byte to write our own rolling counter into or FRAME_NO_BYTE
+    uint8_t counterMask;
+    uint8_t counter;
+    uint8_t checksumByte;   //byte to recompute the checksum of or FRAME_NO_BYTE
+    uint8_t checksumType;   //FRAME_CHECKSUM
+    int8_t next;            //next rule for the same ID, -1 for none
+    volatile uint32_t hits;
+} REWRITE_RULE;
+
+class RewriteRules {
+public:
+    static void setup();
+    static boolean apply(uint8_t fromBus, CAN_FRAME &frame);
+    static boolean setRule(uint8_t idx, uint8_t directions, uint32_t id, boolean extended, uint8_t action, uint8_t byteIdx,
+                           uint8_t mask, uint8_t value, uint8_t counterByte, uint8_t counterMask, uint8_t checksumByte,
+                           uint8_t checksumType);
+    static void clearRule(uint8_t idx);
+    static void clearAll();
+    static void resetHits();
+    static int encodeHits(uint8_t *buff, int maxLen);
+    static void printRules();
+
+private:
+    static REWRITE_RULE rules[REWRITE_MAX_RULES];
+    static int8_t stdIndex[0x800];  //first rule for each standard ID
+    static int8_t extHead;          //extended IDs are rare enough to just keep in one list
+    static uint8_t ruleCount;
+
+    static void rebuildIndex();
+};
+
+#endif /* REWRITERULES_H_ */
@@ -32,8 +32,24 @@
 #include <MCP2515_sw_can.h>
 #include <lin_stack.h>
 #include "EEPROM.h"
+#include "SettingsStore.h"
 #include "config.h"
 #include "sys_io.h"
+#include "Profiler.h"
+#include "SysHealth.h"
+#include "Latency.h"
+#include "LogReplay.h"
+#include "FrameGenerator.h"
+#include "Gateway.h"
+#include "RewriteRules.h"
+#include "IsoTpSniffer.h"
+#include "PidCache.h"
+#include "ObdPoller.h"
+#include "J1939.h"
+#include "SignalDecoder.h"
+#include "LinBus.h"
+#include "FastBoot.h"
+#include "ClockSync.h"
 
 extern EEPROMCLASS *eeprom;
 extern SWcan SWCAN;
@@ -41,21 +57,1087 @@ extern lin_stack LIN1;
 extern lin_stack LIN2;
 extern void CANHandler();
 
-SerialConsole::SerialConsole()
+/*
+ * Config commands (NAME=value) are rows of configCmds[], listed in the order printMenu() shows them.
+ * A # in a name stands for a number typed in its place (a bus, a filter slot) which is handed to the
+ * handler, so CAN0EN and CAN1EN are one row. handleConfigCmd() looks the name up with a binary search
+ * over cmdOrder[], the rows sorted by name, first as typed and then with each run of digits swapped
+ * for a #. CFG_INT values are parsed and range checked before the handler sees them. A handler returns
+ * true when it changed something that has to go back to EEPROM and the row's flags say which block.
+ */
+
+enum CONFIG_ARG {
+    CFG_INT,        //strtol() of the value (so hex works too), must be within min - max
+    CFG_TEXT        //handler parses the value itself
+};
+
+#define CFG_SAVE_SETTINGS   1
+#define CFG_SAVE_DIGTOG     2
+#define CFG_SECTION_END     4   //blank line after this row in the menu
+
+#define CFG_NO_INDEX        0xFF
+
+typedef struct {
+    uint8_t index[2];       //numbers typed in place of the #s in the name
+    int32_t value;
+    char *text;             //value as typed
+} CONFIG_ARGS;
+
+typedef struct {
+    const char *name;
+    uint8_t argType;
+    uint8_t flags;
+    uint8_t indexFirst[2];
+    uint8_t indexLast[2];
+    int32_t min;
+    int32_t max;
+    bool (*handler)(CONFIG_ARGS &args);
+    void (*show)(char *buff, uint8_t index);   //current value for the menu, NULL shows usage instead
+    const char *usage;
+    const char *help;
+} CONFIG_CMD;
+
+static bool cfgLogLevel(CONFIG_ARGS &args)
+{
+    const Logger::LogLevel levels[5] = {Logger::Debug, Logger::Info, Logger::Warn, Logger::Error, Logger::Off};
+    const char *names[5] = {"debug", "info", "warning", "error", "off"};
+
+    Logger::setLoglevel(levels[args.value]);
+    settings.logLevel = args.value;
+    Logger::console("setting loglevel to '%s'", names[args.value]);
+    return true;
+}
+
+static bool cfgSysType(CONFIG_ARGS &args)
+{
+    settings.sysType = args.value;
+    Logger::console("System type updated. Power cycle to apply.");
+    return true;
+}
+
+static bool cfgCanEnable(CONFIG_ARGS &args)
+{
+    CANRaw &port = args.index[0] ? Can1 : Can0;
+
+    Logger::console("Setting CAN%i Enabled to %i", args.index[0], args.value);
+    if (args.index[0] == 0) settings.CAN0_Enabled = args.value;
+    else settings.CAN1_Enabled = args.value;
+    if (args.value) port.begin(args.index[0] ? settings.CAN1Speed : settings.CAN0Speed, 255);
+    else port.disable();
+    return true;
+}
+
+static bool cfgCanSpeed(CONFIG_ARGS &args)
+{
+    Logger::console("Setting CAN%i Baud Rate to %i", args.index[0], args.value);
+    if (args.index[0] == 0) {
+        settings.CAN0Speed = args.value;
+        if (settings.CAN0_Enabled) Can0.begin(settings.CAN0Speed, 255);
+    } else {
+        settings.CAN1Speed = args.value;
+        if (settings.CAN1_Enabled) Can1.begin(settings.CAN1Speed, 255);
+    }
+    return true;
+}
+
+static bool cfgCanListenOnly(CONFIG_ARGS &args)
+{
+    CANRaw &port = args.index[0] ? Can1 : Can0;
+
+    Logger::console("Setting CAN%i Listen Only to %i", args.index[0], args.value);
+    if (args.index[0] == 0) settings.CAN0ListenOnly = args.value;
+    else settings.CAN1ListenOnly = args.value;
+    if (args.value) port.enable_autobaud_listen_mode();
+    else port.disable_autobaud_listen_mode();
+    return true;
+}
+
+//CAN0FILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
+static bool cfgCanFilter(CONFIG_ARGS &args)
+{
+    //there should be four tokens
+    char *idTok = strtok(args.text, ",");
+    char *maskTok = strtok(NULL, ",");
+    char *extTok = strtok(NULL, ",");
+    char *enTok = strtok(NULL, ",");
+
+    if (!idTok || !maskTok || !extTok || !enTok) { //if any of them were null then something was wrong. Abort.
+        Logger::console("Invalid filter! Use ID,MASK,EXT,EN");
+        return false;
+    }
+
+    int idVal = strtol(idTok, NULL, 0);
+    int maskVal = strtol(maskTok, NULL, 0);
+    int extVal = strtol(extTok, NULL, 0);
+    int enVal = strtol(enTok, NULL, 0);
+
+    Logger::console("Setting CAN%iFILTER%i to ID 0x%x Mask 0x%x Extended %i Enabled %i", args.index[0], args.index[1],
+                    idVal, maskVal, extVal, enVal);
+
+    if (args.index[0] == 0) {
+        //settings.CAN0Filters[filter].id = idVal;
+        //settings.CAN0Filters[filter].mask = maskVal;
+        //settings.CAN0Filters[filter].extended = extVal;
+        //settings.CAN0Filters[filter].enabled = enVal;
+        //Can0.setRXFilter(filter, idVal, maskVal, extVal);
+    } else {
+        //settings.CAN1Filters[filter].id = idVal;
+        //settings.CAN1Filters[filter].mask = maskVal;
+        //settings.CAN1Filters[filter].extended = extVal;
+        //settings.CAN1Filters[filter].enabled = enVal;
+        //Can1.setRXFilter(filter, idVal, maskVal, extVal);
+    }
+    return false; //nothing is stored yet
+}
+
+static bool cfgSwcanEnable(CONFIG_ARGS &args)
+{
+    Logger::console("Setting SWCAN Enabled to %i", args.value);
+    if (args.value == 1) {
+        SWCAN.setupSW(settings.SWCANSpeed);
+        delay(20);
+        SWCAN.mode(3); // Go to normal mode. 0 - Sleep, 1 - High Speed, 2 - High Voltage Wake-Up, 3 - Normal
+        attachInterrupt(SWC_INT, CANHandler, FALLING); //enable interrupt for SWCAN
+    } else {
+        SWCAN.Reset();
+        SWCAN.mode(0); //go to sleep
+    }
+    settings.SWCAN_Enabled = args.value;
+    return true;
+}
+
+static bool cfgSwcanSpeed(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Single Wire CAN Baud Rate to %i", args.value);
+    settings.SWCANSpeed = args.value;
+    if (settings.SWCAN_Enabled) SWCAN.setupSW(settings.SWCANSpeed);
+    return true;
+}
+
+static bool cfgSwcanListenOnly(CONFIG_ARGS &args)
+{
+    Logger::console("Setting SWCAN Listen Only to %i", args.value);
+    settings.SWCANListenOnly = args.value;
+    return true;
+}
+
+static bool cfgLinEnable(CONFIG_ARGS &args)
+{
+    int linPort = args.index[0] - 1;
+
+    Logger::console("Setting LIN%i Enabled to %i", linPort + 1, args.value);
+    if (linPort == 0) settings.LIN1_Enabled = args.value;
+    else settings.LIN2_Enabled = args.value;
+    if (args.value == 1) LinBus::begin(linPort, (linPort == 0) ? settings.LIN1Speed : settings.LIN2Speed);
+    else LinBus::end(linPort);
+    return true;
+}
+
+static bool cfgLinSpeed(CONFIG_ARGS &args)
+{
+    int linPort = args.index[0] - 1;
+
+    Logger::console("Setting LIN%i Baud Rate to %i", linPort + 1, args.value);
+    if (linPort == 0) settings.LIN1Speed = args.value;
+    else settings.LIN2Speed = args.value;
+    if (LinBus::isEnabled(linPort)) LinBus::begin(linPort, args.value);
+    return true;
+}
+
+static bool cfgLinStats(CONFIG_ARGS &args)
+{
+    LinBus::printStatus();
+    return false;
+}
+
+/*
+ * ID,LEN,<bytes> for CAN#SEND and SWSEND. Returns false if the value doesn't hold that many
+ * bytes or is too long for a frame.
+ */
+static bool parseSendFrame(char *inputString, CAN_FRAME &frame)
+{
+    char *idTok = strtok(inputString, ",");
+    char *lenTok = strtok(NULL, ",");
+    char *dataTok;
+
+    if (!idTok) return false;
+    if (!lenTok) return false;
+
+    int idVal = strtol(idTok, NULL, 0);
+    int lenVal = strtol(lenTok, NULL, 0);
+    if (lenVal < 0 || lenVal > 8) return false;
+
+    for (int i = 0; i < lenVal; i++) {
+        dataTok = strtok(NULL, ",");
+        if (!dataTok) return false;
+        frame.data.byte[i] = strtol(dataTok, NULL, 0);
+    }
+
+    frame.id = idVal;
+    if (idVal >= 0x7FF) frame.extended = true;
+    else frame.extended = false;
+    frame.rtr = 0;
+    frame.length = lenVal;
+    return true;
+}
+
+static void sendConsoleFrame(CAN_COMMON *port, CAN_FRAME &frame)
+{
+    sendFrame(port, frame);
+    Logger::console("Sending frame with id: 0x%x len: %i", frame.id, frame.length);
+    SysSettings.txToggle = !SysSettings.txToggle;
+    setLED(SysSettings.LED_CANTX, SysSettings.txToggle);
+}
+
+static bool cfgCanSend(CONFIG_ARGS &args)
+{
+    CAN_FRAME frame;
+
+    if (!parseSendFrame(args.text, frame)) Logger::console("Invalid frame! Use ID,LEN,<BYTES>");
+    else sendConsoleFrame(args.index[0] ? (CAN_COMMON *)&Can1 : (CAN_COMMON *)&Can0, frame);
+    return false;
+}
+
+static bool cfgSwcanSend(CONFIG_ARGS &args)
+{
+    CAN_FRAME frame;
+
+    if (!parseSendFrame(args.text, frame)) Logger::console("Invalid frame! Use ID,LEN,<BYTES>");
+    else sendConsoleFrame(&SWCAN, frame);
+    return false;
+}
+
+static bool cfgMark(CONFIG_ARGS &args)
+{
+    //just ascii based for now
+    if (settings.fileOutputType == GVRET) Logger::file("Mark: %s", args.text);
+    if (settings.fileOutputType == CRTD) {
+        uint8_t buff[40];
+        sprintf((char *)buff, "%f CEV ", millis() / 1000.0f);
+        Logger::fileRaw(buff, strlen((char *)buff));
+        Logger::fileRaw((uint8_t *)args.text, strlen(args.text));
+        buff[0] = '\r';
+        buff[1] = '\n';
+        Logger::fileRaw(buff, 2);
+    }
+    if (!settings.useBinarySerialComm) Logger::console("Mark: %s", args.text);
+    return false;
+}
+
+static bool cfgReplay(CONFIG_ARGS &args)
+{
+    if (!stricmp(args.text, "OFF")) LogReplay::stop();
+    else if (!stricmp(args.text, "STATUS")) LogReplay::printStatus();
+    else LogReplay::start(args.text);
+    return false;
+}
+
+static bool cfgReplayType(CONFIG_ARGS &args)
+{
+    LogReplay::setFormat(args.value);
+    return false;
+}
+
+static bool cfgReplaySpeed(CONFIG_ARGS &args)
+{
+    Logger::console("Setting replay speed to %i%%", args.value);
+    LogReplay::setSpeed(args.value);
+    return false;
+}
+
+static bool cfgReplayLoop(CONFIG_ARGS &args)
+{
+    LogReplay::setLooping(args.value ? true : false);
+    return false;
+}
+
+//ID,MASK pair used by the various filter commands. Missing values are 0.
+static void parseIdMask(char *text, uint32_t &id, uint32_t &mask)
+{
+    char *dataTok = strtok(text, ",");
+    id = dataTok ? strtoul(dataTok, NULL, 0) : 0;
+    dataTok = strtok(NULL, ",");
+    mask = dataTok ? strtoul(dataTok, NULL, 0) : 0;
+}
+
+static bool cfgReplayFilter(CONFIG_ARGS &args)
+{
+    uint32_t filterId, filterMask;
+
+    parseIdMask(args.text, filterId, filterMask);
+    Logger::console("Replay filter set to id %x mask %x", filterId, filterMask);
+    LogReplay::setFilter(filterId, filterMask);
+    return false;
+}
+
+static bool cfgReplayMap(CONFIG_ARGS &args)
+{
+    char *dataTok = strtok(args.text, ",");
+    for (int b = 0; b < 3 && dataTok; b++) {
+        LogReplay::setBusMap(b, strtol(dataTok, NULL, 0));
+        dataTok = strtok(NULL, ",");
+    }
+    return false;
+}
+
+static bool cfgGateway(CONFIG_ARGS &args)
+{
+    if (args.value && !(settings.CAN0_Enabled && settings.CAN1_Enabled)) Logger::console("CAN0 and CAN1 both need to be enabled for the gateway");
+    Gateway::setDirections(args.value);
+    Gateway::printStatus();
+    return false;
+}
+
+static bool cfgGatewayFilter(CONFIG_ARGS &args)
+{
+    uint32_t gwId, gwMask;
+
+    parseIdMask(args.text, gwId, gwMask);
+    Gateway::setFilter(args.index[0], gwId, gwMask);
+    return false;
+}
+
+static bool cfgGatewayStats(CONFIG_ARGS &args)
+{
+    if (args.value == 0) Gateway::resetStats();
+    else Gateway::printStatus();
+    return false;
+}
+
+static bool cfgRewriteRule(CONFIG_ARGS &args)
+{
+    uint32_t rwVals[11] = {0, 0, 0, 0, 0, 0, 0, FRAME_NO_BYTE, 0, FRAME_NO_BYTE, CHK_NONE};
+    int rwCount = 0;
+    char *dataTok = strtok(args.text, ",");
+    while (dataTok && rwCount < 11) {
+        rwVals[rwCount++] = strtoul(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+    }
+    if (rwCount < 7 || !RewriteRules::setRule(rwVals[0], rwVals[1], rwVals[2], rwVals[2] > 0x7FF, rwVals[3], rwVals[4],
+                                               rwVals[5], rwVals[6], rwVals[7], rwVals[8], rwVals[9], rwVals[10])) {
+        Logger::console("Invalid rewrite rule");
+    } else RewriteRules::printRules();
+    return false;
+}
+
+static bool cfgRewriteClear(CONFIG_ARGS &args)
+{
+    if (args.value < 0) RewriteRules::clearAll();
+    else RewriteRules::clearRule(args.value);
+    return false;
+}
+
+static bool cfgRewriteStats(CONFIG_ARGS &args)
+{
+    if (args.value == 0) RewriteRules::resetHits();
+    else RewriteRules::printRules();
+    return false;
+}
+
+static bool cfgIsoSniff(CONFIG_ARGS &args)
+{
+    if (args.value < 3) IsoTpSniffer::setMode(args.value);
+    IsoTpSniffer::printStatus();
+    return false;
+}
+
+static bool cfgIsoSniffFilter(CONFIG_ARGS &args)
+{
+    uint32_t snId, snMask;
+
+    parseIdMask(args.text, snId, snMask);
+    IsoTpSniffer::setFilter(snId, snMask);
+    return false;
+}
+
+static bool cfgIsoSniffRaw(CONFIG_ARGS &args)
+{
+    IsoTpSniffer::setKeepRaw(args.value ? true : false);
+    return false;
+}
+
+static bool cfgJ1939(CONFIG_ARGS &args)
+{
+    if (args.value == 0 || args.value == 1) J1939::setEnabled(args.value == 1);
+    else if (args.value == 3) J1939::resetStats();
+    else J1939::printStatus();
+    return false;
+}
+
+static bool cfgJ1939Raw(CONFIG_ARGS &args)
+{
+    J1939::setKeepRaw(args.value ? true : false);
+    return false;
+}
+
+static bool cfgSignalOutput(CONFIG_ARGS &args)
+{
+    if (args.value <= SIG_OUT_CHANGES) SignalDecoder::setOutput(args.value);
+    else SignalDecoder::printSignals();
+    return false;
+}
+
+static bool cfgSignal(CONFIG_ARGS &args)
+{
+    char *sigArgs[8];
+    int sigCount = 0;
+    char *dataTok = strtok(args.text, ",");
+    while (dataTok && sigCount < 8) {
+        sigArgs[sigCount++] = dataTok;
+        dataTok = strtok(NULL, ",");
+    }
+    if (sigCount < 5) Logger::console("Need at least IDX,BUS,ID,START,LEN");
+    else {
+        uint32_t sigId = strtoul(sigArgs[2], NULL, 0);
+        if (!SignalDecoder::setSignal(strtoul(sigArgs[0], NULL, 0), strtoul(sigArgs[1], NULL, 0), sigId,
+                                      sigId > 0x7FF, strtoul(sigArgs[3], NULL, 0), strtoul(sigArgs[4], NULL, 0),
+                                      (sigCount > 5) ? strtoul(sigArgs[5], NULL, 0) : 0,
+                                      (sigCount > 6) ? strtod(sigArgs[6], NULL) : 1.0f,
+                                      (sigCount > 7) ? strtod(sigArgs[7], NULL) : 0.0f)) {
+            Logger::console("Invalid signal");
+        }
+    }
+    return false;
+}
+
+static bool cfgSignalClear(CONFIG_ARGS &args)
+{
+    if (args.value < 0) SignalDecoder::clearAll();
+    else SignalDecoder::clearSignal(args.value);
+    return false;
+}
+
+static bool cfgSignalRaw(CONFIG_ARGS &args)
+{
+    SignalDecoder::setKeepRaw(args.value ? true : false);
+    return false;
+}
+
+static bool cfgElmCache(CONFIG_ARGS &args)
+{
+    if (args.value >= 0) PidCache::setMaxAge(args.value);
+    PidCache::printStatus();
+    return false;
+}
+
+static bool cfgObdPoll(CONFIG_ARGS &args)
+{
+    if (args.value == 0) ObdPoller::stop();
+    else if (args.value == 1) ObdPoller::start();
+    else ObdPoller::printStatus();
+    return false;
+}
+
+static bool cfgObdPid(CONFIG_ARGS &args)
+{
+    uint32_t obdArgs[4] = {0, 0, 0, 0};
+    char *dataTok = strtok(args.text, ",");
+    for (int a = 0; a < 4 && dataTok; a++) {
+        obdArgs[a] = strtoul(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+    }
+    if (obdArgs[3] == 0) ObdPoller::clearEntry(obdArgs[0]);
+    else if (!ObdPoller::setEntry(obdArgs[0], obdArgs[1], obdArgs[2], obdArgs[3])) Logger::console("Invalid OBD poll entry");
+    return false;
+}
+
+static bool cfgObdBudget(CONFIG_ARGS &args)
+{
+    ObdPoller::setBudget(args.value);
+    return false;
+}
+
+static bool cfgObdHeader(CONFIG_ARGS &args)
+{
+    ObdPoller::setHeader(strtoul(args.text, NULL, 0));
+    return false;
+}
+
+static bool cfgGen(CONFIG_ARGS &args)
+{
+    if (args.value == 0) FrameGenerator::stop("stopped by user");
+    else if (args.value == 1) FrameGenerator::start();
+    else FrameGenerator::printStatus();
+    return false;
+}
+
+static bool cfgGenBus(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().bus = args.value;
+    return false;
+}
+
+static bool cfgGenId(CONFIG_ARGS &args)
+{
+    char *dataTok = strtok(args.text, ",");
+    if (dataTok) {
+        FrameGenerator::getConfig().idStart = strtoul(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+        FrameGenerator::getConfig().idEnd = dataTok ? strtoul(dataTok, NULL, 0) : FrameGenerator::getConfig().idStart;
+    }
+    return false;
+}
+
+static bool cfgGenExt(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().extended = args.value ? true : false;
+    return false;
+}
+
+static bool cfgGenLen(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().length = args.value;
+    return false;
+}
+
+static bool cfgGenData(CONFIG_ARGS &args)
+{
+    char *dataTok = strtok(args.text, ",");
+    for (int b = 0; b < 8 && dataTok; b++) {
+        FrameGenerator::getConfig().payload[b] = strtol(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+    }
+    return false;
+}
+
+static bool cfgGenByte(CONFIG_ARGS &args)
+{
+    int vals[4] = {-1, GEN_BYTE_FIXED, 0, 255};
+    char *dataTok = strtok(args.text, ",");
+    for (int v = 0; v < 4 && dataTok; v++) {
+        vals[v] = strtol(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+    }
+    if (vals[0] < 0 || vals[0] > 7 || vals[1] < 0 || vals[1] > 2 || vals[2] > vals[3]) {
+        Logger::console("Invalid setting! Use GENBYTE=IDX,MODE,MIN,MAX");
+    } else {
+        GEN_BYTE &genByte = FrameGenerator::getConfig().bytes[vals[0]];
+        genByte.mode = vals[1];
+        genByte.min = vals[2];
+        genByte.max = vals[3];
+    }
+    return false;
+}
+
+static bool cfgGenRate(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().rate = args.value;
+    FrameGenerator::getConfig().loadPercent = 0;
+    return false;
+}
+
+static bool cfgGenLoad(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().loadPercent = args.value;
+    return false;
+}
+
+static bool cfgGenTime(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().durationMs = args.value;
+    return false;
+}
+
+static bool cfgGenStopId(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().stopId = (args.value < 0) ? GEN_NO_TRIGGER : args.value;
+    return false;
+}
+
+static bool cfgGenStopInput(CONFIG_ARGS &args)
+{
+    FrameGenerator::getConfig().stopInput = (args.value < 0 || args.value > 254) ? GEN_NO_INPUT : args.value;
+    return false;
+}
+
+static bool cfgProfile(CONFIG_ARGS &args)
+{
+    switch (args.value) {
+    case 0:
+        Profiler::setEnabled(false);
+        Logger::console("Loop profiler disabled");
+        break;
+    case 1:
+        Profiler::setEnabled(true);
+        Logger::console("Loop profiler enabled");
+        break;
+    case 2:
+        Profiler::printReport();
+        break;
+    case 3:
+        Profiler::reset();
+        Logger::console("Loop profiler stats cleared");
+        break;
+    }
+    return false;
+}
+
+static bool cfgLatency(CONFIG_ARGS &args)
+{
+    if (args.value == 0) {
+        Latency::reset();
+        Logger::console("Latency stats cleared");
+    } else Latency::printReport();
+    return false;
+}
+
+static bool cfgBootStats(CONFIG_ARGS &args)
+{
+    FastBoot::printStatus();
+    return false;
+}
+
+static bool cfgClockStats(CONFIG_ARGS &args)
+{
+    ClockSync::printStatus();
+    return false;
+}
+
+static bool cfgBinSerial(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Serial Binary Comm to %i", args.value);
+    settings.useBinarySerialComm = args.value;
+    return true;
+}
+
+static bool cfgFileType(CONFIG_ARGS &args)
+{
+    Logger::console("Setting File Output Type to %i", args.value);
+    settings.fileOutputType = (FILEOUTPUTTYPE)args.value; //the numbers all intentionally match up so this works
+    return true;
+}
+
+static bool cfgFileBase(CONFIG_ARGS &args)
+{
+    if (strlen(args.text) >= sizeof(settings.fileNameBase)) {
+        Logger::console("File base name can be at most %i characters", sizeof(settings.fileNameBase) - 1);
+        return false;
+    }
+    Logger::console("Setting File Base Name to %s", args.text);
+    strcpy((char *)settings.fileNameBase, args.text);
+    return true;
+}
+
+static bool cfgFileExt(CONFIG_ARGS &args)
+{
+    if (strlen(args.text) >= sizeof(settings.fileNameExt)) {
+        Logger::console("File extension can be at most %i characters", sizeof(settings.fileNameExt) - 1);
+        return false;
+    }
+    Logger::console("Setting File Extension to %s", args.text);
+    strcpy((char *)settings.fileNameExt, args.text);
+    return true;
+}
+
+static bool cfgFileNum(CONFIG_ARGS &args)
+{
+    Logger::console("Setting File Incrementing Number Base to %i", args.value);
+    settings.fileNum = args.value;
+    return true;
+}
+
+static bool cfgFileAppend(CONFIG_ARGS &args)
+{
+    Logger::console("Setting File Append Mode to %i", args.value);
+    settings.appendFile = args.value;
+    return true;
+}
+
+static bool cfgFileAuto(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Auto File Logging Mode to %i", args.value);
+    settings.autoStartLogging = args.value;
+    return true;
+}
+
+static bool cfgDigTogEnable(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Digital Toggle System Enable to %i", args.value);
+    digToggleSettings.enabled = args.value;
+    return true;
+}
+
+//Set or clear one bit of the digital toggle mode byte
+static void setDigTogModeBit(uint8_t bit, int32_t value)
+{
+    if (value) digToggleSettings.mode |= bit;
+    else digToggleSettings.mode &= ~bit;
+}
+
+static bool cfgDigTogMode(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Digital Toggle Mode to %i", args.value);
+    setDigTogModeBit(1, args.value);
+    return true;
+}
+
+static bool cfgDigTogLevel(CONFIG_ARGS &args)
 {
-    init();
+    Logger::console("Setting Digital Toggle Starting Level to %i", args.value);
+    setDigTogModeBit(0x80, args.value);
+    return true;
 }
 
-void SerialConsole::init()
+static bool cfgDigTogPin(CONFIG_ARGS &args)
 {
-    //State variables for serial console
-    ptrBuffer = 0;
-    state = STATE_ROOT_MENU;
+    Logger::console("Setting Digital Toggle Pin to %i", args.value);
+    digToggleSettings.pin = args.value;
+    return true;
+}
+
+static bool cfgDigTogId(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Digital Toggle CAN ID to %X", args.value);
+    digToggleSettings.rxTxID = args.value;
+    return true;
+}
+
+static bool cfgDigTogCan(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Digital Toggle CAN%i Usage to %i", args.index[0], args.value);
+    setDigTogModeBit(2 << args.index[0], args.value);
+    return true;
+}
+
+static bool cfgDigTogLen(CONFIG_ARGS &args)
+{
+    Logger::console("Setting Digital Toggle Frame Length to %i", args.value);
+    digToggleSettings.length = args.value;
+    return true;
+}
+
+static bool cfgDigTogPayload(CONFIG_ARGS &args)
+{
+    char *dataTok = strtok(args.text, ",");
+    if (!dataTok) {
+        Logger::console("Error processing payload");
+        return false;
+    }
+    for (int b = 0; b < 8 && dataTok; b++) {
+        digToggleSettings.payload[b] = strtol(dataTok, NULL, 0);
+        dataTok = strtok(NULL, ",");
+    }
+    Logger::console("Set new payload bytes");
+    return true;
+}
+
+static void showLogLevel(char *buff, uint8_t index) { sprintf(buff, "%i", settings.logLevel); }
+static void showSysType(char *buff, uint8_t index) { sprintf(buff, "%i", settings.sysType); }
+static void showCanEnable(char *buff, uint8_t index) { sprintf(buff, "%i", index ? settings.CAN1_Enabled : settings.CAN0_Enabled); }
+static void showCanSpeed(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)(index ? settings.CAN1Speed : settings.CAN0Speed)); }
+static void showCanListenOnly(char *buff, uint8_t index) { sprintf(buff, "%i", index ? settings.CAN1ListenOnly : settings.CAN0ListenOnly); }
+static void showSwcanEnable(char *buff, uint8_t index) { sprintf(buff, "%i", settings.SWCAN_Enabled); }
+static void showSwcanSpeed(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)settings.SWCANSpeed); }
+static void showSwcanListenOnly(char *buff, uint8_t index) { sprintf(buff, "%i", settings.SWCANListenOnly); }
+static void showLinEnable(char *buff, uint8_t index) { sprintf(buff, "%i", (index == 1) ? settings.LIN1_Enabled : settings.LIN2_Enabled); }
+static void showLinSpeed(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)((index == 1) ? settings.LIN1Speed : settings.LIN2Speed)); }
+static void showGateway(char *buff, uint8_t index) { sprintf(buff, "%i", Gateway::getDirections()); }
+static void showIsoSniff(char *buff, uint8_t index) { sprintf(buff, "%i", IsoTpSniffer::getMode()); }
+static void showIsoSniffRaw(char *buff, uint8_t index) { sprintf(buff, "%i", IsoTpSniffer::keepRaw()); }
+static void showJ1939(char *buff, uint8_t index) { sprintf(buff, "%i", J1939::isEnabled()); }
+static void showJ1939Raw(char *buff, uint8_t index) { sprintf(buff, "%i", J1939::keepRaw()); }
+static void showSignalOutput(char *buff, uint8_t index) { sprintf(buff, "%i", SignalDecoder::getOutput()); }
+static void showSignalRaw(char *buff, uint8_t index) { sprintf(buff, "%i", SignalDecoder::keepRaw()); }
+static void showElmCache(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)PidCache::getMaxAge()); }
+static void showObdPoll(char *buff, uint8_t index) { sprintf(buff, "%i", ObdPoller::isRunning()); }
+static void showObdBudget(char *buff, uint8_t index) { sprintf(buff, "%i", ObdPoller::getBudget()); }
+static void showGen(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::isRunning()); }
+static void showGenBus(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::getConfig().bus); }
+static void showGenId(char *buff, uint8_t index)
+{
+    sprintf(buff, "0x%lX,0x%lX", (unsigned long)FrameGenerator::getConfig().idStart, (unsigned long)FrameGenerator::getConfig().idEnd);
+}
+static void showGenExt(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::getConfig().extended); }
+static void showGenLen(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::getConfig().length); }
+static void showGenData(char *buff, uint8_t index)
+{
+    uint8_t *p = FrameGenerator::getConfig().payload;
+    sprintf(buff, "0x%X,0x%X,0x%X,0x%X,0x%X,0x%X,0x%X,0x%X", p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+}
+static void showGenRate(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)FrameGenerator::getConfig().rate); }
+static void showGenLoad(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::getConfig().loadPercent); }
+static void showGenTime(char *buff, uint8_t index) { sprintf(buff, "%lu", (unsigned long)FrameGenerator::getConfig().durationMs); }
+static void showGenStopId(char *buff, uint8_t index) { sprintf(buff, "0x%lX", (unsigned long)FrameGenerator::getConfig().stopId); }
+static void showGenStopInput(char *buff, uint8_t index) { sprintf(buff, "%i", FrameGenerator::getConfig().stopInput); }
+static void showProfile(char *buff, uint8_t index) { sprintf(buff, "%i", Profiler::isEnabled()); }
+static void showBinSerial(char *buff, uint8_t index) { sprintf(buff, "%i", settings.useBinarySerialComm); }
+static void showFileType(char *buff, uint8_t index) { sprintf(buff, "%i", settings.fileOutputType); }
+static void showFileBase(char *buff, uint8_t index) { sprintf(buff, "%s", (char *)settings.fileNameBase); }
+static void showFileExt(char *buff, uint8_t index) { sprintf(buff, "%s", (char *)settings.fileNameExt); }
+static void showFileNum(char *buff, uint8_t index) { sprintf(buff, "%i", settings.fileNum); }
+static void showFileAppend(char *buff, uint8_t index) { sprintf(buff, "%i", settings.appendFile); }
+static void showFileAuto(char *buff, uint8_t index) { sprintf(buff, "%i", settings.autoStartLogging); }
+static void showDigTogEnable(char *buff, uint8_t index) { sprintf(buff, "%i", digToggleSettings.enabled); }
+static void showDigTogMode(char *buff, uint8_t index) { sprintf(buff, "%i", digToggleSettings.mode & 1); }
+static void showDigTogLevel(char *buff, uint8_t index) { sprintf(buff, "%i", digToggleSettings.mode >> 7); }
+static void showDigTogPin(char *buff, uint8_t index) { sprintf(buff, "%i", digToggleSettings.pin); }
+static void showDigTogId(char *buff, uint8_t index) { sprintf(buff, "0x%lX", (unsigned long)digToggleSettings.rxTxID); }
+static void showDigTogCan(char *buff, uint8_t index) { sprintf(buff, "%i", (digToggleSettings.mode >> (index + 1)) & 1); }
+static void showDigTogLen(char *buff, uint8_t index) { sprintf(buff, "%i", digToggleSettings.length); }
+static void showDigTogPayload(char *buff, uint8_t index)
+{
+    uint8_t *p = digToggleSettings.payload;
+    sprintf(buff, "0x%X,0x%X,0x%X,0x%X,0x%X,0x%X,0x%X,0x%X", p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+}
+
+static const CONFIG_CMD configCmds[] = {
+    {"LOGLEVEL", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 4, cfgLogLevel, showLogLevel, NULL,
+        "set log level (0=debug, 1=info, 2=warn, 3=error, 4=off)"},
+    {"SYSTYPE", CFG_INT, CFG_SAVE_SETTINGS | CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgSysType, showSysType, NULL,
+        "set board type (0=Macchina M2)"},
+
+    {"CAN#EN", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {1, 0}, 0, 1, cfgCanEnable, showCanEnable, NULL,
+        "Enable/Disable CAN# (0 = Disable, 1 = Enable)"},
+    {"CAN#SPEED", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {1, 0}, 1, 1000000, cfgCanSpeed, showCanSpeed, NULL,
+        "Set speed of CAN# in baud (125000, 250000, etc)"},
+    {"CAN#LISTENONLY", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {1, 0}, 0, 1, cfgCanListenOnly, showCanListenOnly, NULL,
+        "Enable/Disable Listen Only Mode (0 = Dis, 1 = En)"},
+    {"CAN#FILTER#", CFG_TEXT, CFG_SAVE_SETTINGS | CFG_SECTION_END, {0, 0}, {1, 7}, 0, 0, cfgCanFilter, NULL, "ID,MASK,EXT,EN",
+        "Set receive filter 0 - 7 of CAN0 or CAN1. Ex: CAN0FILTER2=0x7E8,0x7F8,0,1"},
+
+    {"SWCANEN", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 1, cfgSwcanEnable, showSwcanEnable, NULL,
+        "Enable/Disable Single Wire CAN (0 = Disable, 1 = Enable)"},
+    {"SWCANSPEED", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 1, 1000000, cfgSwcanSpeed, showSwcanSpeed, NULL,
+        "Set speed of Single Wire CAN in baud (33000, 93000, etc)"},
+    {"SWCANLISTENONLY", CFG_INT, CFG_SAVE_SETTINGS | CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgSwcanListenOnly, showSwcanListenOnly, NULL,
+        "Enable/Disable Listen Only Mode (0 = Dis, 1 = En)"},
+
+    {"LIN#EN", CFG_INT, CFG_SAVE_SETTINGS, {1, 0}, {2, 0}, 0, 1, cfgLinEnable, showLinEnable, NULL,
+        "Enable/Disable LIN# sniffing (0 = Disable, 1 = Enable)"},
+    {"LIN#SPEED", CFG_INT, CFG_SAVE_SETTINGS, {1, 0}, {2, 0}, 1000, 20000, cfgLinSpeed, showLinSpeed, NULL,
+        "Set speed of LIN# in baud (9600, 19200, etc)"},
+    {"LINSTATS", CFG_TEXT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgLinStats, NULL, "1",
+        "Show LIN frame and error counts"},
+
+    {"CAN#SEND", CFG_TEXT, 0, {0, 0}, {1, 0}, 0, 0, cfgCanSend, NULL, "ID,LEN,<BYTES SEPARATED BY COMMAS>",
+        "Send on CAN0 or CAN1. Ex: CAN0SEND=0x200,4,1,2,3,4"},
+    {"SWSEND", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgSwcanSend, NULL, "ID,LEN,<BYTES SEPARATED BY COMMAS>",
+        "Ex: SWSEND=0x100,4,10,20,30,40"},
+    {"MARK", CFG_TEXT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgMark, NULL, "<Description of what you are doing>",
+        "Set a mark in the log file about what you are about to do."},
+
+    {"REPLAY", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgReplay, NULL, "<FILENAME|OFF|STATUS>",
+        "Replay a log file from the sdcard onto the buses, stop replay or show its status"},
+    {"REPLAYTYPE", CFG_INT, 0, {0, 0}, {0, 0}, 0, 2, cfgReplayType, NULL, "<0|1|2>",
+        "Format of the file to replay (0 = Same as FILETYPE, 1 = Binary, 2 = GVRET)"},
+    {"REPLAYSPEED", CFG_INT, 0, {0, 0}, {0, 0}, 0, 10000, cfgReplaySpeed, NULL, "<PERCENT>",
+        "Replay speed in percent of real time (100 = as recorded, 0 = as fast as possible)"},
+    {"REPLAYLOOP", CFG_INT, 0, {0, 0}, {0, 0}, 0, 1, cfgReplayLoop, NULL, "<0|1>",
+        "Start over at the end of the file (0 = No, 1 = Yes)"},
+    {"REPLAYFILTER", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgReplayFilter, NULL, "ID,MASK",
+        "Only replay frames where (id & mask) == (ID & mask). Ex: REPLAYFILTER=0x100,0x700"},
+    {"REPLAYMAP", CFG_TEXT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgReplayMap, NULL, "B0,B1,B2",
+        "Bus to send frames recorded on bus 0, 1, 2 to (3 = don't replay). Ex: REPLAYMAP=1,0,3"},
+
+    {"GATEWAY", CFG_INT, 0, {0, 0}, {0, 0}, 0, 3, cfgGateway, showGateway, NULL,
+        "Forward frames between CAN0 and CAN1 (0 = Off, 1 = CAN0->CAN1, 2 = CAN1->CAN0, 3 = Both)"},
+    {"GWFILTER#", CFG_TEXT, 0, {0, 0}, {1, 0}, 0, 0, cfgGatewayFilter, NULL, "ID,MASK",
+        "Only forward frames from CAN# where (id & mask) == (ID & mask). Ex: GWFILTER0=0x7E0,0x7F0"},
+    {"GWSTATS", CFG_INT, 0, {0, 0}, {0, 0}, 0, 1, cfgGatewayStats, NULL, "<0|1>",
+        "Gateway counters (0 = Clear, 1 = Show)"},
+    {"RWRULE", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgRewriteRule, NULL, "N,DIRS,ID,ACTION,BYTE,MASK,VALUE[,CTRBYTE,CTRMASK,CHKBYTE,CHKTYPE]",
+        "Set gateway rewrite rule N. ACTION 0 = Pass, 1 = Replace, 2 = Add, 3 = Drop. CHKTYPE 1 = Sum, 2 = XOR, 3 = CRC8. 255 = no byte"},
+    {"RWCLEAR", CFG_INT, 0, {0, 0}, {0, 0}, -1, REWRITE_MAX_RULES - 1, cfgRewriteClear, NULL, "<N|-1>",
+        "Remove rewrite rule N or all of them"},
+    {"RWSTATS", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgRewriteStats, NULL, "<0|1>",
+        "Rewrite rule hit counters (0 = Clear, 1 = Show)"},
+
+    {"ISOSNIFF", CFG_INT, 0, {0, 0}, {0, 0}, 0, 3, cfgIsoSniff, showIsoSniff, NULL,
+        "Reassemble captured ISO-TP messages (0 = Off, 1 = IDs matching ISOSNIFFFILTER, 2 = Diagnostic IDs, 3 = Status)"},
+    {"ISOSNIFFFILTER", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgIsoSniffFilter, NULL, "ID,MASK",
+        "IDs to reassemble in mode 1. Ex: ISOSNIFFFILTER=0x7E0,0x7F0"},
+    {"ISOSNIFFRAW", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgIsoSniffRaw, showIsoSniffRaw, NULL,
+        "Also send the raw frames of reassembled messages (0 = No, 1 = Yes)"},
+
+    {"J1939", CFG_INT, 0, {0, 0}, {0, 0}, 0, 3, cfgJ1939, showJ1939, NULL,
+        "Reassemble J1939 transport messages and track PGNs / address claims (0 = Off, 1 = On, 2 = Status, 3 = Clear stats)"},
+    {"J1939RAW", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgJ1939Raw, showJ1939Raw, NULL,
+        "Also send the TP.CM / TP.DT frames of reassembled messages (0 = No, 1 = Yes)"},
+
+    {"SIGOUT", CFG_INT, 0, {0, 0}, {0, 0}, 0, 3, cfgSignalOutput, showSignalOutput, NULL,
+        "Decode signals from received frames (0 = Off, 1 = All values, 2 = Changes only, 3 = Show table)"},
+    {"SIGNAL", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgSignal, NULL, "IDX,BUS,ID,START,LEN,FLAGS,SCALE,OFFSET",
+        "Set a signal. FLAGS 1 = Motorola, 2 = Signed. BUS 255 = Any. Ex: SIGNAL=0,0,0x3E8,24,16,0,0.25,0"},
+    {"SIGCLEAR", CFG_INT, 0, {0, 0}, {0, 0}, -1, SIGNAL_MAX - 1, cfgSignalClear, NULL, "IDX",
+        "Remove a signal (-1 = All)"},
+    {"SIGRAW", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgSignalRaw, showSignalRaw, NULL,
+        "Also send raw frames while decoding (0 = No, 1 = Yes)"},
+
+    {"ELMCACHE", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, -1, 0x7FFFFFFF, cfgElmCache, showElmCache, NULL,
+        "How long (ms) OBD replies seen on CAN0 answer ELM327 requests for (0 = Off, -1 = Status)"},
+
+    {"OBDPOLL", CFG_INT, 0, {0, 0}, {0, 0}, 0, 2, cfgObdPoll, showObdPoll, NULL,
+        "Poll OBD-II PIDs on CAN0 (0 = Stop, 1 = Start, 2 = Show status)"},
+    {"OBDPID", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgObdPid, NULL, "IDX,MODE,PID,MS",
+        "Poll a PID every MS milliseconds (MS of 0 removes it). Ex: OBDPID=0,1,0x0C,100"},
+    {"OBDBUDGET", CFG_INT, 0, {0, 0}, {0, 0}, 1, 100, cfgObdBudget, showObdBudget, NULL,
+        "Percent of CAN0 the poller may use"},
+    {"OBDHDR", CFG_TEXT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgObdHeader, NULL, "ID",
+        "ID requests are sent to (0x7DF = All ECUs). Ex: OBDHDR=0x7E0"},
+
+    {"GEN", CFG_INT, 0, {0, 0}, {0, 0}, 0, 2, cfgGen, showGen, NULL,
+        "Frame generator (0 = Stop, 1 = Start, 2 = Show status)"},
+    {"GENBUS", CFG_INT, 0, {0, 0}, {0, 0}, 0, 2, cfgGenBus, showGenBus, NULL,
+        "Bus to generate frames on (0 = CAN0, 1 = CAN1, 2 = SWCAN)"},
+    {"GENID", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgGenId, showGenId, NULL,
+        "First and last ID to sweep through"},
+    {"GENEXT", CFG_INT, 0, {0, 0}, {0, 0}, 0, 1, cfgGenExt, showGenExt, NULL,
+        "Send extended frames even for IDs under 0x800 (0 = No, 1 = Yes)"},
+    {"GENLEN", CFG_INT, 0, {0, 0}, {0, 0}, 0, 8, cfgGenLen, showGenLen, NULL,
+        "Length of generated frames"},
+    {"GENDATA", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgGenData, showGenData, NULL,
+        "Payload template (used by fixed bytes)"},
+    {"GENBYTE", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgGenByte, NULL, "IDX,MODE,MIN,MAX",
+        "Mode of one byte (0 = Fixed, 1 = Increment, 2 = Random). Ex: GENBYTE=2,1,0,255"},
+    {"GENRATE", CFG_INT, 0, {0, 0}, {0, 0}, 1, 0x7FFFFFFF, cfgGenRate, showGenRate, NULL,
+        "Frames per second to send"},
+    {"GENLOAD", CFG_INT, 0, {0, 0}, {0, 0}, 0, 100, cfgGenLoad, showGenLoad, NULL,
+        "Percent of bus capacity to use instead of GENRATE (0 = Use GENRATE)"},
+    {"GENTIME", CFG_INT, 0, {0, 0}, {0, 0}, 0, 0x7FFFFFFF, cfgGenTime, showGenTime, NULL,
+        "Stop after this many milliseconds (0 = Run until stopped)"},
+    {"GENSTOPID", CFG_INT, 0, {0, 0}, {0, 0}, -1, 0x1FFFFFFF, cfgGenStopId, showGenStopId, NULL,
+        "Stop when this ID is received on any bus (-1 = None)"},
+    {"GENSTOPIN", CFG_INT, CFG_SECTION_END, {0, 0}, {0, 0}, -1, 255, cfgGenStopInput, showGenStopInput, NULL,
+        "Stop when this digital input goes active (255 = None)"},
+
+    {"PROFILE", CFG_INT, 0, {0, 0}, {0, 0}, 0, 3, cfgProfile, showProfile, NULL,
+        "Loop profiler (0 = Off, 1 = On, 2 = Show report, 3 = Clear stats)"},
+    {"LATENCY", CFG_INT, 0, {0, 0}, {0, 0}, 0, 1, cfgLatency, NULL, "<0|1>",
+        "Frame receive to USB/SD latency (0 = Clear stats, 1 = Show report)"},
+    {"BOOTSTATS", CFG_TEXT, 0, {0, 0}, {0, 0}, 0, 0, cfgBootStats, NULL, "1",
+        "Show time from reset to CAN up, first frame and sdcard ready"},
+    {"CLOCKSTATS", CFG_TEXT, CFG_SECTION_END, {0, 0}, {0, 0}, 0, 0, cfgClockStats, NULL, "1",
+        "Show host clock sync offset, drift and round trip"},
+
+    {"BINSERIAL", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 1, cfgBinSerial, showBinSerial, NULL,
+        "Enable/Disable Binary Sending of CANBus Frames to Serial (0=Dis, 1=En)"},
+    {"FILETYPE", CFG_INT, CFG_SAVE_SETTINGS | CFG_SECTION_END, {0, 0}, {0, 0}, 0, 3, cfgFileType, showFileType, NULL,
+        "Set type of file output (0=None, 1 = Binary, 2 = GVRET, 3 = CRTD)"},
+
+    {"FILEBASE", CFG_TEXT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 0, cfgFileBase, showFileBase, NULL,
+        "Set filename base for saving"},
+    {"FILEEXT", CFG_TEXT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 0, cfgFileExt, showFileExt, NULL,
+        "Set filename ext for saving"},
+    {"FILENUM", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 65535, cfgFileNum, showFileNum, NULL,
+        "Set incrementing number for filename"},
+    {"FILEAPPEND", CFG_INT, CFG_SAVE_SETTINGS, {0, 0}, {0, 0}, 0, 1, cfgFileAppend, showFileAppend, NULL,
+        "Append to file (no numbers) or use incrementing numbers after basename (0=Incrementing Numbers, 1=Append)"},
+    {"FILEAUTO", CFG_INT, CFG_SAVE_SETTINGS | CFG_SECTION_END, {0, 0}, {0, 0}, 0, 1, cfgFileAuto, showFileAuto, NULL,
+        "Automatically start logging at startup (0=No, 1 = Yes)"},
+
+    {"DIGTOGEN", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 1, cfgDigTogEnable, showDigTogEnable, NULL,
+        "Enable digital toggling system (0 = Dis, 1 = En)"},
+    {"DIGTOGMODE", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 1, cfgDigTogMode, showDigTogMode, NULL,
+        "Set digital toggle mode (0 = Read pin, send CAN, 1 = Receive CAN, set pin)"},
+    {"DIGTOGLEVEL", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 1, cfgDigTogLevel, showDigTogLevel, NULL,
+        "Set default level of digital pin (0 = LOW, 1 = HIGH)"},
+    {"DIGTOGPIN", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 77, cfgDigTogPin, showDigTogPin, NULL,
+        "Pin to use for digital toggling system (Use Arduino Digital Pin Number)"},
+    {"DIGTOGID", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, (1 << 30) - 1, cfgDigTogId, showDigTogId, NULL,
+        "CAN ID to use for Rx or Tx"},
+    {"DIGTOGCAN#", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {1, 0}, 0, 1, cfgDigTogCan, showDigTogCan, NULL,
+        "Use CAN# with Digital Toggling System? (0 = No, 1 = Yes)"},
+    {"DIGTOGLEN", CFG_INT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 8, cfgDigTogLen, showDigTogLen, NULL,
+        "Length of frame to send (Tx) or validate (Rx)"},
+    {"DIGTOGPAYLOAD", CFG_TEXT, CFG_SAVE_DIGTOG, {0, 0}, {0, 0}, 0, 0, cfgDigTogPayload, showDigTogPayload, NULL,
+        "Payload to send or validate against (comma separated list)"},
+};
+
+#define CONFIG_CMD_COUNT (sizeof(configCmds) / sizeof(configCmds[0]))
+
+static uint8_t cmdOrder[CONFIG_CMD_COUNT];
+static bool cmdOrderBuilt = false;
+
+//Sort the rows by name once. Insertion sort is plenty for a table this size.
+static void buildCmdOrder()
+{
+    if (cmdOrderBuilt) return;
+    for (uint8_t c = 0; c < CONFIG_CMD_COUNT; c++) {
+        int pos = c;
+        while (pos > 0 && strcmp(configCmds[cmdOrder[pos - 1]].name, configCmds[c].name) > 0) {
+            cmdOrder[pos] = cmdOrder[pos - 1];
+            pos--;
+        }
+        cmdOrder[pos] = c;
+    }
+    cmdOrderBuilt = true;
+}
+
+static const CONFIG_CMD *findConfigCmd(const char *name)
+{
+    int low = 0, high = CONFIG_CMD_COUNT - 1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(name, configCmds[cmdOrder[mid]].name);
+        if (cmp == 0) return &configCmds[cmdOrder[mid]];
+        if (cmp < 0) high = mid - 1;
+        else low = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Find the row for an upper cased command name. If the name isn't in the table as typed each run of
+ * digits is taken out (up to two of them) and put into args.index, then the name is looked up again
+ * with a # in their place.
+ */
+static const CONFIG_CMD *lookupConfigCmd(const char *name, CONFIG_ARGS &args)
+{
+    char pattern[24];
+    int len = 0, indexes = 0;
+
+    args.index[0] = args.index[1] = CFG_NO_INDEX;
+    const CONFIG_CMD *cmd = findConfigCmd(name);
+    if (cmd) return cmd;
+
+    while (*name) {
+        if (len >= (int)sizeof(pattern) - 1) return NULL;
+        if (isdigit(*name)) {
+            int number = 0;
+            while (isdigit(*name)) number = (number * 10) + (*name++ - '0');
+            if (indexes >= 2 || number >= CFG_NO_INDEX) return NULL;
+            args.index[indexes++] = number;
+            pattern[len++] = '#';
+        } else pattern[len++] = *name++;
+    }
+    if (indexes == 0) return NULL;
+    pattern[len] = 0;
+    return findConfigCmd(pattern);
+}
+
+//Copy text with each # replaced by a number
+static void fillIndex(char *out, const char *text, uint8_t index)
+{
+    while (*text) {
+        if (*text == '#' && index != CFG_NO_INDEX) out += sprintf(out, "%i", index);
+        else *out++ = *text;
+        text++;
+    }
+    *out = 0;
+}
+
+/*
+ * One menu line for a row, NAME=current - help. Rows that show a value and have a # in the name
+ * get a line for every index, the rest one line with usage in place of the value.
+ */
+static void printConfigCmd(const CONFIG_CMD &cmd)
+{
+    char name[24], value[80], help[160];
+    uint8_t first = cmd.indexFirst[0], last = cmd.indexLast[0];
+
+    if (!cmd.show || !strchr(cmd.name, '#')) first = last = CFG_NO_INDEX;
+    for (int idx = first; idx <= last; idx++) {
+        fillIndex(name, cmd.name, idx);
+        fillIndex(help, cmd.help, idx);
+        if (cmd.show) cmd.show(value, idx);
+        else strcpy(value, cmd.usage);
+        Logger::console("%s=%s - %s", name, value, help);
+    }
 }
 
 void SerialConsole::printMenu()
 {
-    char buff[80];
     //Show build # here as well in case people are using the native port and don't get to see the start up messages
     SerialUSB.print("Build number: ");
     SerialUSB.println(CFG_BUILD_NUM);
@@ -70,67 +1152,26 @@ void SerialConsole::printMenu()
     SerialUSB.println("S = Stop logging to file");
     SerialUSB.println();
     SerialUSB.println("Config Commands (enter command=newvalue). Current values shown in parenthesis:");
+    SerialUSB.println("# in a command stands for a bus or slot number, ie CAN0EN=1");
     SerialUSB.println();
 
-    Logger::console("LOGLEVEL=%i - set log level (0=debug, 1=info, 2=warn, 3=error, 4=off)", settings.logLevel);
-    Logger::console("SYSTYPE=%i - set board type (0=Macchina M2)", settings.sysType);
-    SerialUSB.println();
-
-    Logger::console("CAN0EN=%i - Enable/Disable CAN0 (0 = Disable, 1 = Enable)", settings.CAN0_Enabled);
-    Logger::console("CAN0SPEED=%i - Set speed of CAN0 in baud (125000, 250000, etc)", settings.CAN0Speed);
-    Logger::console("CAN0LISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", settings.CAN0ListenOnly);
-    /*for (int i = 0; i < 8; i++) {
-        sprintf(buff, "CAN0FILTER%i=0x%%x,0x%%x,%%i,%%i (ID, Mask, Extended, Enabled)", i);
-        Logger::console(buff, settings.CAN0Filters[i].id, settings.CAN0Filters[i].mask,
-                        settings.CAN0Filters[i].extended, settings.CAN0Filters[i].enabled);
-    }*/
-    SerialUSB.println();
-
-    Logger::console("CAN1EN=%i - Enable/Disable CAN1 (0 = Disable, 1 = Enable)", settings.CAN1_Enabled);
-    Logger::console("CAN1SPEED=%i - Set speed of CAN1 in baud (125000, 250000, etc)", settings.CAN1Speed);
-    Logger::console("CAN1LISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", settings.CAN1ListenOnly);
-    /*
-    for (int i = 0; i < 8; i++) {
-        sprintf(buff, "CAN1FILTER%i=0x%%x,0x%%x,%%i,%%i (ID, Mask, Extended, Enabled)", i);
-        Logger::console(buff, settings.CAN1Filters[i].id, settings.CAN1Filters[i].mask,
-                        settings.CAN1Filters[i].extended, settings.CAN1Filters[i].enabled);
-    }*/
-    
-    SerialUSB.println();
-
-    Logger::console("SWCANEN=%i - Enable/Disable Single Wire CAN (0 = Disable, 1 = Enable)", settings.SWCAN_Enabled);
-    Logger::console("SWCANSPEED=%i - Set speed of Single Wire CAN in baud (33000, 93000, etc)", settings.SWCANSpeed);
-    Logger::console("SWCANLISTENONLY=%i - Enable/Disable Listen Only Mode (0 = Dis, 1 = En)", settings.SWCANListenOnly);
-    SerialUSB.println();
-    
-    Logger::console("CAN0SEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: CAN0SEND=0x200,4,1,2,3,4");
-    Logger::console("CAN1SEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: CAN1SEND=0x200,8,00,00,00,10,0xAA,0xBB,0xA0,00");
-    Logger::console("SWSEND=ID,LEN,<BYTES SEPARATED BY COMMAS> - Ex: SWSEND=0x100,4,10,20,30,40");
-    Logger::console("MARK=<Description of what you are doing> - Set a mark in the log file about what you are about to do.");
-    SerialUSB.println();
-
-    Logger::console("BINSERIAL=%i - Enable/Disable Binary Sending of CANBus Frames to Serial (0=Dis, 1=En)", settings.useBinarySerialComm);
-    Logger::console("FILETYPE=%i - Set type of file output (0=None, 1 = Binary, 2 = GVRET, 3 = CRTD)", settings.fileOutputType);
-    SerialUSB.println();
+    for (unsigned int c = 0; c < CONFIG_CMD_COUNT; c++) {
+        printConfigCmd(configCmds[c]);
+        if (configCmds[c].flags & CFG_SECTION_END) SerialUSB.println();
+    }
+}
 
-    Logger::console("FILEBASE=%s - Set filename base for saving", (char *)settings.fileNameBase);
-    Logger::console("FILEEXT=%s - Set filename ext for saving", (char *)settings.fileNameExt);
-    Logger::console("FILENUM=%i - Set incrementing number for filename", settings.fileNum);
-    Logger::console("FILEAPPEND=%i - Append to file (no numbers) or use incrementing numbers after basename (0=Incrementing Numbers, 1=Append)", settings.appendFile);
-    Logger::console("FILEAUTO=%i - Automatically start logging at startup (0=No, 1 = Yes)", settings.autoStartLogging);
-    SerialUSB.println();
+SerialConsole::SerialConsole()
+{
+    init();
+}
 
-    Logger::console("DIGTOGEN=%i - Enable digital toggling system (0 = Dis, 1 = En)", digToggleSettings.enabled);
-    Logger::console("DIGTOGMODE=%i - Set digital toggle mode (0 = Read pin, send CAN, 1 = Receive CAN, set pin)", digToggleSettings.mode & 1);
-    Logger::console("DIGTOGLEVEL=%i - Set default level of digital pin (0 = LOW, 1 = HIGH)", digToggleSettings.mode >> 7);
-    Logger::console("DIGTOGPIN=%i - Pin to use for digital toggling system (Use Arduino Digital Pin Number)", digToggleSettings.pin);
-    Logger::console("DIGTOGID=%X - CAN ID to use for Rx or Tx", digToggleSettings.rxTxID);
-    Logger::console("DIGTOGCAN0=%i - Use CAN0 with Digital Toggling System? (0 = No, 1 = Yes)", (digToggleSettings.mode >> 1) & 1);
-    Logger::console("DIGTOGCAN1=%i - Use CAN1 with Digital Toggling System? (0 = No, 1 = Yes)", (digToggleSettings.mode >> 2) & 1);
-    Logger::console("DIGTOGLEN=%i - Length of frame to send (Tx) or validate (Rx)", digToggleSettings.length);
-    Logger::console("DIGTOGPAYLOAD=%X,%X,%X,%X,%X,%X,%X,%X - Payload to send or validate against (comma separated list)", digToggleSettings.payload[0],
-                    digToggleSettings.payload[1], digToggleSettings.payload[2], digToggleSettings.payload[3], digToggleSettings.payload[4],
-                    digToggleSettings.payload[5], digToggleSettings.payload[6], digToggleSettings.payload[7]);
+void SerialConsole::init()
+{
+    //State variables for serial console
+    ptrBuffer = 0;
+    state = STATE_ROOT_MENU;
+    buildCmdOrder();
 }
 
 /*	There is a help menu (press H or h or ?)
@@ -181,8 +1222,7 @@ void SerialConsole::handleShortCmd()
         printMenu();
         break;
     case 'R': //reset to factory defaults.
-        settings.version = 0xFF;
-        EEPROM.write(EEPROM_ADDR, settings);
+        SettingsStore::clear();
         Logger::console("Power cycle to reset to factory defaults");
         break;
     case 's': //start logging canbus to file
@@ -222,7 +1262,12 @@ void SerialConsole::handleShortCmd()
         if (SysSettings.lawicelPollCounter == 0) SerialUSB.write(13);
         break;
     case 'F': //LAWICEL - read status bits
-        SerialUSB.print("F00"); //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
+        //bit 0 = RX Fifo Full, 1 = TX Fifo Full, 2 = Error warning, 3 = Data overrun, 5= Error passive, 6 = Arb. Lost, 7 = Bus Error
+        {
+            char buff[6];
+            sprintf(buff, "F%02X", SysHealth::readLawicelStatus(0));
+            SerialUSB.print(buff);
+        }
         SerialUSB.write(13);
         break;
     case 'V': //LAWICEL - get version number
@@ -267,36 +1312,25 @@ void SerialConsole::handleLawicelCmd()
 {
     cmdBuffer[ptrBuffer] = 0; //make sure to null terminate
     CAN_FRAME outFrame;
-    char buff[80];
     int val;
-    
+    int bus;
+
+    //Frame transmits are what a host sends most by far so they are decoded in place before any tokenizing
+    if (cmdBuffer[0] == 't' || cmdBuffer[0] == 'T' || cmdBuffer[0] == 'r' ||
+            (cmdBuffer[0] == 'R' && !SysSettings.lawicellExtendedMode)) {
+        if (!parseLawicelFrame(outFrame)) {
+            SerialUSB.write(7); //BELL means error
+            return;
+        }
+        sendFrame(&Can0, outFrame);
+        if (SysSettings.lawicelAutoPoll) SerialUSB.print(outFrame.extended ? "Z" : "z");
+        SerialUSB.write(13);
+        return;
+    }
+
     tokenizeCmdString();
 
     switch (cmdBuffer[0]) {
-    case 't': //transmit standard frame
-        outFrame.id = parseHexString(cmdBuffer + 1, 3);
-        outFrame.length = cmdBuffer[4] - '0';
-        outFrame.extended = false;
-        if (outFrame.length < 0) outFrame.length = 0;
-        if (outFrame.length > 8) outFrame.length = 8;
-        for (int data = 0; data < outFrame.length; data++) {
-            outFrame.data.bytes[data] = parseHexString(cmdBuffer + 5 + (2 * data), 2);
-        }
-        Can0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) SerialUSB.print("z");
-        break;
-    case 'T': //transmit extended frame
-        outFrame.id = parseHexString(cmdBuffer + 1, 8);
-        outFrame.length = cmdBuffer[9] - '0';
-        outFrame.extended = false;
-        if (outFrame.length < 0) outFrame.length = 0;
-        if (outFrame.length > 8) outFrame.length = 8;
-        for (int data = 0; data < outFrame.length; data++) {
-            outFrame.data.bytes[data] = parseHexString(cmdBuffer + 10 + (2 * data), 2);
-        }
-        Can0.sendFrame(outFrame);
-        if (SysSettings.lawicelAutoPoll) SerialUSB.print("Z");
-        break;
     case 'S': 
         if (!SysSettings.lawicellExtendedMode) {
             //setup canbus baud via predefined speeds
@@ -332,62 +1366,27 @@ void SerialConsole::handleLawicelCmd()
             }
         }
         else { //LAWICEL V2 - Send packet out of specified bus - S <Bus> <ID> <Data0> <Data1> <...>
-            uint8_t bytes[8];
-            uint32_t id;
-            int numBytes = 0;
-            id = strtol(tokens[2], nullptr, 16);
+            bus = lawicelBusFromName(tokens[1]);
+            outFrame.id = strtoul(tokens[2], nullptr, 16);
+            outFrame.extended = (outFrame.id > 0x7FF);
+            outFrame.rtr = 0;
+            outFrame.length = 0;
             for (int b = 0; b < 8; b++) {
-                if (tokens[3 + b][0] != 0) {
-                    bytes[b] = strtol(tokens[3 + b], nullptr, 16);
-                    numBytes++;
-                }
-                else break; //break for loop because we're obviously done.
-            }
-            if (!stricmp(tokens[1], "CAN0")) {
-                CAN_FRAME outFrame;
-                outFrame.id = id;
-                outFrame.length = numBytes;
-                outFrame.extended = false;
-                for (int b = 0; b < numBytes; b++) outFrame.data.bytes[b] = bytes[b];
-                Can0.sendFrame(outFrame);
-            }
-            if (!stricmp(tokens[1], "CAN1")) {
-                CAN_FRAME outFrame;
-                outFrame.id = id;
-                outFrame.length = numBytes;
-                outFrame.extended = false;
-                for (int b = 0; b < numBytes; b++) outFrame.data.bytes[b] = bytes[b];
-                Can1.sendFrame(outFrame);                
-            }
-            if (!stricmp(tokens[1], "SWCAN")) {
-                CAN_FRAME outFrame;
-                outFrame.id = id;
-                outFrame.length = numBytes;
-                outFrame.extended = false;
-                outFrame.rtr = 0;
-                for (int b = 0; b < numBytes; b++) outFrame.data.bytes[b] = bytes[b];                
-                SWCAN.sendFrame(outFrame);
-            }
-            if (!stricmp(tokens[1], "LIN1")) {
-            }
-            if (!stricmp(tokens[1], "LIN2")) {
+                if (tokens[3 + b][0] == 0) break; //no more data bytes
+                outFrame.data.bytes[outFrame.length++] = strtol(tokens[3 + b], nullptr, 16);
             }
+            if (bus == 0) sendFrame(&Can0, outFrame);
+            if (bus == 1) sendFrame(&Can1, outFrame);
+            if (bus == 2) sendFrame(&SWCAN, outFrame);
+            //LIN1 and LIN2 can't be sent to yet
         }
+        break;
     case 's': //setup canbus baud via register writes (we can't really do that...)
         //settings.CAN0Speed = 250000;
         break;
-    case 'r': //send a standard RTR frame (don't really... that's so deprecated its not even funny)
-        break;
-    case 'R': 
-        if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Set that we want to receive traffic from the given bus - R <BUSID>
-            if (!stricmp(tokens[1], "CAN0")) SysSettings.lawicelBusReception[0] = true;
-            if (!stricmp(tokens[1], "CAN1")) SysSettings.lawicelBusReception[1] = true; 
-            if (!stricmp(tokens[1], "SWCAN")) SysSettings.lawicelBusReception[2] = true;
-            if (!stricmp(tokens[1], "LIN1")) SysSettings.lawicelBusReception[3] = true;
-            if (!stricmp(tokens[1], "LIN2")) SysSettings.lawicelBusReception[4] = true;                                            
-        }
-        else { //Lawicel V1 - send extended RTR frame (NO! DON'T DO IT!)
-        }
+    case 'R': //Lawicel V2 - Set that we want to receive traffic from the given bus - R <BUSID>
+        bus = lawicelBusFromName(tokens[1]);
+        if (bus >= 0) SysSettings.lawicelBusReception[bus] = true;
         break;
     case 'X': //Set autopoll off/on
         if (cmdBuffer[1] == '1') SysSettings.lawicelAutoPoll = true;
@@ -430,11 +1429,8 @@ void SerialConsole::handleLawicelCmd()
         break;
     case 'H':
         if (SysSettings.lawicellExtendedMode) { //Lawicel V2 - Halt reception of traffic from given bus - H <busid>
-            if (!stricmp(tokens[1], "CAN0")) SysSettings.lawicelBusReception[0] = false;
-            if (!stricmp(tokens[1], "CAN1")) SysSettings.lawicelBusReception[1] = false; 
-            if (!stricmp(tokens[1], "SWCAN")) SysSettings.lawicelBusReception[2] = false;
-            if (!stricmp(tokens[1], "LIN1")) SysSettings.lawicelBusReception[3] = false;
-            if (!stricmp(tokens[1], "LIN2")) SysSettings.lawicelBusReception[4] = false;                        
+            bus = lawicelBusFromName(tokens[1]);
+            if (bus >= 0) SysSettings.lawicelBusReception[bus] = false;
         } 
         break;        
     case 'U': //set uart speed. We just ignore this. You can't set a baud rate on a USB CDC port
@@ -459,10 +1455,10 @@ void SerialConsole::handleLawicelCmd()
                 //can't set speed of SWCAN yet
             }
             if (!stricmp(tokens[1], "LIN1")) {
-                //can't set speed of LIN1 yet
+                LinBus::begin(0, speed);
             }
             if (!stricmp(tokens[1], "LIN2")) {
-                //can't set speed of LIN2 yet
+                LinBus::begin(1, speed);
             }
         }
         break;
@@ -470,440 +1466,57 @@ void SerialConsole::handleLawicelCmd()
     SerialUSB.write(13);
 }
 
-/*For simplicity the configuration setting code uses four characters for each configuration choice. This makes things easier for
- comparison purposes.
- */
 void SerialConsole::handleConfigCmd()
 {
-    int i;
-    int newValue;
-    char *newString;
-    bool writeEEPROM = false;
-    bool writeDigEE = false;
-    char *dataTok;
+    CONFIG_ARGS args;
+    char name[24];
+    int hashes = 0;
+    int i = 0;
 
-    //Logger::debug("Cmd size: %i", ptrBuffer);
-    if (ptrBuffer < 6)
-        return; //4 digit command, =, value is at least 6 characters
     cmdBuffer[ptrBuffer] = 0; //make sure to null terminate
-    String cmdString = String();
-    unsigned char whichEntry = '0';
-    i = 0;
-
     while (cmdBuffer[i] != '=' && i < ptrBuffer) {
-        cmdString.concat(String(cmdBuffer[i++]));
+        if (i >= (int)sizeof(name) - 1) {
+            Logger::console("Unknown command");
+            return;
+        }
+        name[i] = toupper(cmdBuffer[i]);
+        i++;
     }
-    i++; //skip the =
+    name[i++] = 0; //skip the =
     if (i >= ptrBuffer) {
         Logger::console("Command needs a value..ie TORQ=3000");
         Logger::console("");
         return; //or, we could use this to display the parameter instead of setting
     }
 
-    // strtol() is able to parse also hex values (e.g. a string "0xCAFE"), useful for enable/disable by device id
-    newValue = strtol((char *) (cmdBuffer + i), NULL, 0); //try to turn the string into a number
-    newString = (char *)(cmdBuffer + i); //leave it as a string
-
-    cmdString.toUpperCase();
-
-    if (cmdString == String("CAN0EN")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting CAN0 Enabled to %i", newValue);
-        settings.CAN0_Enabled = newValue;
-        if (newValue == 1) Can0.begin(settings.CAN0Speed, 255);
-        else Can0.disable();
-        writeEEPROM = true;
-    } else if (cmdString == String("CAN1EN")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting CAN1 Enabled to %i", newValue);
-        if (newValue == 1) Can1.begin(settings.CAN1Speed, 255);
-        else Can1.disable();
-        settings.CAN1_Enabled = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("SWCANEN")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting SWCAN Enabled to %i", newValue);
-        if (newValue == 1) {
-            SWCAN.setupSW(settings.SWCANSpeed);       
-            delay(20);
-            SWCAN.mode(3); // Go to normal mode. 0 - Sleep, 1 - High Speed, 2 - High Voltage Wake-Up, 3 - Normal
-            attachInterrupt(SWC_INT, CANHandler, FALLING); //enable interrupt for SWCAN
-        }
-        else {
-            SWCAN.Reset();
-            SWCAN.mode(0); //go to sleep
-        }
-        settings.SWCAN_Enabled = newValue;
-        writeEEPROM = true;        
-    } else if (cmdString == String("CAN0SPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting CAN0 Baud Rate to %i", newValue);
-            settings.CAN0Speed = newValue;
-            if (settings.CAN0_Enabled) Can0.begin(settings.CAN0Speed, 255);
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
-    } else if (cmdString == String("CAN1SPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting CAN1 Baud Rate to %i", newValue);
-            settings.CAN1Speed = newValue;
-            if (settings.CAN1_Enabled) Can1.begin(settings.CAN1Speed, 255);
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
-    } else if (cmdString == String("SWCANSPEED")) {
-        if (newValue > 0 && newValue <= 1000000) {
-            Logger::console("Setting Single Wire CAN Baud Rate to %i", newValue);
-            settings.SWCANSpeed = newValue;
-            if (settings.SWCAN_Enabled) 
-            {               
-                SWCAN.setupSW(settings.SWCANSpeed);       
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid baud rate! Enter a value 1 - 1000000");
-    } else if (cmdString == String("CAN0LISTENONLY")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting CAN0 Listen Only to %i", newValue);
-            settings.CAN0ListenOnly = newValue;
-            if (settings.CAN0ListenOnly) {
-                Can0.enable_autobaud_listen_mode();
-            } else {
-                Can0.disable_autobaud_listen_mode();
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("CAN1LISTENONLY")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting CAN1 Listen Only to %i", newValue);
-            settings.CAN1ListenOnly = newValue;
-            if (settings.CAN1ListenOnly) {
-                Can1.enable_autobaud_listen_mode();
-            } else {
-                Can1.disable_autobaud_listen_mode();
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid setting! Enter a value 0 - 1");
-    } else if (cmdString == String("SWCANLISTENONLY")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting SWCAN Listen Only to %i", newValue);
-            settings.SWCANListenOnly = newValue;
-            if (settings.CAN1ListenOnly) {
-                //Can1.enable_autobaud_listen_mode();
-            } else {
-                //Can1.disable_autobaud_listen_mode();
-            }
-            writeEEPROM = true;
-        } else Logger::console("Invalid setting! Enter a value 0 - 1");        
-    } else if (cmdString == String("CAN0FILTER0")) { //someone should kick me in the face for this laziness... FIX THIS!
-        handleFilterSet(0, 0, newString);
-    } else if (cmdString == String("CAN0FILTER1")) {
-        if (handleFilterSet(0, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER2")) {
-        if (handleFilterSet(0, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER3")) {
-        if (handleFilterSet(0, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER4")) {
-        if (handleFilterSet(0, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER5")) {
-        if (handleFilterSet(0, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER6")) {
-        if (handleFilterSet(0, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0FILTER7")) {
-        if (handleFilterSet(0, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER0")) {
-        if (handleFilterSet(1, 0, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER1")) {
-        if (handleFilterSet(1, 1, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER2")) {
-        if (handleFilterSet(1, 2, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER3")) {
-        if (handleFilterSet(1, 3, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER4")) {
-        if (handleFilterSet(1, 4, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER5")) {
-        if (handleFilterSet(1, 5, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER6")) {
-        if (handleFilterSet(1, 6, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN1FILTER7")) {
-        if (handleFilterSet(1, 7, newString)) writeEEPROM = true;
-    } else if (cmdString == String("CAN0SEND")) {
-        handleCANSend(Can0, newString);
-    } else if (cmdString == String("CAN1SEND")) {
-        handleCANSend(Can1, newString);
-    } else if (cmdString == String("SWSEND")) {
-        handleSWCANSend(newString);
-    } else if (cmdString == String("MARK")) { //just ascii based for now
-        if (settings.fileOutputType == GVRET) Logger::file("Mark: %s", newString);
-        if (settings.fileOutputType == CRTD) {
-            uint8_t buff[40];
-            sprintf((char *)buff, "%f CEV ", millis() / 1000.0f);
-            Logger::fileRaw(buff, strlen((char *)buff));
-            Logger::fileRaw((uint8_t *)newString, strlen(newString));
-            buff[0] = '\r';
-            buff[1] = '\n';
-            Logger::fileRaw(buff, 2);
-        }
-        if (!settings.useBinarySerialComm) Logger::console("Mark: %s", newString);
-
-    } else if (cmdString == String("BINSERIAL")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting Serial Binary Comm to %i", newValue);
-        settings.useBinarySerialComm = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("FILETYPE")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 3) newValue = 3;
-        Logger::console("Setting File Output Type to %i", newValue);
-        settings.fileOutputType = (FILEOUTPUTTYPE)newValue; //the numbers all intentionally match up so this works
-        writeEEPROM = true;
-    } else if (cmdString == String("FILEBASE")) {
-        Logger::console("Setting File Base Name to %s", newString);
-        strcpy((char *)settings.fileNameBase, newString);
-        writeEEPROM = true;
-    } else if (cmdString == String("FILEEXT")) {
-        Logger::console("Setting File Extension to %s", newString);
-        strcpy((char *)settings.fileNameExt, newString);
-        writeEEPROM = true;
-    } else if (cmdString == String("FILENUM")) {
-        Logger::console("Setting File Incrementing Number Base to %i", newValue);
-        settings.fileNum = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("FILEAPPEND")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting File Append Mode to %i", newValue);
-        settings.appendFile = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("FILEAUTO")) {
-        if (newValue < 0) newValue = 0;
-        if (newValue > 1) newValue = 1;
-        Logger::console("Setting Auto File Logging Mode to %i", newValue);
-        settings.autoStartLogging = newValue;
-        writeEEPROM = true;
-    } else if (cmdString == String("SYSTYPE")) {
-        if (newValue < 1 && newValue >= 0) {
-            settings.sysType = newValue;
-            writeEEPROM = true;
-            Logger::console("System type updated. Power cycle to apply.");
-        } else Logger::console("Invalid system type. Please enter a value between 0 and 0. Yes, just 0");
-    } else if (cmdString == String("DIGTOGEN")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting Digital Toggle System Enable to %i", newValue);
-            digToggleSettings.enabled = newValue;
-            writeDigEE = true;
-        } else Logger::console("Invalid enable value. Must be either 0 or 1");
-    } else if (cmdString == String("DIGTOGMODE")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting Digital Toggle Mode to %i", newValue);
-            if (newValue == 0) digToggleSettings.mode &= ~1;
-            if (newValue == 1) digToggleSettings.mode |= 1;
-            writeDigEE = true;
-        } else Logger::console("Invalid mode. Must be either 0 or 1");
-    } else if (cmdString == String("DIGTOGLEVEL")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting Digital Toggle Starting Level to %i", newValue);
-            if (newValue == 0) digToggleSettings.mode &= ~0x80;
-            if (newValue == 1) digToggleSettings.mode |= 0x80;
-            writeDigEE = true;
-        } else Logger::console("Invalid default level. Must be either 0 or 1");
-    } else if (cmdString == String("DIGTOGPIN")) {
-        if (newValue >= 0 && newValue <= 77) {
-            Logger::console("Setting Digital Toggle Pin to %i", newValue);
-            digToggleSettings.pin = newValue;
-            writeDigEE = true;
-        } else Logger::console("Invalid pin. Must be between 0 and 77");
-    } else if (cmdString == String("DIGTOGID")) {
-        if (newValue >= 0 && newValue < (1 << 30)) {
-            Logger::console("Setting Digital Toggle CAN ID to %X", newValue);
-            digToggleSettings.rxTxID = newValue;
-            writeDigEE = true;
-        } else Logger::console("Invalid CAN ID. Must be either an 11 or 29 bit ID");
-    } else if (cmdString == String("DIGTOGCAN0")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting Digital Toggle CAN0 Usage to %i", newValue);
-            if (newValue == 0) digToggleSettings.mode &= ~2;
-            if (newValue == 1) digToggleSettings.mode |= 2;
-            writeDigEE = true;
-        } else Logger::console("Invalid value. Must be either 0 or 1");
-    } else if (cmdString == String("DIGTOGCAN1")) {
-        if (newValue >= 0 && newValue <= 1) {
-            Logger::console("Setting Digital Toggle CAN1 Usage to %i", newValue);
-            if (newValue == 0) digToggleSettings.mode &= ~4;
-            if (newValue == 1) digToggleSettings.mode |= 4;
-            writeDigEE = true;
-        } else Logger::console("Invalid value. Must be either 0 or 1");
-    } else if (cmdString == String("DIGTOGLEN")) {
-        if (newValue >= 0 && newValue <= 8) {
-            Logger::console("Setting Digital Toggle Frame Length to %i", newValue);
-            digToggleSettings.length = newValue;
-            writeDigEE = true;
-        } else Logger::console("Invalid length. Must be between 0 and 8");
-    } else if (cmdString == String("DIGTOGPAYLOAD")) {
-        dataTok = strtok(newString, ",");
-        if (dataTok) {
-            digToggleSettings.payload[0] = strtol(dataTok, NULL, 0);
-            i = 1;
-            while (i < 8 && dataTok) {
-                dataTok = strtok(NULL, ",");
-                if (dataTok) {
-                    digToggleSettings.payload[i] = strtol(dataTok, NULL, 0);
-                    i += 1;
-                }
-            }
-            writeDigEE = true;
-            Logger::console("Set new payload bytes");
-        } else Logger::console("Error processing payload");
-    } else if (cmdString == String("LOGLEVEL")) {
-        switch (newValue) {
-        case 0:
-            Logger::setLoglevel(Logger::Debug);
-            settings.logLevel = 0;
-            Logger::console("setting loglevel to 'debug'");
-            writeEEPROM = true;
-            break;
-        case 1:
-            Logger::setLoglevel(Logger::Info);
-            settings.logLevel = 1;
-            Logger::console("setting loglevel to 'info'");
-            writeEEPROM = true;
-            break;
-        case 2:
-            Logger::console("setting loglevel to 'warning'");
-            settings.logLevel = 2;
-            Logger::setLoglevel(Logger::Warn);
-            writeEEPROM = true;
-            break;
-        case 3:
-            Logger::console("setting loglevel to 'error'");
-            settings.logLevel = 3;
-            Logger::setLoglevel(Logger::Error);
-            writeEEPROM = true;
-            break;
-        case 4:
-            Logger::console("setting loglevel to 'off'");
-            settings.logLevel = 4;
-            Logger::setLoglevel(Logger::Off);
-            writeEEPROM = true;
-            break;
-        }
-
-    } else {
+    const CONFIG_CMD *cmd = lookupConfigCmd(name, args);
+    if (!cmd) {
         Logger::console("Unknown command");
+        return;
     }
-    if (writeEEPROM) {
-        EEPROM.write(EEPROM_ADDR, settings);
-    }
-    if (writeDigEE) {
-        EEPROM.write(EEPROM_ADDR + 1024, digToggleSettings);
+    for (const char *p = cmd->name; *p; p++) if (*p == '#') hashes++;
+    for (int n = 0; n < hashes; n++) {
+        if (args.index[n] < cmd->indexFirst[n] || args.index[n] > cmd->indexLast[n]) {
+            Logger::console("Invalid index! Enter a value %i - %i", cmd->indexFirst[n], cmd->indexLast[n]);
+            return;
+        }
     }
-}
-
-//CAN0FILTER%i=%%i,%%i,%%i,%%i (ID, Mask, Extended, Enabled)", i);
-bool SerialConsole::handleFilterSet(uint8_t bus, uint8_t filter, char *values)
-{
-    if (filter < 0 || filter > 7) return false;
-    if (bus < 0 || bus > 1) return false;
-
-    //there should be four tokens
-    char *idTok = strtok(values, ",");
-    char *maskTok = strtok(NULL, ",");
-    char *extTok = strtok(NULL, ",");
-    char *enTok = strtok(NULL, ",");
-
-    if (!idTok) return false; //if any of them were null then something was wrong. Abort.
-    if (!maskTok) return false;
-    if (!extTok) return false;
-    if (!enTok) return false;
 
-    int idVal = strtol(idTok, NULL, 0);
-    int maskVal = strtol(maskTok, NULL, 0);
-    int extVal = strtol(extTok, NULL, 0);
-    int enVal = strtol(enTok, NULL, 0);
-
-    Logger::console("Setting CAN%iFILTER%i to ID 0x%x Mask 0x%x Extended %i Enabled %i", bus, filter, idVal, maskVal, extVal, enVal);
-
-    if (bus == 0) {
-        //settings.CAN0Filters[filter].id = idVal;
-        //settings.CAN0Filters[filter].mask = maskVal;
-        //settings.CAN0Filters[filter].extended = extVal;
-        //settings.CAN0Filters[filter].enabled = enVal;
-        //Can0.setRXFilter(filter, idVal, maskVal, extVal);
-    } else if (bus == 1) {
-        //settings.CAN1Filters[filter].id = idVal;
-        //settings.CAN1Filters[filter].mask = maskVal;
-        //settings.CAN1Filters[filter].extended = extVal;
-        //settings.CAN1Filters[filter].enabled = enVal;
-        //Can1.setRXFilter(filter, idVal, maskVal, extVal);
+    // strtol() is able to parse also hex values (e.g. a string "0xCAFE"), useful for enable/disable by device id
+    args.text = (char *)(cmdBuffer + i);
+    args.value = strtol(args.text, NULL, 0);
+    if (cmd->argType == CFG_INT && (args.value < cmd->min || args.value > cmd->max)) {
+        Logger::console("Invalid setting! Enter a value %l - %l", cmd->min, cmd->max);
+        return;
     }
 
-    return true;
-}
-
-bool SerialConsole::handleCANSend(CANRaw &port, char *inputString)
-{
-    char *idTok = strtok(inputString, ",");
-    char *lenTok = strtok(NULL, ",");
-    char *dataTok;
-    CAN_FRAME frame;
-
-    if (!idTok) return false;
-    if (!lenTok) return false;
-
-    int idVal = strtol(idTok, NULL, 0);
-    int lenVal = strtol(lenTok, NULL, 0);
-
-    for (int i = 0; i < lenVal; i++) {
-        dataTok = strtok(NULL, ",");
-        if (!dataTok) return false;
-        frame.data.byte[i] = strtol(dataTok, NULL, 0);
+    if (!cmd->handler(args)) return;
+    if (cmd->flags & CFG_SAVE_SETTINGS) {
+        SettingsStore::save();
     }
-
-    //things seem good so try to send the frame.
-    frame.id = idVal;
-    if (idVal >= 0x7FF) frame.extended = true;
-    else frame.extended = false;
-    frame.rtr = 0;
-    frame.length = lenVal;
-    port.sendFrame(frame);
-    
-    Logger::console("Sending frame with id: 0x%x len: %i", frame.id, frame.length);
-    SysSettings.txToggle = !SysSettings.txToggle;
-    setLED(SysSettings.LED_CANTX, SysSettings.txToggle);
-    return true;
-}
-
-bool SerialConsole::handleSWCANSend(char *inputString)
-{
-    char *idTok = strtok(inputString, ",");
-    char *lenTok = strtok(NULL, ",");
-    char *dataTok;
-    CAN_FRAME frame;
-
-    if (!idTok) return false;
-    if (!lenTok) return false;
-
-    int idVal = strtol(idTok, NULL, 0);
-    int lenVal = strtol(lenTok, NULL, 0);
-
-    for (int i = 0; i < lenVal; i++) {
-        dataTok = strtok(NULL, ",");
-        if (!dataTok) return false;
-        frame.data.byte[i] = strtol(dataTok, NULL, 0);
+    if (cmd->flags & CFG_SAVE_DIGTOG) {
+        EEPROM.write(EEPROM_ADDR + 1024, digToggleSettings);
     }
-
-    //things seem good so try to send the frame.
-    frame.id = idVal;
-    if (idVal >= 0x7FF) frame.extended = true;
-    else frame.extended = false;
-    frame.rtr = 0;
-    frame.length = lenVal;
-    SWCAN.sendFrame(frame);
-    Logger::console("Sending frame with id: 0x%x len: %i", frame.id, frame.length);
-    SysSettings.txToggle = !SysSettings.txToggle;
-    setLED(SysSettings.LED_CANTX, SysSettings.txToggle);
-    return true;
 }
 
 unsigned int SerialConsole::parseHexCharacter(char chr)
@@ -923,22 +1536,32 @@ unsigned int SerialConsole::parseHexString(char *str, int length)
     return result;
 }
 
-//Tokenize cmdBuffer on space boundaries - up to 10 tokens supported
+bool SerialConsole::isHexString(char *str, int length)
+{
+    for (int i = 0; i < length; i++) {
+        if (!isxdigit(str[i])) return false;
+    }
+    return true;
+}
+
+/*
+ * Split cmdBuffer on spaces in place. Nothing is copied, each token points into cmdBuffer and the
+ * spaces after them are overwritten with terminators. Unused tokens point to an empty string.
+ */
 void SerialConsole::tokenizeCmdString() {
-   int idx = 0;
-   char *tok;
-   
-   for (int i = 0; i < 13; i++) tokens[i][0] = 0;
-   
-   tok = strtok(cmdBuffer, " ");
-   if (tok != nullptr) strcpy(tokens[idx], tok);
-       else tokens[idx][0] = 0;
-   while (tokens[idx] != nullptr && idx < 13) {
-       idx++;
-       tok = strtok(nullptr, " ");
-       if (tok != nullptr) strcpy(tokens[idx], tok);
-            else tokens[idx][0] = 0;
-   }
+    static char emptyToken[1];
+    char *pos = cmdBuffer;
+    int idx = 0;
+
+    while (idx < 14) {
+        while (*pos == ' ') pos++;
+        if (*pos == 0) break;
+        tokens[idx++] = pos;
+        while (*pos != ' ' && *pos != 0) pos++;
+        if (*pos == ' ') *pos++ = 0;
+    }
+    emptyToken[0] = 0;
+    while (idx < 14) tokens[idx++] = emptyToken;
 }
 
 void SerialConsole::uppercaseToken(char *token) {
@@ -975,11 +1598,11 @@ void SerialConsole::printBusName(int bus) {
 
 //Expecting to find ID in tokens[2] then zero or more data bytes
 bool SerialConsole::parseLawicelCANCmd(CAN_FRAME &frame) {
-    if (tokens[2] == nullptr) return false;
+    if (tokens[2][0] == 0) return false;
     frame.id = strtol(tokens[2], nullptr, 16);
     int idx = 3;
     int dataLen = 0;
-    while (tokens[idx] != nullptr) {
+    while (idx < 14 && tokens[idx][0] != 0 && dataLen < 8) {
         frame.data.bytes[dataLen++] = strtol(tokens[idx], nullptr, 16);
         idx++;
     }
@@ -987,3 +1610,37 @@ bool SerialConsole::parseLawicelCANCmd(CAN_FRAME &frame) {
         
     return true;
 }
+
+/*
+ * Decode a LAWICEL transmit straight out of cmdBuffer:
+ * tiiil[dd..] standard, Tiiiiiiiil[dd..] extended, riiil and Riiiiiiiil remote frames (no data)
+ */
+bool SerialConsole::parseLawicelFrame(CAN_FRAME &frame) {
+    bool extended = (cmdBuffer[0] == 'T' || cmdBuffer[0] == 'R');
+    bool remote = (cmdBuffer[0] == 'r' || cmdBuffer[0] == 'R');
+    int idLen = extended ? 8 : 3;
+    char *data = cmdBuffer + idLen + 2;
+
+    if (ptrBuffer < idLen + 2 || !isHexString(cmdBuffer + 1, idLen)) return false;
+    if (cmdBuffer[idLen + 1] < '0' || cmdBuffer[idLen + 1] > '8') return false;
+    frame.id = parseHexString(cmdBuffer + 1, idLen);
+    if (frame.id > (extended ? 0x1FFFFFFFul : 0x7FFul)) return false;
+    frame.extended = extended;
+    frame.rtr = remote ? 1 : 0;
+    frame.length = cmdBuffer[idLen + 1] - '0';
+    if (remote) return true;
+
+    if (ptrBuffer < idLen + 2 + frame.length * 2 || !isHexString(data, frame.length * 2)) return false;
+    for (int b = 0; b < frame.length; b++) frame.data.bytes[b] = parseHexString(data + (2 * b), 2);
+    return true;
+}
+
+//Bus index for a LAWICEL V2 bus name or -1 if there's no such bus
+int SerialConsole::lawicelBusFromName(char *name) {
+    const char *names[NUM_BUSES] = {"CAN0", "CAN1", "SWCAN", "LIN1", "LIN2"};
+
+    for (int b = 0; b < NUM_BUSES; b++) {
+        if (!stricmp(name, names[b])) return b;
+    }
+    return -1;
+}
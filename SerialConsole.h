@@ -46,7 +46,7 @@ protected:
 
 private:
     char cmdBuffer[80];
-    char tokens[14][10];
+    char *tokens[14];   //point into cmdBuffer, see tokenizeCmdString()
     int ptrBuffer;
     int state;
 
@@ -55,14 +55,14 @@ private:
     void handleShortCmd();
     void handleConfigCmd();
     void handleLawicelCmd();
-    bool handleFilterSet(uint8_t bus, uint8_t filter, char *values);
-    bool handleCANSend(CANRaw &port, char *inputString);
-    bool handleSWCANSend(char *inputString);
     unsigned int parseHexCharacter(char chr);
     unsigned int parseHexString(char *str, int length);
+    bool isHexString(char *str, int length);
     void tokenizeCmdString();
     void uppercaseToken(char *token);
     bool parseLawicelCANCmd(CAN_FRAME &frame);
+    bool parseLawicelFrame(CAN_FRAME &frame);
+    int lawicelBusFromName(char *name);
 };
 
 #endif /* SERIALCONSOLE_H_ */
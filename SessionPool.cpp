@@ -0,0 +1,93 @@
+/*
+ * SessionPool.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SessionPool.h"
+#include "Logger.h"
+
+/*
+ * The pool is cut into SESSION_POOL_BLOCK byte blocks and a buffer is the first run of free blocks
+ * long enough for it. Buffers live for one message and there are only ever a few of them so a
+ * first fit scan is plenty. If there's no room the caller drops the message, same as when it has
+ * no session left.
+ */
+
+#define SESSION_RUN_TAIL    0xFF
+
+uint8_t SessionPool::pool[SESSION_POOL_SIZE] __attribute__((aligned(4)));
+uint8_t SessionPool::runs[SESSION_POOL_BLOCKS];
+uint16_t SessionPool::blocksUsed = 0;
+uint16_t SessionPool::peakUsed = 0;
+uint32_t SessionPool::refused = 0;
+
+void SessionPool::setup()
+{
+    for (int b = 0; b < SESSION_POOL_BLOCKS; b++) runs[b] = 0;
+    blocksUsed = peakUsed = 0;
+    refused = 0;
+}
+
+//Returns NULL if there isn't a long enough run of free blocks
+uint8_t *SessionPool::alloc(uint16_t length)
+{
+    uint16_t need = (length + SESSION_POOL_BLOCK - 1) / SESSION_POOL_BLOCK;
+    uint16_t start = 0, found = 0;
+
+    if (need == 0) need = 1;
+    for (int b = 0; b < SESSION_POOL_BLOCKS; b++) {
+        if (runs[b] != 0) {
+            found = 0;
+            continue;
+        }
+        if (found == 0) start = b;
+        if (++found < need) continue;
+
+        runs[start] = need;
+        for (int t = start + 1; t < start + need; t++) runs[t] = SESSION_RUN_TAIL;
+        blocksUsed += need;
+        if (blocksUsed > peakUsed) peakUsed = blocksUsed;
+        return pool + (start * SESSION_POOL_BLOCK);
+    }
+    refused++;
+    return NULL;
+}
+
+void SessionPool::release(uint8_t *buf)
+{
+    int first, count;
+
+    if (buf == NULL || buf < pool || buf >= pool + SESSION_POOL_SIZE) return;
+    first = (buf - pool) / SESSION_POOL_BLOCK;
+    count = runs[first];
+    if (count == 0 || count == SESSION_RUN_TAIL) return; //not the start of a buffer
+    for (int b = first; b < first + count; b++) runs[b] = 0;
+    blocksUsed -= count;
+}
+
+void SessionPool::printStatus()
+{
+    Logger::console("Session pool: %i of %i blocks of %i bytes in use (peak %i), %l buffers refused", blocksUsed,
+                    SESSION_POOL_BLOCKS, SESSION_POOL_BLOCK, peakUsed, refused);
+}
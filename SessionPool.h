@@ -0,0 +1,54 @@
+/*
+ * SessionPool.h
+ *
+ * One pool of reassembly memory shared by the ISO-TP engine, the ISO-TP sniffer and J1939
+ * transport sessions. A message takes a buffer of the size it announced when it starts and
+ * gives it back when it finishes, so only the messages actually in progress cost RAM.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SESSIONPOOL_H_
+#define SESSIONPOOL_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define SESSION_POOL_BLOCKS (SESSION_POOL_SIZE / SESSION_POOL_BLOCK)
+
+class SessionPool {
+public:
+    static void setup();
+    static uint8_t *alloc(uint16_t length);
+    static void release(uint8_t *buf);
+    static void printStatus();
+
+private:
+    static uint8_t pool[SESSION_POOL_SIZE];
+    static uint8_t runs[SESSION_POOL_BLOCKS];   //blocks in the buffer at its first block, SESSION_RUN_TAIL for the rest, 0 = free
+    static uint16_t blocksUsed;
+    static uint16_t peakUsed;
+    static uint32_t refused;
+};
+
+#endif /* SESSIONPOOL_H_ */
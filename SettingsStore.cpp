@@ -0,0 +1,181 @@
+/*
+ * SettingsStore.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SettingsStore.h"
+#include "Logger.h"
+#include <stddef.h>
+
+/*
+ * The journal is SETTINGS_SLOTS slots of SETTINGS_SLOT_SIZE bytes starting at SETTINGS_JOURNAL_ADDR.
+ * Each save goes into the slot after the newest record with the next sequence number. At boot only
+ * the headers are read (one short read per slot) to find the newest record, then that record is
+ * read in one sequential read and its CRC checked. If the CRC is bad, say power went away half way
+ * through writing it, the next newest is tried.
+ *
+ * The record is built in record[] by loop() and handed to EEPROM.writeRaw() which writes it out a
+ * page at a time in the background. Saves that come in while that is going on are folded into one
+ * more record once it is done.
+ */
+
+extern EEPROMSettings settings;
+
+uint8_t SettingsStore::record[SETTINGS_SLOT_SIZE];
+uint32_t SettingsStore::sequence = 0;
+int16_t SettingsStore::lastSlot = -1;
+boolean SettingsStore::savePending = false;
+boolean SettingsStore::clearPending = false;
+
+//CRC-32 (same as zlib), a nibble at a time to keep the table small. Pass 0 to start.
+static uint32_t crc32Update(uint32_t crc, const uint8_t *data, uint16_t length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    crc = ~crc;
+    for (int i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+uint32_t SettingsStore::slotAddress(int16_t slot)
+{
+    return SETTINGS_JOURNAL_ADDR + (uint32_t)slot * SETTINGS_SLOT_SIZE;
+}
+
+//CRC of the record in record[], everything but the crc field itself
+uint32_t SettingsStore::calcCrc()
+{
+    SETTINGS_RECORD_HEADER *header = (SETTINGS_RECORD_HEADER *)record;
+    uint32_t crc = crc32Update(0, record, offsetof(SETTINGS_RECORD_HEADER, crc));
+    return crc32Update(crc, record + sizeof(SETTINGS_RECORD_HEADER), header->length);
+}
+
+//Read a whole slot into record[]. True if it holds a record with a good CRC.
+boolean SettingsStore::readRecord(int16_t slot)
+{
+    SETTINGS_RECORD_HEADER *header = (SETTINGS_RECORD_HEADER *)record;
+
+    EEPROM.readRaw(slotAddress(slot), record, SETTINGS_SLOT_SIZE);
+    if (header->magic != SETTINGS_MAGIC || header->length > sizeof(EEPROMSettings)) return false;
+    return header->crc == calcCrc();
+}
+
+//Get anything still queued into the chip. Only for the odd caller that reloads right after saving.
+void SettingsStore::flush()
+{
+    while (savePending || clearPending || EEPROM.isBusy()) {
+        loop();
+        EEPROM.loop();
+    }
+}
+
+/*
+ * Copy the newest stored settings over value. Returns how many bytes were stored, which can be less
+ * than sizeof(EEPROMSettings) if fields were added since, or 0 if there's nothing (or a factory reset
+ * was asked for) and value is left alone. Settings at the old fixed address are moved into the
+ * journal the first time.
+ */
+int SettingsStore::load(EEPROMSettings &value)
+{
+    SETTINGS_RECORD_HEADER header;
+    uint32_t seqs[SETTINGS_SLOTS];
+
+    flush();
+    sequence = 0;
+    lastSlot = -1;
+    for (int s = 0; s < SETTINGS_SLOTS; s++) {
+        EEPROM.readRaw(slotAddress(s), (uint8_t *)&header, sizeof(header));
+        seqs[s] = (header.magic == SETTINGS_MAGIC) ? header.sequence : 0;
+        //new records have to be newer than anything in there, good CRC or not
+        if (seqs[s] != 0 && (lastSlot < 0 || seqs[s] > sequence)) {
+            sequence = seqs[s];
+            lastSlot = s;
+        }
+    }
+
+    while (true) {
+        int best = -1;
+        for (int s = 0; s < SETTINGS_SLOTS; s++) {
+            if (seqs[s] != 0 && (best < 0 || seqs[s] > seqs[best])) best = s;
+        }
+        if (best < 0) break;
+        if (readRecord(best)) {
+            SETTINGS_RECORD_HEADER *found = (SETTINGS_RECORD_HEADER *)record;
+            Logger::info("Settings record %i of %i, sequence %l", best, SETTINGS_SLOTS, found->sequence);
+            memcpy(&value, record + sizeof(SETTINGS_RECORD_HEADER), found->length);
+            return found->length;
+        }
+        Logger::warn("Settings record in slot %i is damaged, using the one before it", best);
+        seqs[best] = 0;
+    }
+
+    if (lastSlot < 0) {
+        EEPROMSettings legacy;
+        EEPROM.readRaw(EEPROM_ADDR, (uint8_t *)&legacy, sizeof(legacy));
+        if (legacy.version == EEPROM_VER) {
+            Logger::console("Moving settings into the EEPROM journal");
+            value = legacy;
+            savePending = true;
+            return sizeof(legacy);
+        }
+    }
+    return 0;
+}
+
+//Store the current settings. The write happens from loop().
+void SettingsStore::save()
+{
+    savePending = true;
+    clearPending = false;
+}
+
+//Store a record that says to use the defaults at the next boot
+void SettingsStore::clear()
+{
+    clearPending = true;
+    savePending = false;
+}
+
+void SettingsStore::loop()
+{
+    SETTINGS_RECORD_HEADER *header = (SETTINGS_RECORD_HEADER *)record;
+
+    if (!savePending && !clearPending) return;
+    if (EEPROM.rawBusy()) return; //record[] is still being written out
+
+    header->magic = SETTINGS_MAGIC;
+    header->length = clearPending ? 0 : sizeof(EEPROMSettings);
+    header->sequence = ++sequence;
+    memcpy(record + sizeof(SETTINGS_RECORD_HEADER), &settings, header->length);
+    header->crc = calcCrc();
+    lastSlot = (lastSlot + 1) % SETTINGS_SLOTS;
+    EEPROM.writeRaw(slotAddress(lastSlot), record, sizeof(SETTINGS_RECORD_HEADER) + header->length);
+    savePending = clearPending = false;
+}
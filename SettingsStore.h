@@ -0,0 +1,71 @@
+/*
+ * SettingsStore.h
+ *
+ * Keeps the system settings as a journal of records in EEPROM instead of at one fixed address.
+ * Every save appends a CRC checked record to the next slot, so a write that gets cut off leaves
+ * the previous record in place and the writes are spread over the whole journal area.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SETTINGSSTORE_H_
+#define SETTINGSSTORE_H_
+
+#include <Arduino.h>
+#include <due_wire.h>
+#include "config.h"
+#include "EEPROM.h"
+
+#define SETTINGS_MAGIC      0x5354
+
+typedef struct {
+    uint16_t magic;         //SETTINGS_MAGIC, anything else is an empty slot
+    uint16_t length;        //bytes of EEPROMSettings that follow, 0 for a factory reset
+    uint32_t sequence;      //one more than the record before it. The highest valid one is current
+    uint32_t crc;           //CRC-32 of the fields above and the settings bytes
+} SETTINGS_RECORD_HEADER;
+
+#define SETTINGS_SLOT_SIZE  (((sizeof(SETTINGS_RECORD_HEADER) + sizeof(EEPROMSettings) + EEPROM_PAGE_SIZE - 1) / EEPROM_PAGE_SIZE) * EEPROM_PAGE_SIZE)
+#define SETTINGS_SLOTS      (SETTINGS_JOURNAL_SIZE / SETTINGS_SLOT_SIZE)
+
+class SettingsStore {
+public:
+    static int load(EEPROMSettings &value);
+    static void save();
+    static void clear();
+    static void loop();
+
+private:
+    static uint8_t record[SETTINGS_SLOT_SIZE];
+    static uint32_t sequence;       //highest sequence number in the journal
+    static int16_t lastSlot;        //slot holding it, -1 if the journal is empty
+    static boolean savePending;
+    static boolean clearPending;
+
+    static uint32_t slotAddress(int16_t slot);
+    static boolean readRecord(int16_t slot);
+    static uint32_t calcCrc();
+    static void flush();
+};
+
+#endif /* SETTINGSSTORE_H_ */
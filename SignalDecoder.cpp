@@ -0,0 +1,250 @@
+/*
+ * SignalDecoder.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SignalDecoder.h"
+#include "Logger.h"
+#include "M2RET.h"
+
+/*
+ * Finding the signals of a frame works like the rewrite rules: standard IDs index straight into
+ * stdIndex, signals of the same ID are chained through next. There are far too many extended IDs
+ * for that so they go in a small open addressed hash, extIds / extIndex, with linear probing. Each signal has its shift and mask
+ * worked out when it is set, so taking it out of a frame is one shift and one and on the frame's
+ * data read as a 64 bit number. Intel signals use the data little endian with the start bit as
+ * the LSB. Motorola signals use it big endian, where DBC's start bit (the MSB) lands on bit
+ * (7 - start / 8) * 8 + start % 8.
+ */
+
+SIGNAL_DEF SignalDecoder::signals[SIGNAL_MAX];
+int8_t SignalDecoder::stdIndex[0x800];
+uint32_t SignalDecoder::extIds[SIGNAL_EXT_HASH];
+int8_t SignalDecoder::extIndex[SIGNAL_EXT_HASH];
+uint8_t SignalDecoder::count = 0;
+uint8_t SignalDecoder::output = SIG_OUT_OFF;
+boolean SignalDecoder::raw = true;
+uint32_t SignalDecoder::decoded = 0;
+uint32_t SignalDecoder::sent = 0;
+
+void SignalDecoder::setup()
+{
+    output = SIG_OUT_OFF;
+    raw = true;
+    for (int s = 0; s < SIGNAL_MAX; s++) signals[s].active = false;
+    rebuildIndex();
+}
+
+//Fibonacci hashing, the top bits of id * 2^32 / golden ratio
+uint16_t SignalDecoder::extSlot(uint32_t id)
+{
+    return (uint16_t)(((id * 2654435761ul) >> 16) & (SIGNAL_EXT_HASH - 1));
+}
+
+void SignalDecoder::rebuildIndex()
+{
+    uint16_t slot;
+
+    memset(stdIndex, -1, sizeof(stdIndex));
+    memset(extIndex, -1, sizeof(extIndex));
+    count = 0;
+    //go backwards so each chain ends up in signal number order
+    for (int s = SIGNAL_MAX - 1; s >= 0; s--) {
+        if (!signals[s].active) continue;
+        count++;
+        if (signals[s].extended) {
+            //there are more slots than signals so this always ends
+            slot = extSlot(signals[s].id);
+            while (extIndex[slot] >= 0 && extIds[slot] != signals[s].id) slot = (slot + 1) & (SIGNAL_EXT_HASH - 1);
+            extIds[slot] = signals[s].id;
+            signals[s].next = extIndex[slot];
+            extIndex[slot] = s;
+        } else {
+            signals[s].next = stdIndex[signals[s].id];
+            stdIndex[signals[s].id] = s;
+        }
+    }
+}
+
+boolean SignalDecoder::setSignal(uint8_t idx, uint8_t bus, uint32_t id, boolean extended, uint8_t startBit, uint8_t length,
+                                 uint8_t flags, float scale, float offset)
+{
+    int shift;
+
+    if (idx >= SIGNAL_MAX || length == 0 || length > 32 || startBit > 63) return false;
+    if (!extended && id > 0x7FF) return false;
+    if (flags & SIG_BIG_ENDIAN) shift = (7 - startBit / 8) * 8 + (startBit % 8) - (length - 1);
+    else shift = startBit;
+    if (shift < 0 || shift + length > 64) return false;
+
+    SIGNAL_DEF &sig = signals[idx];
+    sig.id = id;
+    sig.extended = extended;
+    sig.bus = bus;
+    sig.flags = flags & (SIG_BIG_ENDIAN | SIG_SIGNED);
+    sig.startBit = startBit;
+    sig.length = length;
+    sig.shift = shift;
+    sig.mask = (length == 32) ? 0xFFFFFFFF : ((1ul << length) - 1);
+    sig.scale = scale;
+    sig.offset = offset;
+    sig.haveLast = false;
+    sig.active = true;
+    rebuildIndex();
+    return true;
+}
+
+void SignalDecoder::clearSignal(uint8_t idx)
+{
+    if (idx >= SIGNAL_MAX) return;
+    signals[idx].active = false;
+    rebuildIndex();
+}
+
+void SignalDecoder::clearAll()
+{
+    for (int s = 0; s < SIGNAL_MAX; s++) signals[s].active = false;
+    rebuildIndex();
+}
+
+uint8_t SignalDecoder::signalCount()
+{
+    return count;
+}
+
+void SignalDecoder::setOutput(uint8_t mode)
+{
+    if (mode > SIG_OUT_CHANGES) return;
+    output = mode;
+    //start over so the first value of every signal goes out
+    for (int s = 0; s < SIGNAL_MAX; s++) signals[s].haveLast = false;
+    decoded = sent = 0;
+}
+
+uint8_t SignalDecoder::getOutput()
+{
+    return output;
+}
+
+//Whether raw frames still go out while decoding
+void SignalDecoder::setKeepRaw(boolean keep)
+{
+    raw = keep;
+}
+
+boolean SignalDecoder::keepRaw()
+{
+    return raw;
+}
+
+/*
+ * Decode the signals in a captured frame and send the ones that are due. Returns true while
+ * decoding is on, in which case the caller leaves the raw frame out unless keepRaw().
+ */
+boolean SignalDecoder::handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp)
+{
+    SIGNAL_VALUE values[SIGNAL_MAX_PER_FRAME];
+    uint8_t numValues = 0;
+    uint64_t little = 0, big = 0;
+    boolean haveWords = false;
+    int8_t idx = -1;
+    uint16_t slot;
+    int32_t rawValue;
+
+    if (output == SIG_OUT_OFF) return false;
+    if (count == 0) return true;
+    if (frame.extended) {
+        slot = extSlot(frame.id);
+        while (extIndex[slot] >= 0) {
+            if (extIds[slot] == frame.id) {
+                idx = extIndex[slot];
+                break;
+            }
+            slot = (slot + 1) & (SIGNAL_EXT_HASH - 1);
+        }
+    } else if (frame.id < 0x800) idx = stdIndex[frame.id];
+    else return true;
+
+    while (idx >= 0 && numValues < SIGNAL_MAX_PER_FRAME) {
+        SIGNAL_DEF &sig = signals[idx];
+        uint8_t thisIdx = idx;
+        idx = sig.next;
+        if (sig.bus != SIG_ANY_BUS && sig.bus != bus) continue;
+        //short frames read as zero past their end
+        if (!haveWords) {
+            for (int b = 0; b < 8; b++) {
+                uint8_t v = (b < frame.length) ? frame.data.bytes[b] : 0;
+                little |= (uint64_t)v << (b * 8);
+                big = (big << 8) | v;
+            }
+            haveWords = true;
+        }
+        rawValue = (int32_t)((((sig.flags & SIG_BIG_ENDIAN) ? big : little) >> sig.shift) & sig.mask);
+        if ((sig.flags & SIG_SIGNED) && sig.length < 32 && (rawValue & (1ul << (sig.length - 1)))) rawValue |= ~sig.mask;
+        decoded++;
+        if (output == SIG_OUT_CHANGES && sig.haveLast && sig.lastRaw == rawValue) continue;
+        sig.lastRaw = rawValue;
+        sig.haveLast = true;
+        values[numValues].idx = thisIdx;
+        values[numValues].raw = rawValue;
+        values[numValues].value = rawValue * sig.scale + sig.offset;
+        numValues++;
+    }
+
+    if (numValues > 0) {
+        sent += numValues;
+        sendSignalsToUSB(bus, frame.id, frame.extended, values, numValues, timestamp);
+        if (SysSettings.logToFile) sendSignalsToFile(bus, frame.id, frame.extended, values, numValues, timestamp);
+    }
+    return true;
+}
+
+void SignalDecoder::printSignals()
+{
+    const char *outputs[] = {"off", "all values", "changes only"};
+
+    Logger::console("Signal decoding %s, raw frames %s, %i signals, %l decoded, %l sent", outputs[output],
+                    raw ? "kept" : "left out", count, decoded, sent);
+    for (int s = 0; s < SIGNAL_MAX; s++) {
+        SIGNAL_DEF &sig = signals[s];
+        if (!sig.active) continue;
+        SerialUSB.print(s);
+        SerialUSB.print(": ID ");
+        SerialUSB.print(sig.id, HEX);
+        SerialUSB.print(sig.extended ? " X" : " S");
+        SerialUSB.print(" bus ");
+        if (sig.bus == SIG_ANY_BUS) SerialUSB.print("any");
+        else SerialUSB.print(sig.bus);
+        SerialUSB.print(" start ");
+        SerialUSB.print(sig.startBit);
+        SerialUSB.print(" length ");
+        SerialUSB.print(sig.length);
+        SerialUSB.print((sig.flags & SIG_BIG_ENDIAN) ? " Motorola" : " Intel");
+        SerialUSB.print((sig.flags & SIG_SIGNED) ? " signed" : " unsigned");
+        SerialUSB.print(" scale ");
+        SerialUSB.print(sig.scale, 6);
+        SerialUSB.print(" offset ");
+        SerialUSB.println(sig.offset, 6);
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * SignalDecoder.h
+ *
+ * Decodes DBC style signals out of received frames from a table the host uploads, so only the
+ * values (or only the values that changed) need to go to USB and the sdcard.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SIGNALDECODER_H_
+#define SIGNALDECODER_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//Signal flags
+#define SIG_BIG_ENDIAN  1   //Motorola byte order, start bit is the MSB in DBC numbering
+#define SIG_SIGNED      2
+
+#define SIG_ANY_BUS     0xFF
+
+enum SIGNAL_OUTPUT {
+    SIG_OUT_OFF = 0,
+    SIG_OUT_ALL = 1,        //every decoded value
+    SIG_OUT_CHANGES = 2     //only values that differ from the last one sent
+};
+
+typedef struct {
+    uint32_t id;
+    boolean extended;
+    boolean active;
+    boolean haveLast;       //lastRaw holds a value that went out
+    uint8_t bus;            //SIG_ANY_BUS for all buses
+    uint8_t flags;
+    uint8_t startBit;       //as given, for showing the table
+    uint8_t length;
+    uint8_t shift;          //precomputed: raw = (word >> shift) & mask where word is the data as one 64 bit number,
+    uint32_t mask;          //little endian or big endian depending on SIG_BIG_ENDIAN
+    float scale;
+    float offset;
+    int32_t lastRaw;
+    int8_t next;            //next signal in the same frame, -1 for none
+} SIGNAL_DEF;
+
+typedef struct {
+    uint8_t idx;
+    int32_t raw;
+    float value;
+} SIGNAL_VALUE;
+
+class SignalDecoder {
+public:
+    static void setup();
+    static boolean handleFrame(uint8_t bus, CAN_FRAME &frame, uint32_t timestamp);
+    static boolean setSignal(uint8_t idx, uint8_t bus, uint32_t id, boolean extended, uint8_t startBit, uint8_t length,
+                             uint8_t flags, float scale, float offset);
+    static void clearSignal(uint8_t idx);
+    static void clearAll();
+    static uint8_t signalCount();
+    static void setOutput(uint8_t mode);
+    static uint8_t getOutput();
+    static void setKeepRaw(boolean keep);
+    static boolean keepRaw();
+    static void printSignals();
+
+private:
+    static SIGNAL_DEF signals[SIGNAL_MAX];
+    static int8_t stdIndex[0x800];  //first signal for each standard ID
+    static uint32_t extIds[SIGNAL_EXT_HASH];    //extended ID in each hash slot
+    static int8_t extIndex[SIGNAL_EXT_HASH];    //first signal for that ID, -1 for an empty slot
+    static uint8_t count;
+    static uint8_t output;
+    static boolean raw;
+    static uint32_t decoded;
+    static uint32_t sent;
+
+    static void rebuildIndex();
+    static uint16_t extSlot(uint32_t id);
+};
+
+#endif /* SIGNALDECODER_H_ */
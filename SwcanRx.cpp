@@ -0,0 +1,166 @@
+/*
+ * SwcanRx.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SwcanRx.h"
+#include "SysHealth.h"
+#include <SPI.h>
+#include <MCP2515_sw_can.h>
+
+extern SWcan SWCAN;
+
+/*
+ * The MCP2515's INT pin stays low while any interrupt flag is set and we only get the falling
+ * edge, so the handler keeps going until both RX flags read back clear. Each buffer comes out in one
+ * chip select with READ RX BUFFER (header, DLC and all 8 data bytes) which also clears its flag,
+ * so there is no separate write to acknowledge it. Only the RX flags are taken here. Transmit still
+ * goes through the SWcan library, which moves its own TX buffer into the chip when a TXnIF comes
+ * in, so whenever anything else is flagged (TX done, errors, wake up) its handler is called to deal
+ * with it. Should a frame land in between, the library takes that one into its own RX buffer and
+ * it is moved over to ours. In case an edge is missed anyway loop() also looks at the pin and
+ * empties the chip if it is still low.
+ *
+ * The SPI peripheral isn't used with DMA here. A frame is only 14 bytes, less than setting up
+ * and waiting for a DMA transfer would cost.
+ */
+
+SWCAN_RECEIVED SwcanRx::ring[SWCAN_RX_RING];
+volatile uint16_t SwcanRx::head = 0;
+volatile uint16_t SwcanRx::tail = 0;
+volatile uint32_t SwcanRx::ringDropped = 0;
+volatile uint32_t SwcanRx::chipOverruns = 0;
+uint32_t SwcanRx::reported = 0;
+
+void SwcanRx::setup()
+{
+    head = tail = 0;
+    ringDropped = chipOverruns = 0;
+    reported = 0;
+}
+
+uint8_t SwcanRx::readRegister(uint8_t reg)
+{
+    SPI.transfer(SPI0_CS3, MCP_READ, SPI_CONTINUE);
+    SPI.transfer(SPI0_CS3, reg, SPI_CONTINUE);
+    return SPI.transfer(SPI0_CS3, 0, SPI_LAST);
+}
+
+void SwcanRx::clearBits(uint8_t reg, uint8_t mask)
+{
+    SPI.transfer(SPI0_CS3, MCP_BIT_MODIFY, SPI_CONTINUE);
+    SPI.transfer(SPI0_CS3, reg, SPI_CONTINUE);
+    SPI.transfer(SPI0_CS3, mask, SPI_CONTINUE);
+    SPI.transfer(SPI0_CS3, 0, SPI_LAST);
+}
+
+void SwcanRx::readBuffer(uint8_t instruction, uint32_t timestamp)
+{
+    uint8_t buff[13];   //SIDH SIDL EID8 EID0 DLC D0-D7
+
+    memset(buff, 0, sizeof(buff));
+    SPI.transfer(SPI0_CS3, instruction, SPI_CONTINUE);
+    SPI.transfer(SPI0_CS3, buff, sizeof(buff), SPI_LAST);
+
+    CAN_FRAME frame;
+    if (buff[1] & 0x08) { //IDE
+        frame.extended = true;
+        frame.id = ((uint32_t)buff[0] << 21) | ((uint32_t)(buff[1] & 0xE0) << 13) | ((uint32_t)(buff[1] & 0x03) << 16)
+                   | ((uint32_t)buff[2] << 8) | buff[3];
+        frame.rtr = (buff[4] & 0x40) ? 1 : 0;
+    } else {
+        frame.extended = false;
+        frame.id = ((uint32_t)buff[0] << 3) | (buff[1] >> 5);
+        frame.rtr = (buff[1] & 0x10) ? 1 : 0;
+    }
+    frame.length = buff[4] & 0x0F;
+    if (frame.length > 8) frame.length = 8;
+    for (int b = 0; b < 8; b++) frame.data.bytes[b] = buff[5 + b];
+    push(frame, timestamp);
+}
+
+void SwcanRx::push(CAN_FRAME &frame, uint32_t timestamp)
+{
+    uint16_t nextHead = (head + 1) % SWCAN_RX_RING;
+    if (nextHead == tail) {
+        ringDropped++;
+        return;
+    }
+    ring[head].frame = frame;
+    ring[head].timestamp = timestamp;
+    head = nextHead;
+}
+
+//Attached to the MCP2515's INT pin in place of calling SWCAN.intHandler() directly
+void SwcanRx::handleIrq()
+{
+    uint32_t now = micros();
+    uint8_t flags = readRegister(MCP_CANINTF);
+    CAN_FRAME frame;
+
+    while (flags != 0) {
+        if (flags & MCP_ERRIF) {
+            uint8_t eflg = readRegister(MCP_EFLG);
+            if (eflg & (MCP_RX0OVR | MCP_RX1OVR)) {
+                chipOverruns++;
+                clearBits(MCP_EFLG, MCP_RX0OVR | MCP_RX1OVR);
+            }
+        }
+        //RXB0 first, it fills first and with rollover the older frame is the one in RXB0
+        if (flags & MCP_RX0IF) readBuffer(MCP_READ_RX0, now);
+        if (flags & MCP_RX1IF) readBuffer(MCP_READ_RX1, now);
+        if (flags & ~(MCP_RX0IF | MCP_RX1IF)) {
+            SWCAN.intHandler(); //refills the TX buffers and clears its flags
+            while (SWCAN.GetRXFrame(frame)) push(frame, now);
+        }
+        flags = readRegister(MCP_CANINTF);
+        if (!(flags & (MCP_RX0IF | MCP_RX1IF))) break; //anything left is the library's to clear
+    }
+}
+
+//Take the next received SWCAN frame, like Gateway::read
+boolean SwcanRx::read(CAN_FRAME &frame, uint32_t &timestamp)
+{
+    if (tail == head) return false;
+    frame = ring[tail].frame;
+    timestamp = ring[tail].timestamp;
+    tail = (tail + 1) % SWCAN_RX_RING;
+    return true;
+}
+
+//Pass drops on to the health monitor from outside the interrupt and catch a missed INT edge
+void SwcanRx::loop()
+{
+    if (digitalRead(SWC_INT) == LOW) {
+        noInterrupts();
+        handleIrq();
+        interrupts();
+    }
+
+    uint32_t drops = ringDropped + chipOverruns;
+    if (drops != reported) {
+        reported = drops;
+        SysHealth::rxOverrun(2);
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ * SwcanRx.h
+ *
+ * Drains the MCP2515 single wire CAN controller from its interrupt. Both hardware RX buffers are
+ * read in one burst each and the frames wait in a ring with the time they were taken off the chip,
+ * so bursts and 83.3k high speed mode don't overflow the MCP2515's two buffers.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SWCANRX_H_
+#define SWCANRX_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//MCP2515 SPI instructions and registers used here
+#define MCP_READ            0x03
+#define MCP_BIT_MODIFY      0x05
+#define MCP_READ_RX0        0x90    //READ RX BUFFER starting at RXB0SIDH, clears RX0IF when CS goes high
+#define MCP_READ_RX1        0x94
+#define MCP_CANINTF         0x2C
+#define MCP_EFLG            0x2D
+#define MCP_RX0IF           0x01
+#define MCP_RX1IF           0x02
+#define MCP_ERRIF           0x20
+#define MCP_RX0OVR          0x40
+#define MCP_RX1OVR          0x80
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t timestamp;
+} SWCAN_RECEIVED;
+
+class SwcanRx {
+public:
+    static void setup();
+    static void handleIrq();
+    static boolean read(CAN_FRAME &frame, uint32_t &timestamp);
+    static void loop();
+
+private:
+    static SWCAN_RECEIVED ring[SWCAN_RX_RING];
+    static volatile uint16_t head;
+    static volatile uint16_t tail;
+    static volatile uint32_t ringDropped;   //our ring was full
+    static volatile uint32_t chipOverruns;  //the MCP2515 ran out of buffers before we got to it
+    static uint32_t reported;
+
+    static uint8_t readRegister(uint8_t reg);
+    static void clearBits(uint8_t reg, uint8_t mask);
+    static void readBuffer(uint8_t instruction, uint32_t timestamp);
+    static void push(CAN_FRAME &frame, uint32_t timestamp);
+};
+
+#endif /* SWCANRX_H_ */
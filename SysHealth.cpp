@@ -0,0 +1,240 @@
+/*
+ * SysHealth.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "SysHealth.h"
+#include "Logger.h"
+
+/*
+ * The error type bits of CAN_SR (CERR, SERR, etc) clear when the register is read and due_can's
+ * interrupt handler reads it for every interrupt, so polling it from loop() misses nearly all of
+ * them. Instead the CAN interrupts call canIrq() first (see can0Irq in M2RET.ino), which reads CAN_SR
+ * and counts the errors before the driver gets it. The error interrupts are turned on so every error
+ * gets an interrupt, not just the ones that happen to come with a mailbox event.
+ */
+#define CAN_ERROR_IRQS  (CAN_IER_CERR | CAN_IER_SERR | CAN_IER_AERR | CAN_IER_FERR | CAN_IER_BERR)
+
+BUS_HEALTH SysHealth::buses[NUM_BUSES];
+volatile uint32_t SysHealth::irqBusErrors[2];
+uint32_t SysHealth::usbOverflows = 0;
+uint32_t SysHealth::sdWriteFailures = 0;
+uint32_t SysHealth::lastFileStatus = 0;
+
+void SysHealth::setup()
+{
+    for (int b = 0; b < NUM_BUSES; b++) {
+        buses[b].rxOverruns = 0;
+        buses[b].txErrors = 0;
+        buses[b].busErrors = 0;
+        buses[b].errorPassiveCount = 0;
+        buses[b].busOffCount = 0;
+        buses[b].rxErrorCounter = 0;
+        buses[b].txErrorCounter = 0;
+        buses[b].flags = 0;
+        buses[b].latchedFlags = 0;
+        buses[b].busOff = false;
+    }
+    irqBusErrors[0] = irqBusErrors[1] = 0;
+    usbOverflows = 0;
+    sdWriteFailures = 0;
+    lastFileStatus = millis();
+}
+
+void SysHealth::canIrq(uint8_t bus, Can *regs)
+{
+    if (regs->CAN_SR & (CAN_SR_CERR | CAN_SR_SERR | CAN_SR_AERR | CAN_SR_FERR | CAN_SR_BERR)) irqBusErrors[bus]++;
+}
+
+/*
+ * Sample the controller state and error counters. Error passive and bus off are states so they are
+ * counted on the transition into them. Bus errors are counted by canIrq().
+ */
+void SysHealth::pollCAN(uint8_t bus, CANRaw &port, Can *regs, BUS_HEALTH &health)
+{
+    uint32_t status = port.get_status();
+    uint32_t errors = irqBusErrors[bus];
+    uint8_t newFlags = 0;
+
+    //begin() turns all the controller interrupts off so put the error ones back after each (re)start
+    if ((regs->CAN_IMR & CAN_ERROR_IRQS) != CAN_ERROR_IRQS) regs->CAN_IER = CAN_ERROR_IRQS;
+
+    health.rxErrorCounter = (uint8_t)port.get_rx_error_cnt();
+    health.txErrorCounter = (uint8_t)port.get_tx_error_cnt();
+
+    if (status & CAN_SR_WARN) newFlags |= HEALTH_ERR_WARNING;
+    if (status & (CAN_SR_ERRP | CAN_SR_BOFF)) {
+        newFlags |= HEALTH_ERR_PASSIVE;
+        if (!(health.flags & HEALTH_ERR_PASSIVE)) health.errorPassiveCount++;
+    }
+    if (status & CAN_SR_BOFF) {
+        newFlags |= HEALTH_BUS_ERROR;
+        if (!health.busOff) health.busOffCount++;
+        health.busOff = true;
+    } else health.busOff = false;
+    if (errors != health.busErrors) {
+        health.busErrors = errors;
+        newFlags |= HEALTH_BUS_ERROR;
+    }
+
+    //The driver buffers received frames in a ring of SIZE_RX_BUFFER entries. Once that is full
+    //anything else that comes in is thrown away so treat reaching it as an overrun.
+    if (port.available() >= SIZE_RX_BUFFER - 1) {
+        newFlags |= HEALTH_RX_FULL | HEALTH_OVERRUN;
+        if (!(health.flags & HEALTH_RX_FULL)) health.rxOverruns++;
+    }
+
+    health.flags = newFlags | (health.flags & HEALTH_TX_FULL);
+    health.latchedFlags |= newFlags;
+}
+
+void SysHealth::loop()
+{
+    if (settings.CAN0_Enabled) pollCAN(0, Can0, CAN0, buses[0]);
+    if (settings.CAN1_Enabled) pollCAN(1, Can1, CAN1, buses[1]);
+
+    if ((millis() - lastFileStatus) > HEALTH_FILE_INTERVAL) {
+        lastFileStatus = millis();
+        if (SysSettings.logToFile) writeStatusToFile();
+    }
+}
+
+void SysHealth::rxOverrun(uint8_t bus)
+{
+    if (bus >= NUM_BUSES) return;
+    buses[bus].rxOverruns++;
+    buses[bus].latchedFlags |= HEALTH_OVERRUN;
+}
+
+void SysHealth::txFailed(uint8_t bus)
+{
+    if (bus >= NUM_BUSES) return;
+    buses[bus].txErrors++;
+    buses[bus].latchedFlags |= HEALTH_TX_FULL;
+}
+
+void SysHealth::usbOverflow()
+{
+    usbOverflows++;
+}
+
+void SysHealth::sdWriteFailed()
+{
+    sdWriteFailures++;
+}
+
+const BUS_HEALTH &SysHealth::getBusHealth(uint8_t bus)
+{
+    if (bus >= NUM_BUSES) bus = 0;
+    return buses[bus];
+}
+
+/*
+ * Status byte for the LAWICEL 'F' command. Returns the current state plus anything that
+ * happened since the last time this was called, then clears the latched bits.
+ */
+uint8_t SysHealth::readLawicelStatus(uint8_t bus)
+{
+    if (bus >= NUM_BUSES) return 0;
+    uint8_t val = buses[bus].flags | buses[bus].latchedFlags;
+    buses[bus].latchedFlags = 0;
+    return val;
+}
+
+/*
+ * Binary form of the status for PROTO_GET_STATUS. Layout:
+ * number of buses then, for each bus, current flags, latched flags, REC, TEC,
+ * bus off count (16 bit), error passive count (16 bit), rx overruns, tx errors and
+ * bus errors (32 bit each). After the buses come the USB overflow count and SD write failure
+ * count (32 bit each). Everything is little endian.
+ */
+int SysHealth::encodeStatus(uint8_t *buff, int maxLen)
+{
+    int idx = 0;
+
+    if (maxLen < 1 + (NUM_BUSES * 20) + 8) return 0;
+    buff[idx++] = NUM_BUSES;
+    for (int b = 0; b < NUM_BUSES; b++) {
+        BUS_HEALTH &h = buses[b];
+        buff[idx++] = h.flags;
+        buff[idx++] = h.latchedFlags;
+        buff[idx++] = h.rxErrorCounter;
+        buff[idx++] = h.txErrorCounter;
+        buff[idx++] = (uint8_t)(h.busOffCount & 0xFF);
+        buff[idx++] = (uint8_t)(h.busOffCount >> 8);
+        buff[idx++] = (uint8_t)(h.errorPassiveCount & 0xFF);
+        buff[idx++] = (uint8_t)(h.errorPassiveCount >> 8);
+        buff[idx++] = (uint8_t)(h.rxOverruns & 0xFF);
+        buff[idx++] = (uint8_t)(h.rxOverruns >> 8);
+        buff[idx++] = (uint8_t)(h.rxOverruns >> 16);
+        buff[idx++] = (uint8_t)(h.rxOverruns >> 24);
+        buff[idx++] = (uint8_t)(h.txErrors & 0xFF);
+        buff[idx++] = (uint8_t)(h.txErrors >> 8);
+        buff[idx++] = (uint8_t)(h.txErrors >> 16);
+        buff[idx++] = (uint8_t)(h.txErrors >> 24);
+        buff[idx++] = (uint8_t)(h.busErrors & 0xFF);
+        buff[idx++] = (uint8_t)(h.busErrors >> 8);
+        buff[idx++] = (uint8_t)(h.busErrors >> 16);
+        buff[idx++] = (uint8_t)(h.busErrors >> 24);
+    }
+    buff[idx++] = (uint8_t)(usbOverflows & 0xFF);
+    buff[idx++] = (uint8_t)(usbOverflows >> 8);
+    buff[idx++] = (uint8_t)(usbOverflows >> 16);
+    buff[idx++] = (uint8_t)(usbOverflows >> 24);
+    buff[idx++] = (uint8_t)(sdWriteFailures & 0xFF);
+    buff[idx++] = (uint8_t)(sdWriteFailures >> 8);
+    buff[idx++] = (uint8_t)(sdWriteFailures >> 16);
+    buff[idx++] = (uint8_t)(sdWriteFailures >> 24);
+    return idx;
+}
+
+/*
+ * Put a status record into the log file in the current file format. GVRET files get a
+ * "Status:" line (like "Mark:"), CRTD files get a CEV event line. The binary format has
+ * no way to mark a record as anything but a frame so nothing is written there.
+ * Written in small pieces as the logger only guarantees 40 free bytes per call.
+ */
+void SysHealth::writeStatusToFile()
+{
+    char buff[40];
+
+    if (settings.fileOutputType == GVRET) {
+        Logger::fileRaw((uint8_t *)"Status:", 7);
+    } else if (settings.fileOutputType == CRTD) {
+        sprintf(buff, "%f CEV STATUS", millis() / 1000.0f);
+        Logger::fileRaw((uint8_t *)buff, strlen(buff));
+    } else return;
+
+    for (int b = 0; b < 2; b++) {
+        BUS_HEALTH &h = buses[b];
+        sprintf(buff, " CAN%i F%02X REC%u TEC%u", b, h.flags | h.latchedFlags, h.rxErrorCounter, h.txErrorCounter);
+        Logger::fileRaw((uint8_t *)buff, strlen(buff));
+        sprintf(buff, " OVR%lu TXE%lu", (unsigned long)h.rxOverruns, (unsigned long)h.txErrors);
+        Logger::fileRaw((uint8_t *)buff, strlen(buff));
+        sprintf(buff, " BER%lu BOFF%u", (unsigned long)h.busErrors, h.busOffCount);
+        Logger::fileRaw((uint8_t *)buff, strlen(buff));
+    }
+    sprintf(buff, " USBOVR%lu SDERR%lu\r\n", (unsigned long)usbOverflows, (unsigned long)sdWriteFailures);
+    Logger::fileRaw((uint8_t *)buff, strlen(buff));
+}
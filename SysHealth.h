@@ -0,0 +1,83 @@
+/*
+ * SysHealth.h
+ *
+ * Keeps track of controller status, error counters and buffer overruns so they can be
+ * reported through LAWICEL, the GVRET binary protocol and the log file.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef SYSHEALTH_H_
+#define SYSHEALTH_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//Status flags. These use the same bit positions as the LAWICEL 'F' command so they can be sent as is.
+#define HEALTH_RX_FULL      0x01
+#define HEALTH_TX_FULL      0x02
+#define HEALTH_ERR_WARNING  0x04
+#define HEALTH_OVERRUN      0x08
+#define HEALTH_ERR_PASSIVE  0x20
+#define HEALTH_ARB_LOST     0x40
+#define HEALTH_BUS_ERROR    0x80
+
+typedef struct {
+    uint32_t rxOverruns;        //times the RX buffer was found full (frames were dropped past that point)
+    uint32_t txErrors;          //frames the driver refused to take
+    uint32_t busErrors;         //CRC, stuff, form, bit and ack errors seen by the controller
+    uint16_t errorPassiveCount; //number of times the controller went error passive
+    uint16_t busOffCount;       //number of times the controller went bus off
+    uint8_t rxErrorCounter;     //last sampled REC
+    uint8_t txErrorCounter;     //last sampled TEC
+    uint8_t flags;              //current state, HEALTH_xxx bits
+    uint8_t latchedFlags;       //everything set since the last status read
+    boolean busOff;             //controller is currently bus off
+} BUS_HEALTH;
+
+class SysHealth {
+public:
+    static void setup();
+    static void loop();
+    static void rxOverrun(uint8_t bus);
+    static void txFailed(uint8_t bus);
+    static void usbOverflow();
+    static void sdWriteFailed();
+    static void canIrq(uint8_t bus, Can *regs);
+    static uint8_t readLawicelStatus(uint8_t bus);
+    static int encodeStatus(uint8_t *buff, int maxLen);
+    static void writeStatusToFile();
+    static const BUS_HEALTH &getBusHealth(uint8_t bus);
+
+private:
+    static BUS_HEALTH buses[NUM_BUSES];
+    static uint32_t usbOverflows;
+    static uint32_t sdWriteFailures;
+    static uint32_t lastFileStatus;
+    static volatile uint32_t irqBusErrors[2];   //bumped by canIrq(), copied into busErrors by pollCAN()
+
+    static void pollCAN(uint8_t bus, CANRaw &port, Can *regs, BUS_HEALTH &health);
+};
+
+#endif /* SYSHEALTH_H_ */
@@ -0,0 +1,329 @@
+/*
+ * TxQueue.cpp
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#include "TxQueue.h"
+#include "M2RET.h"
+
+/*
+ * The gateway calls due_can's sendFrame() straight from the CAN interrupts and the driver hands
+ * those frames to any free TX mailbox, so a mailbox it can see can't tell us which frame finished.
+ * The queue instead takes CAN_TX_MAILBOX away from the driver: it's kept disabled while idle,
+ * loaded here register by register and its completion is picked up by mailboxIrq(), which runs in
+ * the CAN interrupt before the driver's handler and disables the mailbox again before anything
+ * else can get to it. due_can keeps mailbox 7 for its own sends.
+ *
+ * mailboxIrq() also puts the next frame off the heap straight into the mailbox so back to back
+ * frames don't have to wait for loop() to come around. The finished frame goes into done[] and is
+ * reported by service(), as reporting it means logging and writing to USB. loop() keeps the CAN
+ * interrupt out with lock() while it works on the heap.
+ */
+
+TxQueue::TxQueue()
+{
+    port = NULL;
+    rawPort = NULL;
+    regs = NULL;
+    busNum = 0;
+    heapCount = 0;
+    nextSeq = 0;
+    inFlight = false;
+    mbState = MB_IDLE;
+    doneHead = doneTail = 0;
+}
+
+void TxQueue::setup(CAN_COMMON *bus, CANRaw *rawBus, Can *rawRegs, uint8_t num)
+{
+    port = bus;
+    rawPort = rawBus;
+    regs = rawRegs;
+    busNum = num;
+    clear();
+}
+
+void TxQueue::clear()
+{
+    heapCount = 0;
+    inFlight = false;
+    mbState = MB_IDLE;
+    doneHead = doneTail = 0;
+}
+
+//Hold off this bus's CAN interrupt, which takes frames off the heap too. USB and the rest keep running.
+void TxQueue::lock()
+{
+    if (rawPort != NULL) NVIC_DisableIRQ((busNum == 0) ? CAN0_IRQn : CAN1_IRQn);
+}
+
+void TxQueue::unlock()
+{
+    if (rawPort != NULL) NVIC_EnableIRQ((busNum == 0) ? CAN0_IRQn : CAN1_IRQn);
+}
+
+uint16_t TxQueue::count()
+{
+    return heapCount + (inFlight ? 1 : 0);
+}
+
+/*
+ * Ordering of the queue. Lower priority number wins, then lower CAN ID (same as bus arbitration
+ * would do), then whichever was queued first. TX_IN_ORDER frames skip the ID step and come after
+ * the rest of their priority, so a replayed log keeps its own order.
+ */
+bool TxQueue::higherPriority(TX_QUEUE_ENTRY &a, TX_QUEUE_ENTRY &b)
+{
+    if (a.priority != b.priority) return a.priority < b.priority;
+    if ((a.flags ^ b.flags) & TX_IN_ORDER) return (b.flags & TX_IN_ORDER) != 0;
+    if (a.flags & TX_IN_ORDER) return (int32_t)(a.seq - b.seq) < 0;
+    if (a.frame.id != b.frame.id) return a.frame.id < b.frame.id;
+    return (int32_t)(a.seq - b.seq) < 0;
+}
+
+void TxQueue::siftUp(int idx)
+{
+    TX_QUEUE_ENTRY temp;
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (!higherPriority(heap[idx], heap[parent])) break;
+        temp = heap[parent];
+        heap[parent] = heap[idx];
+        heap[idx] = temp;
+        idx = parent;
+    }
+}
+
+void TxQueue::siftDown(int idx)
+{
+    TX_QUEUE_ENTRY temp;
+    while (true) {
+        int best = idx;
+        int left = (idx * 2) + 1;
+        int right = left + 1;
+        if (left < heapCount && higherPriority(heap[left], heap[best])) best = left;
+        if (right < heapCount && higherPriority(heap[right], heap[best])) best = right;
+        if (best == idx) break;
+        temp = heap[best];
+        heap[best] = heap[idx];
+        heap[idx] = temp;
+        idx = best;
+    }
+}
+
+void TxQueue::removeTop()
+{
+    if (heapCount == 0) return;
+    heap[0] = heap[--heapCount];
+    siftDown(0);
+}
+
+/*
+ * Add a frame to the queue. Returns false (and reports the frame as dropped) if the queue is full.
+ */
+bool TxQueue::enqueue(CAN_FRAME &frame, uint8_t priority)
+{
+    if (heapCount >= TX_QUEUE_SIZE) {
+        txFrameDone(busNum, frame, TX_EVENT_DROPPED, micros(), priority & 0xF0);
+        return false;
+    }
+    lock();
+    TX_QUEUE_ENTRY &entry = heap[heapCount];
+    entry.frame = frame;
+    entry.priority = ((priority & 0xF) == 0) ? TX_DEFAULT_PRIORITY : (priority & 0xF);
+    entry.flags = priority & 0xF0;
+    entry.seq = nextSeq++;
+    siftUp(heapCount++);
+    unlock();
+    service(); //if the bus is idle this gets the frame going immediately
+    return true;
+}
+
+/*
+ * Drop every queued frame carrying the given flag and report them as dropped. Returns how many there were.
+ * A frame already in the mailbox is left to finish.
+ */
+uint16_t TxQueue::flush(uint8_t flag)
+{
+    uint16_t kept = 0, dropped = 0;
+
+    lock();
+    for (int idx = 0; idx < heapCount; idx++) {
+        if (heap[idx].flags & flag) {
+            txFrameDone(busNum, heap[idx].frame, TX_EVENT_DROPPED, micros(), heap[idx].flags);
+            dropped++;
+        } else heap[kept++] = heap[idx];
+    }
+    heapCount = kept;
+    for (int idx = (heapCount / 2) - 1; idx >= 0; idx--) siftDown(idx);
+    unlock();
+    return dropped;
+}
+
+uint32_t TxQueue::busSpeed()
+{
+    if (busNum == 0) return settings.CAN0Speed;
+    if (busNum == 1) return settings.CAN1Speed;
+    return settings.SWCANSpeed;
+}
+
+//Take the mailbox back if Can0/Can1.begin() has set it up for reception again
+void TxQueue::claimMailbox()
+{
+    if ((regs->CAN_MB[CAN_TX_MAILBOX].CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_DISABLED) {
+        releaseMailbox(regs, CAN_TX_MAILBOX);
+    }
+}
+
+//Hide a mailbox from the driver. Disabled mailboxes are skipped by due_can's sendFrame() and interrupt handler.
+void TxQueue::releaseMailbox(Can *canRegs, uint8_t mailbox)
+{
+    canRegs->CAN_IDR = 1 << mailbox;
+    canRegs->CAN_MB[mailbox].CAN_MMR = CAN_MMR_MOT_MB_DISABLED;
+}
+
+//Send a frame from a mailbox the driver doesn't know about. Its interrupt is turned on to catch the end of it.
+void TxQueue::loadMailbox(Can *canRegs, uint8_t mailbox, CAN_FRAME &frame)
+{
+    CanMb &mb = canRegs->CAN_MB[mailbox];
+    uint8_t *d = frame.data.bytes;
+
+    mb.CAN_MMR = CAN_MMR_MOT_MB_TX;
+    mb.CAN_MID = frame.extended ? ((frame.id & 0x1FFFFFFF) | CAN_MID_MIDE) : CAN_MID_MIDvA(frame.id);
+    mb.CAN_MDL = d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+    mb.CAN_MDH = d[4] | (d[5] << 8) | (d[6] << 16) | ((uint32_t)d[7] << 24);
+    mb.CAN_MCR = CAN_MCR_MDLC(frame.length) | CAN_MCR_MTCR;
+    canRegs->CAN_IER = 1 << mailbox;
+}
+
+/*
+ * Put the top of the heap into the mailbox. Only one frame at a time is given to the controller so
+ * that our ordering is the one that counts. Runs in the CAN interrupt or with it held off.
+ */
+void TxQueue::loadNext()
+{
+    if (inFlight || heapCount == 0) return;
+    if ((doneHead + 1) % TX_DONE_RING == doneTail) return; //no room to report it yet, service() tries again
+    TX_QUEUE_ENTRY &top = heap[0];
+    inFlight = true;
+    inFlightFrame = top.frame;
+    inFlightFlags = top.flags;
+    inFlightStart = micros();
+    mbState = MB_SENDING;
+    loadMailbox(regs, CAN_TX_MAILBOX, top.frame);
+    removeTop();
+}
+
+//Take the frame out of the mailbox and leave it for service() to report
+void TxQueue::finishFrame(uint8_t event, uint32_t timestamp)
+{
+    uint8_t nextHead = (doneHead + 1) % TX_DONE_RING;
+
+    releaseMailbox(regs, CAN_TX_MAILBOX);
+    inFlight = false;
+    mbState = MB_IDLE;
+    if (nextHead == doneTail) return; //can't happen, loadNext() keeps a slot free
+    TX_DONE_ENTRY &rec = done[doneHead];
+    rec.frame = inFlightFrame;
+    rec.timestamp = timestamp;
+    rec.event = event;
+    rec.flags = inFlightFlags;
+    doneHead = nextHead;
+}
+
+/*
+ * Runs in the CAN interrupt (and from checkInFlight() in case the interrupt was turned off by a
+ * restart of the controller). The controller stamps the mailbox with its timer at the end of the
+ * frame so the completion time comes from there, not from when we noticed. The next frame goes
+ * out right behind it.
+ */
+void TxQueue::mailboxIrq()
+{
+    uint32_t status;
+
+    if (regs == NULL || !inFlight) return;
+    CanMb &mb = regs->CAN_MB[CAN_TX_MAILBOX];
+    if ((mb.CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_TX) return;
+    status = mb.CAN_MSR;
+    if (!(status & CAN_MSR_MRDY)) return;
+    if (status & CAN_MSR_MABT) finishFrame(TX_EVENT_FAILED, micros());
+    else finishFrame(TX_EVENT_COMPLETE, canTimestampToMicros(*rawPort, status & 0xFFFF, busSpeed()));
+    loadNext();
+}
+
+/*
+ * Called from loop() with the CAN interrupt held off. A frame that can't get out (no ACK, bus off,
+ * etc) would otherwise be retried forever so it gets aborted after CAN_TX_TIMEOUT. A restart of the
+ * controller under the frame fails it, and an idle mailbox is taken back if Can0/Can1.begin() set it
+ * up for reception again.
+ */
+void TxQueue::checkInFlight()
+{
+    if (!inFlight) {
+        claimMailbox();
+        return;
+    }
+    if ((regs->CAN_MB[CAN_TX_MAILBOX].CAN_MMR & CAN_MMR_MOT_Msk) != CAN_MMR_MOT_MB_TX) {
+        finishFrame(TX_EVENT_FAILED, micros());
+        return;
+    }
+    mailboxIrq(); //in case the mailbox interrupt was turned off
+    if (inFlight && mbState == MB_SENDING && (micros() - inFlightStart) > CAN_TX_TIMEOUT) {
+        mbState = MB_ABORTING;
+        rawPort->mailbox_send_abort_cmd(CAN_TX_MAILBOX);
+    }
+}
+
+/*
+ * Called from loop() (and after every enqueue). Reports the frames the mailbox is done with and
+ * gets the next one going if the CAN interrupt hasn't already.
+ */
+void TxQueue::service()
+{
+    TX_DONE_ENTRY rec;
+
+    if (port == NULL) return;
+
+    if (rawPort == NULL) {
+        if (heapCount == 0) return;
+        if (!port->sendFrame(heap[0].frame)) return; //driver busy, try again next time around
+        //no way to see the mailbox of this one so once the driver takes it we call it sent
+        rec.frame = heap[0].frame;
+        rec.flags = heap[0].flags;
+        removeTop();
+        txFrameDone(busNum, rec.frame, TX_EVENT_COMPLETE, micros(), rec.flags);
+        return;
+    }
+
+    lock();
+    checkInFlight();
+    unlock();
+    while (doneTail != doneHead) {
+        rec = done[doneTail];
+        doneTail = (doneTail + 1) % TX_DONE_RING;
+        txFrameDone(busNum, rec.frame, rec.event, rec.timestamp, rec.flags);
+    }
+    lock();
+    loadNext();
+    unlock();
+}
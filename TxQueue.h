@@ -0,0 +1,117 @@
+/*
+ * TxQueue.h
+ *
+ * Per bus queue of frames waiting to be transmitted. Frames are handed to the CAN
+ * driver one at a time in priority order and their completion is tracked so the host
+ * can be told when (or if) they actually made it onto the bus.
+ *
+ Copyright (c) 2014-2017 Collin Kidder, Michael Neuweiler, Charles Galpin
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the
+ "Software"), to deal in the Software without restriction, including
+ without limitation the rights to use, copy, modify, merge, publish,
+ distribute, sublicense, and/or sell copies of the Software, and to
+ permit persons to whom the Software is furnished to do so, subject to
+ the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+ */
+
+#ifndef TXQUEUE_H_
+#define TXQUEUE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "due_can.h"
+
+//What happened to a frame. Passed to txFrameDone() and sent to the host as PROTO_TX_EVENT
+enum TX_EVENT {
+    TX_EVENT_COMPLETE = 0,  //frame went out on the bus
+    TX_EVENT_FAILED = 1,    //frame was aborted after sitting in the mailbox for CAN_TX_TIMEOUT
+    TX_EVENT_DROPPED = 2    //queue was full or flushed, frame was never sent
+};
+
+//Where the frame in the queue's own mailbox is
+enum TX_MAILBOX_STATE {
+    MB_IDLE,
+    MB_SENDING,
+    MB_ABORTING
+};
+
+//Priority 0 means "none given" and sorts as TX_DEFAULT_PRIORITY. Otherwise 1 is the most urgent and 15 the least.
+#define TX_DEFAULT_PRIORITY 8
+//Flags or'd into the priority. TX_IN_ORDER frames go out in the order they were queued whatever their IDs (log replay).
+//TX_FROM_GENERATOR marks the frame generator's frames so it can flush them and count them as they go out.
+#define TX_IN_ORDER         0x10
+#define TX_FROM_GENERATOR   0x20
+
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t seq;       //keeps frames of equal priority and ID in the order they were queued
+    uint8_t priority;
+    uint8_t flags;      //TX_IN_ORDER, TX_FROM_GENERATOR
+} TX_QUEUE_ENTRY;
+
+//A frame the mailbox is done with, waiting for service() to report it
+typedef struct {
+    CAN_FRAME frame;
+    uint32_t timestamp;
+    uint8_t event;      //TX_EVENT
+    uint8_t flags;
+} TX_DONE_ENTRY;
+
+class TxQueue {
+public:
+    TxQueue();
+    void setup(CAN_COMMON *bus, CANRaw *rawBus, Can *rawRegs, uint8_t busNum);
+    bool enqueue(CAN_FRAME &frame, uint8_t priority);
+    void service();
+    void clear();
+    uint16_t flush(uint8_t flag);
+    uint16_t count();
+    void mailboxIrq();
+    static void loadMailbox(Can *canRegs, uint8_t mailbox, CAN_FRAME &frame);
+    static void releaseMailbox(Can *canRegs, uint8_t mailbox);
+
+private:
+    CAN_COMMON *port;
+    CANRaw *rawPort;    //same as port for CAN0/CAN1, NULL for buses without mailboxes we can watch
+    Can *regs;          //controller registers for rawPort
+    uint8_t busNum;
+    TX_QUEUE_ENTRY heap[TX_QUEUE_SIZE];
+    volatile uint16_t heapCount;    //the CAN interrupt takes frames off too
+    uint32_t nextSeq;
+    volatile bool inFlight;
+    CAN_FRAME inFlightFrame;
+    uint8_t inFlightFlags;
+    uint32_t inFlightStart;
+    volatile uint8_t mbState;
+    TX_DONE_ENTRY done[TX_DONE_RING];
+    volatile uint8_t doneHead;
+    volatile uint8_t doneTail;
+
+    bool higherPriority(TX_QUEUE_ENTRY &a, TX_QUEUE_ENTRY &b);
+    void siftUp(int idx);
+    void siftDown(int idx);
+    void removeTop();
+    void claimMailbox();
+    void loadNext();
+    void finishFrame(uint8_t event, uint32_t timestamp);
+    void checkInFlight();
+    void lock();
+    void unlock();
+    uint32_t busSpeed();
+};
+
+#endif /* TXQUEUE_H_ */
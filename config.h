@@ -34,6 +34,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "due_can.h"
 
+//RAM budget. The SAM3X8E has 96KB of SRAM for everything: globals, the core's USB / SD / CAN driver buffers
+//(about 6KB), the heap and the stack. The static buffers sized in this file come to roughly (KB):
+//  session pool 12, periodic TX 9, boot capture 6, signal decoder 4.5, TX queues 3.3, gateway capture 3,
+//  batch TX 3.5, rewrite rules 2.8, ADC 2.5, USB output 2, log replay 2, SWCAN RX 2, PID cache 2, latency 1.5,
+//  LIN 1.2, J1939 1, everything else about 5
+//That is about 66KB, leaving around 24KB for the stack and heap. Anything that grows one of these or adds
+//a new buffer comes out of that margin, so keep the total under 70KB.
+
 //buffer size for SDCard - Sending canbus data to the card. Still allocated even for GEVCU but unused in that case
 //This is a large buffer but the sketch may as well use up a lot of RAM. It's there.
 //This value is picked up by the SD card library and not directly used in the GVRET code.
@@ -41,12 +49,147 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 //size to use for buffering writes to the USB bulk endpoint
 //This is, however, directly used.
-#define SER_BUFF_SIZE       4096
+#define SER_BUFF_SIZE       2048
 
 //maximum number of microseconds between flushes to the USB port.
 //The host should be polling every 1ms or so and so this time should be a small multiple of that
 #define SER_BUFF_FLUSH_INTERVAL 2000
 
+//Compile in the loop() profiler. It still has to be turned on at runtime (PROFILE=1) but
+//commenting this out removes every trace of it from the main loop.
+#define CFG_PROFILER
+
+//Core clock in MHz. Used to turn profiler cycle counts into microseconds
+#define PROF_CYCLES_PER_US  84
+
+//How often (in milliseconds) a status record with error and overrun counters is put into the log file
+#define HEALTH_FILE_INTERVAL    10000
+
+//Number of frames per output (USB, SD) whose receive time is remembered until their buffer is flushed.
+//Frames past this many are still sent, they just don't get a latency measurement. A full SER_BUFF_SIZE
+//of the smallest binary frames is about 150 of them.
+#define LAT_MAX_PENDING     160
+
+//Received frames that look older than this (in microseconds) based on their controller timestamp are
+//assumed to have a wrapped timestamp and are treated as just received.
+#define CAN_MAX_FRAME_AGE   50000
+
+//Number of frames each bus can have waiting to be sent. Frames past this are dropped and reported to the host.
+#define TX_QUEUE_SIZE       32
+//Finished frames per bus waiting for loop() to report them. The next frame only goes into the mailbox
+//from the CAN interrupt while there's room to report it.
+#define TX_DONE_RING        8
+
+//due_can sets mailboxes 0-6 up for reception and leaves mailbox 7 for transmission. The TX queue and the
+//periodic scheduler each take one of them for themselves so they can tell when their own frames are out.
+//That leaves mailboxes 0-4 for reception and 7 for what the driver sends (gateway).
+#define CAN_TX_MAILBOX      6
+#define PERIODIC_TX_MAILBOX 5
+
+//A frame that hasn't made it onto the bus after this many microseconds is aborted and reported as failed
+#define CAN_TX_TIMEOUT      100000
+
+//Periodic transmit scheduler. Periods and offsets are rounded to PERIODIC_TICK_US.
+//PERIODIC_WHEEL_SLOTS must be a power of two. Periods longer than slots * tick just take extra turns of the wheel.
+#define PERIODIC_MAX_ENTRIES    128
+#define PERIODIC_TICK_US        100
+#define PERIODIC_WHEEL_SLOTS    256
+#define PERIODIC_SENT_RING      64      //sent / dropped reports (and SWCAN sends) waiting for loop()
+#define PERIODIC_TX_PENDING     8       //frames per bus waiting for the scheduler's mailbox
+#define PERIODIC_IRQ_PRIORITY   14
+
+//SD log replay. The read ahead buffer is topped up one chunk per loop() and at most
+//REPLAY_MAX_PER_LOOP frames are looked at per loop() so replay can't starve reception.
+//2048 bytes is four chunks, around 50 CRTD lines, which is more than a few loop() passes replay.
+#define REPLAY_BUFF_SIZE    2048
+#define REPLAY_READ_CHUNK   512
+#define REPLAY_MAX_PER_LOOP 16
+#define REPLAY_MAX_LINE     80
+
+//Most frames the generator will queue up in one loop() when it has fallen behind
+#define GEN_MAX_PER_LOOP    8
+
+//Frames per bus the gateway can hold for loop() to pick up for USB/SD capture
+#define GW_CAPTURE_SIZE     64
+
+//Rewrite rules the gateway can apply to forwarded frames
+#define REWRITE_MAX_RULES   32
+
+//Batched TX (PROTO_BATCH_TX). Largest packet the host may send and frames that can wait to be queued.
+//A full packet of 8 byte frames is 73 of them so one packet always fits, anything past that gets BATCH_FULL.
+#define BATCH_MAX_PAYLOAD   1024
+#define BATCH_PENDING_SIZE  80
+
+//Reassembly memory shared by ISO-TP (IsoTp, IsoTpSniffer) and J1939 transport sessions. A message in
+//progress holds whole blocks of it, enough for its length, until it is done. See SessionPool.
+#define SESSION_POOL_SIZE   12288
+#define SESSION_POOL_BLOCK  128
+
+//ISO-TP engine. A channel holds a TX and an RX buffer of up to ISOTP_MAX_PAYLOAD bytes from the session pool
+//while a message is going through it. ISOTP_TIMEOUT_MS is how long to wait for flow control or the next
+//consecutive frame (N_Bs / N_Cr).
+#define ISOTP_MAX_CHANNELS  4
+#define ISOTP_MAX_PAYLOAD   4095
+#define ISOTP_TIMEOUT_MS    1000
+
+//Passive ISO-TP reassembly. Multi frame messages being put back together at the same time and
+//the most of each one that is kept.
+#define ISOSNIFF_MAX_FLOWS      4
+#define ISOSNIFF_MAX_PAYLOAD    4095
+
+//ELM327 emulator. Size of the reply buffer and the default ATST timeout (4ms units)
+#define ELM_OUT_BUFF_SIZE   128
+#define ELM_DEFAULT_TIMEOUT 0x32
+
+//OBD-II replies kept for the ELM327 emulator and how long (ms) they are good for by default
+#define PIDCACHE_SIZE           64
+#define PIDCACHE_DEFAULT_AGE    100
+
+//OBD-II PID poller. Table size, how long (ms) to wait for a reply and the default share (%) of CAN0 it may use
+#define OBDPOLL_MAX_ENTRIES     32
+#define OBDPOLL_TIMEOUT_MS      100
+#define OBDPOLL_DEFAULT_BUDGET  10
+
+//J1939 layer. Transport sessions reassembled at once and the largest message (J1939-21 allows 1785 bytes),
+//how long (ms) a session may go quiet (T1), PGNs counted and address claims tracked
+#define J1939_MAX_SESSIONS  4
+#define J1939_MAX_PAYLOAD   1785
+#define J1939_TIMEOUT_MS    750
+#define J1939_MAX_PGNS      32
+#define J1939_MAX_CLAIMS    32
+
+//Signal decoder. Signals in the table, the most that can come out of one frame and the slots in the
+//extended ID hash (a power of two, at least twice SIGNAL_MAX so probes stay short)
+#define SIGNAL_MAX              64
+#define SIGNAL_MAX_PER_FRAME    16
+#define SIGNAL_EXT_HASH         128
+
+//Received LIN frames waiting for loop()
+#define LIN_RX_RING         32
+
+//SWCAN frames taken off the MCP2515 in its interrupt and waiting for loop()
+#define SWCAN_RX_RING       64
+
+//EEPROM area the settings journal lives in, see SettingsStore. Has to hold a few records at least,
+//each one is sizeof(EEPROMSettings) plus a 12 byte header rounded up to whole 32 byte pages
+#define SETTINGS_JOURNAL_ADDR   2048
+#define SETTINGS_JOURNAL_SIZE   4096
+
+//CAN0/CAN1 frames held in RAM from the time CAN starts until the sdcard is ready, see FastBoot.
+//192 covers about 50ms of a fully loaded 500k bus, a busy car bus is usually well under half that.
+#define BOOT_CAPTURE_FRAMES 192
+
+//Host clock sync. Out of every CLOCK_SYNC_WINDOW exchanges the least delayed one is kept and the drift
+//is fitted over the last CLOCK_SYNC_HISTORY of those. Exchanges with a round trip over CLOCK_SYNC_MAX_RTT (us)
+//are thrown out and drift estimates past CLOCK_SYNC_MAX_PPM are clamped.
+#define CLOCK_SYNC_WINDOW   8
+#define CLOCK_SYNC_HISTORY  16
+#define CLOCK_SYNC_MAX_RTT  20000
+#define CLOCK_SYNC_MAX_PPM  500
+
+//Largest fixed size payload a binary protocol command can carry
+#define PROTO_MAX_PAYLOAD   32
+
 #define CFG_BUILD_NUM   343
 #define CFG_VERSION "M2RET Alpha Oct 22 2017"
 #define EEPROM_ADDR     0
@@ -78,6 +221,10 @@ enum FILEOUTPUTTYPE {
     CRTD = 3
 };
 
+/*
+ * Stored by SettingsStore. Records saved by older builds are loaded as is and anything past their
+ * length keeps its default, so add new fields at the end and don't move the old ones.
+ */
 struct EEPROMSettings { //Must stay under 256
     uint8_t version;
 
@@ -154,6 +301,7 @@ struct SystemSettings {
     int lawicelPollCounter;
     boolean lawicelBusReception[NUM_BUSES]; //does user want to see messages from this bus?
     int8_t numBuses; //number of buses this hardware currently supports.
+    boolean txEvents; //send TX complete/failed events to the host in binary mode
 };
 
 extern EEPROMSettings settings;